@@ -2,7 +2,7 @@ use std::{
     ffi::{CStr, CString},
     io,
     mem::forget,
-    os::unix::io::{AsRawFd, OwnedFd},
+    os::unix::io::{AsFd, AsRawFd, BorrowedFd, OwnedFd},
     ptr::NonNull,
 };
 
@@ -26,6 +26,19 @@ impl Drop for DIR
     }
 }
 
+impl AsFd for DIR
+{
+    /// Call dirfd(3) on the directory stream.
+    fn as_fd(&self) -> BorrowedFd
+    {
+        // SAFETY: self.inner is not dangling.
+        let fd = unsafe { libc::dirfd(self.inner.as_ptr()) };
+
+        // SAFETY: The file descriptor is owned by self.
+        unsafe { BorrowedFd::borrow_raw(fd) }
+    }
+}
+
 /// dirent(3) structure.
 #[allow(missing_docs, non_camel_case_types)]
 pub struct dirent
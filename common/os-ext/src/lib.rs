@@ -32,15 +32,29 @@
 #![warn(missing_docs)]
 
 pub use {
-    self::{dirent_::*, fcntl::*, stdio::*, stdlib::*, sys_stat::*, unistd::*},
+    self::{
+        dirent_::*, fcntl::*, poll::*, stdio::*, stdlib::*,
+        sys_eventfd::*, sys_file::*, sys_inotify::*, sys_ioctl::*,
+        sys_mman::*, sys_stat::*,
+        unistd::*,
+    },
     libc::{
-        AT_SYMLINK_FOLLOW, AT_SYMLINK_NOFOLLOW,
-        O_CREAT, O_DIRECTORY, O_NOFOLLOW, O_PATH,
-        O_RDONLY, O_RDWR, O_TMPFILE, O_WRONLY,
+        AT_REMOVEDIR, AT_SYMLINK_FOLLOW, AT_SYMLINK_NOFOLLOW,
+        IN_ATTRIB, IN_CLOSE_WRITE, IN_CREATE, IN_DELETE, IN_DELETE_SELF,
+        IN_IGNORED, IN_ISDIR, IN_MOVE_SELF, IN_MOVED_FROM,
+        IN_MOVED_TO, IN_Q_OVERFLOW,
+        LOCK_EX, LOCK_NB, LOCK_SH, LOCK_UN,
+        MAP_SHARED,
+        O_APPEND, O_CREAT, O_DIRECTORY, O_EXCL, O_NOFOLLOW, O_PATH,
+        O_RDONLY, O_RDWR, O_TMPFILE, O_TRUNC, O_WRONLY,
+        POLLIN,
+        PROT_READ,
         RENAME_NOREPLACE,
         S_IFDIR, S_IFIFO, S_IFLNK, S_IFMT, S_IFREG, S_IXUSR,
         S_ISGID, S_ISUID, S_ISVTX,
-        gid_t, uid_t,
+        UTIME_NOW, UTIME_OMIT,
+        _SC_PAGESIZE, _SC_PHYS_PAGES,
+        gid_t, pollfd, timespec, uid_t,
     },
 };
 
@@ -49,8 +63,14 @@ pub mod io;
 
 mod dirent_;
 mod fcntl;
+mod poll;
 mod stdio;
 mod stdlib;
+mod sys_eventfd;
+mod sys_file;
+mod sys_inotify;
+mod sys_ioctl;
+mod sys_mman;
 mod sys_stat;
 mod unistd;
 
@@ -0,0 +1,18 @@
+use std::{io, os::unix::io::{FromRawFd, OwnedFd}};
+
+/// Call eventfd(2) with the given arguments.
+pub fn eventfd(initval: libc::c_uint, flags: libc::c_int)
+    -> io::Result<OwnedFd>
+{
+    let flags = flags | libc::EFD_CLOEXEC;
+
+    // SAFETY: This is always safe.
+    let fd = unsafe { libc::eventfd(initval, flags) };
+
+    if fd == -1 {
+        return Err(io::Error::last_os_error());
+    }
+
+    // SAFETY: fd is a new file descriptor.
+    Ok(unsafe { OwnedFd::from_raw_fd(fd) })
+}
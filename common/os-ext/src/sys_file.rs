@@ -0,0 +1,14 @@
+use std::{io, os::unix::io::{AsRawFd, BorrowedFd}};
+
+/// Call flock(2) with the given arguments.
+pub fn flock(fd: BorrowedFd, operation: libc::c_int) -> io::Result<()>
+{
+    // SAFETY: This is always safe.
+    let result = unsafe { libc::flock(fd.as_raw_fd(), operation) };
+
+    if result == -1 {
+        return Err(io::Error::last_os_error());
+    }
+
+    Ok(())
+}
@@ -0,0 +1,50 @@
+use std::{
+    ffi::CStr,
+    io,
+    os::unix::io::{AsRawFd, BorrowedFd, FromRawFd, OwnedFd},
+};
+
+/// Call inotify_init1(2) with the given arguments.
+pub fn inotify_init1(flags: libc::c_int) -> io::Result<OwnedFd>
+{
+    let flags = flags | libc::IN_CLOEXEC;
+
+    // SAFETY: This is always safe.
+    let fd = unsafe { libc::inotify_init1(flags) };
+
+    if fd == -1 {
+        return Err(io::Error::last_os_error());
+    }
+
+    // SAFETY: fd is a new file descriptor.
+    Ok(unsafe { OwnedFd::from_raw_fd(fd) })
+}
+
+/// Call inotify_add_watch(2) with the given arguments.
+pub fn inotify_add_watch(fd: BorrowedFd, pathname: &CStr, mask: u32)
+    -> io::Result<libc::c_int>
+{
+    // SAFETY: pathname is NUL-terminated.
+    let wd = unsafe {
+        libc::inotify_add_watch(fd.as_raw_fd(), pathname.as_ptr(), mask)
+    };
+
+    if wd == -1 {
+        return Err(io::Error::last_os_error());
+    }
+
+    Ok(wd)
+}
+
+/// Call inotify_rm_watch(2) with the given arguments.
+pub fn inotify_rm_watch(fd: BorrowedFd, wd: libc::c_int) -> io::Result<()>
+{
+    // SAFETY: This is always safe.
+    let result = unsafe { libc::inotify_rm_watch(fd.as_raw_fd(), wd) };
+
+    if result == -1 {
+        return Err(io::Error::last_os_error());
+    }
+
+    Ok(())
+}
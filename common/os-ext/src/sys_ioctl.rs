@@ -0,0 +1,21 @@
+use std::{io, os::unix::io::{AsRawFd, BorrowedFd}};
+
+/// Call ioctl_ficlone(2) with the given arguments.
+///
+/// That is, call ioctl(2) with `FICLONE` on `dest_fd` with `src_fd`.
+pub fn ioctl_ficlone(dest_fd: BorrowedFd, src_fd: BorrowedFd) -> io::Result<()>
+{
+    // Not in the libc crate; _IOW(0x94, 9, int).
+    const FICLONE: libc::c_ulong = 0x40049409;
+
+    // SAFETY: FICLONE takes a file descriptor.
+    let result = unsafe {
+        libc::ioctl(dest_fd.as_raw_fd(), FICLONE, src_fd.as_raw_fd())
+    };
+
+    if result == -1 {
+        return Err(io::Error::last_os_error());
+    }
+
+    Ok(())
+}
@@ -0,0 +1,54 @@
+use {
+    std::{io, os::unix::io::{AsRawFd, BorrowedFd}, ptr::NonNull},
+};
+
+/// Call mmap(2) with the given arguments.
+///
+/// `NULL` is passed for `addr`, so the kernel chooses the address.
+///
+/// # Safety
+///
+/// The mapping is not tracked by the borrow checker.
+/// The caller must ensure that the mapping is not accessed
+/// after it is unmapped, and that `MAP_SHARED` mappings of files
+/// are not accessed in ways that are invalidated by concurrent writes,
+/// such as past the end of a file that is truncated.
+pub unsafe fn mmap(
+    length: usize,
+    prot: libc::c_int,
+    flags: libc::c_int,
+    fd: BorrowedFd,
+    offset: libc::off_t,
+) -> io::Result<NonNull<u8>>
+{
+    let addr = libc::mmap(
+        std::ptr::null_mut(),
+        length,
+        prot,
+        flags,
+        fd.as_raw_fd(),
+        offset,
+    );
+
+    if addr == libc::MAP_FAILED {
+        return Err(io::Error::last_os_error());
+    }
+
+    Ok(NonNull::new_unchecked(addr as *mut u8))
+}
+
+/// Call munmap(2) with the given arguments.
+///
+/// # Safety
+///
+/// The pages in the given range must not be accessed afterwards.
+pub unsafe fn munmap(addr: NonNull<u8>, length: usize) -> io::Result<()>
+{
+    let result = libc::munmap(addr.as_ptr() as *mut libc::c_void, length);
+
+    if result == -1 {
+        return Err(io::Error::last_os_error());
+    }
+
+    Ok(())
+}
@@ -8,6 +8,35 @@ use {
     },
 };
 
+/// Call fchmod(2) with the given arguments.
+pub fn fchmod(fd: BorrowedFd, mode: libc::mode_t) -> io::Result<()>
+{
+    // SAFETY: This is always safe.
+    let result = unsafe { libc::fchmod(fd.as_raw_fd(), mode) };
+
+    if result == -1 {
+        return Err(io::Error::last_os_error());
+    }
+
+    Ok(())
+}
+
+/// Call fstat(2) with the given arguments.
+pub fn fstat(fd: BorrowedFd) -> io::Result<stat>
+{
+    let mut statbuf = MaybeUninit::uninit();
+
+    // SAFETY: statbuf is large enough.
+    let result = unsafe { libc::fstat(fd.as_raw_fd(), statbuf.as_mut_ptr()) };
+
+    if result == -1 {
+        return Err(io::Error::last_os_error());
+    }
+
+    // SAFETY: fstat initialized statbuf.
+    Ok(unsafe { statbuf.assume_init() })
+}
+
 /// Call fstatat(2) with the given arguments.
 ///
 /// If `dirfd` is [`None`], `AT_FDCWD` is passed.
@@ -91,3 +120,27 @@ pub fn mknodat(
 
     Ok(())
 }
+
+/// Call utimensat(2) with the given arguments.
+///
+/// If `dirfd` is [`None`], `AT_FDCWD` is passed.
+pub fn utimensat(
+    dirfd: Option<BorrowedFd>,
+    pathname: &CStr,
+    times: &[libc::timespec; 2],
+    flags: libc::c_int,
+) -> io::Result<()>
+{
+    let dirfd = dirfd.map(|fd| fd.as_raw_fd()).unwrap_or(libc::AT_FDCWD);
+
+    // SAFETY: path is NUL-terminated and times has two elements.
+    let result = unsafe {
+        libc::utimensat(dirfd, pathname.as_ptr(), times.as_ptr(), flags)
+    };
+
+    if result == -1 {
+        return Err(io::Error::last_os_error());
+    }
+
+    Ok(())
+}
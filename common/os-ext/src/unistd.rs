@@ -154,6 +154,49 @@ pub fn symlinkat(
     Ok(())
 }
 
+/// Call sysconf(3) with the given argument.
+///
+/// If the limit is indeterminate, [`None`] is returned.
+pub fn sysconf(name: libc::c_int) -> io::Result<Option<libc::c_long>>
+{
+    // sysconf does not change errno for indeterminate limits.
+    // SAFETY: This is always safe.
+    let result = unsafe {
+        *libc::__errno_location() = 0;
+        libc::sysconf(name)
+    };
+
+    if result == -1 {
+        let error = io::Error::last_os_error();
+        if error.raw_os_error() == Some(0) {
+            return Ok(None);
+        }
+        return Err(error);
+    }
+
+    Ok(Some(result))
+}
+
+/// Call unlinkat(2) with the given arguments.
+///
+/// If `dirfd` is [`None`], `AT_FDCWD` is passed.
+pub fn unlinkat(
+    dirfd: Option<BorrowedFd>,
+    pathname: &CStr,
+    flags: libc::c_int,
+) -> io::Result<()>
+{
+    let dirfd = dirfd.map(|fd| fd.as_raw_fd()).unwrap_or(libc::AT_FDCWD);
+
+    // SAFETY: pathname is NUL-terminated.
+    let result = unsafe { libc::unlinkat(dirfd, pathname.as_ptr(), flags) };
+
+    if result == -1 {
+        return Err(io::Error::last_os_error());
+    }
+
+    Ok(())
+}
 
 #[cfg(test)]
 mod tests
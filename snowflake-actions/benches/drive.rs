@@ -0,0 +1,100 @@
+//! Benchmarks for driving graphs of trivial actions.
+//!
+//! Each action writes a small regular file, so these measure
+//! the overhead of the driver and the state directory per action.
+
+#![feature(concat_bytes)]
+#![feature(io_safety)]
+#![feature(test)]
+
+extern crate test;
+
+use {
+    os_ext::{O_DIRECTORY, O_PATH, cstr, cstring, mkdtemp, open},
+    snowflake_actions::WriteRegularFile,
+    snowflake_core::{
+        action::{Action, ActionGraph, Resources},
+        drive::{Context, Outcome, drive},
+        label::{ActionLabel, ActionOutputLabel},
+        state::State,
+    },
+    std::{
+        num::NonZeroUsize,
+        os::unix::io::AsFd,
+        thread::available_parallelism,
+    },
+    test::Bencher,
+};
+
+/// Number of actions in each graph.
+const ACTIONS: usize = 1000;
+
+/// Graph of independent actions that write distinct files.
+///
+/// `salt` is included in the contents, so that graphs
+/// with different salts share no entries in the action cache.
+fn graph(salt: usize) -> ActionGraph
+{
+    let actions =
+        (0 .. ACTIONS)
+        .map(|action| {
+            let content = format!("{salt} {action}\n").into_bytes();
+            let write = WriteRegularFile{content, executable: false};
+            (ActionLabel{action}, (Box::new(write) as Box<dyn Action>, vec![]))
+        })
+        .collect();
+    let artifacts =
+        (0 .. ACTIONS)
+        .map(|action| ActionOutputLabel{action: ActionLabel{action}, output: 0})
+        .collect();
+    ActionGraph{actions, artifacts}
+}
+
+/// Drive a graph, asserting that every action succeeds.
+fn drive_graph(state: &State, graph: &ActionGraph, cache_hit: bool)
+{
+    let jobs = available_parallelism().unwrap_or(NonZeroUsize::new(1).unwrap());
+    let source_root = open(cstr!(b"."), O_DIRECTORY | O_PATH, 0).unwrap();
+    let context = Context{
+        state,
+        source_root: source_root.as_fd(),
+        jobs,
+        budget: Resources{cpus: jobs.get() as u32, memory: 0},
+        cgroup: None,
+        fail_fast: false,
+        trace: None,
+    };
+    let outcomes = drive(&context, graph).unwrap();
+    assert!(outcomes.values().all(|outcome| matches!(
+        outcome, Outcome::Success{cache_hit: hit, ..} if *hit == cache_hit)));
+}
+
+/// Create a state directory in a new temporary directory.
+fn state() -> State
+{
+    let path = mkdtemp(cstring!(b"/tmp/snowflake-bench-XXXXXX")).unwrap();
+    State::open(&path).unwrap()
+}
+
+/// Perform every action in the graph.
+#[bench]
+fn drive_performed(b: &mut Bencher)
+{
+    let state = state();
+    let mut salt = 0;
+    b.iter(|| {
+        salt += 1;
+        let graph = graph(salt);
+        drive_graph(&state, &graph, false);
+    });
+}
+
+/// Find every action in the graph in the action cache.
+#[bench]
+fn drive_cached(b: &mut Bencher)
+{
+    let state = state();
+    let graph = graph(0);
+    drive_graph(&state, &graph, false);
+    b.iter(|| drive_graph(&state, &graph, true));
+}
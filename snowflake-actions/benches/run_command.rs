@@ -0,0 +1,117 @@
+//! Benchmarks for the latency of running commands in containers.
+//!
+//! The command itself does nothing, so these measure
+//! setting up and tearing down the container.
+
+#![feature(concat_bytes)]
+#![feature(io_safety)]
+#![feature(test)]
+
+extern crate test;
+
+use {
+    os_ext::{
+        O_DIRECTORY, O_PATH, O_RDWR, O_TMPFILE,
+        cstr, cstring, mkdtemp, open,
+        cstr::CStrExt,
+    },
+    snowflake_actions::{Materialization, RunCommand},
+    snowflake_core::{
+        action::{
+            Action, ActionTrace, Cancellation, InputPath, Outputs,
+            Perform, Resources, WrittenOutputs,
+        },
+        state::State,
+    },
+    snowflake_util::basename::Basename,
+    std::{
+        borrow::Cow,
+        ffi::CString,
+        ops::Deref,
+        os::unix::io::AsFd,
+        time::Duration,
+    },
+    test::Bencher,
+};
+
+/// Bench running `true` with the inputs in `testdata/inputs`, if any.
+fn bench_true(b: &mut Bencher, materialization: Materialization, inputs: bool)
+{
+    let coreutils = CString::new(env!("SNOWFLAKE_COREUTILS")).unwrap();
+
+    let inputs: Vec<Basename<CString>> =
+        if inputs {
+            [
+                cstring!(b"regular.txt"),
+                cstring!(b"directory"),
+                cstring!(b"symlink.lnk"),
+                cstring!(b"broken.lnk"),
+            ]
+            .into_iter()
+            .map(|i| Basename::new(i).unwrap())
+            .collect()
+        } else {
+            vec![]
+        };
+
+    let source_root =
+        open(cstr!(b"testdata/inputs"), O_DIRECTORY | O_PATH, 0)
+            .unwrap();
+
+    let input_paths: Vec<InputPath> =
+        inputs.iter()
+        .map(|i| InputPath{
+            dirfd: source_root.as_fd(),
+            path: Cow::Owned(i.deref().to_owned()),
+        })
+        .collect();
+
+    let action = RunCommand{
+        inputs,
+        outputs: Outputs::Outputs(vec![]),
+        program: coreutils.join(cstr!(b"bin/true")),
+        arguments: vec![cstring!(b"true")],
+        environment: vec![],
+        timeout: Duration::from_secs(10),
+        resources: Resources::default(),
+        warnings: None,
+        materialization,
+        worker: None,
+    };
+
+    let path  = mkdtemp(cstring!(b"/tmp/snowflake-bench-XXXXXX")).unwrap();
+    let state = State::open(&path).unwrap();
+
+    b.iter(|| {
+        let build_log = open(cstr!(b"."), O_RDWR | O_TMPFILE, 0o644).unwrap();
+        let scratch   = state.new_scratch_dir().unwrap();
+        let perform = Perform{
+            build_log: build_log.as_fd(),
+            scratch: scratch.as_fd(),
+            state: &state,
+            cgroup: None,
+            written_outputs: &WrittenOutputs::default(),
+            cancellation: &Cancellation::new(),
+            trace: ActionTrace::default(),
+        };
+        action.perform(&perform, &input_paths).unwrap()
+    });
+}
+
+#[bench]
+fn run_true(b: &mut Bencher)
+{
+    bench_true(b, Materialization::Mount, false);
+}
+
+#[bench]
+fn run_true_mount_inputs(b: &mut Bencher)
+{
+    bench_true(b, Materialization::Mount, true);
+}
+
+#[bench]
+fn run_true_link_inputs(b: &mut Bencher)
+{
+    bench_true(b, Materialization::Link, true);
+}
@@ -8,7 +8,9 @@
 #![feature(exit_status_error)]
 #![feature(io_safety)]
 #![feature(let_else)]
+#![feature(once_cell)]
 #![feature(panic_always_abort)]
+#![feature(scoped_threads)]
 #![feature(type_ascription)]
 #![warn(missing_docs)]
 
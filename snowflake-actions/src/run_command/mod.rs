@@ -0,0 +1,1757 @@
+pub use self::worker::Worker;
+
+use {
+    self::{sandbox::spawn_container, worker::perform_worker_request},
+    anyhow::Context,
+    os_ext::{
+        AT_REMOVEDIR, AT_SYMLINK_NOFOLLOW,
+        O_CREAT, O_DIRECTORY, O_EXCL, O_NOFOLLOW, O_RDONLY, O_WRONLY,
+        S_IFDIR, S_IFLNK, S_IFMT, S_IFREG,
+        cstr, cstr_cow, fdopendir, fstat, fstatat,
+        ioctl_ficlone, linkat, mkdirat, mknodat, openat, pipe2,
+        readdir, readlink, readlinkat, stat, symlinkat, unlinkat,
+        cstr::CStrExt,
+        io::{BorrowedFdExt, magic_link},
+    },
+    regex::bytes::Regex,
+    snowflake_core::{
+        action::{
+            Action, ActionTrace, Cancellation, Error, InputPath, Outputs,
+            Perform, Resources, Success, Result as AResult,
+        },
+        state::State,
+    },
+    snowflake_util::{basename::Basename, hash::{Blake3, Hash}},
+    std::{
+        borrow::Cow,
+        ffi::{CStr, CString},
+        fs::File,
+        io::{self, ErrorKind::{Interrupted, NotFound}, Read, Write},
+        os::unix::{
+            io::{AsFd, AsRawFd, BorrowedFd, OwnedFd},
+            process::ExitStatusExt,
+        },
+        process::{self, ExitStatus},
+        ptr::{null, null_mut},
+        sync::atomic::{AtomicU64, Ordering::SeqCst},
+        time::{Duration, Instant},
+    },
+};
+
+mod sandbox;
+mod worker;
+
+/// Action that runs an arbitrary command in a container.
+pub struct RunCommand
+{
+    /// What to call the inputs in the command's working directory.
+    pub inputs: Vec<Basename<CString>>,
+
+    /// What the outputs are called in the command's working directory.
+    pub outputs: Outputs<Vec<Basename<CString>>>,
+
+    /// Absolute path to the program to run.
+    pub program: CString,
+
+    /// Arguments to the program.
+    ///
+    /// This should include the zeroth argument,
+    /// which is normally equal to [`program`][`Self::program`].
+    pub arguments: Vec<CString>,
+
+    /// The environment variables to the program.
+    ///
+    /// This specifies the *exact* environment to the program.
+    /// No extra environment variables are set by the
+    /// [`perform`][`RunCommand::perform`] method.
+    pub environment: Vec<CString>,
+
+    /// How much time the program may spend.
+    ///
+    /// If the program spends more time than this,
+    /// it is killed and the action fails.
+    pub timeout: Duration,
+
+    /// The resources to reserve for the program.
+    ///
+    /// If the driver was given a [cgroup], the program is run
+    /// in a new cgroup whose `cpu.max` and `memory.max` are set
+    /// according to the reservation, so the program cannot exceed it.
+    /// A memory reservation of zero is not enforced.
+    /// Persistent workers are not run in such cgroups.
+    ///
+    /// [cgroup]: `snowflake_core::drive::Context::cgroup`
+    pub resources: Resources,
+
+    /// Regular expression that matches warnings in the build log.
+    ///
+    /// If [`None`], no warnings are assumed to have been emitted.
+    pub warnings: Option<Regex>,
+
+    /// How the inputs are made available to the program.
+    ///
+    /// Ignored if [`worker`][`Self::worker`] is set.
+    pub materialization: Materialization,
+
+    /// Persistent worker to send the command to.
+    ///
+    /// If [`None`], the program is run in a new container instead.
+    pub worker: Option<Worker>,
+}
+
+/// How the inputs of a [`RunCommand`] are made available to the program.
+///
+/// Either way, the inputs appear in the command's working directory,
+/// and the program cannot modify the originals.
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub enum Materialization
+{
+    /// Bind mount each input into the container, read-only.
+    Mount,
+
+    /// Link the inputs into a single tree in the scratch directory,
+    /// which is then mounted as the lower layer of an overlay.
+    ///
+    /// This avoids a mount call per input, which is beneficial
+    /// for actions with many inputs, such as link steps.
+    /// Regular files from the output cache are hard linked, or cloned
+    /// if that fails; other regular files are cloned.
+    /// Directories from the output cache are linked recursively.
+    /// Inputs that cannot be linked or cloned are bind mounted.
+    ///
+    /// Unlike with [`Mount`][`Self::Mount`], the program may write to
+    /// its inputs, but the writes only affect copies in the overlay.
+    /// Requires Linux 5.11 or later, for overlays in user namespaces.
+    Link,
+}
+
+impl Action for RunCommand
+{
+    fn inputs(&self) -> usize
+    {
+        self.inputs.len()
+    }
+
+    fn outputs(&self) -> Outputs<usize>
+    {
+        self.outputs.as_ref().map(Vec::len)
+    }
+
+    fn perform(&self, perform: &Perform, input_paths: &[InputPath]) -> AResult
+    {
+        perform_run_command(perform, self, input_paths)
+    }
+
+    fn resources(&self) -> Resources
+    {
+        self.resources
+    }
+
+    fn hash(&self, input_hashes: &[Hash]) -> Hash
+    {
+        // NOTE: See the manual chapter on avoiding hash collisions.
+
+        const OUTPUTS_TYPE_OUTPUTS: u8 = 0;
+        const OUTPUTS_TYPE_LINT:    u8 = 1;
+
+        let Self{inputs, outputs, program, arguments, environment,
+                 timeout, resources, warnings, materialization, worker} = self;
+
+        debug_assert_eq!(input_hashes.len(), inputs.len());
+
+        let mut h = Blake3::new();
+
+        h.put_str("RunCommand");
+
+        h.put_usize(inputs.len());
+        for (basename, hash) in inputs.iter().zip(input_hashes) {
+            h.put_cstr(basename);
+            h.put_hash(*hash);
+        }
+
+        match outputs {
+            Outputs::Outputs(outputs) => {
+                h.put_u8(OUTPUTS_TYPE_OUTPUTS);
+                h.put_slice(outputs, |h, o| h.put_cstr(o));
+            },
+            Outputs::Lint => {
+                h.put_u8(OUTPUTS_TYPE_LINT);
+            },
+        }
+
+        h.put_cstr(program);
+        h.put_slice(arguments, |h, a| h.put_cstr(a));
+        h.put_slice(environment, |h, e| h.put_cstr(e));
+
+        h.put_bool(worker.is_some());
+        if let Some(Worker{arguments}) = worker {
+            h.put_u64(worker::PROTOCOL_VERSION);
+            h.put_slice(arguments, |h, a| h.put_cstr(a));
+        }
+
+        // The timeout, resources, and materialization cannot affect
+        // the output of the action, so there is no need to include them.
+        let _ = timeout;
+        let _ = resources;
+        let _ = materialization;
+
+        h.put_bool(warnings.is_some());
+        if let Some(warnings) = warnings {
+            h.put_str(warnings.as_str());
+        }
+
+        h.finalize()
+    }
+}
+
+fn perform_run_command(
+    perform: &Perform,
+    action: &RunCommand,
+    input_paths: &[InputPath],
+) -> AResult
+{
+    // Unpack the arguments into convenient variables.
+    let Perform{build_log, scratch, state, cgroup, cancellation, trace, ..} =
+        perform;
+    let RunCommand{inputs, outputs, program, arguments, environment,
+                   timeout, resources, warnings, materialization, worker} = action;
+
+    // Workers have their own way of performing the action.
+    if let Some(worker) = worker {
+        return perform_worker_request(perform, action, worker, input_paths);
+    }
+
+    // Mounting must happen in the child process,
+    // so we collect all the mount calls in here.
+    // Targets are absolute paths within the container template.
+    let mut mounts = Vec::new();
+
+    // Perform the run command action.
+    let started = Instant::now();
+    let scratch_path = resolve_magic(*scratch)                                  .with_context(|| "Find path to scratch directory")?;
+    let template = container_template(state)                                    .with_context(|| "Create container template")?;
+    let root = resolve_magic(template.as_fd())                                  .with_context(|| "Find path to container template")?;
+    create_build_directory(*scratch, *materialization)?;
+    repair_root_mount(&mut mounts);
+    mount_root(&root, &mut mounts);
+    mount_build_directory(&root, &scratch_path, *materialization, &mut mounts);
+    mount_dev_directory(&root, &mut mounts);
+    mount_proc(&root, &mut mounts);
+    mount_nix_store(&root, &mut mounts);
+    match materialization {
+        Materialization::Mount =>
+            mount_inputs(*scratch, &scratch_path, &root,
+                         inputs, input_paths, &mut mounts)?,
+        Materialization::Link =>
+            link_inputs(*scratch, &scratch_path, state, &root,
+                        inputs, input_paths, &mut mounts)?,
+    }
+    let cgroup = cgroup.map(|cgroup| Cgroup::create(cgroup, resources))
+        .transpose()?;
+    trace.record("prepare container", started, started.elapsed());
+    let warnings =
+        run_command(*build_log, &root, program,
+                    arguments, environment, *timeout, warnings.as_ref(),
+                    cgroup.as_ref().map(|cgroup| cgroup.dir.as_fd()),
+                    cancellation, *trace, mounts)?;
+    let output_paths = output_paths(outputs);
+
+    // Summarize the result.
+    Ok(Success{output_paths, warnings})
+}
+
+/// Arguments to mount.
+#[derive(Default)]
+struct Mount<'a>
+{
+    source: Cow<'a, CStr>,
+    target: Cow<'a, CStr>,
+    filesystemtype: Cow<'a, CStr>,
+    mountflags: libc::c_ulong,
+    data: Cow<'a, CStr>,
+}
+
+impl<'a> Mount<'a>
+{
+    /// Create a read-only bind mount.
+    ///
+    /// This is more involved than simply passing `MS_BIND | MS_RDONLY`.
+    /// See https://unix.stackexchange.com/a/492462 for more information.
+    pub fn rdonly_bind_mount(source: Cow<'a, CStr>, target: Cow<'a, CStr>)
+        -> [Self; 2]
+    {
+        let common_flags = libc::MS_BIND | libc::MS_REC;
+        [
+            Self{
+                source: source,
+                target: target.clone(),
+                mountflags: common_flags,
+                ..Mount::default()
+            },
+            Self{
+                source: cstr_cow!(b"none"),
+                target: target,
+                mountflags: common_flags | libc::MS_RDONLY | libc::MS_REMOUNT,
+                ..Mount::default()
+            },
+        ]
+    }
+}
+
+/// Device files that are bind mounted into the container's `/dev`.
+fn device_files() -> [&'static CStr; 5]
+{
+    [
+        cstr!(b"null"),
+        cstr!(b"zero"),
+        cstr!(b"full"),
+        cstr!(b"random"),
+        cstr!(b"urandom"),
+    ]
+}
+
+/// Open the template for the container's `/` directory.
+///
+/// The directory structure of the container is the same for every action,
+/// so it is created only once and shared by all containers.
+/// Each container mounts it read-only as its root directory,
+/// and mounts its own scratch directory's `build` directory onto it.
+fn container_template(state: &State) -> anyhow::Result<OwnedFd>
+{
+    // NOTE: See the manual chapter on avoiding hash collisions.
+    let mut key = Blake3::new();
+    key.put_str("RunCommand container template 1");
+    key.put_str(env!("SNOWFLAKE_BASH"));
+    key.put_str(env!("SNOWFLAKE_COREUTILS"));
+
+    state.template_dir(key.finalize(), |template| {
+        populate_root_directory(template)?;
+        populate_dev_directory(template)?;
+        install_blessed_programs(template)?;
+        Ok(())
+    })
+}
+
+/// Populate the container's `/` directory.
+fn populate_root_directory(template: BorrowedFd) -> anyhow::Result<()>
+{
+    let mk = |path, mode| mkdirat(Some(template), path, mode)                   .with_context(|| format!("Create {path:?} inside container"));
+    mk(cstr!(b"bin"),       0o755)?;
+    mk(cstr!(b"dev"),       0o755)?;
+    mk(cstr!(b"nix"),       0o755)?;
+    mk(cstr!(b"nix/store"), 0o755)?;
+    mk(cstr!(b"proc"),      0o555)?;  // (sic)
+    mk(cstr!(b"root"),      0o755)?;
+    mk(cstr!(b"usr"),       0o755)?;
+    mk(cstr!(b"usr/bin"),   0o755)?;
+    mk(cstr!(b"build"),     0o755)?;
+    Ok(())
+}
+
+/// Populate the container's `/dev` directory.
+fn populate_dev_directory(template: BorrowedFd) -> anyhow::Result<()>
+{
+    // The standard streams are symbolic links, so they cannot be mounted.
+    let mk = |target, path| symlinkat(target, Some(template), path)             .with_context(|| format!("Create {path:?} inside container"));
+    mk(cstr!(b"/proc/self/fd/0"), cstr!(b"dev/stdin"))?;
+    mk(cstr!(b"/proc/self/fd/1"), cstr!(b"dev/stdout"))?;
+    mk(cstr!(b"/proc/self/fd/2"), cstr!(b"dev/stderr"))?;
+
+    // Device files cannot be created directly; mknod fails with EPERM.
+    // Instead, we mknod a regular file for each device file,
+    // which is then used as a mount target for a bind mount.
+    for basename in device_files() {
+        let target = cstr!(b"dev").join(basename);
+        mknodat(Some(template), &target, S_IFREG | 0o644, 0)                    .with_context(|| format!("Create {target:?} inside container"))?;
+    }
+
+    Ok(())
+}
+
+/// Point the container's symbolic links `/bin/sh` and `/usr/bin/env`
+/// to their respective executables in the Nix store.
+///
+/// These two programs are commonly used in shebangs,
+/// so having them not be where expected is very annoying.
+fn install_blessed_programs(template: BorrowedFd) -> anyhow::Result<()>
+{
+    let bash      = CString::new(env!("SNOWFLAKE_BASH")).unwrap();
+    let coreutils = CString::new(env!("SNOWFLAKE_COREUTILS")).unwrap();
+
+    let mk = |target: &CStr, path| symlinkat(target, Some(template), path)      .with_context(|| format!("Create {path:?} inside container"));
+    mk(&bash.join(cstr!(b"bin/bash")),     cstr!(b"bin/sh"))?;
+    mk(&coreutils.join(cstr!(b"bin/env")), cstr!(b"usr/bin/env"))?;
+
+    Ok(())
+}
+
+/// Create the directory that is mounted at the container's `/build`.
+///
+/// With [`Materialization::Link`], also create the directories
+/// for the lower layer and for the work of the overlay.
+fn create_build_directory(scratch: BorrowedFd, materialization: Materialization)
+    -> Result<(), Error>
+{
+    let mk = |path| mkdirat(Some(scratch), path, 0o755)                         .with_context(|| format!("Create {path:?} directory"));
+    mk(cstr!(b"build"))?;
+    if materialization == Materialization::Link {
+        mk(cstr!(b"inputs"))?;
+        mk(cstr!(b"overlay-work"))?;
+    }
+    Ok(())
+}
+
+/// Prevent mount events from propagating out of the container.
+///
+/// `/` is usually mounted with `MS_SHARED`, but we want `MS_PRIVATE`.
+/// Otherwise, mount events inside the container could propagate out.
+fn repair_root_mount(mounts: &mut Vec<Mount>)
+{
+    let mount = Mount{
+        source: cstr_cow!(b"none"),
+        target: cstr_cow!(b"/"),
+        mountflags: libc::MS_PRIVATE | libc::MS_REC,
+        ..Mount::default()
+    };
+    mounts.push(mount);
+}
+
+/// Mount the container template onto itself, read-only.
+///
+/// The template is shared by all containers, so it must not be modified.
+/// The mounts below are made on top of this mount,
+/// and only exist within the mount namespace of the container.
+fn mount_root<'a>(root: &'a CStr, mounts: &mut Vec<Mount<'a>>)
+{
+    let mountz = Mount::rdonly_bind_mount(root.into(), root.into());
+    mounts.extend(mountz);
+}
+
+/// Mount the scratch directory's `build` directory at `/build`.
+///
+/// With [`Materialization::Link`], it is the upper layer of an overlay
+/// whose lower layer is the scratch directory's `inputs` directory.
+fn mount_build_directory(
+    root: &CStr,
+    scratch_path: &CStr,
+    materialization: Materialization,
+    mounts: &mut Vec<Mount>,
+)
+{
+    let target = root.join(cstr!(b"build")).into();
+    let mount = match materialization {
+        Materialization::Mount =>
+            Mount{
+                source: scratch_path.join(cstr!(b"build")).into(),
+                target,
+                mountflags: libc::MS_BIND,
+                ..Mount::default()
+            },
+        Materialization::Link => {
+            let option = |key: &str, path: &CStr| {
+                let mut option = key.as_bytes().to_vec();
+                option.push(b'=');
+                for &b in scratch_path.join(path).to_bytes() {
+                    // These separate options and layers.
+                    if matches!(b, b',' | b':' | b'\\') { option.push(b'\\'); }
+                    option.push(b);
+                }
+                option
+            };
+            let data = [
+                option("lowerdir", cstr!(b"inputs")),
+                option("upperdir", cstr!(b"build")),
+                option("workdir",  cstr!(b"overlay-work")),
+                b"userxattr".to_vec(),
+            ].join(&b',');
+            Mount{
+                source: cstr_cow!(b"overlay"),
+                target,
+                filesystemtype: cstr_cow!(b"overlay"),
+                data: CString::new(data).unwrap().into(),
+                ..Mount::default()
+            }
+        },
+    };
+    mounts.push(mount);
+}
+
+/// Bind mount the device files into the container's `/dev` directory.
+fn mount_dev_directory(root: &CStr, mounts: &mut Vec<Mount>)
+{
+    for basename in device_files() {
+        let mount = Mount{
+            source: cstr!(b"/dev").join(basename).into(),
+            target: root.join(&cstr!(b"dev").join(basename)).into(),
+            mountflags: libc::MS_BIND | libc::MS_REC,
+            ..Mount::default()
+        };
+        mounts.push(mount);
+    }
+}
+
+// Mount the proc file system at the container's path `/proc`.
+fn mount_proc(root: &CStr, mounts: &mut Vec<Mount>)
+{
+    let mount = Mount{
+        source: cstr_cow!(b"proc"),
+        target: root.join(cstr!(b"proc")).into(),
+        filesystemtype: cstr_cow!(b"proc"),
+        mountflags: libc::MS_NODEV | libc::MS_NOEXEC | libc::MS_NOSUID,
+        ..Mount::default()
+    };
+    mounts.push(mount);
+}
+
+/// Mount the Nix store at the container's path `/nix/store`.
+fn mount_nix_store(root: &CStr, mounts: &mut Vec<Mount>)
+{
+    let source = cstr_cow!(b"/nix/store");
+    let target = root.join(cstr!(b"nix/store")).into();
+    let mountz = Mount::rdonly_bind_mount(source, target);
+    mounts.extend(mountz);
+}
+
+/// Mount every input in the container's `/build` directory.
+///
+/// Inputs are not bind mounted from where they are directly.
+/// Instead, each directory that inputs are relative to is first
+/// bind mounted read-only in the scratch directory, outside the container.
+/// Bind mounts inherit the read-only flag of the mount they are made from,
+/// so each input then takes a single mount call rather than two.
+/// This also means that only the paths of those directories
+/// need to be resolved, rather than the path of each input.
+fn mount_inputs(
+    scratch: BorrowedFd,
+    scratch_path: &CStr,
+    root: &CStr,
+    inputs: &[Basename<CString>],
+    input_paths: &[InputPath],
+    mounts: &mut Vec<Mount>,
+) -> Result<(), Error>
+{
+    debug_assert_eq!(input_paths.len(), inputs.len());
+
+    // Directories that inputs are relative to, and where they are mounted.
+    let mut sources = Vec::new();
+
+    for (input_basename, input_path) in inputs.iter().zip(input_paths) {
+        let source = mount_source(scratch, scratch_path,
+                                  input_path.dirfd, &mut sources, mounts)
+            .with_context(|| format!("Mount source of input at {input_basename:?}"))?;
+        mount_input(scratch, root, source, cstr!(b"build"),
+                    input_basename, input_path, mounts)
+            .with_context(|| format!("Mount input at {input_basename:?}"))?;
+    }
+
+    Ok(())
+}
+
+/// Mount a directory that inputs are relative to, unless already mounted.
+///
+/// Returns the absolute path at which the directory is mounted.
+fn mount_source<'a>(
+    scratch: BorrowedFd,
+    scratch_path: &CStr,
+    dirfd: BorrowedFd,
+    sources: &'a mut Vec<(libc::c_int, CString)>,
+    mounts: &mut Vec<Mount>,
+) -> anyhow::Result<&'a CStr>
+{
+    let index = match sources.iter().position(|s| s.0 == dirfd.as_raw_fd()) {
+        Some(index) => index,
+        None => {
+            if sources.is_empty() {
+                mkdirat(Some(scratch), cstr!(b"sources"), 0o755)               .with_context(|| "Create sources directory")?;
+            }
+
+            // Make the source path absolute so it can be mounted.
+            // There is unfortunately no "mountat" system call.
+            let source =
+                resolve_magic(dirfd)
+                .with_context(|| "Find path to input path dir")?;
+
+            // The sources directory is outside the container,
+            // so the action cannot access anything but its inputs.
+            let index = sources.len();
+            let target = cstr!(b"sources").join(&CString::new(index.to_string()).unwrap());
+            mkdirat(Some(scratch), &target, 0o755)                              .with_context(|| "Create mount target")?;
+            let target = scratch_path.join(&target);
+
+            let mountz = Mount::rdonly_bind_mount(source.into(), target.clone().into());
+            mounts.extend(mountz);
+            sources.push((dirfd.as_raw_fd(), target));
+            index
+        },
+    };
+    Ok(&sources[index].1)
+}
+
+/// Mount an input in the container's `/build` directory.
+///
+/// The mount target is created in `targets`, a directory in the scratch
+/// directory that is mounted at `/build` by [`mount_build_directory`].
+fn mount_input(
+    scratch: BorrowedFd,
+    root: &CStr,
+    source: &CStr,
+    targets: &CStr,
+    input_basename: &Basename<CString>,
+    input_path: &InputPath,
+    mounts: &mut Vec<Mount>,
+) -> anyhow::Result<()>
+{
+    let InputPath{dirfd, path} = input_path;
+
+    // The mount target is created in the scratch directory,
+    // and mounted onto through the container's /build directory.
+    let target = targets.join(input_basename);
+    let mount = Mount{
+        source: source.join(path).into(),
+        target: root.join(cstr!(b"build")).join(input_basename).into(),
+        mountflags: libc::MS_BIND | libc::MS_REC,
+        ..Mount::default()
+    };
+
+    // How to mount the input depends on what type of file it is.
+    let statbuf = fstatat(Some(*dirfd), path, AT_SYMLINK_NOFOLLOW)              .with_context(|| "Find file type of input")?;
+    match statbuf.st_mode & S_IFMT {
+        S_IFREG => {
+            // If it's a regular file, the target must be a regular file.
+            mknodat(Some(scratch), &target, S_IFREG | 0o644, 0)                 .with_context(|| "Create mount target")?;
+            mounts.push(mount);
+        },
+        S_IFDIR => {
+            // If it's a directory, the target must be a directory.
+            mkdirat(Some(scratch), &target, 0o755)                              .with_context(|| "Create mount target")?;
+            mounts.push(mount);
+        },
+        S_IFLNK => {
+            // If it's a symbolic link, we're fucked as they can't be mounted.
+            // Copy the symbolic link instead (should be fast; they're small).
+            let symlink_target = readlinkat(Some(*dirfd), path)                 .with_context(|| "Find target of symbolic link")?;
+            symlinkat(&symlink_target, Some(scratch), &target)                  .with_context(|| "Create copy of symbolic link")?;
+        },
+        _ =>
+            unreachable!("Input has been hashed by the driver,
+                          so it can only be of a supported type"),
+    }
+
+    Ok(())
+}
+
+/// Link every input into the scratch directory's `inputs` directory.
+///
+/// See [`Materialization::Link`] for how each input is linked.
+/// Inputs that cannot be linked are mounted as by [`mount_inputs`].
+fn link_inputs(
+    scratch: BorrowedFd,
+    scratch_path: &CStr,
+    state: &State,
+    root: &CStr,
+    inputs: &[Basename<CString>],
+    input_paths: &[InputPath],
+    mounts: &mut Vec<Mount>,
+) -> Result<(), Error>
+{
+    debug_assert_eq!(input_paths.len(), inputs.len());
+
+    // Links cannot cross file systems, so don't bother trying.
+    let scratch_dev = fstat(scratch)                                            .with_context(|| "Find device of scratch directory")?.st_dev;
+    let output_cache = state.output_cache_dir()                                 .with_context(|| "Open output cache")?;
+
+    let mut sources = Vec::new();
+
+    for (input_basename, input_path) in inputs.iter().zip(input_paths) {
+        let InputPath{dirfd, path} = input_path;
+        let cached = dirfd.as_raw_fd() == output_cache.as_raw_fd();
+        let target = cstr!(b"inputs").join(input_basename);
+        let build_target = cstr!(b"build").join(input_basename);
+
+        let statbuf = fstatat(Some(*dirfd), path, AT_SYMLINK_NOFOLLOW)          .with_context(|| format!("Find file type of input at {input_basename:?}"))?;
+        let linkable = statbuf.st_dev == scratch_dev && match statbuf.st_mode & S_IFMT {
+            S_IFREG => true,
+            S_IFDIR => cached,
+            _       => false,
+        };
+
+        if !linkable {
+            let source = mount_source(scratch, scratch_path,
+                                      *dirfd, &mut sources, mounts)
+                .with_context(|| format!("Mount source of input at {input_basename:?}"))?;
+            mount_input(scratch, root, source, cstr!(b"inputs"),
+                        input_basename, input_path, mounts)
+                .with_context(|| format!("Mount input at {input_basename:?}"))?;
+            continue;
+        }
+
+        // Files that could not be linked are mounted onto instead.
+        let mut unlinked = Vec::new();
+        link_file(scratch, *dirfd, path, path, &statbuf, cached, false,
+                  &target, &build_target, &mut unlinked)
+            .with_context(|| format!("Link input at {input_basename:?}"))?;
+
+        if !unlinked.is_empty() {
+            let source = mount_source(scratch, scratch_path,
+                                      *dirfd, &mut sources, mounts)
+                .with_context(|| format!("Mount source of input at {input_basename:?}"))?;
+            for (source_path, build_target) in unlinked {
+                mounts.push(Mount{
+                    source: source.join(&source_path).into(),
+                    target: root.join(&build_target).into(),
+                    mountflags: libc::MS_BIND,
+                    ..Mount::default()
+                });
+            }
+        }
+    }
+
+    Ok(())
+}
+
+/// Link a file into the scratch directory, recursively for directories.
+///
+/// `source_path` is the path of the file relative to the input's `dirfd`.
+/// Regular files that can be neither linked nor cloned are copied
+/// if `copy` is set. Otherwise they are left empty,
+/// and their source and `/build`-relative paths are added to `unlinked`.
+#[allow(clippy::too_many_arguments)]
+fn link_file(
+    scratch: BorrowedFd,
+    dirfd: BorrowedFd,
+    path: &CStr,
+    source_path: &CStr,
+    statbuf: &stat,
+    cached: bool,
+    copy: bool,
+    target: &CStr,
+    build_target: &CStr,
+    unlinked: &mut Vec<(CString, CString)>,
+) -> anyhow::Result<()>
+{
+    match statbuf.st_mode & S_IFMT {
+        S_IFREG => {
+            // Cached outputs may be linked if the caller ensures
+            // that the program cannot modify them, as the overlay does.
+            // Linking may still fail, for instance with EMLINK.
+            if cached && linkat(Some(dirfd), path, Some(scratch), target, 0).is_ok() {
+                return Ok(());
+            }
+
+            // Otherwise clone the file, which works on some file systems.
+            // If that fails too, the file is either copied,
+            // or the empty file serves as a mount target.
+            let source = openat(Some(dirfd), path, O_NOFOLLOW | O_RDONLY, 0)   .with_context(|| "Open input file")?;
+            let flags = O_CREAT | O_EXCL | O_WRONLY;
+            let mode = statbuf.st_mode & 0o777;
+            let file = openat(Some(scratch), target, flags, mode)               .with_context(|| "Create copy of input file")?;
+            if ioctl_ficlone(file.as_fd(), source.as_fd()).is_err() {
+                if copy {
+                    io::copy(&mut File::from(source), &mut File::from(file))    .with_context(|| "Copy input file")?;
+                } else {
+                    unlinked.push((source_path.to_owned(), build_target.to_owned()));
+                }
+            }
+        },
+        S_IFDIR => {
+            mkdirat(Some(scratch), target, 0o755)                              .with_context(|| "Create copy of input directory")?;
+            let flags = O_DIRECTORY | O_NOFOLLOW | O_RDONLY;
+            let dir = openat(Some(dirfd), path, flags, 0)                       .with_context(|| "Open input directory")?;
+            let mut stream = fdopendir(dir)                                     .with_context(|| "Open input directory")?;
+            while let Some(dirent) = readdir(&mut stream)                       .with_context(|| "Read input directory")? {
+                let entry = dirent.d_name;
+                if entry.as_ref() == cstr!(b".") || entry.as_ref() == cstr!(b"..") {
+                    continue;
+                }
+                let statbuf = fstatat(Some(stream.as_fd()), &entry, AT_SYMLINK_NOFOLLOW)
+                    .with_context(|| "Find file type of input")?;
+                link_file(scratch, stream.as_fd(), &entry, &source_path.join(&entry),
+                          &statbuf, cached, copy, &target.join(&entry),
+                          &build_target.join(&entry), unlinked)?;
+            }
+        },
+        S_IFLNK => {
+            // Symbolic links are small, so copy them.
+            let symlink_target = readlinkat(Some(dirfd), path)                  .with_context(|| "Find target of symbolic link")?;
+            symlinkat(&symlink_target, Some(scratch), target)                   .with_context(|| "Create copy of symbolic link")?;
+        },
+        _ =>
+            unreachable!("Input has been hashed by the driver,
+                          so it can only be of a supported type"),
+    }
+    Ok(())
+}
+
+/// Compute the scratch-relative path at which each output is created.
+fn output_paths(outputs: &Outputs<Vec<Basename<CString>>>) -> Vec<CString>
+{
+    let build_dir = cstr!(b"build");
+    outputs.as_ref()
+        .map(|o| o.iter().map(|b| build_dir.join(&**b)).collect())
+        .get()
+}
+
+/// Looks for warnings in output as it is produced.
+///
+/// Output is fed in chunks of arbitrary size, and each line is matched
+/// against the pattern once it is complete, so that the build log need not
+/// be read back after the command terminates. Line feeds are not part of
+/// the lines that are matched, so the pattern is matched exactly as if
+/// it were matched against each line of the entire output.
+struct WarningScanner<'a>
+{
+    /// If [`None`], we assume there are no warnings.
+    pattern: Option<&'a Regex>,
+
+    /// Whether a line matched the pattern.
+    found: bool,
+
+    /// The start of a line that is split across chunks.
+    partial: Vec<u8>,
+
+    /// How much time was spent matching lines.
+    scanning: Duration,
+}
+
+impl<'a> WarningScanner<'a>
+{
+    /// Lines are cut off at this length when they are split across chunks.
+    ///
+    /// Commands that print megabytes without a line feed would otherwise
+    /// make the scanner buffer all of it, even though they are not
+    /// printing the kind of diagnostic that the pattern is looking for.
+    const MAX_PARTIAL: usize = 1 << 20;
+
+    fn new(pattern: Option<&'a Regex>) -> Self
+    {
+        Self{pattern, found: false, partial: Vec::new(),
+             scanning: Duration::ZERO}
+    }
+
+    /// Match the lines completed by a chunk of output.
+    fn feed(&mut self, chunk: &[u8])
+    {
+        let started = Instant::now();
+        self.feed_lines(chunk);
+        self.scanning += started.elapsed();
+    }
+
+    fn feed_lines(&mut self, chunk: &[u8])
+    {
+        // Once a warning is found, the rest of the output is irrelevant.
+        let Some(pattern) = self.pattern
+            else { return };
+        if self.found {
+            return;
+        }
+
+        // BufRead::lines is inadequate as output may be invalid UTF-8.
+        // That's also why we use regex::bytes::Regex instead of regex::Regex.
+        let mut lines = chunk.split(|&b| b == b'\n');
+        let last = lines.next_back().unwrap_or_default();
+        for line in lines {
+            let line = if self.partial.is_empty() {
+                line
+            } else {
+                self.extend_partial(line);
+                &self.partial
+            };
+            if pattern.is_match(line) {
+                self.found = true;
+                self.partial = Vec::new();
+                return;
+            }
+            self.partial.clear();
+        }
+        self.extend_partial(last);
+    }
+
+    /// Match the last line, which need not end in a line feed.
+    fn finish(&mut self) -> bool
+    {
+        if !self.partial.is_empty() {
+            self.feed(b"\n");
+        }
+        self.found
+    }
+
+    fn extend_partial(&mut self, bytes: &[u8])
+    {
+        let room = Self::MAX_PARTIAL - self.partial.len();
+        self.partial.extend_from_slice(&bytes[.. bytes.len().min(room)]);
+    }
+}
+
+/// Obtain the path to the file referred to by a file descriptor.
+///
+/// Some system calls do not work well with file descriptors:
+///
+///  1. There is no `mountat` system call, necessitating the use of `mount`.
+///  2. `fchdir` doesn't work with mount namespaces for whichever reason.
+fn resolve_magic(fd: BorrowedFd) -> Result<CString, Error>
+{
+    readlink(&magic_link(fd))
+        .map_err(|err| Error::from(anyhow::Error::from(err)))
+}
+
+/// Run the command in the already set up container.
+fn run_command(
+    build_log: BorrowedFd,
+    root: &CStr,
+    program: &CStr,
+    arguments: &[CString],
+    environment: &[CString],
+    timeout: Duration,
+    warnings: Option<&Regex>,
+    cgroup: Option<BorrowedFd>,
+    cancellation: &Cancellation,
+    trace: ActionTrace,
+    mounts: Vec<Mount>,
+) -> Result<bool, Error>
+{
+    // The output goes through a pipe so that we see it as it is written.
+    let (output_r, output_w) = pipe2(0)                                         .with_context(|| "Create pipe for command output")?;
+    let stdio = Stdio{stdin: None, stdout: output_w.as_fd(),
+                      stderr: output_w.as_fd()};
+    let container = trace.phase("spawn container", || {
+        spawn_container(stdio, root, program, arguments,
+                        environment, cgroup, mounts)
+    })?;
+
+    // Otherwise we would never see end-of-file on the read end.
+    drop(output_w);
+
+    let build_log = build_log.try_to_owned()                                    .with_context(|| "Duplicate build log file descriptor")?;
+    let mut scanner = WarningScanner::new(warnings);
+    let started = Instant::now();
+    let result = container.wait(timeout, cancellation, File::from(output_r),
+                                &mut File::from(build_log), &mut scanner);
+    let finished = Instant::now();
+    trace.record("run command", started, finished - started);
+    result?;
+    let warnings = scanner.finish();
+
+    // Lines are matched in between reading the output of the command,
+    // so the time spent on that is recorded as a single phase
+    // that ends where running the command ended.
+    let scanning = scanner.scanning;
+    trace.record("scan warnings", finished - scanning, scanning);
+
+    Ok(warnings)
+}
+
+/// Cgroup that enforces the reservation of a single container.
+///
+/// The cgroup is removed when this is dropped.
+/// This must happen after the container has terminated.
+struct Cgroup<'a>
+{
+    parent: BorrowedFd<'a>,
+    name: CString,
+    dir: OwnedFd,
+}
+
+impl<'a> Cgroup<'a>
+{
+    /// The period over which CPU usage is limited, in microseconds.
+    ///
+    /// This is the default period that the kernel uses.
+    const CPU_PERIOD: u64 = 100_000;
+
+    /// Create a cgroup within `parent` and apply limits to it.
+    ///
+    /// Limits for controllers that are not enabled are skipped.
+    fn create(parent: BorrowedFd<'a>, resources: &Resources)
+        -> Result<Self, Error>
+    {
+        static NEXT: AtomicU64 = AtomicU64::new(0);
+        let id = NEXT.fetch_add(1, SeqCst);
+        let name = format!("snowflake-{}-{id}", process::id());
+        let name = CString::new(name).unwrap();
+
+        mkdirat(Some(parent), &name, 0o755)                                     .with_context(|| "Create cgroup")?;
+
+        // Remove the cgroup again if it cannot be opened.
+        let dir = openat(Some(parent), &name, O_DIRECTORY | O_RDONLY, 0)
+            .with_context(|| "Open cgroup");
+        let dir = dir.map_err(|err| {
+            let _ = unlinkat(Some(parent), &name, AT_REMOVEDIR);
+            err
+        })?;
+
+        // From here on, dropping the cgroup removes it.
+        let this = Self{parent, name, dir};
+
+        let Resources{cpus, memory} = *resources;
+        let cpu_max = format!("{} {}\n", cpus as u64 * Self::CPU_PERIOD,
+                                         Self::CPU_PERIOD);
+        let memory_max = match memory {
+            0 => "max\n".to_owned(),
+            _ => format!("{memory}\n"),
+        };
+        this.write_limit(cstr!(b"cpu.max"), &cpu_max)                           .with_context(|| "Set cpu.max of cgroup")?;
+        this.write_limit(cstr!(b"memory.max"), &memory_max)                     .with_context(|| "Set memory.max of cgroup")?;
+
+        Ok(this)
+    }
+
+    /// Write to an interface file, if the controller is enabled.
+    fn write_limit(&self, file: &CStr, value: &str) -> io::Result<()>
+    {
+        match openat(Some(self.dir.as_fd()), file, O_WRONLY, 0) {
+            Ok(file) => File::from(file).write_all(value.as_bytes()),
+            Err(err) if err.kind() == NotFound => Ok(()),
+            Err(err) => Err(err),
+        }
+    }
+}
+
+impl<'a> Drop for Cgroup<'a>
+{
+    fn drop(&mut self)
+    {
+        // The kernel may still be tearing down processes of the container,
+        // in which case it reports EBUSY. There is nothing we can do then,
+        // other than leave the empty cgroup for the administrator.
+        let _ = unlinkat(Some(self.parent), &self.name, AT_REMOVEDIR);
+    }
+}
+
+/// Where the standard streams of a container process are connected to.
+struct Stdio<'a>
+{
+    /// If [`None`], standard input is closed.
+    stdin: Option<BorrowedFd<'a>>,
+    stdout: BorrowedFd<'a>,
+    stderr: BorrowedFd<'a>,
+}
+
+/// Process running in a container, created by [`spawn_container`].
+///
+/// If the process has not terminated when this is dropped,
+/// the process is killed.
+struct Container
+{
+    pid: libc::pid_t,
+    pidfd: OwnedFd,
+    terminated: bool,
+}
+
+impl Container
+{
+    /// Wait for the process to terminate and check its exit status.
+    ///
+    /// Meanwhile, whatever the process writes to `output` is copied to
+    /// `build_log` and fed to `warnings`. This continues until end-of-file,
+    /// so no output is lost if the process terminates while writing.
+    /// If it does not terminate within the timeout,
+    /// or if the cancellation is requested, it is killed.
+    fn wait(
+        mut self,
+        timeout: Duration,
+        cancellation: &Cancellation,
+        mut output: File,
+        build_log: &mut File,
+        warnings: &mut WarningScanner,
+    ) -> Result<(), Error>
+    {
+        // A pidfd reports "readable" when the child terminates.
+        // We don't need to actually read from the pidfd, only ppoll.
+        // Negative file descriptors are ignored by ppoll,
+        // which is how we stop polling for events that already occurred.
+        let mut pollfds = [
+            libc::pollfd{
+                fd: self.pidfd.as_raw_fd(),
+                events: libc::POLLIN,
+                revents: 0,
+            },
+            libc::pollfd{
+                fd: output.as_raw_fd(),
+                events: libc::POLLIN,
+                revents: 0,
+            },
+            libc::pollfd{
+                fd: cancellation.as_fd().map_or(-1, |fd| fd.as_raw_fd()),
+                events: libc::POLLIN,
+                revents: 0,
+            },
+        ];
+
+        // Large chunks keep the number of system calls down
+        // for commands that write a lot of output.
+        let mut chunk = vec![0; 64 * 1024];
+
+        // The child has terminated once both the pidfd and the output
+        // are done with; the cancellation is never done with.
+        let deadline = Instant::now().checked_add(timeout);
+        while pollfds[.. 2].iter().any(|pollfd| pollfd.fd != -1) {
+
+            // Without a file descriptor, cancellation is checked
+            // whenever the child writes output.
+            if cancellation.is_cancelled() {
+                return Err(Error::Cancelled);
+            }
+
+            // Convert remaining time from Duration to libc::timespec.
+            let remaining = deadline.map(|deadline|
+                deadline.saturating_duration_since(Instant::now()));
+            let ptimeout = remaining.map(|remaining| libc::timespec{
+                tv_sec: remaining.as_secs().try_into().unwrap_or(libc::time_t::MAX),
+                tv_nsec: remaining.subsec_nanos().try_into().unwrap_or(libc::c_long::MAX),
+            });
+            let ptimeout = ptimeout.as_ref().map_or(null(), |p| p as *const _);
+
+            // Wait for the child to terminate or write output,
+            // or for the timeout to occur.
+            let nfds = pollfds.len() as libc::nfds_t;
+            let ppoll = unsafe {
+                libc::ppoll(pollfds.as_mut_ptr(), nfds, ptimeout, null())
+            };
+            if ppoll == -1 {
+                let error = io::Error::last_os_error();
+                if error.kind() == Interrupted {
+                    continue;
+                }
+                return Err(anyhow::Error::from(error))
+                    .with_context(|| "Poll child process")
+                    .map_err(Error::from);
+            }
+            if ppoll == 0 {
+                return Err(Error::Timeout(timeout));
+            }
+
+            // Dropping self kills the child.
+            if pollfds[2].revents != 0 {
+                return Err(Error::Cancelled);
+            }
+
+            if pollfds[0].revents != 0 {
+                pollfds[0].fd = -1;
+            }
+
+            // Hangups are reported as such even if data remains,
+            // so keep reading until end-of-file.
+            if pollfds[1].revents != 0 {
+                let nread = match output.read(&mut chunk) {
+                    Ok(nread) => nread,
+                    Err(err) if err.kind() == Interrupted => continue,
+                    Err(err) => return Err(anyhow::Error::from(err))
+                        .with_context(|| "Read output of command")
+                        .map_err(Error::from),
+                };
+                if nread == 0 {
+                    pollfds[1].fd = -1;
+                }
+                build_log.write_all(&chunk[.. nread])                           .with_context(|| "Write output of command to build log")?;
+                warnings.feed(&chunk[.. nread]);
+            }
+        }
+
+        // The child has terminated, so no need to kill it.
+        self.terminated = true;
+
+        // Clean up the child process and obtain its wait status.
+        // Check that the child terminated successfully.
+        let mut wstatus = 0;
+        let waitpid = unsafe { libc::waitpid(self.pid, &mut wstatus, 0) };
+        assert_eq!(waitpid, self.pid, "pidfd reported that child has terminated");
+        ExitStatus::from_raw(wstatus).exit_ok()?;
+
+        Ok(())
+    }
+}
+
+impl Drop for Container
+{
+    fn drop(&mut self)
+    {
+        // SIGKILL is normally frowned upon; the child gets no chance to clean up.
+        // But in our case the child is sandboxed; there is nothing to clean up.
+        if !self.terminated {
+            unsafe { libc::kill(self.pid, libc::SIGKILL); }
+            unsafe { libc::waitpid(self.pid, null_mut(), libc::WNOHANG); }
+        }
+    }
+}
+
+/// Arguments to the clone3 system call.
+///
+/// This struct is unfortunately not part of the libc crate.
+#[repr(C)]
+struct clone_args
+{
+    flags:        u64,
+    pidfd:        u64,
+    child_tid:    u64,
+    parent_tid:   u64,
+    exit_signal:  u64,
+    stack:        u64,
+    stack_size:   u64,
+    tls:          u64,
+    set_tid:      u64,
+    set_tid_size: u64,
+    cgroup:       u64,
+}
+
+/// Flag to the clone3 system call, new in Linux 5.7.
+///
+/// This flag is unfortunately not part of the libc crate.
+const CLONE_INTO_CGROUP: u64 = 0x200000000;
+
+#[cfg(test)]
+mod tests
+{
+    use {
+        super::*,
+        os_ext::{
+            O_DIRECTORY, O_PATH, O_RDWR, O_TMPFILE,
+            cstr, cstring, mkdtemp, open,
+        },
+        snowflake_core::action::WrittenOutputs,
+        std::{
+            assert_matches::assert_matches,
+            io::{Seek, Write},
+            ops::Deref,
+            thread,
+        },
+    };
+
+    /// Call the perform_run_command function and
+    /// return the result and the build log file.
+    fn call_perform_run_command(
+        action: &RunCommand,
+        input_paths: &[InputPath],
+    ) -> (Result<Success, Error>, File)
+    {
+        let path  = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+        call_perform_run_command_in(&state, action, input_paths)
+    }
+
+    /// Like [`call_perform_run_command`], but with a given state directory.
+    fn call_perform_run_command_in(
+        state: &State,
+        action: &RunCommand,
+        input_paths: &[InputPath],
+    ) -> (Result<Success, Error>, File)
+    {
+        let build_log = open(cstr!(b"."), O_RDWR | O_TMPFILE, 0o644).unwrap();
+        let scratch   = state.new_scratch_dir().unwrap();
+
+        let perform = Perform{
+            build_log: build_log.as_fd(),
+            scratch: scratch.as_fd(),
+            state,
+            cgroup: None,
+            written_outputs: &WrittenOutputs::default(),
+            cancellation: &Cancellation::new(),
+            trace: ActionTrace::default(),
+        };
+
+        let result = perform_run_command(&perform, action, input_paths);
+
+        let mut build_log = File::from(build_log);
+        build_log.rewind().unwrap();
+
+        (result, build_log)
+    }
+
+    #[test]
+    fn inputs()
+    {
+        for materialization in [Materialization::Mount, Materialization::Link] {
+            check_inputs(materialization);
+        }
+    }
+
+    fn check_inputs(materialization: Materialization)
+    {
+        let coreutils = env!("SNOWFLAKE_COREUTILS");
+
+        let inputs: Vec<Basename<CString>> =
+            [
+                cstring!(b"regular.txt"),
+                cstring!(b"directory"),
+                cstring!(b"symlink.lnk"),
+                cstring!(b"broken.lnk"),
+            ]
+            .into_iter()
+            .map(|i| Basename::new(i).unwrap())
+            .collect();
+
+        let source_root =
+            open(cstr!(b"testdata/inputs"), O_DIRECTORY | O_PATH, 0)
+                .unwrap();
+
+        let input_paths: Vec<InputPath> =
+            inputs.iter()
+            .map(|i| InputPath{
+                dirfd: source_root.as_fd(),
+                path: Cow::Owned(i.deref().to_owned()),
+            })
+            .collect();
+
+        let action = RunCommand{
+            inputs,
+            outputs: Outputs::Outputs(vec![]),
+            program: cstring!(b"/bin/sh"),
+            arguments: vec![
+                cstring!(b"sh"),
+                cstring!(b"-c"),
+                cstring!(br#"
+                    cat regular.txt
+                    ls directory
+                    readlink symlink.lnk
+                    readlink broken.lnk
+                "#),
+            ],
+            environment: vec![
+                CString::new(format!("PATH={coreutils}/bin")).unwrap(),
+            ],
+            // Mounting the overlay happens in the container, and takes time.
+            timeout: Duration::from_millis(500),
+            resources: Resources::default(),
+            warnings: None,
+            materialization,
+            worker: None,
+        };
+
+        let (result, mut build_log) =
+            call_perform_run_command(&action, &input_paths);
+
+        assert_matches!(result, Ok(Success{warnings: false, ..}),
+                        "{materialization:?}");
+        let mut buf = String::new();
+        build_log.read_to_string(&mut buf).unwrap();
+        assert_eq!(buf, "Hello, world!\nbar.txt\nfoo.txt\n\
+                         regular.txt\nenoent.txt\n");
+    }
+
+    #[test]
+    fn inputs_read_only()
+    {
+        let source_root =
+            open(cstr!(b"testdata/inputs"), O_DIRECTORY | O_PATH, 0)
+                .unwrap();
+
+        let input_paths = [
+            InputPath{
+                dirfd: source_root.as_fd(),
+                path: Cow::Borrowed(cstr!(b"regular.txt")),
+            },
+            InputPath{
+                dirfd: source_root.as_fd(),
+                path: Cow::Borrowed(cstr!(b"directory/foo.txt")),
+            },
+        ];
+
+        let action = RunCommand{
+            inputs: vec![
+                Basename::new(cstring!(b"a.txt")).unwrap(),
+                Basename::new(cstring!(b"b.txt")).unwrap(),
+            ],
+            outputs: Outputs::Outputs(vec![]),
+            program: cstring!(b"/bin/sh"),
+            arguments: vec![
+                cstring!(b"sh"),
+                cstring!(b"-c"),
+                cstring!(b"echo bad > b.txt"),
+            ],
+            environment: vec![],
+            timeout: Duration::from_millis(50),
+            resources: Resources::default(),
+            warnings: None,
+            materialization: Materialization::Mount,
+            worker: None,
+        };
+
+        let (result, _) = call_perform_run_command(&action, &input_paths);
+        assert_matches!(result, Err(Error::ExitStatus(_)));
+    }
+
+    #[test]
+    fn inputs_copy_on_write()
+    {
+        let path  = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+
+        // Outputs from the output cache are hard linked into the overlay.
+        let source = state.new_scratch_dir().unwrap();
+        mkdirat(Some(source.as_fd()), cstr!(b"directory"), 0o755).unwrap();
+        let flags = O_CREAT | O_WRONLY;
+        let file = openat(Some(source.as_fd()), cstr!(b"directory/a.txt"), flags, 0o644).unwrap();
+        File::from(file).write_all(b"good\n").unwrap();
+        let hash = state.cache_output(Some(source.as_fd()), cstr!(b"directory")).unwrap();
+        let (dirfd, path) = state.cached_output(hash).unwrap();
+
+        let input_paths = [InputPath{dirfd, path: Cow::Borrowed(&path)}];
+
+        let action = RunCommand{
+            inputs: vec![Basename::new(cstring!(b"directory")).unwrap()],
+            outputs: Outputs::Outputs(vec![]),
+            program: cstring!(b"/bin/sh"),
+            arguments: vec![
+                cstring!(b"sh"),
+                cstring!(b"-c"),
+                cstring!(b"echo bad > directory/a.txt"),
+            ],
+            environment: vec![],
+            timeout: Duration::from_millis(500),
+            resources: Resources::default(),
+            warnings: None,
+            materialization: Materialization::Link,
+            worker: None,
+        };
+
+        let (result, _) = call_perform_run_command_in(&state, &action, &input_paths);
+        assert_matches!(result, Ok(Success{warnings: false, ..}));
+
+        // The write went to a copy in the overlay, not to the output cache.
+        let mut buf = String::new();
+        let path = CString::new(format!("{hash}/a.txt")).unwrap();
+        let file = openat(Some(dirfd), &path, O_RDONLY, 0).unwrap();
+        File::from(file).read_to_string(&mut buf).unwrap();
+        assert_eq!(buf, "good\n");
+    }
+
+    /// Worker that runs each command in a subshell.
+    ///
+    /// Each output is prefixed with the number of requests so far,
+    /// so that tests can tell whether the worker was reused.
+    fn shell_worker(arguments: Vec<CString>, timeout: Duration) -> RunCommand
+    {
+        let bash      = CString::new(env!("SNOWFLAKE_BASH")).unwrap();
+        let coreutils = env!("SNOWFLAKE_COREUTILS");
+        RunCommand{
+            inputs: vec![Basename::new(cstring!(b"regular.txt")).unwrap()],
+            outputs: Outputs::Outputs(vec![Basename::new(cstring!(b"out.txt")).unwrap()]),
+            program: bash.join(cstr!(b"bin/bash")),
+            arguments,
+            environment: vec![
+                CString::new(format!("PATH={coreutils}/bin")).unwrap(),
+                cstring!(b"LC_ALL=C"),
+            ],
+            timeout,
+            resources: Resources::default(),
+            warnings: None,
+            materialization: Materialization::Mount,
+            worker: Some(Worker{
+                arguments: vec![
+                    cstring!(b"bash"),
+                    cstring!(b"-c"),
+                    cstring!(br#"
+                        count=0
+                        while read -r -d '' dir && read -r -d '' argc; do
+                            args=()
+                            for (( i = 0; i < argc; i++ )); do
+                                read -r -d '' arg
+                                args+=("$arg")
+                            done
+                            count=$(( count + 1 ))
+                            output=$(cd "$dir" && "${args[@]}" 2>&1)
+                            status=$?
+                            output="$count: $output"
+                            printf '%s\0%s\0%s' "$status" "${#output}" "$output"
+                        done
+                    "#),
+                ],
+            }),
+        }
+    }
+
+    #[test]
+    fn worker()
+    {
+        let path  = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+
+        let source_root =
+            open(cstr!(b"testdata/inputs"), O_DIRECTORY | O_PATH, 0)
+                .unwrap();
+        let input_paths = [InputPath{
+            dirfd: source_root.as_fd(),
+            path: Cow::Borrowed(cstr!(b"regular.txt")),
+        }];
+
+        let bash = CString::new(env!("SNOWFLAKE_BASH")).unwrap();
+        let action = shell_worker(
+            vec![
+                bash.join(cstr!(b"bin/bash")),
+                cstring!(b"-c"),
+                cstring!(b"cat regular.txt > out.txt; cat out.txt"),
+            ],
+            Duration::from_secs(1),
+        );
+
+        // The second action is sent to the same worker.
+        for expected in ["1: Hello, world!", "2: Hello, world!"] {
+            let (result, mut build_log) =
+                call_perform_run_command_in(&state, &action, &input_paths);
+            assert_matches!(result, Ok(Success{warnings: false, ..}));
+            let mut buf = String::new();
+            build_log.read_to_string(&mut buf).unwrap();
+            assert_eq!(buf, expected);
+        }
+    }
+
+    #[test]
+    fn worker_inputs_copy_on_write()
+    {
+        let path  = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+
+        let source = state.new_scratch_dir().unwrap();
+        let flags = O_CREAT | O_WRONLY;
+        let file = openat(Some(source.as_fd()), cstr!(b"regular.txt"), flags, 0o644).unwrap();
+        File::from(file).write_all(b"good\n").unwrap();
+        let hash = state.cache_output(Some(source.as_fd()), cstr!(b"regular.txt")).unwrap();
+        let (dirfd, path) = state.cached_output(hash).unwrap();
+
+        let input_paths = [InputPath{dirfd, path: Cow::Borrowed(&path)}];
+
+        let bash = CString::new(env!("SNOWFLAKE_BASH")).unwrap();
+        let action = shell_worker(
+            vec![
+                bash.join(cstr!(b"bin/bash")),
+                cstring!(b"-c"),
+                cstring!(b"echo bad > regular.txt; chmod 755 regular.txt; : > out.txt"),
+            ],
+            Duration::from_secs(1),
+        );
+
+        let (result, _) = call_perform_run_command_in(&state, &action, &input_paths);
+        assert_matches!(result, Ok(Success{warnings: false, ..}));
+
+        // The write went to a copy, not to the output cache.
+        let mut buf = String::new();
+        let file = openat(Some(dirfd), &path, O_RDONLY, 0).unwrap();
+        File::from(file).read_to_string(&mut buf).unwrap();
+        assert_eq!(buf, "good\n");
+        let statbuf = fstatat(Some(dirfd), &path, 0).unwrap();
+        assert_eq!(statbuf.st_mode & 0o111, 0);
+    }
+
+    #[test]
+    fn worker_workspace()
+    {
+        let path  = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+
+        // The scratch directory of a concurrent action.
+        let other = state.new_scratch_dir().unwrap();
+        mkdirat(Some(other.as_fd()), cstr!(b"build"), 0o755).unwrap();
+
+        let source_root =
+            open(cstr!(b"testdata/inputs"), O_DIRECTORY | O_PATH, 0)
+                .unwrap();
+        let input_paths = [InputPath{
+            dirfd: source_root.as_fd(),
+            path: Cow::Borrowed(cstr!(b"regular.txt")),
+        }];
+
+        let bash = CString::new(env!("SNOWFLAKE_BASH")).unwrap();
+        let action = shell_worker(
+            vec![
+                bash.join(cstr!(b"bin/bash")),
+                cstring!(b"-c"),
+                cstring!(b"shopt -s dotglob; echo /build/*; : > out.txt"),
+            ],
+            Duration::from_secs(1),
+        );
+
+        // Neither other actions nor earlier requests are visible.
+        for expected in ["1: /build/request", "2: /build/request"] {
+            let (result, mut build_log) =
+                call_perform_run_command_in(&state, &action, &input_paths);
+            assert_matches!(result, Ok(Success{warnings: false, ..}));
+            let mut buf = String::new();
+            build_log.read_to_string(&mut buf).unwrap();
+            assert_eq!(buf, expected);
+        }
+    }
+
+    #[test]
+    fn worker_failure()
+    {
+        let path  = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+
+        let source_root =
+            open(cstr!(b"testdata/inputs"), O_DIRECTORY | O_PATH, 0)
+                .unwrap();
+        let input_paths = [InputPath{
+            dirfd: source_root.as_fd(),
+            path: Cow::Borrowed(cstr!(b"regular.txt")),
+        }];
+
+        // Unsuccessful commands do not affect the worker.
+        let action = shell_worker(vec![cstring!(b"false")], Duration::from_secs(1));
+        let (result, _) = call_perform_run_command_in(&state, &action, &input_paths);
+        assert_matches!(result, Err(Error::ExitStatus(_)));
+
+        // Workers that time out are killed.
+        let action = shell_worker(
+            vec![cstring!(b"sleep"), cstring!(b"1")],
+            Duration::from_millis(50),
+        );
+        let (result, _) = call_perform_run_command_in(&state, &action, &input_paths);
+        assert_matches!(result, Err(Error::Timeout(_)));
+
+        // So the next action starts a new worker.
+        let action = shell_worker(vec![cstring!(b"true")], Duration::from_secs(1));
+        let (result, mut build_log) =
+            call_perform_run_command_in(&state, &action, &input_paths);
+        assert_matches!(result, Ok(Success{warnings: false, ..}));
+        let mut buf = String::new();
+        build_log.read_to_string(&mut buf).unwrap();
+        assert_eq!(buf, "1: ");
+    }
+
+    #[test]
+    fn pid_1()
+    {
+        let action = RunCommand{
+            inputs: vec![],
+            outputs: Outputs::Outputs(vec![]),
+            program: cstring!(b"/bin/sh"),
+            arguments: vec![
+                cstring!(b"sh"),
+                cstring!(b"-c"),
+                cstring!(b"echo $$"),
+            ],
+            environment: vec![],
+            timeout: Duration::from_millis(50),
+            resources: Resources::default(),
+            warnings: None,
+            materialization: Materialization::Mount,
+            worker: None,
+        };
+        let (result, mut build_log) = call_perform_run_command(&action, &[]);
+        assert_matches!(result, Ok(Success{warnings: false, ..}));
+        let mut buf = Vec::new();
+        build_log.read_to_end(&mut buf).unwrap();
+        assert_eq!(buf, b"1\n");
+    }
+
+    #[test]
+    fn timeout()
+    {
+        let coreutils = CString::new(env!("SNOWFLAKE_COREUTILS")).unwrap();
+        let action = RunCommand{
+            inputs: vec![],
+            outputs: Outputs::Outputs(vec![]),
+            program: coreutils.join(cstr!(b"bin/sleep")),
+            arguments: vec![cstring!(b"sleep"), cstring!(b"0.060")],
+            environment: vec![],
+            timeout: Duration::from_millis(50),
+            resources: Resources::default(),
+            warnings: None,
+            materialization: Materialization::Mount,
+            worker: None,
+        };
+        let (result, _) = call_perform_run_command(&action, &[]);
+        assert_matches!(result, Err(Error::Timeout(_)));
+    }
+
+    #[test]
+    fn cancellation()
+    {
+        let coreutils = CString::new(env!("SNOWFLAKE_COREUTILS")).unwrap();
+        let action = RunCommand{
+            inputs: vec![],
+            outputs: Outputs::Outputs(vec![]),
+            program: coreutils.join(cstr!(b"bin/sleep")),
+            arguments: vec![cstring!(b"sleep"), cstring!(b"10")],
+            environment: vec![],
+            timeout: Duration::from_secs(20),
+            resources: Resources::default(),
+            warnings: None,
+            materialization: Materialization::Mount,
+            worker: None,
+        };
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+        let build_log = open(cstr!(b"."), O_RDWR | O_TMPFILE, 0o644).unwrap();
+        let scratch = state.new_scratch_dir().unwrap();
+        let cancellation = Cancellation::new();
+        let perform = Perform{
+            build_log: build_log.as_fd(),
+            scratch: scratch.as_fd(),
+            state: &state,
+            cgroup: None,
+            written_outputs: &WrittenOutputs::default(),
+            cancellation: &cancellation,
+            trace: ActionTrace::default(),
+        };
+
+        // The command is killed soon after the cancellation is requested.
+        let started = Instant::now();
+        let result = thread::scope(|s| {
+            s.spawn(|| {
+                thread::sleep(Duration::from_millis(50));
+                cancellation.cancel();
+            });
+            perform_run_command(&perform, &action, &[])
+        });
+        assert_matches!(result, Err(Error::Cancelled));
+        assert!(started.elapsed() < Duration::from_secs(5));
+    }
+
+    #[test]
+    fn unsuccessful_termination()
+    {
+        let coreutils = CString::new(env!("SNOWFLAKE_COREUTILS")).unwrap();
+        let action = RunCommand{
+            inputs: vec![],
+            outputs: Outputs::Outputs(vec![]),
+            program: coreutils.join(cstr!(b"bin/false")),
+            arguments: vec![cstring!(b"false")],
+            environment: vec![],
+            timeout: Duration::from_millis(50),
+            resources: Resources::default(),
+            warnings: None,
+            materialization: Materialization::Mount,
+            worker: None,
+        };
+        let (result, _) = call_perform_run_command(&action, &[]);
+        assert_matches!(result, Err(Error::ExitStatus(_)));
+    }
+
+    #[test]
+    fn warnings_across_chunks()
+    {
+        let pattern = Regex::new("^warning:").unwrap();
+        let scan = |chunks: &[&[u8]]| {
+            let mut scanner = WarningScanner::new(Some(&pattern));
+            chunks.iter().for_each(|chunk| scanner.feed(chunk));
+            scanner.finish()
+        };
+        assert!(scan(&[b"hello\nwarn", b"ing: boo\n"]));
+        assert!(scan(&[b"hello\n", b"warning: boo"]));
+        assert!(!scan(&[b"hello warn", b"ing: boo\n"]));
+        assert!(!scan(&[b"hello\n", b"", b"\n"]));
+    }
+
+    #[test]
+    fn warnings()
+    {
+        let action = RunCommand{
+            inputs: vec![],
+            outputs: Outputs::Outputs(vec![]),
+            program: cstring!(b"/bin/sh"),
+            arguments: vec![
+                cstring!(b"sh"),
+                cstring!(b"-c"),
+                cstring!(b"echo hello; echo 'warning: boo'"),
+            ],
+            environment: vec![],
+            timeout: Duration::from_millis(50),
+            resources: Resources::default(),
+            warnings: Some(Regex::new("^warning:").unwrap()),
+            materialization: Materialization::Mount,
+            worker: None,
+        };
+        let (result, _) = call_perform_run_command(&action, &[]);
+        assert_matches!(result, Ok(Success{warnings: true, ..}));
+    }
+}
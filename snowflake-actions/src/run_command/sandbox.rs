@@ -0,0 +1,798 @@
+use {
+    super::{CLONE_INTO_CGROUP, Container, Mount, Stdio, clone_args},
+    anyhow::Context,
+    os_ext::{getgid, getuid, pipe2},
+    snowflake_core::action::Error,
+    std::{
+        ffi::{CStr, CString},
+        fs::File,
+        io::{self, ErrorKind::Interrupted, Read},
+        lazy::SyncOnceCell,
+        mem::{size_of_val, zeroed},
+        os::unix::io::{AsFd, AsRawFd, BorrowedFd, FromRawFd, OwnedFd, RawFd},
+        panic::always_abort,
+        ptr::{addr_of, addr_of_mut, null, null_mut},
+        sync::Mutex,
+    },
+};
+
+/// Namespaces that each container gets for itself.
+///
+/// The user namespace is not among these; it belongs to the helper,
+/// and is shared by all containers that the helper spawns.
+/// Creating namespaces other than user namespaces requires
+/// no mappings to be written, so these are cheap to create.
+const CONTAINER_NAMESPACES: u64 = (
+    libc::CLONE_NEWCGROUP |  // New cgroup namespace.
+    libc::CLONE_NEWIPC    |  // New IPC namespace.
+    libc::CLONE_NEWNET    |  // New network namespace.
+    libc::CLONE_NEWNS     |  // New mount namespace.
+    libc::CLONE_NEWPID    |  // New PID namespace.
+    libc::CLONE_NEWUTS       // New UTS namespace.
+) as u64;
+
+/// Maximum size in bytes of the body of a request.
+const MAX_BODY: usize = 1 << 20;
+
+/// Maximum number of pointers to strings in a request,
+/// including the null pointers that terminate argv and envp.
+const MAX_STRINGS: usize = 1 << 14;
+
+/// Maximum number of file descriptors sent along with a request.
+const MAX_FDS: usize = 5;
+
+/// Size in bytes of the header of a request.
+const HEADER_SIZE: usize = 20;
+
+/// Header flag: a file descriptor for standard input is included.
+const HAS_STDIN: u32 = 1;
+
+/// Header flag: a file descriptor for the cgroup is included.
+const HAS_CGROUP: u32 = 2;
+
+/// Process that spawns containers on behalf of this process.
+///
+/// Creating a user namespace and writing its uid and gid maps
+/// is by far the most expensive part of creating a container,
+/// and the kernel serializes it, so it does not scale across cores.
+/// A helper is started in a user namespace of its own,
+/// and spawns the containers in that same user namespace.
+/// Idle helpers are kept for the remainder of the process,
+/// so that each helper is used for many containers.
+///
+/// # Protocol
+///
+/// Requests are sent over a Unix stream socket, one at a time.
+/// Each request consists of a header of five native-endian u32s:
+/// the length of the body, the number of arguments, the number of
+/// environment variables, the number of mounts, and some flags.
+/// The body consists of the mount flags of each mount as u64s,
+/// followed by these NUL-terminated strings: the root, the program,
+/// the arguments, the environment variables, and for each mount,
+/// the source, target, file system type, and data.
+/// Attached to the header are the file descriptors for standard output,
+/// standard error, the write end of the error pipe of [`spawn_container`],
+/// and, if the respective flags are set, standard input and the cgroup.
+///
+/// The helper spawns the container with `CLONE_PARENT`,
+/// so that this process can wait for it like for any other child.
+/// It then responds with the pid of the container and an errno,
+/// as native-endian i32s. If the pid is not -1, the pidfd of the
+/// container is attached. The helper exits when the socket is closed.
+struct Helper
+{
+    pid: libc::pid_t,
+    socket: OwnedFd,
+}
+
+/// Idle helpers.
+static IDLE: SyncOnceCell<Mutex<Vec<Helper>>> = SyncOnceCell::new();
+
+/// Start a program in the already set up container.
+///
+/// The container is spawned by an idle helper, or a new one.
+pub (super) fn spawn_container(
+    stdio: Stdio,
+    root: &CStr,
+    program: &CStr,
+    arguments: &[CString],
+    environment: &[CString],
+    cgroup: Option<BorrowedFd>,
+    // By value, to prevent accidentally adding
+    // mounts *after* running the command. :)
+    mounts: Vec<Mount>,
+) -> Result<Container, Error>
+{
+    // This pipe is used by the child to send pre-execve errors to the parent.
+    // Since CLOEXEC is enabled, the parent knows execve has succeeded.
+    let (pipe_r, pipe_w) = pipe2(0)                                             .with_context(|| "Create pipe for parent-child communication")?;
+
+    let mut fds = vec![stdio.stdout, stdio.stderr, pipe_w.as_fd()];
+    let mut flags = 0;
+    if let Some(stdin) = stdio.stdin {
+        fds.push(stdin);
+        flags |= HAS_STDIN;
+    }
+    if let Some(cgroup) = cgroup {
+        fds.push(cgroup);
+        flags |= HAS_CGROUP;
+    }
+
+    let request = encode_request(root, program, arguments,
+                                 environment, &mounts, flags)?;
+    let container = spawn_with_helper(&request, &fds)                           .with_context(|| "Spawn container")?;
+
+    // Close the write end of the pipe.
+    // The helper closed its copy after spawning the container.
+    drop(fds);
+    drop(pipe_w);
+
+    // Read from the read end of the pipe.
+    // On EOF, we know that execve was successful.
+    // On data, the child has written an error to us.
+    let mut buf = [0; 128];
+    let nread = File::from(pipe_r).read(&mut buf)                               .with_context(|| "Read from pipe")?;
+    if nread != 0 {
+        // First four bytes are errno, remaining bytes are error message.
+        let io_error = i32::from_ne_bytes(buf[.. 4].try_into().unwrap());
+        let io_error = io::Error::from_raw_os_error(io_error);
+        let message = String::from_utf8_lossy(&buf[4 ..]);
+        let message = message.trim_end_matches('\0').to_owned();
+        return Err(anyhow::Error::from(io_error))
+            .with_context(|| message)
+            .with_context(|| "Post-fork pre-execve setup")
+            .map_err(Error::from);
+    }
+
+    Ok(container)
+}
+
+/// Encode a request as described in [`Helper`].
+fn encode_request(
+    root: &CStr,
+    program: &CStr,
+    arguments: &[CString],
+    environment: &[CString],
+    mounts: &[Mount],
+    flags: u32,
+) -> Result<Vec<u8>, Error>
+{
+    let strings = 2 + arguments.len() + environment.len() + 4 * mounts.len();
+    if strings + 2 > MAX_STRINGS {
+        return Err(anyhow::anyhow!("Too many arguments or mounts").into());
+    }
+
+    let mut body = Vec::new();
+    for mount in mounts {
+        body.extend_from_slice(&(mount.mountflags as u64).to_ne_bytes());
+    }
+    let mut put = |string: &CStr| body.extend_from_slice(string.to_bytes_with_nul());
+    put(root);
+    put(program);
+    arguments.iter().for_each(|argument| put(argument));
+    environment.iter().for_each(|variable| put(variable));
+    for Mount{source, target, filesystemtype, data, ..} in mounts {
+        put(source);
+        put(target);
+        put(filesystemtype);
+        put(data);
+    }
+    if body.len() > MAX_BODY {
+        return Err(anyhow::anyhow!("Arguments or mounts are too long").into());
+    }
+
+    let header = [body.len(), arguments.len(), environment.len(), mounts.len()];
+    let mut request = Vec::with_capacity(HEADER_SIZE + body.len());
+    for field in header {
+        request.extend_from_slice(&(field as u32).to_ne_bytes());
+    }
+    request.extend_from_slice(&flags.to_ne_bytes());
+    request.extend_from_slice(&body);
+    Ok(request)
+}
+
+/// Send a request to an idle helper, or a new one, and await the response.
+fn spawn_with_helper(request: &[u8], fds: &[BorrowedFd])
+    -> io::Result<Container>
+{
+    let idle = IDLE.get_or_init(Default::default);
+
+    // Idle helpers may have been killed in the meantime.
+    // If sending fails, the helper cannot have spawned anything,
+    // so it is safe to retry with a new helper.
+    let taken = idle.lock().unwrap().pop();
+    let helper = match taken {
+        Some(helper) if helper.send(request, fds).is_ok() => helper,
+        _ => {
+            let helper = Helper::start()?;
+            helper.send(request, fds)?;
+            helper
+        },
+    };
+
+    // If receiving fails, the helper is in an unknown state.
+    // It is then dropped, which kills it, rather than put back.
+    let result = helper.receive()?;
+    idle.lock().unwrap().push(helper);
+    result
+}
+
+impl Helper
+{
+    /// Start a new helper in a new user namespace.
+    fn start() -> io::Result<Self>
+    {
+        let mut sockets = [-1; 2];
+        let flags = libc::SOCK_STREAM | libc::SOCK_CLOEXEC;
+        // SAFETY: sockets has room for two file descriptors.
+        let result = unsafe {
+            libc::socketpair(libc::AF_UNIX, flags, 0, sockets.as_mut_ptr())
+        };
+        if result == -1 {
+            return Err(io::Error::last_os_error());
+        }
+        // SAFETY: socketpair created two new file descriptors.
+        let (socket, theirs) = unsafe {
+            (OwnedFd::from_raw_fd(sockets[0]), OwnedFd::from_raw_fd(sockets[1]))
+        };
+
+        // Prepare writes to /proc/self/gid_map and /proc/self/uid_map.
+        // These files map users and groups inside the containers
+        // to users and groups outside the containers.
+        let setgroups = "deny\n";
+        let uid_map = format!("0 {} 1\n", getuid());
+        let gid_map = format!("0 {} 1\n", getgid());
+
+        // The helper must not allocate, so it gets its buffers up front.
+        // Their pages are only touched in the helper.
+        let mut body = vec![0u8; MAX_BODY];
+        let mut strings = vec![null(); MAX_STRINGS];
+
+        // Zero-initialize this because we don't use most of its features.
+        let mut cl_args = unsafe { zeroed::<clone_args>() };
+        cl_args.flags = libc::CLONE_NEWUSER as u64;
+
+        // We don't actually care about the exit signal,
+        // but if we don't set this then waitpid doesn't work.
+        // The containers inherit it, as they are spawned with CLONE_PARENT.
+        cl_args.exit_signal = libc::SIGCHLD as u64;
+
+        let pid = unsafe {
+            libc::syscall(
+                libc::SYS_clone3,
+                addr_of!(cl_args): *const clone_args,
+                size_of_val(&cl_args): libc::size_t,
+            )
+        };
+
+        // NOTE: No code may appear between the above clone3 call
+        //       and the below async-signal-safe code section.
+
+        /* ============================================================== */
+        /*                 BEGIN OF ASYNC-SIGNAL-SAFE CODE                */
+        /* ============================================================== */
+
+        // clone3 returns a pid, but syscall returns a c_long.
+        let pid = pid as libc::pid_t;
+
+        if pid == 0 {
+
+            // Unwinding the stack would be horrifying.
+            always_abort();
+
+            unsafe {
+                // Write the /proc/self/\* files prepared above.
+                let write_file = |pathname: &'static [u8], data: &[u8]| {
+                    let fd = libc::open(pathname.as_ptr().cast(), libc::O_WRONLY, 0);
+                    let nwritten = libc::write(fd, data.as_ptr().cast(), data.len());
+                    if fd == -1 || nwritten != data.len() as isize {
+                        libc::_exit(1);
+                    }
+                    libc::close(fd);
+                };
+                write_file(b"/proc/self/setgroups\0", setgroups.as_bytes());
+                write_file(b"/proc/self/uid_map\0", uid_map.as_bytes());
+                write_file(b"/proc/self/gid_map\0", gid_map.as_bytes());
+
+                serve(theirs.as_raw_fd(), &mut body, &mut strings);
+            }
+
+        }
+
+        /* ============================================================== */
+        /*                  END OF ASYNC-SIGNAL-SAFE CODE                 */
+        /* ============================================================== */
+
+        if pid == -1 {
+            return Err(io::Error::last_os_error());
+        }
+
+        Ok(Self{pid, socket})
+    }
+
+    /// Send a request to the helper.
+    fn send(&self, request: &[u8], fds: &[BorrowedFd]) -> io::Result<()>
+    {
+        let fds: Vec<RawFd> = fds.iter().map(AsRawFd::as_raw_fd).collect();
+        let mut cmsg_buf = [0u64; 8];
+        let mut iov = libc::iovec{
+            iov_base: request.as_ptr() as *mut _,
+            iov_len: request.len(),
+        };
+
+        // SAFETY: The buffers outlive the sendmsg call,
+        //         and the control message fits in its buffer.
+        let nsent = unsafe {
+            let mut msg = zeroed::<libc::msghdr>();
+            msg.msg_iov = &mut iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = cmsg_buf.as_mut_ptr().cast();
+            msg.msg_controllen = libc::CMSG_SPACE(size_of_val(&fds[..]) as u32) as _;
+            let cmsg = libc::CMSG_FIRSTHDR(&msg);
+            (*cmsg).cmsg_level = libc::SOL_SOCKET;
+            (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+            (*cmsg).cmsg_len = libc::CMSG_LEN(size_of_val(&fds[..]) as u32) as _;
+            libc::CMSG_DATA(cmsg).cast::<RawFd>()
+                .copy_from_nonoverlapping(fds.as_ptr(), fds.len());
+            libc::sendmsg(self.socket.as_raw_fd(), &msg, libc::MSG_NOSIGNAL)
+        };
+        if nsent == -1 {
+            return Err(io::Error::last_os_error());
+        }
+
+        // The file descriptors went along with the first byte,
+        // so whatever remains can be sent without them.
+        let mut remaining = &request[nsent as usize ..];
+        while !remaining.is_empty() {
+            // SAFETY: remaining is a valid buffer.
+            let nsent = unsafe {
+                libc::send(self.socket.as_raw_fd(), remaining.as_ptr().cast(),
+                           remaining.len(), libc::MSG_NOSIGNAL)
+            };
+            if nsent == -1 {
+                let error = io::Error::last_os_error();
+                if error.kind() == Interrupted {
+                    continue;
+                }
+                return Err(error);
+            }
+            remaining = &remaining[nsent as usize ..];
+        }
+
+        Ok(())
+    }
+
+    /// Receive the response to a request.
+    ///
+    /// The outer result is an error if communication failed;
+    /// the inner result is an error if spawning the container failed.
+    fn receive(&self) -> io::Result<io::Result<Container>>
+    {
+        let mut response = [0u8; 8];
+        let mut cmsg_buf = [0u64; 4];
+        let mut iov = libc::iovec{
+            iov_base: response.as_mut_ptr().cast(),
+            iov_len: response.len(),
+        };
+
+        let mut msg = unsafe { zeroed::<libc::msghdr>() };
+        msg.msg_iov = &mut iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsg_buf.as_mut_ptr().cast();
+        msg.msg_controllen = size_of_val(&cmsg_buf) as _;
+
+        let flags = libc::MSG_CMSG_CLOEXEC | libc::MSG_WAITALL;
+        let nread = loop {
+            // SAFETY: The buffers outlive the recvmsg call.
+            let nread = unsafe {
+                libc::recvmsg(self.socket.as_raw_fd(), &mut msg, flags)
+            };
+            if nread == -1 {
+                let error = io::Error::last_os_error();
+                if error.kind() == Interrupted {
+                    continue;
+                }
+                return Err(error);
+            }
+            break nread as usize;
+        };
+
+        // SAFETY: recvmsg initialized the control messages it returned.
+        let pidfd = unsafe {
+            let cmsg = libc::CMSG_FIRSTHDR(&msg);
+            (!cmsg.is_null() && (*cmsg).cmsg_type == libc::SCM_RIGHTS)
+                .then(|| libc::CMSG_DATA(cmsg).cast::<RawFd>().read_unaligned())
+                .map(|pidfd| OwnedFd::from_raw_fd(pidfd))
+        };
+
+        if nread != response.len() {
+            return Err(io::Error::new(io::ErrorKind::UnexpectedEof,
+                                      "Sandbox helper terminated unexpectedly"));
+        }
+
+        let pid = i32::from_ne_bytes(response[.. 4].try_into().unwrap());
+        let errno = i32::from_ne_bytes(response[4 ..].try_into().unwrap());
+        match (pid, pidfd) {
+            (-1, _) => Ok(Err(io::Error::from_raw_os_error(errno))),
+            (pid, Some(pidfd)) => Ok(Ok(Container{pid, pidfd, terminated: false})),
+            (_, None) => Err(io::Error::new(io::ErrorKind::InvalidData,
+                                            "Sandbox helper sent no pidfd")),
+        }
+    }
+}
+
+impl Drop for Helper
+{
+    fn drop(&mut self)
+    {
+        // The helper is not sandboxed itself, but it holds no state.
+        unsafe { libc::kill(self.pid, libc::SIGKILL); }
+        unsafe { libc::waitpid(self.pid, null_mut(), 0); }
+    }
+}
+
+/// Serve requests until the socket is closed.
+///
+/// This runs in the helper, which is forked from a multithreaded process,
+/// so it must be async-signal-safe. See the man page signal-safety(7).
+/// IMPORTANT: NO HEAP ALLOCATIONS ALLOWED!
+/// The buffers are allocated before the helper is forked.
+unsafe fn serve(
+    socket: RawFd,
+    body: &mut [u8],
+    strings: &mut [*const libc::c_char],
+) -> !
+{
+    // The helper inherited every file descriptor of this process,
+    // which would keep, for example, the pipes of other containers open.
+    // Only the standard streams and the socket are kept, as descriptor 3.
+    if socket != 3 && libc::dup3(socket, 3, libc::O_CLOEXEC) == -1 {
+        libc::_exit(1);
+    }
+    if libc::syscall(libc::SYS_close_range, 4, libc::c_uint::MAX, 0) == -1 {
+        libc::_exit(1);
+    }
+    let socket = 3;
+
+    loop {
+        // Receive the header and the file descriptors.
+        let mut header = [0u8; HEADER_SIZE];
+        let mut cmsg_buf = [0u64; 8];
+        let mut iov = libc::iovec{
+            iov_base: header.as_mut_ptr().cast(),
+            iov_len: header.len(),
+        };
+        let mut msg = zeroed::<libc::msghdr>();
+        msg.msg_iov = &mut iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsg_buf.as_mut_ptr().cast();
+        msg.msg_controllen = size_of_val(&cmsg_buf) as _;
+        let nread = libc::recvmsg(socket, &mut msg, libc::MSG_CMSG_CLOEXEC);
+        if nread == -1 && *libc::__errno_location() == libc::EINTR {
+            continue;
+        }
+        if nread <= 0 {
+            // The process that started the helper closed the socket.
+            libc::_exit(0);
+        }
+        read_exactly(socket, &mut header[nread as usize ..]);
+
+        let mut fds = [-1; MAX_FDS];
+        let mut nfds = 0;
+        let mut cmsg = libc::CMSG_FIRSTHDR(&msg);
+        while !cmsg.is_null() {
+            if (*cmsg).cmsg_type == libc::SCM_RIGHTS {
+                let data = libc::CMSG_DATA(cmsg).cast::<RawFd>();
+                let len = (*cmsg).cmsg_len as usize - libc::CMSG_LEN(0) as usize;
+                for i in 0 .. len / 4 {
+                    let fd = data.add(i).read_unaligned();
+                    if nfds == MAX_FDS {
+                        libc::_exit(1);
+                    }
+                    fds[nfds] = fd;
+                    nfds += 1;
+                }
+            }
+            cmsg = libc::CMSG_NXTHDR(&msg, cmsg);
+        }
+
+        let field = |i: usize| {
+            let bytes = [header[4 * i], header[4 * i + 1],
+                         header[4 * i + 2], header[4 * i + 3]];
+            u32::from_ne_bytes(bytes) as usize
+        };
+        let (body_len, nargs, nenv, nmounts) = (field(0), field(1), field(2), field(3));
+        let flags = field(4) as u32;
+
+        // Receive the body.
+        if body_len > body.len() {
+            libc::_exit(1);
+        }
+        let body = &mut body[.. body_len];
+        read_exactly(socket, body);
+
+        // Check that the request is consistent; only this process sends
+        // requests, so any inconsistency is a bug, and fatal to the helper.
+        let has_stdin = flags & HAS_STDIN != 0;
+        let has_cgroup = flags & HAS_CGROUP != 0;
+        let expected_fds = 3 + has_stdin as usize + has_cgroup as usize;
+        let nstrings = 2 + nargs + nenv + 4 * nmounts;
+        if nfds != expected_fds || nstrings + 2 > strings.len() ||
+            8 * nmounts > body_len
+        {
+            libc::_exit(1);
+        }
+
+        // Find the strings, leaving room for null pointers after
+        // the arguments and after the environment variables.
+        let (mountflags, text) = body.split_at(8 * nmounts);
+        let mut found = 0;
+        let mut start = 0;
+        for (i, &byte) in text.iter().enumerate() {
+            if byte != 0 {
+                continue;
+            }
+            if found == nstrings {
+                libc::_exit(1);
+            }
+            let index =
+                if found < 2 + nargs { found }
+                else if found < 2 + nargs + nenv { found + 1 }
+                else { found + 2 };
+            strings[index] = text[start ..].as_ptr().cast();
+            found += 1;
+            start = i + 1;
+        }
+        if found != nstrings || start != text.len() {
+            libc::_exit(1);
+        }
+        strings[2 + nargs] = null();
+        strings[3 + nargs + nenv] = null();
+
+        let request = Request{
+            stdout: fds[0],
+            stderr: fds[1],
+            error_pipe: fds[2],
+            stdin: if has_stdin { fds[3] } else { -1 },
+            root: strings[0],
+            program: strings[1],
+            argv: strings[2 ..].as_ptr(),
+            envp: strings[3 + nargs ..].as_ptr(),
+            mountflags,
+            mounts: &strings[4 + nargs + nenv .. 4 + nargs + nenv + 4 * nmounts],
+        };
+        let cgroup = if has_cgroup { Some(fds[expected_fds - 1]) } else { None };
+        let (pid, pidfd) = clone_container(&request, cgroup);
+        let errno = if pid == -1 { *libc::__errno_location() } else { 0 };
+
+        // The container has its own copies of the file descriptors.
+        for &fd in &fds[.. nfds] {
+            libc::close(fd);
+        }
+
+        // Send the response, with the pidfd if there is one.
+        let mut response = [0u8; 8];
+        response[.. 4].copy_from_slice(&pid.to_ne_bytes());
+        response[4 ..].copy_from_slice(&errno.to_ne_bytes());
+        let mut iov = libc::iovec{
+            iov_base: response.as_mut_ptr().cast(),
+            iov_len: response.len(),
+        };
+        let mut cmsg_buf = [0u64; 4];
+        let mut msg = zeroed::<libc::msghdr>();
+        msg.msg_iov = &mut iov;
+        msg.msg_iovlen = 1;
+        if pid != -1 {
+            msg.msg_control = cmsg_buf.as_mut_ptr().cast();
+            msg.msg_controllen = libc::CMSG_SPACE(4) as _;
+            let cmsg = libc::CMSG_FIRSTHDR(&msg);
+            (*cmsg).cmsg_level = libc::SOL_SOCKET;
+            (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+            (*cmsg).cmsg_len = libc::CMSG_LEN(4) as _;
+            libc::CMSG_DATA(cmsg).cast::<RawFd>().write_unaligned(pidfd);
+        }
+        let nsent = libc::sendmsg(socket, &msg, libc::MSG_NOSIGNAL);
+        if pid != -1 {
+            libc::close(pidfd);
+        }
+        if nsent != response.len() as isize {
+            libc::_exit(1);
+        }
+    }
+}
+
+/// Read until the buffer is full, or exit if that is not possible.
+unsafe fn read_exactly(fd: RawFd, mut buf: &mut [u8])
+{
+    while !buf.is_empty() {
+        let nread = libc::read(fd, buf.as_mut_ptr().cast(), buf.len());
+        if nread == -1 && *libc::__errno_location() == libc::EINTR {
+            continue;
+        }
+        if nread <= 0 {
+            libc::_exit(0);
+        }
+        buf = &mut buf[nread as usize ..];
+    }
+}
+
+/// Request as decoded by the helper.
+///
+/// The pointers point into the buffers of the helper.
+struct Request<'a>
+{
+    stdin: RawFd,
+    stdout: RawFd,
+    stderr: RawFd,
+    error_pipe: RawFd,
+    root: *const libc::c_char,
+    program: *const libc::c_char,
+    argv: *const *const libc::c_char,
+    envp: *const *const libc::c_char,
+    mountflags: &'a [u8],
+    mounts: &'a [*const libc::c_char],
+}
+
+/// Spawn a container from the helper.
+///
+/// Returns the pid and pidfd of the container, or -1 on failure.
+unsafe fn clone_container(request: &Request, cgroup: Option<RawFd>)
+    -> (libc::pid_t, RawFd)
+{
+    // Zero-initialize this because we don't use most of its features.
+    let mut cl_args = zeroed::<clone_args>();
+    cl_args.flags |= CONTAINER_NAMESPACES;
+
+    // Make the container a child of the process that started the helper,
+    // so that it can wait for the container, and kill it if need be.
+    // With CLONE_PARENT the exit signal is that of the helper,
+    // and clone3 requires the exit signal argument to be zero.
+    cl_args.flags |= libc::CLONE_PARENT as u64;
+
+    // Atomically create a pidfd for use with ppoll.
+    // The pidfd will have CLOEXEC enabled, yay!
+    let mut pidfd = -1;
+    cl_args.flags |= libc::CLONE_PIDFD as u64;
+    cl_args.pidfd = addr_of_mut!(pidfd) as u64;
+
+    // Start the child in the given cgroup, if any.
+    // Doing this atomically ensures the limits apply from the start.
+    if let Some(cgroup) = cgroup {
+        cl_args.flags |= CLONE_INTO_CGROUP;
+        cl_args.cgroup = cgroup as u64;
+    }
+
+    // Spawn the child process using the clone3 system call.
+    // The interface is similar to that of the fork system call:
+    // 0 is returned in the child, pid is returned in the parent.
+    let pid = libc::syscall(
+        libc::SYS_clone3,
+        // syscall is variadic so let's be explicit about types.
+        addr_of!(cl_args): *const clone_args,
+        size_of_val(&cl_args): libc::size_t,
+    );
+
+    // clone3 returns a pid, but syscall returns a c_long.
+    let pid = pid as libc::pid_t;
+
+    // If clone3 returns zero, then we are the child process.
+    if pid == 0 {
+        exec_container(request);
+    }
+
+    (pid, pidfd)
+}
+
+/// Set up the container and run the program.
+///
+/// If anything fails, an error is written to the error pipe,
+/// and the process terminates.
+unsafe fn exec_container(request: &Request) -> !
+{
+    // Assert-like function for use within this function.
+    // If the condition is false, we write an error to the pipe,
+    // and then immediately terminate the child process.
+    let enforce = |message: &'static str, condition: bool| {
+        if !condition {
+            let errnum = (*libc::__errno_location(): i32).to_ne_bytes();
+            libc::write(request.error_pipe, errnum.as_ptr().cast(), 4);
+            libc::write(request.error_pipe, message.as_ptr().cast(), message.len());
+            libc::_exit(1);
+        }
+    };
+
+    // Configure the standard streams stdin, stdout, and stderr.
+    // dup2 turns off CLOEXEC which is exactly what we need.
+    match request.stdin {
+        -1 => enforce("close stdin", libc::close(0) != -1),
+        stdin => enforce("dup2 stdin", libc::dup2(stdin, 0) != -1),
+    }
+    enforce("dup2 stdout", libc::dup2(request.stdout, 1) != -1);
+    enforce("dup2 stderr", libc::dup2(request.stderr, 2) != -1);
+
+    // Apply the prepared mounts.
+    let mountflags = request.mountflags.chunks_exact(8);
+    for (mount, flags) in request.mounts.chunks_exact(4).zip(mountflags) {
+        let mut bytes = [0; 8];
+        bytes.copy_from_slice(flags);
+        let flags = u64::from_ne_bytes(bytes) as libc::c_ulong;
+        let mount = libc::mount(mount[0], mount[1], mount[2], flags,
+                                mount[3].cast());
+        enforce("mount", mount != -1);
+    }
+
+    // Change the working directory, now that the root is mounted.
+    enforce("chdir", libc::chdir(request.root) != -1);
+
+    // Change the root directory.
+    enforce("chroot", libc::chroot(b".\0".as_ptr().cast()) != -1);
+
+    // Change the working directory to the build directory.
+    // Must be an absolute path, because chroot doesn't update it.
+    let chdir = libc::chdir(b"/build\0".as_ptr().cast());
+    enforce("chdir", chdir != -1);
+
+    // Run the specified program.
+    libc::execve(request.program, request.argv, request.envp);
+    enforce("execve", false);
+    unreachable!();
+}
+
+#[cfg(test)]
+mod tests
+{
+    use {
+        super::*,
+        os_ext::{
+            O_DIRECTORY, O_PATH,
+            cstr, cstring, mkdirat, mkdtemp, open,
+            cstr::CStrExt,
+        },
+        std::{os::unix::process::ExitStatusExt, process::ExitStatus, thread},
+    };
+
+    #[test]
+    fn concurrent_containers()
+    {
+        // The root contains the Nix store, so that programs can run.
+        let root = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let root_dir = open(&root, O_DIRECTORY | O_PATH, 0).unwrap();
+        for path in [cstr!(b"build"), cstr!(b"nix"), cstr!(b"nix/store")] {
+            mkdirat(Some(root_dir.as_fd()), path, 0o755).unwrap();
+        }
+        let coreutils = CString::new(env!("SNOWFLAKE_COREUTILS")).unwrap();
+        let program = coreutils.join(cstr!(b"bin/true"));
+
+        let spawn = || {
+            let (_output_r, output_w) = pipe2(0).unwrap();
+            let stdio = Stdio{stdin: None, stdout: output_w.as_fd(),
+                              stderr: output_w.as_fd()};
+            let mounts = vec![Mount{
+                source: cstr!(b"/nix/store").into(),
+                target: root.join(cstr!(b"nix/store")).into(),
+                mountflags: libc::MS_BIND | libc::MS_REC,
+                ..Mount::default()
+            }];
+            let arguments = [cstring!(b"true")];
+            let mut container = spawn_container(stdio, &root, &program,
+                                                &arguments, &[], None, mounts)
+                .unwrap();
+
+            // The container is a child of this process.
+            let mut wstatus = 0;
+            let waitpid = unsafe { libc::waitpid(container.pid, &mut wstatus, 0) };
+            assert_eq!(waitpid, container.pid);
+            container.terminated = true;
+            ExitStatus::from_raw(wstatus).exit_ok().unwrap();
+        };
+
+        // Helpers serve one container at a time,
+        // so each thread keeps at most one busy.
+        thread::scope(|s| {
+            for _ in 0 .. 4 {
+                s.spawn(|| (0 .. 8).for_each(|_| spawn()));
+            }
+        });
+        assert!(!IDLE.get().unwrap().lock().unwrap().is_empty());
+    }
+}
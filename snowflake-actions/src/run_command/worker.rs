@@ -0,0 +1,441 @@
+use {
+    super::{
+        Container, Mount, RunCommand, Stdio, WarningScanner,
+        container_template, link_file, mount_dev_directory,
+        mount_nix_store, mount_proc, mount_root, output_paths,
+        repair_root_mount, resolve_magic, spawn_container,
+    },
+    anyhow::{Context, anyhow},
+    os_ext::{
+        AT_SYMLINK_NOFOLLOW, O_APPEND, O_CREAT, O_DIRECTORY, O_PATH,
+        O_WRONLY, RENAME_NOREPLACE,
+        cstr, fstatat, mkdirat, openat, pipe2, renameat2,
+        cstr::CStrExt,
+        io::BorrowedFdExt,
+    },
+    snowflake_core::{
+        action::{
+            Cancellation, Error, InputPath, Perform,
+            Result as AResult, Success,
+        },
+        state::State,
+    },
+    snowflake_util::{basename::Basename, hash::{Blake3, Hash}},
+    std::{
+        collections::HashMap,
+        ffi::{CStr, CString},
+        fs::File,
+        io::{self, ErrorKind::Interrupted, Read, Write},
+        lazy::SyncOnceCell,
+        os::unix::{
+            io::{AsFd, AsRawFd, BorrowedFd, OwnedFd},
+            process::ExitStatusExt,
+        },
+        process::ExitStatus,
+        sync::Mutex,
+        time::{Duration, Instant},
+    },
+};
+
+/// Version of the protocol described in [`Worker`].
+///
+/// This is included in the hash of actions that use workers,
+/// so that changing the protocol invalidates their cache entries.
+pub (super) const PROTOCOL_VERSION: u64 = 1;
+
+/// Persistent process that runs the commands of [`RunCommand`] actions.
+///
+/// Some programs take a long time to start, for instance those
+/// that run on the JVM or that load many compiler plugins.
+/// A worker is started once and is then sent a request for each action,
+/// so that only the first action pays for the startup.
+/// Idle workers are kept for the remainder of the process, and are reused
+/// by actions with the same program, worker arguments, and environment.
+///
+/// # Sandbox
+///
+/// A worker runs in a container like that of any other [`RunCommand`],
+/// except that its `/build` is a directory of its own, which outlives
+/// the requests. The inputs of each request are cloned into the
+/// `/build/request` directory, or copied if they cannot be cloned.
+/// The outputs must be written to that same directory.
+/// Once the worker responds, the directory is moved out of `/build`
+/// into the action's scratch directory, before the next request.
+/// Unlike with [`Materialization::Link`], there is no overlay
+/// to protect the output cache from writes by the worker,
+/// so cached outputs are never linked.
+/// Workers cannot see the scratch directories of other actions,
+/// which may contain such links, nor those of earlier requests.
+///
+/// # Protocol
+///
+/// Requests are written to the standard input of the worker,
+/// and responses are read from its standard output.
+/// The standard error of the worker is written to `worker.log`
+/// in a scratch directory created for the worker.
+///
+/// Each request consists of the following NUL-terminated fields:
+///
+///  1. The absolute path to the working directory of the command.
+///  2. The number of arguments that follow, in decimal.
+///  3. The [`arguments`][`RunCommand::arguments`] of the command.
+///
+/// Each response consists of the following fields:
+///
+///  1. The exit status of the command in decimal, NUL-terminated.
+///     An exit status of zero indicates success.
+///  2. The length in bytes of the output, in decimal, NUL-terminated.
+///  3. The output of the command, which is written to the build log.
+///
+/// Workers receive one request at a time, and must respond to it
+/// within the [`timeout`][`RunCommand::timeout`] of the action.
+/// If they do not, they are killed.
+/// Workers must exit when their standard input is closed.
+///
+/// [`Materialization::Link`]: `super::Materialization::Link`
+pub struct Worker
+{
+    /// Arguments with which the worker is started.
+    ///
+    /// The worker is started by running the [`program`] of the action
+    /// with these arguments and the [`environment`] of the action.
+    /// This should include the zeroth argument.
+    ///
+    /// [`program`]: `RunCommand::program`
+    /// [`environment`]: `RunCommand::environment`
+    pub arguments: Vec<CString>,
+}
+
+/// Running worker that is not currently handling a request.
+struct Process
+{
+    /// The container the worker runs in.
+    ///
+    /// Dropping this kills the worker.
+    _container: Container,
+
+    /// The standard input of the worker.
+    requests: File,
+
+    /// The standard output of the worker.
+    responses: File,
+
+    /// The directory mounted at the worker's `/build`.
+    workspace: OwnedFd,
+
+    /// Bytes read from the standard output but not yet parsed.
+    buffer: Vec<u8>,
+}
+
+/// Idle workers, by the key computed by [`worker_key`].
+static IDLE: SyncOnceCell<Mutex<HashMap<Hash, Vec<Process>>>> =
+    SyncOnceCell::new();
+
+/// Perform a run command action by sending a request to a worker.
+pub (super) fn perform_worker_request(
+    perform: &Perform,
+    action: &RunCommand,
+    worker: &Worker,
+    input_paths: &[InputPath],
+) -> AResult
+{
+    let Perform{build_log, scratch, state, cancellation, ..} = perform;
+    let RunCommand{inputs, outputs, program, arguments,
+                   environment, timeout, warnings, ..} = action;
+
+    // The build directory is moved from the worker's workspace
+    // to the scratch directory, which must be on the same file system,
+    // so workers for different state directories are kept apart.
+    let scratch_path = resolve_magic(*scratch)                                  .with_context(|| "Find path to scratch directory")?;
+    let (scratches_path, _) = split_path(&scratch_path);
+
+    let key = worker_key(program, worker, environment, &scratches_path);
+    let mut process = match take_idle(key) {
+        Some(process) => process,
+        None => start_worker(state, program, &worker.arguments, environment)?,
+    };
+
+    // If anything fails, the worker is in an unknown state.
+    // It is then dropped, which kills it, rather than put back.
+    mkdirat(Some(process.workspace.as_fd()), cstr!(b"request"), 0o755)          .with_context(|| "Create build directory")?;
+    copy_inputs(process.workspace.as_fd(), inputs, input_paths)?;
+    let (status, output) = process.request(cstr!(b"/build/request"), arguments,
+                                           *timeout, cancellation)?;
+    renameat2(Some(process.workspace.as_fd()), cstr!(b"request"),
+              Some(*scratch), cstr!(b"build"), RENAME_NOREPLACE)                .with_context(|| "Move build directory out of worker")?;
+    put_idle(key, process);
+
+    let build_log_file = build_log.try_to_owned()                               .with_context(|| "Duplicate build log file descriptor")?;
+    File::from(build_log_file).write_all(&output)                               .with_context(|| "Write output of worker to build log")?;
+
+    // Exit statuses that do not fit in a byte are clamped,
+    // so that they do not wrap around to success.
+    let status = if status == 0 { 0 } else { status.clamp(1, 255) as i32 };
+    ExitStatus::from_raw(status << 8).exit_ok()?;
+
+    let output_paths = output_paths(outputs);
+    let mut scanner = WarningScanner::new(warnings.as_ref());
+    scanner.feed(&output);
+    let warnings = scanner.finish();
+
+    Ok(Success{output_paths, warnings})
+}
+
+/// Split a path into its parent directory and its last component.
+fn split_path(path: &CStr) -> (CString, CString)
+{
+    let bytes = path.to_bytes();
+    let slash = bytes.iter().rposition(|&b| b == b'/')
+        .expect("Path to scratch directory should be absolute");
+    (
+        CString::new(&bytes[.. slash]).unwrap(),
+        CString::new(&bytes[slash + 1 ..]).unwrap(),
+    )
+}
+
+/// Clone or copy every input into the workspace's `request` directory.
+///
+/// Workers cannot see mounts made after they were started,
+/// so inputs that cannot be cloned are copied instead.
+/// Inputs are never linked, as the worker could then modify the originals.
+fn copy_inputs(
+    workspace: BorrowedFd,
+    inputs: &[Basename<CString>],
+    input_paths: &[InputPath],
+) -> Result<(), Error>
+{
+    debug_assert_eq!(input_paths.len(), inputs.len());
+
+    for (input_basename, input_path) in inputs.iter().zip(input_paths) {
+        let InputPath{dirfd, path} = input_path;
+        let target = cstr!(b"request").join(input_basename);
+
+        let statbuf = fstatat(Some(*dirfd), path, AT_SYMLINK_NOFOLLOW)          .with_context(|| format!("Find file type of input at {input_basename:?}"))?;
+
+        let mut unlinked = Vec::new();
+        link_file(workspace, *dirfd, path, path, &statbuf, false, true,
+                  &target, &target, &mut unlinked)
+            .with_context(|| format!("Copy input at {input_basename:?}"))?;
+        debug_assert!(unlinked.is_empty(), "Files should have been copied");
+    }
+
+    Ok(())
+}
+
+/// Compute the key by which idle workers are found.
+///
+/// Workers for different state directories have their workspaces
+/// in different scratches directories, so its path is included.
+fn worker_key(
+    program: &CStr,
+    worker: &Worker,
+    environment: &[CString],
+    scratches_path: &CStr,
+) -> Hash
+{
+    // NOTE: See the manual chapter on avoiding hash collisions.
+    let mut h = Blake3::new();
+    h.put_cstr(program);
+    h.put_slice(&worker.arguments, |h, a| h.put_cstr(a));
+    h.put_slice(environment, |h, e| h.put_cstr(e));
+    h.put_cstr(scratches_path);
+    h.finalize()
+}
+
+/// Take an idle worker with the given key, if there is one.
+fn take_idle(key: Hash) -> Option<Process>
+{
+    let idle = IDLE.get_or_init(Default::default);
+    idle.lock().unwrap().get_mut(&key)?.pop()
+}
+
+/// Make a worker available to other actions again.
+fn put_idle(key: Hash, process: Process)
+{
+    let idle = IDLE.get_or_init(Default::default);
+    idle.lock().unwrap().entry(key).or_default().push(process);
+}
+
+/// Start a new worker in a container.
+///
+/// The worker gets a scratch directory for its log and its workspace.
+fn start_worker(
+    state: &State,
+    program: &CStr,
+    arguments: &[CString],
+    environment: &[CString],
+) -> Result<Process, Error>
+{
+    let template = container_template(state)                                    .with_context(|| "Create container template")?;
+    let root = resolve_magic(template.as_fd())                                  .with_context(|| "Find path to container template")?;
+
+    let scratch = state.new_scratch_dir()                                       .with_context(|| "Create scratch directory for worker")?;
+    let flags = O_APPEND | O_CREAT | O_WRONLY;
+    let log = openat(Some(scratch.as_fd()), cstr!(b"worker.log"), flags, 0o644) .with_context(|| "Create worker log")?;
+    mkdirat(Some(scratch.as_fd()), cstr!(b"workspace"), 0o755)                  .with_context(|| "Create worker workspace")?;
+    let workspace = openat(Some(scratch.as_fd()), cstr!(b"workspace"),
+                           O_DIRECTORY | O_PATH, 0)                             .with_context(|| "Open worker workspace")?;
+    let workspace_path = resolve_magic(workspace.as_fd())                       .with_context(|| "Find path to worker workspace")?;
+
+    let (requests_r, requests_w) = pipe2(0)                                     .with_context(|| "Create pipe for worker requests")?;
+    let (responses_r, responses_w) = pipe2(0)                                   .with_context(|| "Create pipe for worker responses")?;
+
+    let mut mounts = Vec::new();
+    repair_root_mount(&mut mounts);
+    mount_root(&root, &mut mounts);
+    mounts.push(Mount{
+        source: workspace_path.into(),
+        target: root.join(cstr!(b"build")).into(),
+        mountflags: libc::MS_BIND,
+        ..Mount::default()
+    });
+    mount_dev_directory(&root, &mut mounts);
+    mount_proc(&root, &mut mounts);
+    mount_nix_store(&root, &mut mounts);
+
+    let stdio = Stdio{
+        stdin: Some(requests_r.as_fd()),
+        stdout: responses_w.as_fd(),
+        stderr: log.as_fd(),
+    };
+    let container = spawn_container(stdio, &root, program, arguments,
+                                    environment, None, mounts)?;
+
+    // The ends of the pipes that the worker uses are closed here,
+    // so that reading responses sees EOF when the worker terminates.
+    Ok(Process{
+        _container: container,
+        requests: File::from(requests_w),
+        responses: File::from(responses_r),
+        workspace,
+        buffer: Vec::new(),
+    })
+}
+
+impl Process
+{
+    /// Send a request to the worker and wait for the response.
+    ///
+    /// Returns the exit status and the output of the command.
+    fn request(
+        &mut self,
+        working_directory: &CStr,
+        arguments: &[CString],
+        timeout: Duration,
+        cancellation: &Cancellation,
+    ) -> Result<(u64, Vec<u8>), Error>
+    {
+        let deadline = Instant::now() + timeout;
+
+        let mut request = Vec::new();
+        request.extend_from_slice(working_directory.to_bytes_with_nul());
+        request.extend_from_slice(arguments.len().to_string().as_bytes());
+        request.push(0);
+        for argument in arguments {
+            request.extend_from_slice(argument.to_bytes_with_nul());
+        }
+        self.requests.write_all(&request)                                       .with_context(|| "Write request to worker")?;
+
+        loop {
+            if let Some((response, len)) = parse_response(&self.buffer)? {
+                self.buffer.drain(.. len);
+                break Ok(response);
+            }
+            self.read_before(deadline, timeout, cancellation)?;
+        }
+    }
+
+    /// Read more of the response into the buffer.
+    ///
+    /// Fails with [`Error::Timeout`] if nothing is read before the deadline,
+    /// and with [`Error::Cancelled`] if the cancellation is requested.
+    fn read_before(
+        &mut self,
+        deadline: Instant,
+        timeout: Duration,
+        cancellation: &Cancellation,
+    ) -> Result<(), Error>
+    {
+        if cancellation.is_cancelled() {
+            return Err(Error::Cancelled);
+        }
+
+        let mut pollfds = [
+            libc::pollfd{
+                fd: self.responses.as_raw_fd(),
+                events: libc::POLLIN,
+                revents: 0,
+            },
+            libc::pollfd{
+                fd: cancellation.as_fd().map_or(-1, |fd| fd.as_raw_fd()),
+                events: libc::POLLIN,
+                revents: 0,
+            },
+        ];
+
+        // Round up, so that the deadline has passed when poll times out.
+        let remaining = deadline.saturating_duration_since(Instant::now());
+        let millis = (remaining.as_nanos() + 999_999) / 1_000_000;
+        let millis = millis.try_into().unwrap_or(libc::c_int::MAX);
+
+        let nfds = pollfds.len() as libc::nfds_t;
+        let poll = unsafe { libc::poll(pollfds.as_mut_ptr(), nfds, millis) };
+        if poll == -1 {
+            let error = io::Error::last_os_error();
+            if error.kind() == Interrupted {
+                return Ok(());
+            }
+            return Err(anyhow::Error::from(error))
+                .with_context(|| "Poll worker")
+                .map_err(Error::from);
+        }
+        if poll == 0 {
+            return Err(Error::Timeout(timeout));
+        }
+        if pollfds[1].revents != 0 {
+            return Err(Error::Cancelled);
+        }
+
+        let mut chunk = [0; 8192];
+        let nread = match self.responses.read(&mut chunk) {
+            Ok(nread) => nread,
+            Err(err) if err.kind() == Interrupted => return Ok(()),
+            Err(err) => return Err(anyhow::Error::from(err))
+                .with_context(|| "Read response from worker")
+                .map_err(Error::from),
+        };
+        if nread == 0 {
+            return Err(anyhow!("Worker terminated unexpectedly").into());
+        }
+        self.buffer.extend_from_slice(&chunk[.. nread]);
+
+        Ok(())
+    }
+}
+
+/// Parse a response at the start of the buffer.
+///
+/// Returns the exit status and the output, along with the number of bytes
+/// that make up the response, or [`None`] if the response is incomplete.
+fn parse_response(buf: &[u8]) -> Result<Option<((u64, Vec<u8>), usize)>, Error>
+{
+    /// Parse a decimal number that is terminated by a NUL.
+    fn field(buf: &[u8]) -> Result<Option<(u64, &[u8])>, Error>
+    {
+        let Some(nul) = buf.iter().position(|&b| b == 0)
+            else { return Ok(None) };
+        let number = std::str::from_utf8(&buf[.. nul]).ok()
+            .and_then(|number| number.parse().ok())
+            .ok_or_else(|| anyhow!("Malformed response from worker"))?;
+        Ok(Some((number, &buf[nul + 1 ..])))
+    }
+
+    let Some((status, rest)) = field(buf)? else { return Ok(None) };
+    let Some((len, rest)) = field(rest)? else { return Ok(None) };
+    let Ok(len) = usize::try_from(len)
+        else { return Err(anyhow!("Malformed response from worker").into()) };
+    let Some(output) = rest.get(.. len) else { return Ok(None) };
+
+    let consumed = buf.len() - rest.len() + len;
+    Ok(Some(((status, output.to_vec()), consumed)))
+}
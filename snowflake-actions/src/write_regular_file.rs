@@ -1,12 +1,12 @@
 use {
     anyhow::Context,
-    os_ext::{O_CREAT, O_WRONLY, cstring, openat},
+    os_ext::cstring,
     snowflake_core::action::{
         Action, InputPath, Outputs,
         Perform, Result, Success,
     },
     snowflake_util::hash::{Blake3, Hash},
-    std::{fs::File, io::Write},
+    std::io::Write,
 };
 
 /// Action that writes a regular file.
@@ -36,11 +36,12 @@ impl Action for WriteRegularFile
     {
         debug_assert_eq!(input_paths.len(), 0);
         let output_path = cstring!(b"output");
-        let flags = O_CREAT | O_WRONLY;
-        let mode = if self.executable { 0o755 } else { 0o644 };
-        let file = openat(Some(perform.scratch), &output_path, flags, mode)
+        let size = self.content.len() as u64;
+        let mut file = perform.create_regular_file(&output_path, self.executable, size)
             .context("Open regular file")?;
-        File::from(file).write_all(&self.content)
+        file.write_all(&self.content)
+            .context("Write regular file")?;
+        file.finish()
             .context("Write regular file")?;
         Ok(Success{output_paths: vec![output_path], warnings: false})
     }
@@ -59,4 +60,9 @@ impl Action for WriteRegularFile
         h.put_bool(*executable);
         h.finalize()
     }
+
+    fn is_trivial(&self) -> bool
+    {
+        true
+    }
 }
@@ -0,0 +1,112 @@
+//! Benchmarks for the action cache and the output cache.
+
+#![feature(concat_bytes)]
+#![feature(io_safety)]
+#![feature(test)]
+
+extern crate test;
+
+use {
+    os_ext::{O_CREAT, O_WRONLY, cstr, cstring, mkdtemp, openat},
+    snowflake_core::state::{ActionCacheEntry, State},
+    snowflake_util::hash::{Blake3, Hash},
+    std::{ffi::CString, fs::File, io::Write, os::unix::io::AsFd},
+    test::Bencher,
+};
+
+/// Create a state directory in a new temporary directory.
+fn state() -> State
+{
+    let path = mkdtemp(cstring!(b"/tmp/snowflake-bench-XXXXXX")).unwrap();
+    State::open(&path).unwrap()
+}
+
+/// Distinct hash for each number.
+fn hash(i: usize) -> Hash
+{
+    let mut h = Blake3::new();
+    h.put_usize(i);
+    h.finalize()
+}
+
+/// Action cache entry with a typical number of outputs.
+///
+/// The outputs are cached, as entries are not found otherwise.
+fn entry(state: &State) -> ActionCacheEntry
+{
+    let scratch = state.new_scratch_dir().unwrap();
+    let cache = |i: usize| {
+        let path = CString::new(i.to_string()).unwrap();
+        let file = openat(Some(scratch.as_fd()), &path, O_CREAT | O_WRONLY, 0o644).unwrap();
+        File::from(file).write_all(&i.to_ne_bytes()).unwrap();
+        state.cache_output(Some(scratch.as_fd()), &path).unwrap()
+    };
+    ActionCacheEntry{
+        build_log: cache(0),
+        outputs: vec![cache(1), cache(2)],
+        warnings: false,
+    }
+}
+
+/// Insert new entries into the action cache.
+#[bench]
+fn cache_action(b: &mut Bencher)
+{
+    let state = state();
+    let entry = entry(&state);
+    let mut i = 0;
+    b.iter(|| {
+        i += 1;
+        state.cache_action(hash(i), &entry).unwrap();
+    });
+}
+
+/// Look up entries in an action cache of ten thousand entries.
+#[bench]
+fn cached_action(b: &mut Bencher)
+{
+    let state = state();
+    let entry = entry(&state);
+    let hashes: Vec<_> = (0 .. 10_000).map(hash).collect();
+    for &hash in &hashes {
+        state.cache_action(hash, &entry).unwrap();
+    }
+    let mut i = 0;
+    b.iter(|| {
+        i = (i + 1) % hashes.len();
+        state.cached_action(hashes[i]).unwrap().unwrap()
+    });
+}
+
+/// Look up entries that are not in the action cache.
+#[bench]
+fn cached_action_miss(b: &mut Bencher)
+{
+    let state = state();
+    state.cache_action(hash(0), &entry(&state)).unwrap();
+    let mut i = 0;
+    b.iter(|| {
+        i += 1;
+        assert!(state.cached_action(hash(i)).unwrap().is_none());
+    });
+}
+
+/// Move new small regular files into the output cache.
+///
+/// Writing the file is included in the measurement,
+/// as every iteration needs a file with new contents.
+#[bench]
+fn cache_output(b: &mut Bencher)
+{
+    let state = state();
+    let scratch = state.new_scratch_dir().unwrap();
+    let mut i = 0usize;
+    b.iter(|| {
+        i += 1;
+        let path = cstr!(b"output");
+        let flags = O_CREAT | O_WRONLY;
+        let file = openat(Some(scratch.as_fd()), path, flags, 0o644).unwrap();
+        File::from(file).write_all(&i.to_ne_bytes()).unwrap();
+        state.cache_output(Some(scratch.as_fd()), path).unwrap()
+    });
+}
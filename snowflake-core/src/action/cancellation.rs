@@ -0,0 +1,75 @@
+use {
+    os_ext::eventfd,
+    std::{
+        fs::File,
+        io::Write,
+        os::unix::io::{AsFd, BorrowedFd},
+        sync::atomic::{AtomicBool, Ordering::SeqCst},
+    },
+};
+
+/// Tells actions being performed that they should stop.
+///
+/// Actions that wait for file descriptors, such as those of processes,
+/// can poll [`as_fd`][`Self::as_fd`] along with them; it becomes
+/// readable when the cancellation is requested and remains so.
+/// Actions that are cancelled fail with [`Error::Cancelled`].
+///
+/// [`Error::Cancelled`]: `super::Error::Cancelled`
+pub struct Cancellation
+{
+    cancelled: AtomicBool,
+
+    /// If no eventfd could be created, actions cannot be interrupted,
+    /// but the driver still does not start any more actions.
+    eventfd: Option<File>,
+}
+
+impl Cancellation
+{
+    /// Create a cancellation that has not yet been requested.
+    pub fn new() -> Self
+    {
+        let eventfd = eventfd(0, 0).ok().map(File::from);
+        Self{cancelled: AtomicBool::new(false), eventfd}
+    }
+
+    /// Request the cancellation.
+    ///
+    /// Requesting it again has no further effect.
+    pub fn cancel(&self)
+    {
+        if self.cancelled.swap(true, SeqCst) {
+            return;
+        }
+        if let Some(mut eventfd) = self.eventfd.as_ref() {
+            // The counter starts at zero, so this cannot overflow it.
+            let _ = eventfd.write_all(&1u64.to_ne_bytes());
+        }
+    }
+
+    /// Whether the cancellation was requested.
+    pub fn is_cancelled(&self) -> bool
+    {
+        self.cancelled.load(SeqCst)
+    }
+
+    /// File descriptor that is readable once the cancellation is requested.
+    ///
+    /// This is [`None`] if the file descriptor could not be created,
+    /// in which case actions should check [`is_cancelled`] instead.
+    ///
+    /// [`is_cancelled`]: `Self::is_cancelled`
+    pub fn as_fd(&self) -> Option<BorrowedFd>
+    {
+        self.eventfd.as_ref().map(File::as_fd)
+    }
+}
+
+impl Default for Cancellation
+{
+    fn default() -> Self
+    {
+        Self::new()
+    }
+}
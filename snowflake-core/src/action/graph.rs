@@ -1,6 +1,7 @@
 use {
     crate::label::{ActionLabel, ActionOutputLabel},
     super::{Action, ActionExt},
+    snowflake_util::bit_set::BitSet,
     std::{collections::{HashMap, HashSet}, ffi::CString, fmt},
 };
 
@@ -45,42 +46,227 @@ impl Input
 
 impl ActionGraph
 {
+    /// Index the graph for traversal.
+    pub fn compact(&self) -> CompactGraph
+    {
+        CompactGraph::new(self)
+    }
+
     /// Remove any actions that do not need to be performed.
     ///
     /// Actions that do not need to be performed are non-lint actions
     /// which are not transitively depended upon by the artifact set.
     pub fn prune(&mut self)
     {
-        let mut live = HashSet::new();
+        let compact = self.compact();
+        let mut live = BitSet::new(compact.len());
 
         // Lint actions are always considered live.
-        live.extend(
-            self.actions.iter()
-            .filter(|a| a.1.0.is_lint())
-            .map(|a| a.0.clone())
-        );
+        let mut roots: Vec<_> =
+            (0 .. compact.len())
+            .filter(|&index| compact.action(index).is_lint())
+            .collect();
 
         // Use mark-and-sweep to find other live actions.
-        fn mark_recursively<'a>(
-            graph: &HashMap<ActionLabel, (Box<dyn Action>, Vec<Input>)>,
-            live: &mut HashSet<ActionLabel>,
-            outputs: impl Iterator<Item=&'a ActionOutputLabel>,
-        )
-        {
-            for ActionOutputLabel{action, ..} in outputs {
-                if !live.insert(action.clone()) {
-                    continue;
-                }
-                let (_, inputs) = graph.get(action)
+        // An explicit stack keeps deep dependency chains off the call stack.
+        roots.extend(
+            self.artifacts.iter()
+            .map(|artifact| compact.index(&artifact.action)
+                                .expect("Action graph is missing action"))
+        );
+        let mut stack = roots;
+        while let Some(index) = stack.pop() {
+            if !live.insert(index) {
+                continue;
+            }
+            for &dependency in compact.dependencies(index) {
+                let dependency = CompactGraph::resolve(dependency)
                     .expect("Action graph is missing action");
-                mark_recursively(graph, live,
-                    inputs.iter().flat_map(Input::dependency));
+                if !live.contains(dependency) {
+                    stack.push(dependency);
+                }
             }
         }
-        mark_recursively(&self.actions, &mut live, self.artifacts.iter());
 
         // Throw away all non-live actions.
-        self.actions.retain(|k, _| live.contains(k));
+        let labels = compact.dead_labels(&live);
+        for label in labels {
+            self.actions.remove(&label);
+        }
+    }
+}
+
+/// Index-based view of an action graph.
+///
+/// The actions are numbered densely in order of their labels,
+/// and the dependencies of all actions are stored in one flat array,
+/// so that traversals can keep their state in vectors and bit sets
+/// rather than in hash maps keyed by label.
+pub struct CompactGraph<'a>
+{
+    /// The label of each action, in ascending order.
+    labels: Vec<&'a ActionLabel>,
+
+    /// Each action and its inputs.
+    actions: Vec<(&'a dyn Action, &'a [Input])>,
+
+    /// For each action, where its dependencies start in `edges`.
+    /// There is one more element, which is the length of `edges`.
+    offsets: Vec<u32>,
+
+    /// For each dependency of each action, the index of the dependency,
+    /// or [`DANGLING`][`Self::DANGLING`] if it is not in the graph.
+    /// Dependencies on multiple outputs of the same action appear
+    /// multiple times, in the order of the inputs.
+    edges: Vec<u32>,
+}
+
+impl<'a> CompactGraph<'a>
+{
+    /// Edge to an action that is not in the graph.
+    pub const DANGLING: u32 = u32::MAX;
+
+    fn new(graph: &'a ActionGraph) -> Self
+    {
+        let mut entries: Vec<_> = graph.actions.iter().collect();
+        entries.sort_unstable_by_key(|(label, _)| label.action);
+
+        // Edges are stored as u32 to halve the size of the edge array.
+        assert!(entries.len() < Self::DANGLING as usize,
+                "Action graph has too many actions");
+
+        let labels: Vec<_> = entries.iter().map(|&(label, _)| label).collect();
+        let mut this = Self{
+            labels,
+            actions: Vec::with_capacity(entries.len()),
+            offsets: Vec::with_capacity(entries.len() + 1),
+            edges: Vec::new(),
+        };
+
+        for (_, (action, inputs)) in entries {
+            this.actions.push((&**action, inputs));
+            this.offsets.push(this.edges.len() as u32);
+            for dependency in inputs.iter().flat_map(Input::dependency) {
+                let index = this.index(&dependency.action)
+                    .map_or(Self::DANGLING, |index| index as u32);
+                this.edges.push(index);
+            }
+        }
+        this.offsets.push(this.edges.len() as u32);
+
+        this
+    }
+
+    /// The number of actions in the graph.
+    pub fn len(&self) -> usize
+    {
+        self.labels.len()
+    }
+
+    /// Whether the graph has no actions.
+    pub fn is_empty(&self) -> bool
+    {
+        self.labels.is_empty()
+    }
+
+    /// The index of the action with the given label, if it is in the graph.
+    pub fn index(&self, label: &ActionLabel) -> Option<usize>
+    {
+        // Labels are usually numbered densely from zero,
+        // in which case each label is at its own index.
+        match self.labels.get(label.action) {
+            Some(found) if found.action == label.action => Some(label.action),
+            _ => self.labels.binary_search_by_key(&label.action, |l| l.action).ok(),
+        }
+    }
+
+    /// The label of the action at an index.
+    pub fn label(&self, index: usize) -> &'a ActionLabel
+    {
+        self.labels[index]
+    }
+
+    /// The action at an index.
+    pub fn action(&self, index: usize) -> &'a dyn Action
+    {
+        self.actions[index].0
+    }
+
+    /// The inputs of the action at an index.
+    pub fn inputs(&self, index: usize) -> &'a [Input]
+    {
+        self.actions[index].1
+    }
+
+    /// The indices of the dependencies of the action at an index,
+    /// in the order of its inputs.
+    ///
+    /// Use [`resolve`][`Self::resolve`] to detect dangling dependencies.
+    pub fn dependencies(&self, index: usize) -> &[u32]
+    {
+        let start = self.offsets[index] as usize;
+        let end = self.offsets[index + 1] as usize;
+        &self.edges[start .. end]
+    }
+
+    /// Convert an edge to an index, unless it is dangling.
+    pub fn resolve(edge: u32) -> Option<usize>
+    {
+        (edge != Self::DANGLING).then(|| edge as usize)
+    }
+
+    /// Each action with a dependency that is not in the graph,
+    /// along with the label of that dependency.
+    pub fn dangling_dependencies(&self)
+        -> impl Iterator<Item=(&'a ActionLabel, &'a ActionLabel)> + '_
+    {
+        (0 .. self.len())
+            .flat_map(move |index| {
+                self.inputs(index).iter()
+                .flat_map(Input::dependency)
+                .zip(self.dependencies(index))
+                .filter(|&(_, &edge)| edge == Self::DANGLING)
+                .map(move |(dependency, _)|
+                    (self.labels[index], &dependency.action))
+            })
+    }
+
+    /// For each action, the actions that depend on it.
+    ///
+    /// Dangling dependencies are left out.
+    pub fn dependents(&self) -> Dependents
+    {
+        let mut offsets = vec![0; self.len() + 1];
+        for &edge in &self.edges {
+            if let Some(dependency) = Self::resolve(edge) {
+                offsets[dependency + 1] += 1;
+            }
+        }
+        for index in 0 .. self.len() {
+            offsets[index + 1] += offsets[index];
+        }
+
+        let mut edges = vec![0; offsets[self.len()] as usize];
+        let mut cursors = offsets.clone();
+        for index in 0 .. self.len() {
+            for &edge in self.dependencies(index) {
+                if let Some(dependency) = Self::resolve(edge) {
+                    edges[cursors[dependency] as usize] = index as u32;
+                    cursors[dependency] += 1;
+                }
+            }
+        }
+
+        Dependents{offsets, edges}
+    }
+
+    /// The labels of the actions not in `live`.
+    fn dead_labels(&self, live: &BitSet) -> Vec<ActionLabel>
+    {
+        (0 .. self.len())
+            .filter(|&index| !live.contains(index))
+            .map(|index| self.labels[index].clone())
+            .collect()
     }
 }
 
@@ -117,3 +303,73 @@ impl fmt::Display for ActionGraph
         write!(f, "}}")
     }
 }
+
+/// The reverse edges of a [`CompactGraph`].
+///
+/// An action that depends on multiple outputs of the same action
+/// appears multiple times among its dependents.
+pub struct Dependents
+{
+    offsets: Vec<u32>,
+    edges: Vec<u32>,
+}
+
+impl Dependents
+{
+    /// The indices of the actions that depend on the action at an index.
+    pub fn of(&self, index: usize) -> &[u32]
+    {
+        let start = self.offsets[index] as usize;
+        let end = self.offsets[index + 1] as usize;
+        &self.edges[start .. end]
+    }
+}
+
+#[cfg(test)]
+mod tests
+{
+    use {super::*, crate::action::Dummy};
+
+    #[test]
+    fn compact_and_prune()
+    {
+        // Action 10 depends on action 30 twice and on missing action 40.
+        // Action 20 is a lint that depends on action 50.
+        let label = |action| ActionLabel{action};
+        let output = |action| ActionOutputLabel{action: label(action), output: 0};
+        let dependency = |action| Input::Dependency(output(action));
+        let action = |lint, inputs| -> (Box<dyn Action>, Vec<Input>)
+            { (Box::new(Dummy{lint, ..Dummy::default()}), inputs) };
+        let mut graph = ActionGraph{
+            actions: [
+                (label(10), action(false, vec![dependency(30), dependency(40), dependency(30)])),
+                (label(20), action(true,  vec![dependency(50)])),
+                (label(30), action(false, vec![Input::StaticFile(CString::default())])),
+                (label(50), action(false, vec![])),
+                (label(60), action(false, vec![dependency(40)])),
+            ].into_iter().collect(),
+            artifacts: [output(30)].into_iter().collect(),
+        };
+
+        // Actions are numbered in order of their labels.
+        let compact = graph.compact();
+        assert_eq!(compact.len(), 5);
+        assert_eq!(compact.index(&label(30)), Some(2));
+        assert_eq!(compact.index(&label(40)), None);
+        assert_eq!(compact.label(3), &label(50));
+        assert_eq!(compact.dependencies(0), [2, CompactGraph::DANGLING, 2]);
+        assert_eq!(compact.dependencies(1), [3]);
+        assert!(compact.dependencies(2).is_empty());
+        assert_eq!(compact.dependents().of(2), [0, 0]);
+        let dangling: Vec<_> = compact.dangling_dependencies().collect();
+        assert_eq!(dangling, [(&label(10), &label(40)), (&label(60), &label(40))]);
+        drop(compact);
+
+        // Only the artifacts, lints, and their dependencies remain.
+        // Dead actions may have dangling dependencies.
+        graph.prune();
+        let mut remaining: Vec<_> = graph.actions.keys().map(|l| l.action).collect();
+        remaining.sort();
+        assert_eq!(remaining, [20, 30, 50]);
+    }
+}
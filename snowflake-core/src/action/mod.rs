@@ -1,8 +1,12 @@
 //! Describing and performing actions.
 
-pub use self::{graph::*, outputs::*};
+pub use self::{
+    cancellation::*, graph::*, outputs::*, resources::*, trace::*,
+    written_outputs::*,
+};
 
 use {
+    crate::state::State,
     snowflake_util::hash::Hash,
     std::{
         borrow::Cow,
@@ -14,11 +18,18 @@ use {
     thiserror::Error,
 };
 
+mod cancellation;
 mod graph;
 mod outputs;
+mod resources;
+mod trace;
+mod written_outputs;
 
 /// Object-safe trait for actions.
-pub trait Action
+///
+/// Actions are performed concurrently by the driver,
+/// hence the `Send` and `Sync` bounds.
+pub trait Action: Send + Sync
 {
     /// The number of inputs to this action.
     fn inputs(&self) -> usize;
@@ -46,6 +57,30 @@ pub trait Action
     /// The number of input hashes must equal [`inputs`][`Self::inputs`]
     /// and their order must match that of the inputs in [`ActionGraph`].
     fn hash(&self, input_hashes: &[Hash]) -> Hash;
+
+    /// The resources to reserve for performing the action.
+    ///
+    /// By default this is a single CPU and no particular amount of memory.
+    fn resources(&self) -> Resources
+    {
+        Resources::default()
+    }
+
+    /// Whether the action is trivial to perform.
+    ///
+    /// Trivial actions are performed in this process and take
+    /// next to no time, such as writing a file with given contents.
+    /// When performed successfully, a trivial action must not have
+    /// written to the build log, nor left anything in the scratch
+    /// directory other than its outputs. The driver then reuses
+    /// build logs and scratch directories between trivial actions,
+    /// and does not record how long they took.
+    ///
+    /// By default actions are not trivial.
+    fn is_trivial(&self) -> bool
+    {
+        false
+    }
 }
 
 /// Extra methods for actions.
@@ -72,6 +107,35 @@ pub struct Perform<'a>
 
     /// Scratch directory which the action may use freely.
     pub scratch: BorrowedFd<'a>,
+
+    /// The state directory, for resources shared between actions.
+    ///
+    /// See for example [`State::template_dir`].
+    pub state: &'a State,
+
+    /// The cgroup in which to create cgroups for processes, if any.
+    ///
+    /// See [`Context::cgroup`][`crate::drive::Context::cgroup`].
+    pub cgroup: Option<BorrowedFd<'a>>,
+
+    /// Outputs that were hashed while they were written.
+    ///
+    /// Use [`create_regular_file`][`Self::create_regular_file`]
+    /// to add to these.
+    pub written_outputs: &'a WrittenOutputs,
+
+    /// Requested when the action should stop being performed.
+    ///
+    /// Actions that take long should stop soon after
+    /// and fail with [`Error::Cancelled`].
+    pub cancellation: &'a Cancellation,
+
+    /// Records the phases of performing the action.
+    ///
+    /// Actions that go through distinct phases, such as
+    /// setting up a container and then running a command in it,
+    /// can record those, so that slow builds can be diagnosed.
+    pub trace: ActionTrace<'a>,
 }
 
 /// Path to an input and the directory to which it is relative.
@@ -118,9 +182,39 @@ pub enum Error
     #[error("Timeout after {0:?}")]
     Timeout(Duration),
 
+    #[error("Cancelled")]
+    Cancelled,
+
     #[error("{0}")]
     ExitStatus(#[from] ExitStatusError),
 
     #[error("Unexpected error: {0}")]
     Unexpected(#[from] anyhow::Error),
 }
+
+/// Action for tests that need actions but never perform them.
+///
+/// Only [`Action::outputs`] and [`Action::resources`] are implemented;
+/// the other methods panic.
+#[cfg(test)]
+#[derive(Default)]
+pub (crate) struct Dummy
+{
+    /// Whether the action is a lint, rather than having one output.
+    pub lint: bool,
+
+    /// The resources to reserve for the action.
+    pub resources: Resources,
+}
+
+#[cfg(test)]
+impl Action for Dummy
+{
+    fn inputs(&self) -> usize { unimplemented!() }
+    fn outputs(&self) -> Outputs<usize>
+        { if self.lint { Outputs::Lint } else { Outputs::Outputs(1) } }
+    fn perform(&self, _: &Perform, _: &[InputPath]) -> Result
+        { unimplemented!() }
+    fn hash(&self, _: &[Hash]) -> Hash { unimplemented!() }
+    fn resources(&self) -> Resources { self.resources }
+}
@@ -0,0 +1,59 @@
+/// Machine resources reserved for performing an action.
+///
+/// The driver does not start an action unless its reservation fits
+/// in what remains of the [budget] after the reservations of the actions
+/// that are being performed. Actions may also enforce their reservations,
+/// for example by running their processes in a [cgroup].
+///
+/// [budget]: `crate::drive::Context::budget`
+/// [cgroup]: `crate::drive::Context::cgroup`
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub struct Resources
+{
+    /// The number of CPUs.
+    pub cpus: u32,
+
+    /// The amount of memory, in bytes.
+    pub memory: u64,
+}
+
+impl Default for Resources
+{
+    /// One CPU and no particular amount of memory.
+    fn default() -> Self
+    {
+        Self{cpus: 1, memory: 0}
+    }
+}
+
+impl Resources
+{
+    /// Whether these resources are available in `available`.
+    pub fn fits_within(&self, available: &Self) -> bool
+    {
+        self.cpus <= available.cpus && self.memory <= available.memory
+    }
+
+    /// Reduce each resource to at most the amount in `budget`.
+    pub fn clamp_to(&self, budget: &Self) -> Self
+    {
+        Self{cpus: self.cpus.min(budget.cpus),
+             memory: self.memory.min(budget.memory)}
+    }
+
+    /// Take these resources from `available`.
+    ///
+    /// The resources must [fit][`Self::fits_within`].
+    pub fn take_from(&self, available: &mut Self)
+    {
+        available.cpus -= self.cpus;
+        available.memory -= self.memory;
+    }
+
+    /// Return these resources to `available`.
+    pub fn return_to(&self, available: &mut Self)
+    {
+        available.cpus += self.cpus;
+        available.memory += self.memory;
+    }
+}
@@ -0,0 +1,239 @@
+use {
+    crate::label::ActionLabel,
+    serde::Serialize,
+    std::{
+        io::{self, Write},
+        mem::take,
+        process,
+        sync::{Mutex, atomic::{AtomicU64, Ordering::SeqCst}},
+        time::{Duration, Instant},
+    },
+};
+
+/// Timeline of the phases that building actions went through.
+///
+/// The driver records a phase for each step of building an action,
+/// such as hashing its inputs or looking it up in the action cache,
+/// and actions record the phases of performing them through
+/// [`Perform::trace`]. The timeline can be written as a Chrome trace,
+/// which can be viewed with Perfetto or `chrome://tracing`.
+/// Writing the trace forgets the events written, so that
+/// a long-running process only keeps those of its current build.
+///
+/// [`Perform::trace`]: `super::Perform::trace`
+pub struct Trace
+{
+    /// Start times of phases are relative to this.
+    epoch: Instant,
+
+    events: Mutex<Vec<TraceEvent>>,
+}
+
+/// Phase of building an action, as recorded in a [`Trace`].
+#[allow(missing_docs)]
+#[derive(Clone, Debug)]
+pub struct TraceEvent
+{
+    pub action: ActionLabel,
+    pub phase: &'static str,
+
+    /// Identifies the thread on which the phase took place.
+    pub thread: u64,
+
+    /// When the phase started, relative to the creation of the trace.
+    pub start: Duration,
+
+    pub duration: Duration,
+}
+
+impl Trace
+{
+    /// Create a trace without any events.
+    pub fn new() -> Self
+    {
+        Self{epoch: Instant::now(), events: Mutex::new(Vec::new())}
+    }
+
+    /// Record that an action went through a phase.
+    pub fn record(
+        &self,
+        action:   &ActionLabel,
+        phase:    &'static str,
+        start:    Instant,
+        duration: Duration,
+    )
+    {
+        let event = TraceEvent{
+            action: action.clone(),
+            phase,
+            thread: thread_id(),
+            start: start.saturating_duration_since(self.epoch),
+            duration,
+        };
+        self.events.lock().unwrap().push(event);
+    }
+
+    /// The events recorded so far, in the order they were recorded.
+    pub fn events(&self) -> Vec<TraceEvent>
+    {
+        self.events.lock().unwrap().clone()
+    }
+
+    /// Remove the events recorded so far and return them.
+    pub fn take_events(&self) -> Vec<TraceEvent>
+    {
+        take(&mut self.events.lock().unwrap())
+    }
+
+    /// Write the events recorded so far in the Chrome trace event format,
+    /// and remove them from the trace.
+    ///
+    /// Each phase becomes a complete event named after the phase,
+    /// with the action label in its arguments. The events are written
+    /// in the JSON array form, which needs no closing bracket, so that
+    /// later calls can append to the same file. Pass `first` for the
+    /// first call, which writes the opening bracket.
+    pub fn write_chrome_trace(&self, mut writer: impl Write, first: bool)
+        -> io::Result<()>
+    {
+        #[derive(Serialize)]
+        struct ChromeEvent<'a>
+        {
+            name: &'a str,
+            cat: &'a str,
+            ph: &'a str,
+            ts: f64,
+            dur: f64,
+            pid: u32,
+            tid: u64,
+            args: ChromeArgs,
+        }
+
+        #[derive(Serialize)]
+        struct ChromeArgs
+        {
+            action: String,
+        }
+
+        if first {
+            writer.write_all(b"[\n")?;
+        }
+
+        // Each event is followed by a comma, as in traces written by Chrome;
+        // viewers accept the comma after the last event.
+        for event in self.take_events() {
+            let chrome_event = ChromeEvent{
+                name: event.phase,
+                cat: "snowflake",
+                ph: "X",
+                ts: event.start.as_secs_f64() * 1e6,
+                dur: event.duration.as_secs_f64() * 1e6,
+                pid: process::id(),
+                tid: event.thread,
+                args: ChromeArgs{action: event.action.to_string()},
+            };
+            serde_json::to_writer(&mut writer, &chrome_event)?;
+            writer.write_all(b",\n")?;
+        }
+
+        Ok(())
+    }
+}
+
+impl Default for Trace
+{
+    fn default() -> Self
+    {
+        Self::new()
+    }
+}
+
+/// Small number that identifies the current thread in traces.
+fn thread_id() -> u64
+{
+    static NEXT: AtomicU64 = AtomicU64::new(1);
+    thread_local! {
+        static ID: u64 = NEXT.fetch_add(1, SeqCst);
+    }
+    ID.with(|id| *id)
+}
+
+/// Records the phases of building a single action.
+///
+/// The default records nothing, for when there is no trace.
+#[derive(Clone, Copy, Default)]
+pub struct ActionTrace<'a>
+{
+    inner: Option<(&'a Trace, &'a ActionLabel)>,
+}
+
+impl<'a> ActionTrace<'a>
+{
+    /// Record the phases of an action into a trace, if any.
+    pub fn new(trace: Option<&'a Trace>, action: &'a ActionLabel) -> Self
+    {
+        Self{inner: trace.map(|trace| (trace, action))}
+    }
+
+    /// Call a function and record the time it takes as a phase.
+    pub fn phase<T>(self, phase: &'static str, f: impl FnOnce() -> T) -> T
+    {
+        let start = Instant::now();
+        let result = f();
+        self.record(phase, start, start.elapsed());
+        result
+    }
+
+    /// Record a phase that was timed by the caller.
+    pub fn record(self, phase: &'static str, start: Instant, duration: Duration)
+    {
+        if let Some((trace, action)) = self.inner {
+            trace.record(action, phase, start, duration);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests
+{
+    use {super::*, serde_json::Value};
+
+    #[test]
+    fn chrome_trace()
+    {
+        let trace = Trace::new();
+        let label = ActionLabel{action: 3};
+        let action_trace = ActionTrace::new(Some(&trace), &label);
+        assert_eq!(action_trace.phase("outer", || {
+            action_trace.phase("inner", || 1)
+        }), 1);
+        ActionTrace::default().phase("ignored", || ());
+
+        // Phases are recorded when they end.
+        let events = trace.events();
+        let phases: Vec<_> = events.iter().map(|e| e.phase).collect();
+        assert_eq!(phases, ["inner", "outer"]);
+        assert!(events[0].start >= events[1].start);
+        assert!(events[0].duration <= events[1].duration);
+
+        // Writing forgets the events, and later writes append.
+        let mut json = Vec::new();
+        trace.write_chrome_trace(&mut json, true).unwrap();
+        assert!(trace.events().is_empty());
+        action_trace.phase("later", || ());
+        trace.write_chrome_trace(&mut json, false).unwrap();
+        trace.write_chrome_trace(&mut json, false).unwrap();
+
+        // Viewers accept the trailing comma, but serde_json does not.
+        let json = [json.strip_suffix(b",\n").unwrap(), b"]"].concat();
+        let json: Value = serde_json::from_slice(&json).unwrap();
+        let names: Vec<_> = json.as_array().unwrap().iter()
+            .map(|event| event["name"].as_str().unwrap()).collect();
+        assert_eq!(names, ["inner", "outer", "later"]);
+        let event = &json[1];
+        assert_eq!(event["name"], "outer");
+        assert_eq!(event["ph"], "X");
+        assert_eq!(event["args"]["action"], "#3");
+        assert_eq!(event["tid"], events[1].thread);
+    }
+}
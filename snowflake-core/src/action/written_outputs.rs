@@ -0,0 +1,93 @@
+use {
+    super::Perform,
+    os_ext::{O_CREAT, O_EXCL, O_WRONLY, openat},
+    snowflake_util::hash::{HashingWriter, WrittenFile},
+    std::{
+        collections::HashMap,
+        ffi::{CStr, CString},
+        fs::File,
+        io::{self, Write},
+        sync::Mutex,
+    },
+};
+
+/// Outputs that an action hashed while writing them.
+///
+/// The driver looks up outputs here before caching them,
+/// and outputs found here are not read back in order to hash them.
+/// Outputs are added through [`Perform::create_regular_file`].
+#[derive(Default)]
+pub struct WrittenOutputs
+{
+    /// Keyed by path relative to the scratch directory.
+    files: Mutex<HashMap<CString, WrittenFile>>,
+}
+
+impl WrittenOutputs
+{
+    /// Remove a written output, given its path relative to the scratch
+    /// directory, as found in [`Success::output_paths`].
+    ///
+    /// [`Success::output_paths`]: `super::Success::output_paths`
+    pub fn take(&self, path: &CStr) -> Option<WrittenFile>
+    {
+        self.files.lock().unwrap().remove(path)
+    }
+}
+
+/// Regular file being written by [`Perform::create_regular_file`].
+pub struct OutputFile<'a>
+{
+    writer: HashingWriter<File>,
+    path: CString,
+    outputs: &'a WrittenOutputs,
+}
+
+impl Write for OutputFile<'_>
+{
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize>
+    {
+        self.writer.write(buf)
+    }
+
+    fn flush(&mut self) -> io::Result<()>
+    {
+        self.writer.flush()
+    }
+}
+
+impl OutputFile<'_>
+{
+    /// Close the file and remember its hash for the driver.
+    ///
+    /// If this is not called, the file is hashed by the driver as usual.
+    pub fn finish(self) -> io::Result<()>
+    {
+        let (_, written) = self.writer.finish()?;
+        self.outputs.files.lock().unwrap().insert(self.path, written);
+        Ok(())
+    }
+}
+
+impl<'a> Perform<'a>
+{
+    /// Create a regular file in the scratch directory and write it,
+    /// hashing it in the process.
+    ///
+    /// The size of the file must be known in advance; see [`HashingWriter`].
+    /// The file must not yet exist, and must not be modified after
+    /// [`finish`][`OutputFile::finish`] is called.
+    pub fn create_regular_file(
+        &self,
+        path: &CStr,
+        executable: bool,
+        size: u64,
+    ) -> io::Result<OutputFile<'a>>
+    {
+        let flags = O_CREAT | O_EXCL | O_WRONLY;
+        let mode = if executable { 0o755 } else { 0o644 };
+        let file = openat(Some(self.scratch), path, flags, mode)?;
+        let writer = HashingWriter::new(File::from(file), executable, size);
+        Ok(OutputFile{writer, path: path.to_owned(), outputs: self.written_outputs})
+    }
+}
@@ -0,0 +1,316 @@
+use {
+    super::{Context, DriveError, Outcome, drive_linear, prepare},
+    crate::{
+        action::{Action, ActionGraph, Input},
+        label::ActionLabel,
+    },
+    std::{
+        collections::{BTreeMap, HashMap},
+        ffi::CStr,
+        mem::take,
+        ops::Bound::{Excluded, Included},
+    },
+};
+
+/// Driver that builds the same action graph repeatedly.
+///
+/// The graph is sorted and indexed once, when this is created.
+/// Outcomes are kept between builds, and [`invalidate`] discards
+/// only the outcomes of the actions affected by a changed file.
+/// The next [`build`] then builds only those actions,
+/// without visiting the rest of the graph.
+///
+/// Use a [`Watcher`] to find out which files changed.
+///
+/// [`build`]: `Self::build`
+/// [`invalidate`]: `Self::invalidate`
+/// [`Watcher`]: `super::Watcher`
+pub struct Incremental<'a>
+{
+    graph: &'a ActionGraph,
+
+    /// The actions of the graph, topologically sorted.
+    linear: Vec<(&'a ActionLabel, &'a dyn Action, &'a [Input])>,
+
+    /// For each static file, the actions that have it as an input.
+    readers: BTreeMap<&'a [u8], Vec<&'a ActionLabel>>,
+
+    /// For each action, the actions that depend on it.
+    dependents: HashMap<&'a ActionLabel, Vec<&'a ActionLabel>>,
+
+    /// Outcomes of the actions that were built and not invalidated since.
+    ///
+    /// If an action has an outcome, then so do all of its dependencies.
+    outcomes: HashMap<&'a ActionLabel, Outcome<'a>>,
+}
+
+impl<'a> Incremental<'a>
+{
+    /// Sort and index an action graph.
+    ///
+    /// No actions are built until [`build`][`Self::build`] is called.
+    pub fn new(graph: &'a ActionGraph) -> Result<Self, DriveError>
+    {
+        let linear = prepare(graph)?;
+
+        let mut readers = BTreeMap::<_, Vec<_>>::new();
+        let mut dependents = HashMap::<_, Vec<_>>::new();
+        for &(label, _, inputs) in &linear {
+            for input in inputs {
+                match input {
+                    Input::Dependency(dependency) =>
+                        dependents.entry(&dependency.action)
+                            .or_default().push(label),
+                    Input::StaticFile(path) =>
+                        readers.entry(path.as_bytes())
+                            .or_default().push(label),
+                }
+            }
+        }
+
+        Ok(Self{graph, linear, readers, dependents, outcomes: HashMap::new()})
+    }
+
+    /// Build every action that does not have an outcome.
+    ///
+    /// These are the actions that were never built before, those
+    /// invalidated since, and those that did not succeed last time.
+    /// The outcomes of all actions in the graph are returned.
+    pub fn build(&mut self, context: &Context)
+        -> &HashMap<&'a ActionLabel, Outcome<'a>>
+    {
+        // Unsuccessful actions are retried, along with their dependents.
+        let unsuccessful =
+            self.outcomes.iter()
+            .filter(|(_, outcome)| !matches!(outcome, Outcome::Success{..}))
+            .map(|(&label, _)| label)
+            .collect();
+        self.discard(unsuccessful);
+
+        let outcomes = take(&mut self.outcomes);
+
+        let linear: Vec<_> =
+            self.linear.iter()
+            .filter(|(label, ..)| !outcomes.contains_key(label))
+            .copied()
+            .collect();
+
+        self.outcomes = drive_linear(context, self.graph, &linear, outcomes);
+        &self.outcomes
+    }
+
+    /// Discard the outcomes of actions affected by a changed file.
+    ///
+    /// `path` is relative to the [source root]. Static file inputs
+    /// that are, contain, or are contained in `path` are affected;
+    /// paths are compared by their bytes, without normalization.
+    /// An empty path affects every static file input.
+    /// The outcomes of actions that transitively depend on an action
+    /// with an affected input are also discarded.
+    ///
+    /// Returns the number of outcomes that were discarded.
+    ///
+    /// [source root]: `super::Context::source_root`
+    pub fn invalidate(&mut self, path: &CStr) -> usize
+    {
+        let path = path.to_bytes();
+        let mut dirty = Vec::new();
+
+        if path.is_empty() {
+            dirty.extend(self.readers.values().flatten());
+        } else {
+            // Static files that are or contain the changed file.
+            let prefixes =
+                path.iter().enumerate()
+                .filter(|&(_, &b)| b == b'/')
+                .map(|(i, _)| &path[.. i])
+                .chain([path]);
+            for prefix in prefixes {
+                dirty.extend(self.readers.get(prefix).into_iter().flatten());
+            }
+
+            // Static files contained in the changed file.
+            // '0' is the byte after '/', so this covers exactly
+            // the paths that start with the changed path and a '/'.
+            let lower = [path, b"/"].concat();
+            let upper = [path, b"0"].concat();
+            let range = (Included(&lower[..]), Excluded(&upper[..]));
+            dirty.extend(self.readers.range::<[u8], _>(range)
+                             .flat_map(|(_, readers)| readers));
+        }
+
+        self.discard(dirty)
+    }
+
+    /// Discard the outcomes of actions and their transitive dependents.
+    fn discard(&mut self, mut dirty: Vec<&'a ActionLabel>) -> usize
+    {
+        // Because actions only have outcomes if their dependencies do,
+        // there is no need to visit the dependents of outcomeless actions.
+        let mut discarded = 0;
+        while let Some(label) = dirty.pop() {
+            if self.outcomes.remove(label).is_some() {
+                discarded += 1;
+                dirty.extend(self.dependents.get(label).into_iter().flatten());
+            }
+        }
+        discarded
+    }
+
+    /// The outcomes of the actions, as of the most recent build.
+    ///
+    /// Actions that were invalidated since do not have an outcome.
+    pub fn outcomes(&self) -> &HashMap<&'a ActionLabel, Outcome<'a>>
+    {
+        &self.outcomes
+    }
+
+    /// Like [`outcomes`][`Self::outcomes`], but by value.
+    pub fn into_outcomes(self) -> HashMap<&'a ActionLabel, Outcome<'a>>
+    {
+        self.outcomes
+    }
+}
+
+#[cfg(test)]
+mod tests
+{
+    use {
+        super::*,
+        crate::{
+            action::{self, InputPath, Outputs, Perform, Resources, Success},
+            state::State,
+        },
+        os_ext::{
+            O_CREAT, O_DIRECTORY, O_PATH, O_RDONLY, O_TRUNC, O_WRONLY,
+            cstr, cstring, mkdirat, mkdtemp, open, openat,
+        },
+        snowflake_util::hash::{Blake3, Hash},
+        std::{
+            collections::HashSet,
+            fs::File,
+            io::{self, Write},
+            num::NonZeroUsize,
+            os::unix::io::{AsFd, BorrowedFd},
+            sync::{Arc, atomic::{AtomicUsize, Ordering::SeqCst}},
+        },
+    };
+
+    /// Action that copies its input, counting how often it does so.
+    /// The tag distinguishes otherwise equivalent actions.
+    struct Copy
+    {
+        tag: usize,
+        performed: Arc<AtomicUsize>,
+    }
+
+    impl Action for Copy
+    {
+        fn inputs(&self) -> usize { 1 }
+        fn outputs(&self) -> Outputs<usize> { Outputs::Outputs(1) }
+
+        fn perform(&self, perform: &Perform, input_paths: &[InputPath])
+            -> action::Result
+        {
+            self.performed.fetch_add(1, SeqCst);
+            let InputPath{dirfd, path} = &input_paths[0];
+            let input = openat(Some(*dirfd), path, O_RDONLY, 0).unwrap();
+            let output = cstr!(b"output");
+            let flags = O_CREAT | O_WRONLY;
+            let output_file = openat(Some(perform.scratch), output, flags, 0o644).unwrap();
+            io::copy(&mut File::from(input), &mut File::from(output_file)).unwrap();
+            Ok(Success{output_paths: vec![output.to_owned()], warnings: false})
+        }
+
+        fn hash(&self, input_hashes: &[Hash]) -> Hash
+        {
+            let mut h = Blake3::new();
+            h.put_str("Copy");
+            h.put_usize(self.tag);
+            h.put_hash(input_hashes[0]);
+            h.finalize()
+        }
+    }
+
+    fn write(dirfd: BorrowedFd, path: &CStr, content: &[u8])
+    {
+        let flags = O_CREAT | O_TRUNC | O_WRONLY;
+        let file = openat(Some(dirfd), path, flags, 0o644).unwrap();
+        File::from(file).write_all(content).unwrap();
+    }
+
+    #[test]
+    fn invalidate()
+    {
+        // Create state directory and source root.
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let source_root = open(&path, O_DIRECTORY | O_PATH, 0).unwrap();
+        let source_root = source_root.as_fd();
+        mkdirat(Some(source_root), cstr!(b"d"), 0o755).unwrap();
+        write(source_root, cstr!(b"a"), b"a");
+        write(source_root, cstr!(b"d/e"), b"e");
+
+        // Action 1 copies the output of action 0, which copies a.
+        // Action 2 copies d/e.
+        let counters: Vec<_> = (0 .. 3).map(|_| Arc::new(AtomicUsize::new(0))).collect();
+        let copy = |tag: usize| -> Box<dyn Action> {
+            Box::new(Copy{tag, performed: counters[tag].clone()})
+        };
+        let label = |action| ActionLabel{action};
+        let dependency = |action| Input::Dependency(
+            crate::label::ActionOutputLabel{action: label(action), output: 0});
+        let graph = ActionGraph{
+            actions: [
+                (label(0), (copy(0), vec![Input::StaticFile(cstring!(b"a"))])),
+                (label(1), (copy(1), vec![dependency(0)])),
+                (label(2), (copy(2), vec![Input::StaticFile(cstring!(b"d/e"))])),
+            ].into_iter().collect(),
+            artifacts: HashSet::new(),
+        };
+        let performed = || -> Vec<usize> {
+            counters.iter().map(|counter| counter.load(SeqCst)).collect()
+        };
+
+        let context = Context{
+            state: &state,
+            source_root,
+            jobs: NonZeroUsize::new(2).unwrap(),
+            budget: Resources{cpus: 2, memory: 0},
+            cgroup: None,
+            fail_fast: false,
+            trace: None,
+        };
+        let mut incremental = Incremental::new(&graph).unwrap();
+
+        // The first build builds everything.
+        let outcomes = incremental.build(&context);
+        assert!(outcomes.values().all(|o| matches!(o, Outcome::Success{..})));
+        assert_eq!(performed(), [1, 1, 1]);
+
+        // Unrelated files affect nothing.
+        assert_eq!(incremental.invalidate(cstr!(b"b")), 0);
+        assert_eq!(incremental.invalidate(cstr!(b"d/f")), 0);
+
+        // Changing a file only rebuilds its readers.
+        write(source_root, cstr!(b"d/e"), b"E");
+        assert_eq!(incremental.invalidate(cstr!(b"d")), 1);
+        assert_eq!(incremental.outcomes().len(), 2);
+        incremental.build(&context);
+        assert_eq!(performed(), [1, 1, 2]);
+
+        // Dependents are invalidated transitively.
+        write(source_root, cstr!(b"a"), b"A");
+        assert_eq!(incremental.invalidate(cstr!(b"a")), 2);
+        incremental.build(&context);
+        assert_eq!(performed(), [2, 2, 2]);
+
+        // The empty path invalidates everything,
+        // but nothing changed, so everything is in the action cache.
+        assert_eq!(incremental.invalidate(cstr!(b"")), 3);
+        let outcomes = incremental.build(&context);
+        assert!(outcomes.values().all(|o| matches!(o, Outcome::Success{cache_hit: true, ..})));
+        assert_eq!(performed(), [2, 2, 2]);
+    }
+}
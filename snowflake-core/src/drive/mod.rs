@@ -0,0 +1,1109 @@
+//! The driver builds a collection of actions.
+
+pub use self::{incremental::*, watch::*};
+
+use {
+    crate::{
+        action::{
+            self, Action, ActionGraph, ActionTrace, Cancellation, CompactGraph,
+            Input, InputPath, Perform, Resources, Success, Trace,
+            WrittenOutputs,
+        },
+        label::ActionLabel,
+        state::{ActionCacheEntry, CacheOutputError, State},
+    },
+    anyhow::{Context as _},
+    os_ext::{O_RDWR, O_TMPFILE, cstr, fstat, openat, unlinkat},
+    snowflake_util::hash::Hash,
+    self::schedule::{Reservation, Scheduler},
+    std::{
+        borrow::Cow,
+        collections::HashMap,
+        ffi::CStr,
+        io::{self, ErrorKind::NotFound},
+        iter,
+        lazy::SyncOnceCell,
+        num::NonZeroUsize,
+        os::unix::io::{AsFd, BorrowedFd, OwnedFd},
+        sync::Mutex,
+        time::{Duration, Instant},
+    },
+    thiserror::Error,
+};
+
+mod incremental;
+mod schedule;
+mod watch;
+
+/// Parameters passed to the driver.
+pub struct Context<'a>
+{
+    /// The state directory to use.
+    pub state: &'a State,
+
+    /// The directory that static file inputs are relative to.
+    pub source_root: BorrowedFd<'a>,
+
+    /// The maximum number of actions to build concurrently.
+    pub jobs: NonZeroUsize,
+
+    /// The resources available to actions being performed concurrently.
+    ///
+    /// Reservations that exceed the budget are reduced to the budget,
+    /// so that such actions can still be performed, albeit on their own.
+    pub budget: Resources,
+
+    /// A cgroup in which actions may create cgroups for their processes.
+    ///
+    /// Actions use these to enforce their [reservations].
+    /// This must be a directory in a cgroup2 file system,
+    /// and the cpu and memory controllers must be enabled
+    /// in its `cgroup.subtree_control` for the respective limits to apply.
+    ///
+    /// [reservations]: `Action::resources`
+    pub cgroup: Option<BorrowedFd<'a>>,
+
+    /// Whether to stop building as soon as an action fails.
+    ///
+    /// If so, the actions being performed are [cancelled],
+    /// which kills the processes of run command actions,
+    /// and actions that were not yet started are not started.
+    /// Otherwise the build keeps going, and only the actions
+    /// that depend on failed actions are skipped.
+    ///
+    /// [cancelled]: `Perform::cancellation`
+    pub fail_fast: bool,
+
+    /// Where to record the phases of building each action, if anywhere.
+    ///
+    /// The driver records collecting the input paths, hashing the action,
+    /// looking it up in the action cache, fetching its inputs,
+    /// performing it, and caching its build log and outputs.
+    /// Actions may record phases of their own while being performed.
+    pub trace: Option<&'a Trace>,
+}
+
+/// Error that occurs whilst building a collection of actions.
+#[allow(missing_docs)]
+#[derive(Debug, Error)]
+pub enum DriveError
+{
+    /// Each action in the cycle depends on the next,
+    /// and the last action depends on the first.
+    #[error("There are actions that cyclically depend on each other: {}",
+            display_cycle(.0))]
+    CyclicDependency(Vec<ActionLabel>),
+
+    /// Each action that depends on a missing action,
+    /// along with the label of the missing action.
+    #[error("There are actions that depend on missing actions: {}",
+            display_dangling(.0))]
+    DanglingDependency(Vec<(ActionLabel, ActionLabel)>),
+}
+
+fn display_cycle(cycle: &[ActionLabel]) -> String
+{
+    cycle.iter().chain(cycle.first())
+        .map(ActionLabel::to_string)
+        .collect::<Vec<_>>()
+        .join(" -> ")
+}
+
+fn display_dangling(dangling: &[(ActionLabel, ActionLabel)]) -> String
+{
+    dangling.iter()
+        .map(|(action, missing)| format!("{action} -> {missing}"))
+        .collect::<Vec<_>>()
+        .join(", ")
+}
+
+/// Error that occurs whilst building an action.
+#[allow(missing_docs)]
+#[derive(Debug, Error)]
+pub enum BuildError
+{
+    #[error("{0}")]
+    Perform(#[from] action::Error),
+
+    #[error("{0}")]
+    CacheOutput(#[from] CacheOutputError),
+
+    #[error("Unexpected error: {0}")]
+    Unexpected(#[from] anyhow::Error),
+}
+
+/// The outcome of an attempt at building an action.
+///
+/// An action is considered *built*
+/// if it is found in the action cache, or
+/// if it is performed successfully and all outputs are able to be cached.
+/// This type describes those scenarios, as well as possible failure cases.
+#[allow(missing_docs)]
+#[derive(Debug)]
+pub enum Outcome<'a>
+{
+    /// The action was built successfully.
+    ///
+    /// If the action was performed and `outputs_unchanged` is true,
+    /// every output was equivalent to one already in the output cache,
+    /// typically from an earlier build of the same action.
+    /// The hashes of those outputs are passed on to dependents,
+    /// so dependents are then found in the action cache
+    /// without performing them or hashing their inputs again.
+    /// For cache hits, `outputs_unchanged` is always false.
+    Success{
+        cache_entry: ActionCacheEntry,
+        cache_hit: bool,
+        outputs_unchanged: bool,
+    },
+
+    /// Performing the action failed because of an error.
+    Failed{
+        build_log: Option<Hash>,
+        error: BuildError,
+    },
+
+    /// The action was skipped because a transitive dependency failed.
+    Skipped{failed_dependency: &'a ActionLabel},
+
+    /// The action was not started because the build was cancelled.
+    ///
+    /// See [`Context::fail_fast`].
+    Cancelled,
+}
+
+/// Build all actions in an action graph.
+///
+/// Up to [`jobs`][`Context::jobs`] actions are built concurrently.
+/// An action is started as soon as all of its dependencies are built.
+/// Of the actions that can be started, those with the longest
+/// critical path go first, based on how long they took to perform
+/// in earlier builds; see [`State::record_action_duration`].
+/// Actions are started only if their [reservation][`Action::resources`]
+/// fits in the [budget][`Context::budget`].
+///
+/// Outputs found in the action cache may not have been fetched yet;
+/// see [`State::set_lazy_outputs`]. They are materialized only for
+/// the inputs of actions that are performed, and for the artifacts.
+///
+/// Each static file is hashed at most once, however many actions read it,
+/// so static files must not change while the build is running;
+/// see [`State::hash_input`] for how unchanged files avoid being read.
+///
+/// To build the same graph repeatedly as files change,
+/// use [`Incremental`] instead, which only rebuilds what changed.
+pub fn drive<'a>(context: &Context, graph: &'a ActionGraph)
+    -> Result<HashMap<&'a ActionLabel, Outcome<'a>>, DriveError>
+{
+    let linear = prepare(graph)?;
+    Ok(drive_linear(context, graph, &linear, HashMap::new()))
+}
+
+/// Build the given topologically sorted actions.
+///
+/// `outcomes` contains the outcomes of any dependencies
+/// that are not among the given actions, from an earlier build.
+/// The returned outcomes include those.
+fn drive_linear<'a>(
+    context:  &Context,
+    graph:    &'a ActionGraph,
+    linear:   &[(&'a ActionLabel, &'a dyn Action, &'a [Input])],
+    outcomes: HashMap<&'a ActionLabel, Outcome<'a>>,
+) -> HashMap<&'a ActionLabel, Outcome<'a>>
+{
+    let estimates = estimate_durations(context, linear);
+    let scheduler = Scheduler::new(linear, context.budget,
+                                   |label, _| estimates[label], outcomes);
+
+    let session = Session{
+        cancellation: Cancellation::new(),
+        static_hashes: StaticHashes::new(linear),
+        spares: Spares::default(),
+    };
+    let session = &session;
+    let cancellation = &session.cancellation;
+    let jobs = context.jobs.get();
+    let mut outcomes = scheduler.run(jobs, |outcomes, label, action, inputs| {
+        // Input paths are collected while the outcomes are locked,
+        // so that the outcomes need not be shared with the build.
+        // Once cancelled, the remaining actions are handed out
+        // only so that they can be given an outcome.
+        let trace = ActionTrace::new(context.trace, label);
+        let input_paths = (!cancellation.is_cancelled())
+            .then(|| trace.phase("collect inputs", || {
+                collect_input_paths(context, outcomes, inputs)
+            }));
+        move |reservation| {
+            let Some(input_paths) = input_paths
+                else { return Outcome::Cancelled };
+            let outcome = build(context, session, trace, reservation,
+                                action, input_paths);
+            if context.fail_fast && matches!(outcome, Outcome::Failed{..}) {
+                cancellation.cancel();
+            }
+            outcome
+        }
+    });
+
+    materialize_artifacts(context, graph, &mut outcomes);
+    record_output_uses(context, linear, &outcomes);
+
+    outcomes
+}
+
+/// Record the uses of the outputs of the given successful actions.
+///
+/// This keeps them from being garbage collected soon.
+/// Outcomes from earlier builds are not included; their uses were
+/// recorded by those builds, and recording them on every rebuild
+/// would make the record grow with the size of the graph.
+/// The uses only affect garbage collection, so errors are ignored.
+fn record_output_uses(
+    context:  &Context,
+    linear:   &[(&ActionLabel, &dyn Action, &[Input])],
+    outcomes: &HashMap<&ActionLabel, Outcome>,
+)
+{
+    let hashes: Vec<_> =
+        linear.iter()
+        .filter_map(|(label, _, _)| match outcomes.get(label)? {
+            Outcome::Success{cache_entry, ..} => Some(cache_entry),
+            _ => None,
+        })
+        .flat_map(|entry| iter::once(&entry.build_log).chain(&entry.outputs))
+        .copied()
+        .collect();
+    let _ = context.state.record_output_uses(&hashes);
+}
+
+/// Topologically sort the action graph.
+fn prepare(graph: &ActionGraph)
+    -> Result<Vec<(&ActionLabel, &dyn Action, &[Input])>, DriveError>
+{
+    let graph = graph.compact();
+
+    let dangling: Vec<_> =
+        graph.dangling_dependencies()
+        .map(|(action, missing)| (action.clone(), missing.clone()))
+        .collect();
+    if !dangling.is_empty() {
+        return Err(DriveError::DanglingDependency(dangling));
+    }
+
+    // Kahn's algorithm: each action is appended to the order
+    // once all of its dependencies are, and the order itself
+    // serves as the queue of actions whose dependents to visit.
+    let dependents = graph.dependents();
+    let mut pending: Vec<_> =
+        (0 .. graph.len())
+        .map(|index| graph.dependencies(index).len())
+        .collect();
+    let mut order: Vec<_> =
+        (0 .. graph.len())
+        .filter(|&index| pending[index] == 0)
+        .collect();
+    let mut next = 0;
+    while let Some(&index) = order.get(next) {
+        next += 1;
+        for &dependent in dependents.of(index) {
+            let dependent = dependent as usize;
+            pending[dependent] -= 1;
+            if pending[dependent] == 0 {
+                order.push(dependent);
+            }
+        }
+    }
+
+    if order.len() < graph.len() {
+        return Err(DriveError::CyclicDependency(find_cycle(&graph, &pending)));
+    }
+
+    let linear =
+        order.into_iter()
+        .map(|index| (graph.label(index), graph.action(index),
+                      graph.inputs(index)))
+        .collect();
+    Ok(linear)
+}
+
+/// Find a cycle among the actions that Kahn's algorithm left pending.
+///
+/// Each pending action has a pending dependency, so following those
+/// from any pending action must eventually revisit an action.
+fn find_cycle(graph: &CompactGraph, pending: &[usize]) -> Vec<ActionLabel>
+{
+    let mut position = vec![usize::MAX; graph.len()];
+    let mut path = Vec::new();
+    let mut index = pending.iter().position(|&count| count != 0)
+        .expect("Some action should be pending");
+    while position[index] == usize::MAX {
+        position[index] = path.len();
+        path.push(index);
+        index =
+            graph.dependencies(index).iter()
+            .map(|&dependency| dependency as usize)
+            .find(|&dependency| pending[dependency] != 0)
+            .expect("Pending action should have a pending dependency");
+    }
+    path[position[index] ..].iter()
+        .map(|&index| graph.label(index).clone())
+        .collect()
+}
+
+/// How long an action is assumed to take if no action was ever performed.
+const DEFAULT_ESTIMATE: Duration = Duration::from_secs(1);
+
+/// Estimate how long performing each action will take.
+///
+/// Actions that were performed before are assumed to take as long again.
+/// Other actions are assumed to take as long as the others on average.
+/// Trivial actions are assumed to take no time, and are not recorded.
+/// The estimates only affect scheduling, so errors are ignored.
+fn estimate_durations<'a>(
+    context: &Context,
+    linear:  &[(&'a ActionLabel, &'a dyn Action, &'a [Input])],
+) -> HashMap<&'a ActionLabel, Duration>
+{
+    // The outer option is none for trivial actions.
+    let recorded: Vec<_> =
+        linear.iter()
+        .map(|&(label, action, _)| {
+            let key = (!action.is_trivial()).then(|| duration_key(action));
+            let duration = key.map(|key| {
+                context.state.action_duration(key).ok().flatten()
+            });
+            (label, duration)
+        })
+        .collect();
+
+    let known: Vec<_> = recorded.iter().filter_map(|&(_, d)| d.flatten()).collect();
+    let fallback = match u32::try_from(known.len()) {
+        Ok(0) | Err(_) => DEFAULT_ESTIMATE,
+        Ok(n) => known.iter().sum::<Duration>() / n,
+    };
+
+    recorded.into_iter()
+        .map(|(label, duration)| {
+            (label, duration.map_or(Duration::ZERO, |d| d.unwrap_or(fallback)))
+        })
+        .collect()
+}
+
+/// Key under which the duration of an action is recorded.
+///
+/// Actions are typically performed because their inputs changed,
+/// so the key is the action hash with every input hash left out.
+fn duration_key(action: &dyn Action) -> Hash
+{
+    action.hash(&vec![Hash([0; 32]); action.inputs()])
+}
+
+/// Result of [`collect_input_paths`].
+type InputPaths<'a, 'b> =
+    Result<Result<Inputs<'a, 'b>, &'b ActionLabel>, BuildError>;
+
+/// The path of each input, and the hashes of inputs already known.
+///
+/// Dependencies are found in the output cache, which is content-addressed,
+/// so their hashes are known without having to hash them again.
+struct Inputs<'a, 'b>
+{
+    paths: Vec<InputPath<'a, 'b>>,
+    known_hashes: Vec<Option<Hash>>,
+}
+
+/// State shared by the builds of all actions in a single build.
+struct Session<'a>
+{
+    cancellation: Cancellation,
+    static_hashes: StaticHashes<'a>,
+    spares: Spares,
+}
+
+/// Build logs and scratch directories left over by trivial actions.
+///
+/// Trivial actions that succeed leave their build log empty and their
+/// scratch directory empty once the outputs are cached, so the next
+/// trivial action can use them instead of creating new ones.
+/// See [`Action::is_trivial`].
+#[derive(Default)]
+struct Spares
+{
+    build_logs: Mutex<Vec<OwnedFd>>,
+    scratches: Mutex<Vec<OwnedFd>>,
+}
+
+/// Build an action.
+///
+/// The resources for the action are reserved only if it is performed.
+fn build<'a>(
+    context:     &Context,
+    session:     &Session,
+    trace:       ActionTrace,
+    reservation: Reservation,
+    action:      &dyn Action,
+    input_paths: InputPaths<'_, 'a>,
+) -> Outcome<'a>
+{
+    match build_inner(context, session, trace, reservation, action, input_paths) {
+        Ok(outcome) => outcome,
+        Err(error) => Outcome::Failed{build_log: None, error},
+    }
+}
+
+fn build_inner<'a>(
+    context:         &Context,
+    session:         &Session,
+    trace:           ActionTrace,
+    mut reservation: Reservation,
+    action:          &dyn Action,
+    input_paths:     InputPaths<'_, 'a>,
+) -> Result<Outcome<'a>, BuildError>
+{
+    let Inputs{paths: input_paths, known_hashes} = match input_paths? {
+        Ok(inputs) => inputs,
+        Err(fd) => return Ok(Outcome::Skipped{failed_dependency: fd}),
+    };
+    let action_hash = trace.phase("hash action", || {
+        compute_action_hash(context, &session.static_hashes, action,
+                            &input_paths, &known_hashes)
+    })?;
+    let cache_entry = trace.phase("check action cache", || {
+        check_action_cache(context, action_hash)
+    })?;
+    if let Some(cache_entry) = cache_entry {
+        return Ok(Outcome::Success{cache_entry, cache_hit: true,
+                                   outputs_unchanged: false});
+    }
+    trace.phase("fetch inputs", || materialize_inputs(context, &known_hashes))?;
+    let trivial = action.is_trivial();
+    let spare = |spares: &Mutex<Vec<OwnedFd>>|
+        trivial.then(|| spares.lock().unwrap().pop()).flatten();
+    let build_log = match spare(&session.spares.build_logs) {
+        Some(build_log) => build_log,
+        None => create_build_log(context)?,
+    };
+    let scratch = match spare(&session.spares.scratches) {
+        Some(scratch) => scratch,
+        None => context.state.new_scratch_dir()                                 .with_context(|| "Create scratch directory")?,
+    };
+    let written_outputs = WrittenOutputs::default();
+    trace.phase("reserve resources", || reservation.reserve());
+    let started = Instant::now();
+    let result = perform_action(context, &session.cancellation, trace, action,
+                                &input_paths, &build_log, &scratch,
+                                &written_outputs);
+    let duration = started.elapsed();
+    drop(reservation);
+    trace.record("perform", started, duration);
+    let build_log = trace.phase("cache build log", || {
+        cache_build_log(context, &session.spares, trivial, build_log)
+    })                                                                          .with_context(|| "Move build log to output cache")?;
+    // Trivial actions take no time worth scheduling around.
+    // The duration only affects scheduling, so errors are ignored.
+    if !trivial {
+        let _ = context.state.record_action_duration(duration_key(action), duration);
+    }
+    let success = match result {
+        Ok(success) => success,
+        Err(error) => return Ok(Outcome::Failed{build_log: Some(build_log), error: error.into()}),
+    };
+    let outcome = trace.phase("cache outputs", || {
+        cache_action(context, action, action_hash, build_log,
+                     &scratch, &written_outputs, &success)
+    })?;
+    if trivial {
+        recycle_scratch(&session.spares, scratch, &success);
+    }
+    Ok(outcome)
+}
+
+/// Move the build log to the output cache.
+///
+/// Empty build logs of trivial actions are kept for reuse instead,
+/// and the hash of the empty build log is returned for them.
+fn cache_build_log(
+    context:   &Context,
+    spares:    &Spares,
+    trivial:   bool,
+    build_log: OwnedFd,
+) -> io::Result<Hash>
+{
+    if trivial && fstat(build_log.as_fd())?.st_size == 0 {
+        spares.build_logs.lock().unwrap().push(build_log);
+        return context.state.cache_empty_build_log();
+    }
+    context.state.cache_build_log(build_log)
+}
+
+/// Keep the scratch directory of a trivial action for reuse.
+///
+/// Outputs that were already in the output cache were not moved there,
+/// so they are removed first. If that fails, the scratch directory
+/// is left for the reaper, as it would be for any other action.
+fn recycle_scratch(spares: &Spares, scratch: OwnedFd, success: &Success)
+{
+    for output_path in &success.output_paths {
+        match unlinkat(Some(scratch.as_fd()), output_path, 0) {
+            Err(err) if err.kind() != NotFound => return,
+            _ => (),
+        }
+    }
+    spares.scratches.lock().unwrap().push(scratch);
+}
+
+/// Compute the path of each input.
+///
+/// If inputs are missing due to unfortunate outcomes of dependencies,
+/// this function returns early with the dependency that failed.
+fn collect_input_paths<'a, 'b>(
+    context:  &'a Context,
+    outcomes: &HashMap<&ActionLabel, Outcome<'b>>,
+    inputs:   &'b [Input],
+) -> InputPaths<'a, 'b>
+{
+    let mut input_paths = Vec::with_capacity(inputs.len());
+    let mut known_hashes = Vec::with_capacity(inputs.len());
+
+    for input in inputs {
+        match input {
+            Input::Dependency(label) => {
+                let outcome = outcomes.get(&label.action)
+                    .expect("Action should have been built before");
+                match outcome {
+                    Outcome::Success{cache_entry, ..} => {
+                        let hash = cache_entry.outputs.get(label.output)
+                            .expect("Action refers to non-existent output");
+                        let (dirfd, path) = context.state.cached_output(*hash)  .with_context(|| "Retrieve dependency from output cache")?;
+                        let path = Cow::Owned((*path).to_owned());
+                        input_paths.push(InputPath{dirfd, path});
+                        known_hashes.push(Some(*hash));
+                    },
+                    Outcome::Failed{..} =>
+                        return Ok(Err(&label.action)),
+                    Outcome::Skipped{failed_dependency} =>
+                        return Ok(Err(failed_dependency)),
+                    // Dependencies are cancelled only if the build is,
+                    // in which case this is not reached; but if it is,
+                    // the cancelled dependency is as good as failed.
+                    Outcome::Cancelled =>
+                        return Ok(Err(&label.action)),
+                }
+            },
+            Input::StaticFile(path) => {
+                let dirfd = context.source_root;
+                let path = Cow::Borrowed(path.as_ref());
+                input_paths.push(InputPath{dirfd, path});
+                known_hashes.push(None);
+            },
+        }
+    }
+
+    Ok(Ok(Inputs{paths: input_paths, known_hashes}))
+}
+
+/// Compute the hash of an action, which is its key into the action cache.
+///
+/// Only inputs whose hashes are not already known are hashed.
+/// Those are the static files, whose hashes are shared between actions.
+fn compute_action_hash(
+    context:       &Context,
+    static_hashes: &StaticHashes,
+    action:        &dyn Action,
+    input_paths:   &[InputPath],
+    known_hashes:  &[Option<Hash>],
+) -> Result<Hash, BuildError>
+{
+    let mut input_hashes = Vec::with_capacity(input_paths.len());
+
+    for (InputPath{path, ..}, known_hash) in input_paths.iter().zip(known_hashes) {
+        let hash = match known_hash {
+            Some(hash) => *hash,
+            None => static_hashes.get(context, path)                            .with_context(|| "Compute hash of input")?,
+        };
+        input_hashes.push(hash);
+    }
+
+    Ok(action.hash(&input_hashes))
+}
+
+/// Hashes of the static file inputs, computed at most once per build.
+///
+/// Static files are often inputs to many actions, toolchains especially.
+/// Even if the hash of a static file is in the input hash cache,
+/// looking it up requires identifying the file, which stats every file
+/// in it; for a large directory, that is the bulk of a no-op build.
+/// Static files are assumed not to change during a build;
+/// changes are picked up by the next build.
+struct StaticHashes<'a>
+{
+    /// For each static file, its index into `hashes`.
+    indices: HashMap<&'a CStr, usize>,
+
+    hashes: Vec<SyncOnceCell<Hash>>,
+}
+
+impl<'a> StaticHashes<'a>
+{
+    fn new(linear: &[(&'a ActionLabel, &'a dyn Action, &'a [Input])]) -> Self
+    {
+        let mut indices = HashMap::new();
+        for input in linear.iter().flat_map(|(_, _, inputs)| *inputs) {
+            if let Input::StaticFile(path) = input {
+                let next = indices.len();
+                indices.entry(path.as_ref()).or_insert(next);
+            }
+        }
+        let hashes = (0 .. indices.len()).map(|_| SyncOnceCell::new()).collect();
+        Self{indices, hashes}
+    }
+
+    /// The hash of a static file, relative to the source root.
+    ///
+    /// If actions that are being built concurrently need the
+    /// same static file, one hashes it while the others wait.
+    fn get(&self, context: &Context, path: &CStr) -> io::Result<Hash>
+    {
+        let hash_input = || context.state.hash_input(Some(context.source_root), path);
+        match self.indices.get(path) {
+            Some(&index) => self.hashes[index].get_or_try_init(hash_input).copied(),
+            None => hash_input(),
+        }
+    }
+}
+
+/// Look up the action in the action cache, in order to skip the build.
+fn check_action_cache(context: &Context, action_hash: Hash)
+    -> Result<Option<ActionCacheEntry>, BuildError>
+{
+    let cache_entry = context.state.cached_action(action_hash)                  .with_context(|| "Look up action in action cache")?;
+    Ok(cache_entry)
+}
+
+/// Ensure that the dependencies of an action exist in the output cache.
+fn materialize_inputs(context: &Context, known_hashes: &[Option<Hash>])
+    -> Result<(), BuildError>
+{
+    for hash in known_hashes.iter().flatten() {
+        context.state.materialize_output(*hash)                                 .with_context(|| "Fetch dependency from remote cache")?;
+    }
+    Ok(())
+}
+
+/// Ensure that the artifacts exist in the output cache.
+///
+/// Actions whose artifacts cannot be materialized are considered failed.
+fn materialize_artifacts<'a>(
+    context:  &Context,
+    graph:    &'a ActionGraph,
+    outcomes: &mut HashMap<&'a ActionLabel, Outcome<'a>>,
+)
+{
+    for artifact in &graph.artifacts {
+        let Some(Outcome::Success{cache_entry, ..}) = outcomes.get(&artifact.action)
+            else { continue };
+        let hash = cache_entry.outputs.get(artifact.output)
+            .expect("Artifact refers to non-existent output");
+        let build_log = cache_entry.build_log;
+        if let Err(err) = context.state.materialize_output(*hash) {
+            let error = anyhow::Error::from(err).context("Fetch artifact from remote cache");
+            let outcome = Outcome::Failed{build_log: Some(build_log), error: error.into()};
+            outcomes.insert(&artifact.action, outcome);
+        }
+    }
+}
+
+/// Create the file that will store the build log.
+fn create_build_log(context: &Context) -> Result<OwnedFd, BuildError>
+{
+    let state_dir = context.state.as_fd();
+    let file = openat(Some(state_dir), cstr!(b"."), O_TMPFILE | O_RDWR, 0o644)  .with_context(|| "Create build log")?;
+    Ok(file)
+}
+
+/// Perform the action.
+fn perform_action(
+    context: &Context,
+    cancellation: &Cancellation,
+    trace: ActionTrace,
+    action: &dyn Action,
+    input_paths: &[InputPath],
+    build_log: &OwnedFd,
+    scratch: &OwnedFd,
+    written_outputs: &WrittenOutputs,
+) -> action::Result
+{
+    let perform = Perform{
+        build_log: build_log.as_fd(),
+        scratch: scratch.as_fd(),
+        state: context.state,
+        cgroup: context.cgroup,
+        written_outputs,
+        cancellation,
+        trace,
+    };
+    action.perform(&perform, input_paths)
+}
+
+/// Insert the outputs and action into the caches.
+fn cache_action<'a>(
+    context:     &Context,
+    action:      &dyn Action,
+    action_hash: Hash,
+    build_log:   Hash,
+    scratch:     &OwnedFd,
+    written:     &WrittenOutputs,
+    success:     &Success,
+) -> Result<Outcome<'a>, BuildError>
+{
+    let (outputs, outputs_unchanged) =
+        cache_outputs(context, action, scratch, written, success)?;
+    let warnings = success.warnings;
+    let cache_entry = ActionCacheEntry{build_log, outputs, warnings};
+    context.state.cache_action(action_hash, &cache_entry)                       .with_context(|| "Insert action into action cache")?;
+    Ok(Outcome::Success{cache_entry, cache_hit: false, outputs_unchanged})
+}
+
+/// Move every output to the output cache and return their hashes.
+///
+/// Also returns whether every output was already in the output cache.
+fn cache_outputs(
+    context: &Context,
+    action:  &dyn Action,
+    scratch: &OwnedFd,
+    written: &WrittenOutputs,
+    success: &Success,
+) -> Result<(Vec<Hash>, bool), BuildError>
+{
+    let scratch = scratch.as_fd();
+    let count = action.outputs().get();
+
+    // Can only be triggered by a fauly implementation of Action::perform.
+    // So there is no need to return a user-facing error for this.
+    assert_eq!(success.output_paths.len(), count,
+        "Action must produce as many outputs as declared");
+
+    let mut output_hashes = Vec::with_capacity(count);
+    let mut unchanged = true;
+
+    for output_path in &success.output_paths {
+        // Outputs are placed by the action in the scratch directory.
+        // And the output path is relative to the scratch directory.
+        let state = context.state;
+        let (hash, already_cached) = match written.take(output_path) {
+            Some(written) =>
+                state.cache_written_output(Some(scratch), output_path, written)?,
+            None =>
+                state.cache_output_dedup(Some(scratch), output_path)?,
+        };
+        output_hashes.push(hash);
+        unchanged &= already_cached;
+    }
+
+    Ok((output_hashes, unchanged))
+}
+
+#[cfg(test)]
+mod tests
+{
+    use {
+        super::*,
+        crate::{
+            action::{Dummy, InputPath, Outputs},
+            label::ActionOutputLabel,
+        },
+        os_ext::{
+            AT_SYMLINK_NOFOLLOW,
+            O_CREAT, O_DIRECTORY, O_EXCL, O_PATH, O_RDONLY, O_TRUNC, O_WRONLY,
+            S_IFDIR, S_IFMT,
+            cstring, fdopendir, fstatat, mkdtemp, open, readdir,
+        },
+        snowflake_util::hash::{Blake3, hash_file_at},
+        std::{
+            collections::HashSet,
+            fs::File,
+            io::{Read, Write},
+            thread,
+        },
+    };
+
+    /// Graph in which each action depends on the given actions.
+    fn graph_of(dependencies: &[&[usize]]) -> ActionGraph
+    {
+        let label = |action| ActionLabel{action};
+        let dependency = |&action: &usize| Input::Dependency(
+            ActionOutputLabel{action: label(action), output: 0});
+        ActionGraph{
+            actions:
+                dependencies.iter().enumerate()
+                .map(|(action, dependencies)| {
+                    let inputs = dependencies.iter().map(dependency).collect();
+                    (label(action), (Box::new(Dummy::default()) as Box<dyn Action>, inputs))
+                })
+                .collect(),
+            artifacts: HashSet::new(),
+        }
+    }
+
+    #[test]
+    fn prepare_long_chain()
+    {
+        // Each action depends on the next, deeper than any call stack.
+        const COUNT: usize = 100_000;
+        let dependencies: Vec<Vec<_>> =
+            (0 .. COUNT)
+            .map(|n| (n + 1 .. COUNT).take(1).collect())
+            .collect();
+        let dependencies: Vec<_> = dependencies.iter().map(Vec::as_slice).collect();
+        let graph = graph_of(&dependencies);
+        let linear = prepare(&graph).unwrap();
+        assert!(linear.iter().map(|(label, ..)| label.action).eq((0 .. COUNT).rev()));
+    }
+
+    #[test]
+    fn prepare_errors()
+    {
+        // Action 0 depends on the cycle formed by actions 1, 2, and 3.
+        let graph = graph_of(&[&[1], &[2], &[3, 3][..], &[1]]);
+        let result = prepare(&graph);
+        let Err(DriveError::CyclicDependency(cycle)) = result
+            else { panic!("Expected cycle") };
+        let cycle: Vec<_> = cycle.iter().map(|l| l.action).collect();
+        assert_eq!(cycle, [1, 2, 3]);
+        assert_eq!(
+            DriveError::CyclicDependency(
+                vec![ActionLabel{action: 1}, ActionLabel{action: 2}]
+            ).to_string(),
+            "There are actions that cyclically depend on each other: \
+             #1 -> #2 -> #1",
+        );
+
+        // Dangling dependencies are reported before cycles.
+        let graph = graph_of(&[&[1, 5][..], &[0], &[6]]);
+        let result = prepare(&graph);
+        let Err(error@DriveError::DanglingDependency(..)) = result
+            else { panic!("Expected dangling dependency") };
+        assert_eq!(
+            error.to_string(),
+            "There are actions that depend on missing actions: \
+             #0 -> #5, #2 -> #6",
+        );
+    }
+
+    /// Action that fails, or that waits until it is cancelled.
+    struct FailOrWait
+    {
+        tag: usize,
+        fail: bool,
+    }
+
+    impl Action for FailOrWait
+    {
+        fn inputs(&self) -> usize { usize::from(self.tag == 2) }
+        fn outputs(&self) -> Outputs<usize> { Outputs::Outputs(0) }
+
+        fn perform(&self, perform: &Perform, _: &[InputPath])
+            -> action::Result
+        {
+            if self.fail {
+                return Err(anyhow::anyhow!("Fail").into());
+            }
+            let started = Instant::now();
+            while started.elapsed() < Duration::from_secs(5) {
+                if perform.cancellation.is_cancelled() {
+                    return Err(action::Error::Cancelled);
+                }
+                thread::sleep(Duration::from_millis(1));
+            }
+            Ok(Success{output_paths: vec![], warnings: false})
+        }
+
+        fn hash(&self, _: &[Hash]) -> Hash
+        {
+            let mut h = Blake3::new();
+            h.put_str("FailOrWait");
+            h.put_usize(self.tag);
+            h.finalize()
+        }
+    }
+
+    #[test]
+    fn static_hashes()
+    {
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let source_root = open(&path, O_DIRECTORY | O_PATH, 0).unwrap();
+        let write = |content: &[u8]| {
+            let flags = O_CREAT | O_TRUNC | O_WRONLY;
+            let file = openat(Some(source_root.as_fd()), cstr!(b"a"), flags, 0o644).unwrap();
+            File::from(file).write_all(content).unwrap();
+            hash_file_at(Some(source_root.as_fd()), cstr!(b"a")).unwrap()
+        };
+
+        let context = Context{
+            state: &state,
+            source_root: source_root.as_fd(),
+            jobs: NonZeroUsize::new(1).unwrap(),
+            budget: Resources{cpus: 1, memory: 0},
+            cgroup: None,
+            fail_fast: false,
+            trace: None,
+        };
+        let label = ActionLabel{action: 0};
+        let inputs = [Input::StaticFile(cstring!(b"a"))];
+        let dummy = Dummy::default();
+        let linear = [(&label, &dummy as &dyn Action, &inputs[..])];
+
+        // Static files are hashed once per build.
+        let old = write(b"old");
+        let static_hashes = StaticHashes::new(&linear);
+        assert_eq!(static_hashes.get(&context, cstr!(b"a")).unwrap(), old);
+        let new = write(b"new");
+        assert_eq!(static_hashes.get(&context, cstr!(b"a")).unwrap(), old);
+        let static_hashes = StaticHashes::new(&linear);
+        assert_eq!(static_hashes.get(&context, cstr!(b"a")).unwrap(), new);
+    }
+
+    /// Trivial action that writes its content to its output.
+    /// The tag distinguishes otherwise equivalent actions.
+    struct Trivial
+    {
+        tag: usize,
+        content: u8,
+    }
+
+    impl Action for Trivial
+    {
+        fn inputs(&self) -> usize { 0 }
+        fn outputs(&self) -> Outputs<usize> { Outputs::Outputs(1) }
+        fn is_trivial(&self) -> bool { true }
+
+        fn perform(&self, perform: &Perform, _: &[InputPath]) -> action::Result
+        {
+            let output = cstr!(b"output");
+            let flags = O_CREAT | O_EXCL | O_WRONLY;
+            let file = openat(Some(perform.scratch), output, flags, 0o644)
+                .map_err(anyhow::Error::from)?;
+            File::from(file).write_all(&[self.content]).unwrap();
+            Ok(Success{output_paths: vec![output.to_owned()], warnings: false})
+        }
+
+        fn hash(&self, _: &[Hash]) -> Hash
+        {
+            let mut h = Blake3::new();
+            h.put_str("Trivial");
+            h.put_usize(self.tag);
+            h.finalize()
+        }
+    }
+
+    #[test]
+    fn trivial_actions()
+    {
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+        let source_root = open(&path, O_DIRECTORY | O_PATH, 0).unwrap();
+
+        // Actions 0, 1, and 2 have the same output, which is cached once.
+        // So at least one of them leaves its output in the scratch directory
+        // and is followed by another action, which must not see it.
+        let label = |action| ActionLabel{action};
+        let trivial = |tag, content| -> Box<dyn Action>
+            { Box::new(Trivial{tag, content}) };
+        let graph = ActionGraph{
+            actions: [
+                (label(0), (trivial(0, 0), vec![])),
+                (label(1), (trivial(1, 0), vec![])),
+                (label(2), (trivial(2, 0), vec![])),
+                (label(3), (trivial(3, 1), vec![])),
+            ].into_iter().collect(),
+            artifacts: HashSet::new(),
+        };
+
+        let context = Context{
+            state: &state,
+            source_root: source_root.as_fd(),
+            jobs: NonZeroUsize::new(1).unwrap(),
+            budget: Resources{cpus: 1, memory: 0},
+            cgroup: None,
+            fail_fast: false,
+            trace: None,
+        };
+        let outcomes = drive(&context, &graph).unwrap();
+
+        // The actions share the empty build log.
+        let build_logs: HashSet<_> =
+            outcomes.values()
+            .map(|outcome| match outcome {
+                Outcome::Success{cache_entry, cache_hit: false, ..} =>
+                    cache_entry.build_log,
+                other => panic!("Unexpected outcome: {other:?}"),
+            })
+            .collect();
+        assert_eq!(build_logs.len(), 1);
+        let build_log = *build_logs.iter().next().unwrap();
+        let mut content = Vec::new();
+        state.open_build_log(build_log).unwrap().read_to_end(&mut content).unwrap();
+        assert!(content.is_empty());
+
+        // The actions share a scratch directory.
+        let scratches = openat(Some(state.as_fd()), cstr!(b"scratches"),
+                               O_DIRECTORY | O_RDONLY, 0).unwrap();
+        let mut scratches = fdopendir(scratches).unwrap();
+        let mut directories = 0;
+        while let Some(entry) = readdir(&mut scratches).unwrap() {
+            let name = entry.d_name;
+            if matches!(name.as_bytes(), b"." | b"..") {
+                continue;
+            }
+            let statbuf = fstatat(Some(scratches.as_fd()), &name,
+                                  AT_SYMLINK_NOFOLLOW).unwrap();
+            directories += (statbuf.st_mode & S_IFMT == S_IFDIR) as usize;
+        }
+        assert_eq!(directories, 1);
+    }
+
+    #[test]
+    fn fail_fast()
+    {
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+        let source_root = open(&path, O_DIRECTORY | O_PATH, 0).unwrap();
+
+        // Action 0 fails while action 1 is being performed.
+        // Action 2 depends on action 1, so it cannot start before then.
+        let label = |action| ActionLabel{action};
+        let action = |tag, fail| -> Box<dyn Action>
+            { Box::new(FailOrWait{tag, fail}) };
+        let dependency = Input::Dependency(
+            ActionOutputLabel{action: label(1), output: 0});
+        let graph = ActionGraph{
+            actions: [
+                (label(0), (action(0, true), vec![])),
+                (label(1), (action(1, false), vec![])),
+                (label(2), (action(2, false), vec![dependency])),
+            ].into_iter().collect(),
+            artifacts: HashSet::new(),
+        };
+
+        let context = Context{
+            state: &state,
+            source_root: source_root.as_fd(),
+            jobs: NonZeroUsize::new(2).unwrap(),
+            budget: Resources{cpus: 2, memory: 0},
+            cgroup: None,
+            fail_fast: true,
+            trace: None,
+        };
+        let started = Instant::now();
+        let outcomes = drive(&context, &graph).unwrap();
+        assert!(started.elapsed() < Duration::from_secs(5));
+
+        assert!(matches!(outcomes[&label(0)], Outcome::Failed{
+            error: BuildError::Perform(action::Error::Unexpected(_)), ..}));
+        assert!(matches!(outcomes[&label(1)], Outcome::Failed{
+            error: BuildError::Perform(action::Error::Cancelled), ..}));
+        assert!(matches!(outcomes[&label(2)], Outcome::Cancelled));
+    }
+}
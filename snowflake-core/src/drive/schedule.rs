@@ -0,0 +1,535 @@
+use {
+    super::Outcome,
+    crate::{action::{Action, Input, Resources}, label::ActionLabel},
+    scope_exit::scope_exit,
+    std::{
+        cmp::Ordering,
+        collections::{BinaryHeap, HashMap},
+        sync::{Condvar, Mutex, MutexGuard},
+        thread,
+        time::Duration,
+    },
+};
+
+/// Hands out actions to workers as soon as their dependencies are built.
+///
+/// Workers share a single queue of ready actions.
+/// Performing an action takes far longer than popping it from the queue,
+/// so contention on the queue is not a concern in practice.
+///
+/// Ready actions are handed out longest remaining critical path first.
+/// The critical path of an action is its estimated duration
+/// plus the longest critical path of any of its dependents.
+/// Starting the long poles early keeps workers busy towards the end.
+///
+/// Resources are reserved only for performing an action, through the
+/// [`Reservation`] passed to the build, so that actions that need not be
+/// performed, such as those found in the action cache, never wait for them.
+/// Of the actions waiting to be performed, the one with the longest
+/// critical path goes first once its reservation fits in the remaining
+/// budget; until then the others wait too, so that it is not starved.
+///
+/// Actions are identified by their position in the linear order,
+/// so that the per-action state can be kept in vectors.
+pub (super) struct Scheduler<'a>
+{
+    /// The actions, in the linear order, along with their inputs.
+    actions: Vec<(&'a ActionLabel, &'a dyn Action, &'a [Input])>,
+
+    /// For each action, the estimated length of its critical path.
+    critical_paths: Vec<Duration>,
+
+    /// For each action, the resources reserved for it.
+    reservations: Vec<Resources>,
+
+    /// For each action, where its dependents start in `dependents`.
+    /// There is one more element, which is the length of `dependents`.
+    dependent_offsets: Vec<usize>,
+
+    /// For each action, the actions that depend on it.
+    ///
+    /// An action that depends on multiple outputs of the same action
+    /// appears multiple times, once for each dependency.
+    dependents: Vec<usize>,
+
+    /// State shared between workers.
+    shared: Mutex<Shared<'a>>,
+
+    /// Notified when actions become ready or all work is done.
+    wakeup: Condvar,
+}
+
+struct Shared<'a>
+{
+    /// Actions whose dependencies have all been built.
+    ready: BinaryHeap<Ready<'a>>,
+
+    /// For each action, the number of dependencies not yet built.
+    pending: Vec<usize>,
+
+    /// Resources not reserved by the actions being performed.
+    available: Resources,
+
+    /// Actions waiting for their reservations, in the order they get them.
+    waiting: BinaryHeap<Ready<'a>>,
+
+    /// Outcomes of the actions that have been built.
+    outcomes: HashMap<&'a ActionLabel, Outcome<'a>>,
+
+    /// The number of actions that do not yet have an outcome.
+    remaining: usize,
+
+    /// Set when a worker panicked, so that the other workers stop.
+    aborted: bool,
+}
+
+/// Action in a queue, ordered by its critical path.
+struct Ready<'a>
+{
+    critical_path: Duration,
+    label: &'a ActionLabel,
+    index: usize,
+}
+
+impl PartialEq for Ready<'_>
+{
+    fn eq(&self, other: &Self) -> bool
+    {
+        self.cmp(other) == Ordering::Equal
+    }
+}
+
+impl Eq for Ready<'_>
+{
+}
+
+impl PartialOrd for Ready<'_>
+{
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering>
+    {
+        Some(self.cmp(other))
+    }
+}
+
+impl Ord for Ready<'_>
+{
+    fn cmp(&self, other: &Self) -> Ordering
+    {
+        // Ties are broken by label, to make the order deterministic.
+        self.critical_path.cmp(&other.critical_path)
+            .then_with(|| other.label.action.cmp(&self.label.action))
+    }
+}
+
+impl<'a> Scheduler<'a>
+{
+    /// Create a scheduler for the given actions.
+    ///
+    /// The actions must be topologically sorted, dependencies first.
+    /// Every dependency of every action must be among them,
+    /// or have an outcome in `outcomes` from an earlier build.
+    /// `estimate` is called once for each action to estimate its duration.
+    /// Reservations are reduced to `budget` where they exceed it.
+    pub fn new<E>(
+        linear:   &[(&'a ActionLabel, &'a dyn Action, &'a [Input])],
+        budget:   Resources,
+        estimate: E,
+        outcomes: HashMap<&'a ActionLabel, Outcome<'a>>,
+    ) -> Self
+        where E: Fn(&'a ActionLabel, &'a dyn Action) -> Duration
+    {
+        let positions: HashMap<_, _> =
+            linear.iter().enumerate()
+            .map(|(index, &(label, ..))| (label, index))
+            .collect();
+
+        // Dependencies that have an outcome are not waited for.
+        let scheduled_dependencies = |inputs: &'a [Input]|
+            inputs.iter().flat_map(Input::dependency)
+            .filter(|dependency| !outcomes.contains_key(&dependency.action))
+            .map(|dependency| positions[&dependency.action]);
+
+        // Count the dependents of each action, and the dependencies
+        // each action waits for, then lay out the dependents by action.
+        let mut pending = vec![0; linear.len()];
+        let mut dependent_offsets = vec![0; linear.len() + 1];
+        for (index, &(_, _, inputs)) in linear.iter().enumerate() {
+            for dependency in scheduled_dependencies(inputs) {
+                dependent_offsets[dependency + 1] += 1;
+                pending[index] += 1;
+            }
+        }
+        for index in 0 .. linear.len() {
+            dependent_offsets[index + 1] += dependent_offsets[index];
+        }
+        let mut dependents = vec![0; dependent_offsets[linear.len()]];
+        let mut cursors = dependent_offsets.clone();
+        for (index, &(_, _, inputs)) in linear.iter().enumerate() {
+            for dependency in scheduled_dependencies(inputs) {
+                dependents[cursors[dependency]] = index;
+                cursors[dependency] += 1;
+            }
+        }
+
+        let reservations =
+            linear.iter()
+            .map(|(_, action, _)| action.resources().clamp_to(&budget))
+            .collect();
+
+        // Dependents come after their dependencies in the linear order,
+        // so visiting it backwards computes their critical paths first.
+        let mut critical_paths = vec![Duration::ZERO; linear.len()];
+        for (index, &(label, action, _)) in linear.iter().enumerate().rev() {
+            let longest_dependent =
+                dependents[dependent_offsets[index] .. dependent_offsets[index + 1]]
+                .iter()
+                .map(|&dependent| critical_paths[dependent])
+                .max()
+                .unwrap_or(Duration::ZERO);
+            critical_paths[index] = estimate(label, action) + longest_dependent;
+        }
+
+        let ready =
+            linear.iter().enumerate()
+            .filter(|&(index, _)| pending[index] == 0)
+            .map(|(index, &(label, ..))|
+                Ready{critical_path: critical_paths[index], label, index})
+            .collect();
+
+        let shared = Shared{
+            ready,
+            pending,
+            available: budget,
+            waiting: BinaryHeap::new(),
+            outcomes,
+            remaining: linear.len(),
+            aborted: false,
+        };
+
+        Self{actions: linear.to_vec(), critical_paths, reservations,
+             dependent_offsets, dependents,
+             shared: Mutex::new(shared), wakeup: Condvar::new()}
+    }
+
+    /// Run `build` on `jobs` threads until every action has an outcome.
+    ///
+    /// The returned outcomes include those passed to [`new`][`Self::new`].
+    ///
+    /// `build` is called with the outcomes so far, which are guaranteed
+    /// to include the outcomes of all dependencies of the action,
+    /// and with the action to build.
+    /// It is called with the outcomes locked, so it should return quickly;
+    /// the returned closure is called without the lock and does the work.
+    /// It must [reserve][`Reservation::reserve`] the resources for the
+    /// action before performing it.
+    pub fn run<B, F>(self, jobs: usize, build: B)
+        -> HashMap<&'a ActionLabel, Outcome<'a>>
+        where B: Fn(&HashMap<&'a ActionLabel, Outcome<'a>>,
+                    &'a ActionLabel, &'a dyn Action, &'a [Input]) -> F
+                 + Sync
+            , F: FnOnce(Reservation) -> Outcome<'a>
+    {
+        thread::scope(|s| {
+            for _ in 0 .. jobs {
+                s.spawn(|| self.work(&build));
+            }
+        });
+
+        let shared = self.shared.into_inner()
+            .expect("Workers should not panic while holding the lock");
+        debug_assert_eq!(shared.remaining, 0);
+        shared.outcomes
+    }
+
+    /// Build actions until there are none left.
+    fn work<B, F>(&self, build: &B)
+        where B: Fn(&HashMap<&'a ActionLabel, Outcome<'a>>,
+                    &'a ActionLabel, &'a dyn Action, &'a [Input]) -> F
+            , F: FnOnce(Reservation) -> Outcome<'a>
+    {
+        // If building an action panics, no outcome would ever be
+        // recorded for it, and the other workers would wait forever.
+        scope_exit! {
+            if thread::panicking() {
+                if let Ok(mut shared) = self.shared.lock() {
+                    shared.aborted = true;
+                }
+                self.wakeup.notify_all();
+            }
+        }
+
+        let mut shared = self.lock();
+        loop {
+            if shared.aborted || shared.remaining == 0 {
+                break;
+            }
+
+            let Some(Ready{index, ..}) = shared.ready.pop() else {
+                shared = self.wakeup.wait(shared)
+                    .expect("Workers should not panic while holding the lock");
+                continue;
+            };
+
+            let (label, action, inputs) = self.actions[index];
+            let perform = build(&shared.outcomes, label, action, inputs);
+            drop(shared);
+
+            let outcome = perform(Reservation{scheduler: self, index, reserved: false});
+
+            shared = self.lock();
+            self.finish(&mut shared, index, outcome);
+        }
+    }
+
+    /// Record the outcome of an action and release its dependents.
+    fn finish(&self, shared: &mut Shared<'a>,
+              index: usize, outcome: Outcome<'a>)
+    {
+        shared.outcomes.insert(self.actions[index].0, outcome);
+        shared.remaining -= 1;
+
+        let dependents = self.dependent_offsets[index]
+                      .. self.dependent_offsets[index + 1];
+        for &dependent in &self.dependents[dependents] {
+            shared.pending[dependent] -= 1;
+            if shared.pending[dependent] == 0 {
+                let critical_path = self.critical_paths[dependent];
+                let label = self.actions[dependent].0;
+                shared.ready.push(Ready{critical_path, label, index: dependent});
+            }
+        }
+
+        // The released dependents may allow any number of waiting
+        // workers to start an action. When everything is done,
+        // all workers must wake up to exit.
+        self.wakeup.notify_all();
+    }
+
+    fn lock(&self) -> MutexGuard<Shared<'a>>
+    {
+        self.shared.lock()
+            .expect("Workers should not panic while holding the lock")
+    }
+}
+
+/// The resources for performing an action, once reserved.
+///
+/// The resources are returned to the budget when this is dropped.
+pub (super) struct Reservation<'s, 'a: 's>
+{
+    scheduler: &'s Scheduler<'a>,
+    index: usize,
+    reserved: bool,
+}
+
+impl Reservation<'_, '_>
+{
+    /// Wait until the resources for the action fit in the remaining budget,
+    /// and reserve them, unless they are reserved already.
+    ///
+    /// Of the actions that are waiting, the one with the longest critical
+    /// path gets its resources first; see [`Scheduler`].
+    pub fn reserve(&mut self)
+    {
+        if self.reserved {
+            return;
+        }
+
+        let scheduler = self.scheduler;
+        let reservation = &scheduler.reservations[self.index];
+        let mut shared = scheduler.lock();
+        shared.waiting.push(Ready{
+            critical_path: scheduler.critical_paths[self.index],
+            label: scheduler.actions[self.index].0,
+            index: self.index,
+        });
+        loop {
+            // Another worker panicked, so resources
+            // may never be returned; the build is abandoned anyway.
+            if shared.aborted {
+                return;
+            }
+            let first = shared.waiting.peek().map(|ready| ready.index);
+            if first == Some(self.index) && reservation.fits_within(&shared.available) {
+                break;
+            }
+            shared = scheduler.wakeup.wait(shared)
+                .expect("Workers should not panic while holding the lock");
+        }
+
+        shared.waiting.pop();
+        reservation.take_from(&mut shared.available);
+        self.reserved = true;
+
+        // The next action that is waiting may fit as well.
+        scheduler.wakeup.notify_all();
+    }
+}
+
+impl Drop for Reservation<'_, '_>
+{
+    fn drop(&mut self)
+    {
+        if !self.reserved {
+            return;
+        }
+        // This also runs when performing the action panicked.
+        if let Ok(mut shared) = self.scheduler.shared.lock() {
+            let reservation = &self.scheduler.reservations[self.index];
+            reservation.return_to(&mut shared.available);
+        }
+        self.scheduler.wakeup.notify_all();
+    }
+}
+
+#[cfg(test)]
+mod tests
+{
+    use {
+        super::*,
+        crate::{
+            action::Dummy,
+            drive::BuildError,
+            label::ActionOutputLabel,
+        },
+        std::{ffi::CString, sync::atomic::{AtomicUsize, Ordering::SeqCst}},
+    };
+
+    #[test]
+    fn dependencies_first()
+    {
+        // Action n depends on actions 2n + 1 and 2n + 2 (twice).
+        const COUNT: usize = 100;
+        let labels: Vec<_> = (0 .. COUNT).map(|action| ActionLabel{action}).collect();
+        let inputs: Vec<Vec<_>> =
+            (0 .. COUNT)
+            .map(|n| {
+                [2 * n + 1, 2 * n + 2, 2 * n + 2].into_iter()
+                    .filter(|&d| d < COUNT)
+                    .map(|d| ActionOutputLabel{action: labels[d].clone(), output: 0})
+                    .map(Input::Dependency)
+                    .collect()
+            })
+            .collect();
+        let dummy = Dummy::default();
+        let linear: Vec<_> =
+            (0 .. COUNT).rev()
+            .map(|n| (&labels[n], &dummy as &dyn Action, &inputs[n][..]))
+            .collect();
+
+        // Each dependency must have an outcome before its dependent starts.
+        let started = AtomicUsize::new(0);
+        let budget = Resources{cpus: 4, memory: 0};
+        let estimate = |_, _| Duration::ZERO;
+        let scheduler = Scheduler::new(&linear, budget, estimate, HashMap::new());
+        let outcomes = scheduler.run(4, |outcomes, _, _, inputs| {
+            for dependency in inputs.iter().flat_map(Input::dependency) {
+                assert!(outcomes.contains_key(&dependency.action));
+            }
+            started.fetch_add(1, SeqCst);
+            |_| Outcome::Failed{
+                build_log: None,
+                error: BuildError::Unexpected(anyhow::anyhow!("Dummy")),
+            }
+        });
+
+        assert_eq!(started.load(SeqCst), COUNT);
+        assert_eq!(outcomes.len(), COUNT);
+    }
+
+    #[test]
+    fn critical_path_first()
+    {
+        // Action 0 depends on action 1; the others stand alone.
+        // Each action has a static file input named after the action,
+        // which is how the build closure tells the actions apart.
+        let labels: Vec<_> = (0 .. 4).map(|action| ActionLabel{action}).collect();
+        let inputs: Vec<Vec<_>> =
+            (0 .. 4)
+            .map(|n| {
+                let name = CString::new(n.to_string()).unwrap();
+                let mut inputs = vec![Input::StaticFile(name)];
+                if n == 0 {
+                    let dependency = ActionOutputLabel{action: labels[1].clone(), output: 0};
+                    inputs.push(Input::Dependency(dependency));
+                }
+                inputs
+            })
+            .collect();
+        let dummy = Dummy::default();
+        let linear: Vec<_> =
+            [1, 0, 2, 3].into_iter()
+            .map(|n| (&labels[n], &dummy as &dyn Action, &inputs[n][..]))
+            .collect();
+
+        // Critical paths are 10, 11, 5, and 7 seconds, respectively.
+        let durations = [10, 1, 5, 7];
+        let estimate = |label: &ActionLabel, _|
+            Duration::from_secs(durations[label.action]);
+
+        // With a single worker, actions start one at a time.
+        let order = Mutex::new(Vec::<usize>::new());
+        let budget = Resources{cpus: 1, memory: 0};
+        let scheduler = Scheduler::new(&linear, budget, estimate, HashMap::new());
+        scheduler.run(1, |_, _, _, inputs| {
+            let Input::StaticFile(name) = &inputs[0] else { unreachable!() };
+            order.lock().unwrap().push(name.to_str().unwrap().parse().unwrap());
+            |_| Outcome::Failed{
+                build_log: None,
+                error: BuildError::Unexpected(anyhow::anyhow!("Dummy")),
+            }
+        });
+
+        // Action 0 is released by action 1, and its path beats action 3.
+        assert_eq!(order.into_inner().unwrap(), [1, 0, 3, 2]);
+    }
+
+    #[test]
+    fn reservations()
+    {
+        // Each action reserves more than half of the budget,
+        // and one of them reserves more than the entire budget.
+        const COUNT: usize = 20;
+        let labels: Vec<_> = (0 .. COUNT).map(|action| ActionLabel{action}).collect();
+        let actions: Vec<_> =
+            (0 .. COUNT)
+            .map(|n| Resources{cpus: 3, memory: 100 * n as u64})
+            .map(|resources| Dummy{resources, ..Dummy::default()})
+            .collect();
+        let linear: Vec<_> =
+            (0 .. COUNT)
+            .map(|n| (&labels[n], &actions[n] as &dyn Action, &[][..]))
+            .collect();
+
+        // Track how many actions are built at once,
+        // optionally reserving resources for each.
+        let most_running = |reserve: bool| {
+            let running = AtomicUsize::new(0);
+            let most_running = AtomicUsize::new(0);
+            let budget = Resources{cpus: 4, memory: 1000};
+            let estimate = |_, _| Duration::ZERO;
+            let scheduler = Scheduler::new(&linear, budget, estimate, HashMap::new());
+            let outcomes = scheduler.run(4, |_, _, _, _| |mut reservation: Reservation| {
+                if reserve {
+                    reservation.reserve();
+                }
+                let now = running.fetch_add(1, SeqCst) + 1;
+                most_running.fetch_max(now, SeqCst);
+                thread::sleep(Duration::from_millis(10));
+                running.fetch_sub(1, SeqCst);
+                Outcome::Failed{
+                    build_log: None,
+                    error: BuildError::Unexpected(anyhow::anyhow!("Dummy")),
+                }
+            });
+            assert_eq!(outcomes.len(), COUNT);
+            most_running.into_inner()
+        };
+
+        // Actions that are performed are never performed concurrently.
+        assert_eq!(most_running(true), 1);
+
+        // Builds that perform nothing, such as cache hits, do not wait.
+        assert!(most_running(false) > 1);
+    }
+}
@@ -0,0 +1,431 @@
+use {
+    crate::action::{ActionGraph, Input},
+    os_ext::{
+        AT_SYMLINK_NOFOLLOW,
+        IN_ATTRIB, IN_CLOSE_WRITE, IN_CREATE, IN_DELETE, IN_DELETE_SELF,
+        IN_IGNORED, IN_ISDIR, IN_MOVE_SELF, IN_MOVED_FROM, IN_MOVED_TO,
+        IN_Q_OVERFLOW,
+        O_DIRECTORY, O_RDONLY, POLLIN, S_IFDIR, S_IFMT,
+        cstr, fdopendir, fstatat, inotify_add_watch, inotify_init1,
+        inotify_rm_watch, openat, poll, pollfd, readdir,
+        cstr::CStrExt,
+        io::magic_link,
+    },
+    std::{
+        collections::{BTreeSet, HashMap},
+        ffi::{CStr, CString},
+        fs::File,
+        io::{self, ErrorKind::NotFound, Read},
+        os::{raw::c_int, unix::io::{AsFd, AsRawFd, BorrowedFd}},
+        time::Duration,
+    },
+};
+
+/// Events that indicate that a file may have changed.
+const MASK: u32 =
+    IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+    IN_DELETE_SELF | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO;
+
+/// Size of the fixed part of struct inotify_event.
+const EVENT_HEADER_SIZE: usize = 16;
+
+/// Maximum length of a file name on Linux.
+const NAME_MAX: usize = 255;
+
+/// Watches the static file inputs of an action graph for changes.
+///
+/// The directory containing each static file is watched,
+/// so that files replaced by renaming are noticed.
+/// Static files that are directories are watched recursively.
+/// If a directory that would be watched does not exist, for instance
+/// because it was removed or moved away and is yet to be replaced,
+/// its nearest existing ancestor is watched instead, until it is created.
+/// The reported paths can be passed to [`Incremental::invalidate`].
+///
+/// [`Incremental::invalidate`]: `super::Incremental::invalidate`
+pub struct Watcher<'a>
+{
+    source_root: BorrowedFd<'a>,
+
+    inotify: File,
+
+    /// The paths of the static files, relative to the source root.
+    static_files: BTreeSet<CString>,
+
+    /// For each watch, the path to the directory relative to the source
+    /// root, and whether its subdirectories are to be watched as well.
+    watches: HashMap<i32, (CString, bool)>,
+
+    /// Buffer for reading events, which must fit at least one event.
+    buffer: Vec<u8>,
+}
+
+impl<'a> Watcher<'a>
+{
+    /// Start watching the static file inputs of an action graph.
+    ///
+    /// `source_root` must be the [source root] of the graph.
+    ///
+    /// [source root]: `super::Context::source_root`
+    pub fn new(source_root: BorrowedFd<'a>, graph: &ActionGraph)
+        -> io::Result<Self>
+    {
+        let static_files: BTreeSet<_> =
+            graph.actions.values()
+            .flat_map(|(_, inputs)| inputs)
+            .filter_map(|input| match input {
+                Input::StaticFile(path) => Some(path.clone()),
+                Input::Dependency(..) => None,
+            })
+            .collect();
+
+        let mut this = Self{
+            source_root,
+            inotify: File::from(inotify_init1(0)?),
+            static_files,
+            watches: HashMap::new(),
+            // Names are at most NAME_MAX bytes, plus a terminating nul.
+            buffer: vec![0; 64 * (EVENT_HEADER_SIZE + NAME_MAX + 1)],
+        };
+        this.watch_static_files(cstr!(b""))?;
+        Ok(this)
+    }
+
+    /// Wait for changes and return the paths to the changed files.
+    ///
+    /// The paths are relative to the source root.
+    /// An empty path is returned if events were lost,
+    /// in which case any static file may have changed.
+    pub fn wait(&mut self) -> io::Result<Vec<CString>>
+    {
+        let nread = self.inotify.read(&mut self.buffer)?;
+        self.handle_events(nread)
+    }
+
+    /// Like [`wait`][`Self::wait`], but give up after a timeout.
+    ///
+    /// If no changes happen in time, no paths are returned.
+    pub fn wait_timeout(&mut self, timeout: Duration)
+        -> io::Result<Vec<CString>>
+    {
+        let mut pollfds = [
+            pollfd{fd: self.inotify.as_raw_fd(), events: POLLIN, revents: 0},
+        ];
+
+        // Round up, so that the timeout has passed when poll times out.
+        let millis = (timeout.as_nanos() + 999_999) / 1_000_000;
+        let millis = millis.try_into().unwrap_or(c_int::MAX);
+        if poll(&mut pollfds, millis)? == 0 {
+            return Ok(Vec::new());
+        }
+
+        self.wait()
+    }
+
+    /// Turn the events read into the buffer into changed paths.
+    fn handle_events(&mut self, nread: usize) -> io::Result<Vec<CString>>
+    {
+
+        let mut changed = Vec::new();
+        let mut offset = 0;
+        while offset + EVENT_HEADER_SIZE <= nread {
+            let field = |i: usize| {
+                let start = offset + 4 * i;
+                <[u8; 4]>::try_from(&self.buffer[start .. start + 4]).unwrap()
+            };
+            let wd = i32::from_ne_bytes(field(0));
+            let mask = u32::from_ne_bytes(field(1));
+            let len = u32::from_ne_bytes(field(3)) as usize;
+
+            // The name is padded with nuls, if there is a name at all.
+            let name = &self.buffer[offset + EVENT_HEADER_SIZE ..][.. len];
+            let name = &name[.. name.iter().position(|&b| b == 0).unwrap_or(len)];
+            let name = CString::new(name).unwrap();
+            offset += EVENT_HEADER_SIZE + len;
+
+            if mask & IN_Q_OVERFLOW != 0 {
+                changed.push(CString::default());
+                continue;
+            }
+
+            let Some((directory, recursive)) = self.watches.get(&wd)
+                else { continue };
+            let recursive = *recursive;
+            let path = match name.as_bytes() {
+                b"" => directory.clone(),
+                _ => directory.join(&name),
+            };
+
+            // A watched directory that is gone, or was moved elsewhere,
+            // is no longer at its path, so watch what is there instead.
+            if mask & (IN_IGNORED | IN_MOVE_SELF) != 0 {
+                self.watches.remove(&wd);
+                if mask & IN_MOVE_SELF != 0 {
+                    self.unwatch(&path);
+                }
+                self.watch_static_files(&path)?;
+                changed.push(path);
+                continue;
+            }
+
+            // New directories may need to be watched themselves.
+            let created = mask & (IN_CREATE | IN_MOVED_TO) != 0;
+            if created && mask & IN_ISDIR != 0 {
+                if recursive {
+                    self.watch(&path, true)?;
+                }
+                self.watch_static_files(&path)?;
+            }
+
+            changed.push(path);
+        }
+
+        Ok(changed)
+    }
+
+    /// Set up the watches for the static files that are or are in `path`.
+    ///
+    /// An empty path stands for every static file.
+    fn watch_static_files(&mut self, path: &CStr) -> io::Result<()>
+    {
+        let path = path.to_bytes();
+        let mut static_files: Vec<CString> =
+            if path.is_empty() {
+                self.static_files.iter().cloned().collect()
+            } else {
+                // '0' is the byte after '/'; see Incremental::invalidate.
+                let lower = CString::new([path, b"/"].concat()).unwrap();
+                let upper = CString::new([path, b"0"].concat()).unwrap();
+                self.static_files.range(lower .. upper).cloned().collect()
+            };
+        if let Ok(path) = CString::new(path) {
+            if self.static_files.contains(&path) {
+                static_files.push(path);
+            }
+        }
+
+        for static_file in static_files {
+            self.watch_nearest(parent(static_file.as_bytes()))?;
+            if self.is_directory(&static_file)? {
+                self.watch(&static_file, true)?;
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Stop watching a directory and its subdirectories.
+    ///
+    /// This is needed when the directory was moved,
+    /// as the watches would otherwise report the wrong paths.
+    fn unwatch(&mut self, path: &CStr)
+    {
+        let path = path.to_bytes();
+        let inotify = self.inotify.as_fd();
+        self.watches.retain(|&wd, (directory, _)| {
+            let directory = directory.as_bytes();
+            let under = path.is_empty() || directory == path ||
+                directory.starts_with(path) && directory[path.len()] == b'/';
+            if under {
+                // The watch may already be gone, which is fine.
+                let _ = inotify_rm_watch(inotify, wd);
+            }
+            !under
+        });
+    }
+
+    /// Watch a directory, or its nearest ancestor that exists.
+    fn watch_nearest(&mut self, mut path: &[u8]) -> io::Result<()>
+    {
+        while !self.watch(&CString::new(path).unwrap(), false)? {
+            if path.is_empty() {
+                break;
+            }
+            path = parent(path);
+        }
+        Ok(())
+    }
+
+    /// Watch a directory, and optionally its subdirectories.
+    ///
+    /// Returns false if the directory does not exist.
+    fn watch(&mut self, path: &CStr, recursive: bool) -> io::Result<bool>
+    {
+        let absolute = magic_link(self.source_root).join(path);
+        let wd = match inotify_add_watch(self.inotify.as_fd(), &absolute, MASK) {
+            Ok(wd) => wd,
+            Err(err) if err.kind() == NotFound => return Ok(false),
+            Err(err) => return Err(err),
+        };
+
+        // Watching the same directory again yields the same watch.
+        let entry = self.watches.entry(wd)
+            .or_insert_with(|| (path.to_owned(), false));
+        if !recursive || entry.1 {
+            return Ok(true);
+        }
+        entry.1 = true;
+
+        let flags = O_DIRECTORY | O_RDONLY;
+        let dir = match openat(None, &absolute, flags, 0) {
+            Ok(dir) => dir,
+            Err(err) if err.kind() == NotFound => return Ok(true),
+            Err(err) => return Err(err),
+        };
+        let mut dir = fdopendir(dir)?;
+        let mut subdirectories = Vec::new();
+        while let Some(entry) = readdir(&mut dir)? {
+            let name = entry.d_name;
+            if matches!(name.as_bytes(), b"." | b"..") {
+                continue;
+            }
+            match fstatat(Some(dir.as_fd()), &name, AT_SYMLINK_NOFOLLOW) {
+                Ok(statbuf) if statbuf.st_mode & S_IFMT == S_IFDIR =>
+                    subdirectories.push(path.join(&name)),
+                Ok(_) => (),
+                Err(err) if err.kind() == NotFound => (),
+                Err(err) => return Err(err),
+            }
+        }
+
+        for subdirectory in subdirectories {
+            self.watch(&subdirectory, true)?;
+        }
+
+        Ok(true)
+    }
+
+    /// Whether a path relative to the source root is a directory.
+    fn is_directory(&self, path: &CStr) -> io::Result<bool>
+    {
+        match fstatat(Some(self.source_root), path, AT_SYMLINK_NOFOLLOW) {
+            Ok(statbuf) => Ok(statbuf.st_mode & S_IFMT == S_IFDIR),
+            Err(err) if err.kind() == NotFound => Ok(false),
+            Err(err) => Err(err),
+        }
+    }
+}
+
+/// The directory that contains a path relative to the source root.
+///
+/// The parent of a path without slashes is the source root itself.
+fn parent(path: &[u8]) -> &[u8]
+{
+    match path.iter().rposition(|&b| b == b'/') {
+        Some(slash) => &path[.. slash],
+        None => b"",
+    }
+}
+
+#[cfg(test)]
+mod tests
+{
+    use {
+        super::*,
+        crate::{
+            action::{Action, Dummy},
+            label::ActionLabel,
+        },
+        os_ext::{
+            AT_REMOVEDIR, O_CREAT, O_PATH, O_WRONLY,
+            cstring, mkdirat, mkdtemp, open, renameat2, unlinkat,
+        },
+        std::{collections::HashSet, io::Write, time::Instant},
+    };
+
+    #[test]
+    fn changes()
+    {
+        // Create source root with a regular file and a directory.
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let source_root = open(&path, O_DIRECTORY | O_PATH, 0).unwrap();
+        let source_root = source_root.as_fd();
+        mkdirat(Some(source_root), cstr!(b"d"), 0o755).unwrap();
+        mkdirat(Some(source_root), cstr!(b"s"), 0o755).unwrap();
+        mkdirat(Some(source_root), cstr!(b"s/t"), 0o755).unwrap();
+        let write = |path: &CStr| {
+            let file = openat(Some(source_root), path, O_CREAT | O_WRONLY, 0o644).unwrap();
+            File::from(file).write_all(b"").unwrap();
+        };
+        write(cstr!(b"d/e"));
+
+        // Watch a graph that has both as static files.
+        let inputs = vec![
+            Input::StaticFile(cstring!(b"d/e")),
+            Input::StaticFile(cstring!(b"s")),
+        ];
+        let graph = ActionGraph{
+            actions: [(ActionLabel{action: 0}, (Box::new(Dummy::default()) as Box<dyn Action>, inputs))]
+                .into_iter().collect(),
+            artifacts: HashSet::new(),
+        };
+        let mut watcher = Watcher::new(source_root, &graph).unwrap();
+
+        // Wait until a change to a given path is reported.
+        let wait_for = |watcher: &mut Watcher, expected: &CStr| {
+            wait_until(watcher, |_, changed| changed.iter().any(|path| &**path == expected));
+        };
+
+        // Wait until a given directory is watched.
+        let wait_watched = |watcher: &mut Watcher, expected: &CStr| {
+            wait_until(watcher, |watcher, _| {
+                watcher.watches.values().any(|(path, _)| &**path == expected)
+            });
+        };
+
+        // Changes to static files are reported.
+        write(cstr!(b"d/e"));
+        wait_for(&mut watcher, cstr!(b"d/e"));
+
+        // Changes within directories are reported.
+        write(cstr!(b"s/t/u"));
+        wait_for(&mut watcher, cstr!(b"s/t/u"));
+
+        // New directories are watched as well.
+        mkdirat(Some(source_root), cstr!(b"s/n"), 0o755).unwrap();
+        wait_for(&mut watcher, cstr!(b"s/n"));
+        write(cstr!(b"s/n/x"));
+        wait_for(&mut watcher, cstr!(b"s/n/x"));
+
+        // Static files in replaced directories are still watched.
+        unlinkat(Some(source_root), cstr!(b"d/e"), 0).unwrap();
+        unlinkat(Some(source_root), cstr!(b"d"), AT_REMOVEDIR).unwrap();
+        wait_for(&mut watcher, cstr!(b"d"));
+        mkdirat(Some(source_root), cstr!(b"d"), 0o755).unwrap();
+        wait_watched(&mut watcher, cstr!(b"d"));
+        write(cstr!(b"d/e"));
+        wait_for(&mut watcher, cstr!(b"d/e"));
+
+        // Static files in moved directories are watched at their path.
+        renameat2(Some(source_root), cstr!(b"d"),
+                  Some(source_root), cstr!(b"m"), 0).unwrap();
+        wait_for(&mut watcher, cstr!(b"d"));
+        mkdirat(Some(source_root), cstr!(b"d"), 0o755).unwrap();
+        wait_watched(&mut watcher, cstr!(b"d"));
+        write(cstr!(b"d/e"));
+        wait_for(&mut watcher, cstr!(b"d/e"));
+        write(cstr!(b"m/e"));
+        write(cstr!(b"d/x"));
+        wait_until(&mut watcher, |_, changed| {
+            assert!(changed.iter().all(|path| path.as_bytes() != b"d/e"));
+            changed.iter().any(|path| path.as_bytes() == b"d/x")
+        });
+    }
+
+    /// Wait for changes until a condition holds of the changes so far.
+    ///
+    /// Fails with the changes seen if it takes more than ten seconds.
+    fn wait_until(
+        watcher: &mut Watcher,
+        mut done: impl FnMut(&Watcher, &[CString]) -> bool,
+    )
+    {
+        let deadline = Instant::now() + Duration::from_secs(10);
+        let mut changed = Vec::new();
+        while !done(watcher, &changed) {
+            let remaining = deadline.saturating_duration_since(Instant::now());
+            assert!(!remaining.is_zero(), "Timed out; changes seen: {changed:?}");
+            changed.extend(watcher.wait_timeout(remaining).unwrap());
+        }
+    }
+}
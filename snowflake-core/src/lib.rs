@@ -8,7 +8,9 @@
 #![feature(exit_status_error)]
 #![feature(io_error_other)]
 #![feature(io_safety)]
+#![feature(let_else)]
 #![feature(once_cell)]
+#![feature(scoped_threads)]
 #![feature(type_ascription)]
 #![warn(missing_docs)]
 
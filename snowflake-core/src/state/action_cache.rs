@@ -0,0 +1,326 @@
+use {
+    super::{
+        ACTION_CACHE_FILE, ActionCacheEntry,
+        record_log::{RecordLog, records},
+    },
+    os_ext::{
+        LOCK_EX, LOCK_SH, MAP_SHARED, O_DIRECTORY, O_PATH, PROT_READ,
+        cstr, fstat, mmap, munmap, openat,
+    },
+    snowflake_util::hash::Hash,
+    std::{
+        collections::HashMap,
+        ffi::CStr,
+        io,
+        ops::{Deref, Range},
+        os::{raw::c_int, unix::io::{AsFd, BorrowedFd, OwnedFd}},
+        ptr::NonNull,
+        slice,
+        sync::RwLock,
+    },
+};
+
+/// Binary action cache, persisted as a [record log].
+///
+/// Each record consists of an action hash followed by an encoded entry.
+/// The log is mapped into memory, and an index from action hashes
+/// to the locations of their records in the mapping is kept.
+/// Looking up an entry that is in the index requires no system calls.
+/// On a miss, the log is checked for records appended since it was mapped,
+/// for instance by other processes using the same state directory.
+///
+/// The garbage collector [compacts][`Self::compact`] the log by replacing
+/// it with a new file. Records are appended under a shared lock on the
+/// log, so none are appended to a log that is being replaced, and the
+/// index starts over when it finds that the mapped log was replaced.
+///
+/// [record log]: `RecordLog`
+pub (super) struct ActionCache
+{
+    /// The state directory, which contains the log.
+    state_dir: OwnedFd,
+
+    index: RwLock<Index>,
+}
+
+struct Index
+{
+    /// The log that is mapped.
+    log: RecordLog,
+
+    /// Mapping of the log, up to its size when it was last mapped.
+    mapping: Mapping,
+
+    /// Offset into the mapping up to which records have been indexed.
+    scanned: usize,
+
+    /// For each action hash, the location of its entry in the mapping.
+    entries: HashMap<Hash, Range<usize>>,
+}
+
+/// Current version of the encoding of records.
+pub (super) const VERSION: u8 = 1;
+
+/// Marks a record that removes the entry for an action hash.
+///
+/// Such a record consists of only this byte and the action hash.
+/// Older versions ignore these records, as they do not match [`VERSION`].
+const EVICTED: u8 = 0xFF;
+
+impl ActionCache
+{
+    pub fn open(state_dir: BorrowedFd) -> io::Result<Self>
+    {
+        let state_dir = openat(Some(state_dir), cstr!(b"."), O_DIRECTORY | O_PATH, 0)?;
+        let mut index = Index::new(RecordLog::open(state_dir.as_fd(), ACTION_CACHE_FILE)?);
+        index.refresh(state_dir.as_fd())?;
+        Ok(Self{state_dir, index: RwLock::new(index)})
+    }
+
+    /// Look up an entry in the action cache.
+    pub fn get(&self, hash: &Hash) -> io::Result<Option<ActionCacheEntry>>
+    {
+        {
+            let index = self.index.read().unwrap();
+            if let Some(entry) = index.get(hash) {
+                return Ok(Some(entry));
+            }
+        }
+
+        let mut index = self.index.write().unwrap();
+        index.refresh(self.state_dir.as_fd())?;
+        Ok(index.get(hash))
+    }
+
+    /// Insert an entry into the action cache.
+    ///
+    /// If the entry already exists, nothing is changed.
+    pub fn insert(&self, hash: Hash, entry: &ActionCacheEntry)
+        -> io::Result<()>
+    {
+        if self.index.read().unwrap().entries.contains_key(&hash) {
+            return Ok(());
+        }
+
+        // The record is not indexed until the log is next refreshed.
+        // Concurrent inserts of the same hash are harmless;
+        // the record that comes first in the log wins.
+        self.lock(LOCK_SH)?.append(&encode(hash, entry))
+    }
+
+    /// Remove an entry from the action cache.
+    ///
+    /// The entry may be inserted again later.
+    /// Other processes stop finding the entry once they refresh.
+    pub fn evict(&self, hash: Hash) -> io::Result<()>
+    {
+        let mut record = Vec::with_capacity(33);
+        record.push(EVICTED);
+        record.extend_from_slice(&hash.0);
+        self.lock(LOCK_SH)?.append(&record)?;
+        self.index.write().unwrap().entries.remove(&hash);
+        Ok(())
+    }
+
+    /// Every entry in the action cache, including those appended since
+    /// the log was last mapped.
+    pub fn entries(&self) -> io::Result<Vec<(Hash, ActionCacheEntry)>>
+    {
+        let mut index = self.index.write().unwrap();
+        index.refresh(self.state_dir.as_fd())?;
+        let entries =
+            index.entries.keys()
+            .filter_map(|&hash| Some((hash, index.get(&hash)?)))
+            .collect();
+        Ok(entries)
+    }
+
+    /// Rewrite the log with only the records of the entries it has.
+    ///
+    /// Records of evicted entries, records that lost to an earlier record
+    /// for the same action hash, and eviction records are left out.
+    /// Records of other versions are kept, as they may mean something
+    /// to those versions. The compacted log is written to `tmp_path`,
+    /// which then replaces the log; see [`RecordLog::replace`].
+    /// If there is nothing to leave out, the log is not rewritten.
+    pub fn compact(&self, tmp_dirfd: BorrowedFd, tmp_path: &CStr)
+        -> io::Result<()>
+    {
+        let log = self.lock(LOCK_EX)?;
+        let buf = log.read()?;
+
+        // The same rules as for indexing decide which entries remain.
+        let mut entries = HashMap::new();
+        let mut kept = Vec::new();
+        let mut total = 0;
+        for (record, _) in records(&buf) {
+            total += 1;
+            let payload = &buf[record.clone()];
+            if payload.len() >= 33 && payload[0] == VERSION {
+                let hash = Hash(payload[1 .. 33].try_into().unwrap());
+                entries.entry(hash).or_insert(record);
+            } else if payload.len() == 33 && payload[0] == EVICTED {
+                let hash = Hash(payload[1 .. 33].try_into().unwrap());
+                entries.remove(&hash);
+            } else {
+                kept.push(record);
+            }
+        }
+        kept.extend(entries.into_values());
+        if kept.len() == total {
+            return Ok(());
+        }
+
+        // Keep the records in the order in which they were appended.
+        kept.sort_unstable_by_key(|record| record.start);
+        RecordLog::replace(
+            self.state_dir.as_fd(), ACTION_CACHE_FILE,
+            tmp_dirfd, tmp_path,
+            kept.into_iter().map(|record| &buf[record]),
+        )
+    }
+
+    /// Open and lock the log.
+    ///
+    /// The log is opened anew each time, as it may have been replaced
+    /// by [compaction][`Self::compact`] since.
+    fn lock(&self, operation: c_int) -> io::Result<RecordLog>
+    {
+        RecordLog::open_locked(self.state_dir.as_fd(), ACTION_CACHE_FILE, operation)
+    }
+}
+
+impl Index
+{
+    fn new(log: RecordLog) -> Self
+    {
+        Self{log, mapping: Mapping::empty(), scanned: 0, entries: HashMap::new()}
+    }
+
+    fn get(&self, hash: &Hash) -> Option<ActionCacheEntry>
+    {
+        let range = self.entries.get(hash)?;
+        decode(&self.mapping[range.clone()])
+    }
+
+    /// Map and index any records appended since the last refresh.
+    ///
+    /// If the log was replaced since, the new log is indexed instead.
+    fn refresh(&mut self, state_dir: BorrowedFd) -> io::Result<()>
+    {
+        let mut statbuf = fstat(self.log.as_fd())?;
+        while statbuf.st_nlink == 0 {
+            *self = Self::new(RecordLog::open(state_dir, ACTION_CACHE_FILE)?);
+            statbuf = fstat(self.log.as_fd())?;
+        }
+
+        let len = statbuf.st_size as usize;
+        if len > self.mapping.len() {
+            self.mapping = Mapping::new(&self.log, len)?;
+        }
+
+        let base = self.scanned;
+        for (record, end) in records(&self.mapping[base ..]) {
+            let payload = &self.mapping[base + record.start .. base + record.end];
+            if payload.len() >= 33 && payload[0] == VERSION {
+                let hash = Hash(payload[1 .. 33].try_into().unwrap());
+                let entry = base + record.start + 33 .. base + record.end;
+                self.entries.entry(hash).or_insert(entry);
+            }
+            if payload.len() == 33 && payload[0] == EVICTED {
+                let hash = Hash(payload[1 .. 33].try_into().unwrap());
+                self.entries.remove(&hash);
+            }
+            self.scanned = base + end;
+        }
+
+        Ok(())
+    }
+}
+
+/// Encode an action cache record.
+///
+/// The encoding is a version byte, the action hash, the build log hash,
+/// a byte of flags, and the hashes of the outputs.
+/// The number of outputs follows from the length of the record.
+pub (super) fn encode(hash: Hash, entry: &ActionCacheEntry) -> Vec<u8>
+{
+    let ActionCacheEntry{build_log, outputs, warnings} = entry;
+    let mut record = Vec::with_capacity(66 + 32 * outputs.len());
+    record.push(VERSION);
+    record.extend_from_slice(&hash.0);
+    record.extend_from_slice(&build_log.0);
+    record.push(*warnings as u8);
+    for output in outputs {
+        record.extend_from_slice(&output.0);
+    }
+    record
+}
+
+/// Decode an action cache entry, which excludes the version and action hash.
+pub (super) fn decode(buf: &[u8]) -> Option<ActionCacheEntry>
+{
+    let build_log = Hash(buf.get(.. 32)?.try_into().unwrap());
+    let warnings = *buf.get(32)? != 0;
+    let outputs = buf.get(33 ..)?;
+    if outputs.len() % 32 != 0 {
+        return None;
+    }
+    let outputs = outputs.chunks_exact(32)
+        .map(|chunk| Hash(chunk.try_into().unwrap()))
+        .collect();
+    Some(ActionCacheEntry{build_log, outputs, warnings})
+}
+
+/// Read-only shared mapping of a record log.
+///
+/// Record logs are only ever appended to, never truncated;
+/// compaction replaces them with a new file instead.
+/// So the mapped pages remain valid for as long as they are mapped.
+struct Mapping
+{
+    ptr: NonNull<u8>,
+    len: usize,
+}
+
+// SAFETY: The mapping is read-only and owned exclusively.
+unsafe impl Send for Mapping { }
+unsafe impl Sync for Mapping { }
+
+impl Mapping
+{
+    fn empty() -> Self
+    {
+        Self{ptr: NonNull::dangling(), len: 0}
+    }
+
+    fn new(log: &RecordLog, len: usize) -> io::Result<Self>
+    {
+        // SAFETY: See the documentation of this type.
+        let ptr = unsafe { mmap(len, PROT_READ, MAP_SHARED, log.as_fd(), 0)? };
+        Ok(Self{ptr, len})
+    }
+}
+
+impl Deref for Mapping
+{
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8]
+    {
+        // SAFETY: The mapping is readable and len bytes long.
+        unsafe { slice::from_raw_parts(self.ptr.as_ptr(), self.len) }
+    }
+}
+
+impl Drop for Mapping
+{
+    fn drop(&mut self)
+    {
+        if self.len != 0 {
+            // SAFETY: The mapping is no longer borrowed.
+            unsafe { munmap(self.ptr, self.len) }
+                .expect("munmap should not fail on a valid mapping");
+        }
+    }
+}
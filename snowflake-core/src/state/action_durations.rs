@@ -0,0 +1,121 @@
+use {
+    super::{ACTION_DURATIONS_FILE, State, record_log::{RecordLog, records}},
+    os_ext::{LOCK_EX, LOCK_SH},
+    snowflake_util::hash::Hash,
+    std::{
+        collections::HashMap,
+        io,
+        os::{raw::c_int, unix::io::AsFd},
+        sync::Mutex,
+        time::Duration,
+    },
+};
+
+/// Wall times of actions that were performed, keyed by arbitrary hashes.
+///
+/// The driver uses these to estimate how long performing an action takes,
+/// so that it can start actions on the critical path early.
+///
+/// The durations are persisted as a [record log] in the state directory,
+/// each record of which consists of a key and a duration in nanoseconds.
+/// Later records take precedence over earlier records with the same key.
+/// It is read into memory when it is first used, and compacted then
+/// if it holds many more records than there are keys.
+///
+/// [record log]: `RecordLog`
+pub (super) struct ActionDurations
+{
+    durations: Mutex<HashMap<Hash, Duration>>,
+}
+
+/// How many superseded records the log may hold before it is compacted,
+/// in addition to one for each key.
+const COMPACTION_SLACK: usize = 1024;
+
+impl State
+{
+    /// Look up the most recently recorded duration for a key.
+    pub fn action_duration(&self, key: Hash) -> io::Result<Option<Duration>>
+    {
+        let durations = self.action_durations()?;
+        Ok(durations.durations.lock().unwrap().get(&key).copied())
+    }
+
+    /// Record how long it took to perform an action.
+    ///
+    /// The key should identify the action across builds,
+    /// preferably without depending on the contents of its inputs,
+    /// as actions are typically performed because their inputs changed.
+    pub fn record_action_duration(&self, key: Hash, duration: Duration)
+        -> io::Result<()>
+    {
+        let durations = self.action_durations()?;
+        self.lock_action_durations(LOCK_SH)?.append(&encode(key, duration))?;
+        durations.durations.lock().unwrap().insert(key, duration);
+        Ok(())
+    }
+
+    /// Handle to the recorded action durations.
+    fn action_durations(&self) -> io::Result<&ActionDurations>
+    {
+        self.action_durations.get_or_try_init(|| {
+            let buf = self.lock_action_durations(LOCK_SH)?.read()?;
+            let (durations, count) = decode(&buf);
+            if count <= 2 * durations.len() + COMPACTION_SLACK {
+                return Ok(ActionDurations{durations: Mutex::new(durations)});
+            }
+
+            // Records may have been appended since we read the log.
+            let log = self.lock_action_durations(LOCK_EX)?;
+            let (durations, _) = decode(&log.read()?);
+            let records: Vec<_> =
+                durations.iter()
+                .map(|(&key, &duration)| encode(key, duration))
+                .collect();
+            RecordLog::replace(
+                self.state_dir.as_fd(), ACTION_DURATIONS_FILE,
+                self.scratches_dir()?, &self.fresh_scratch(),
+                records.iter().map(|record| &record[..]),
+            )?;
+            Ok(ActionDurations{durations: Mutex::new(durations)})
+        })
+    }
+
+    /// Open and lock the record log of action durations.
+    ///
+    /// The log is opened anew each time, as it may have been replaced
+    /// by compaction since.
+    fn lock_action_durations(&self, operation: c_int) -> io::Result<RecordLog>
+    {
+        let dirfd = self.state_dir.as_fd();
+        RecordLog::open_locked(dirfd, ACTION_DURATIONS_FILE, operation)
+    }
+}
+
+/// Encode a record of the log of action durations.
+fn encode(key: Hash, duration: Duration) -> [u8; 40]
+{
+    // Durations of over 584 years are clamped, which is fine.
+    let nanos = u64::try_from(duration.as_nanos()).unwrap_or(u64::MAX);
+    let mut record = [0; 40];
+    record[.. 32].copy_from_slice(&key.0);
+    record[32 ..].copy_from_slice(&nanos.to_le_bytes());
+    record
+}
+
+/// Read the latest duration for each key, and count the records.
+fn decode(buf: &[u8]) -> (HashMap<Hash, Duration>, usize)
+{
+    let mut count = 0;
+    let durations =
+        records(buf)
+        .inspect(|_| count += 1)
+        .filter_map(|(record, _)| {
+            let record = &buf[record];
+            let key = Hash(record.get(.. 32)?.try_into().ok()?);
+            let nanos = record.get(32 ..)?.try_into().ok()?;
+            Some((key, Duration::from_nanos(u64::from_le_bytes(nanos))))
+        })
+        .collect();
+    (durations, count)
+}
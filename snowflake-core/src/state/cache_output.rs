@@ -2,12 +2,18 @@ use {
     super::{State, hash_to_path, ok_if_already_exists},
     bitflags::bitflags,
     os_ext::{
+        AT_SYMLINK_NOFOLLOW,
         S_IFDIR, S_IFLNK, S_IFMT, S_IFREG, S_ISGID, S_ISUID, S_ISVTX,
-        RENAME_NOREPLACE,
-        renameat2, stat,
+        RENAME_NOREPLACE, UTIME_NOW, UTIME_OMIT,
+        fstatat, renameat2, stat, timespec, utimensat,
+    },
+    snowflake_util::hash::{Hash, WrittenFile, hash_file_at_with},
+    std::{
+        ffi::CStr,
+        fmt,
+        io::{self, ErrorKind::NotFound},
+        os::unix::io::BorrowedFd,
     },
-    snowflake_util::hash::{Hash, hash_file_at_with},
-    std::{ffi::CStr, fmt, io, os::unix::io::BorrowedFd},
     thiserror::Error,
 };
 
@@ -17,32 +23,56 @@ use {
 
 impl State
 {
-    /// Implementation of [`cache_output`][`Self::cache_output`].
+    /// Implementation of [`cache_output_dedup`][`Self::cache_output_dedup`].
     pub (super) fn cache_output_impl(
         &self,
         dirfd: Option<BorrowedFd>,
         pathname: &CStr,
-    ) -> Result<Hash, CacheOutputError>
+        written: Option<WrittenFile>,
+    ) -> Result<(Hash, bool), CacheOutputError>
     {
-        // Hash the output and check its properties.
-        let hash = hash_file_at_with(dirfd, pathname, |statbuf| {
+        let check = |statbuf: &stat| {
             let error = Self::check_output(statbuf);
             if error.is_empty() {
                 Ok(())
             } else {
                 Err(io::Error::other(error))
             }
-        })?;
+        };
+
+        // Hash the output and check its properties.
+        // Outputs hashed while they were written need not be read,
+        // unless they were changed since in ways that we can see.
+        let hash = match written {
+            Some(written) => {
+                let statbuf = fstatat(dirfd, pathname, AT_SYMLINK_NOFOLLOW)?;
+                check(&statbuf)?;
+                if written.matches(&statbuf) {
+                    written.hash
+                } else {
+                    hash_file_at_with(dirfd, pathname, check)?
+                }
+            },
+            None => hash_file_at_with(dirfd, pathname, check)?,
+        };
 
         // Move the output to the cache.
+        // If it was already cached, the garbage collector must learn
+        // that it is in use again, or it could evict it. But it may
+        // also have been evicted just now, in which case we try again.
         let cache = self.output_cache_dir()?;
-        renameat2(
-            dirfd, pathname,
-            Some(cache), &hash_to_path(&hash),
-            RENAME_NOREPLACE,
-        ).or_else(ok_if_already_exists)?;
-
-        Ok(hash)
+        let path = hash_to_path(&hash);
+        loop {
+            match renameat2(dirfd, pathname, Some(cache), &path, RENAME_NOREPLACE) {
+                Ok(()) => return Ok((hash, false)),
+                Err(err) => ok_if_already_exists(err)?,
+            }
+            match touch_output(cache, &path) {
+                Ok(()) => return Ok((hash, true)),
+                Err(err) if err.kind() == NotFound => continue,
+                Err(err) => return Err(err.into()),
+            }
+        }
     }
 
     /// Check that the properties of an output look reasonable.
@@ -89,6 +119,23 @@ impl State
     }
 }
 
+/// Update the ctime of a cached output to the current time.
+///
+/// The garbage collector does not evict outputs cached recently,
+/// and this makes the output look like it was. Only the access time
+/// is set, which nothing relies on, so the output is not changed.
+/// This takes a single system call, which fails with `ENOENT`
+/// if the output is not cached, for instance because it was evicted.
+pub (super) fn touch_output(output_cache: BorrowedFd, path: &CStr)
+    -> io::Result<()>
+{
+    let times = [
+        timespec{tv_sec: 0, tv_nsec: UTIME_NOW},
+        timespec{tv_sec: 0, tv_nsec: UTIME_OMIT},
+    ];
+    utimensat(Some(output_cache), path, &times, AT_SYMLINK_NOFOLLOW)
+}
+
 /* -------------------------------------------------------------------------- */
 /*                             Cache output error                             */
 /* -------------------------------------------------------------------------- */
@@ -221,4 +268,54 @@ mod tests
         test_case(&state, scratch, cstr!(b"link1"),   Oe::MULTIPLE_HARD_LINKS);
         test_case(&state, scratch, cstr!(b"link2"),   Oe::MULTIPLE_HARD_LINKS);
     }
+
+    #[test]
+    fn dedup()
+    {
+        // Create state directory.
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+
+        // Create scratch directory.
+        let state = State::open(&path).unwrap();
+        let scratch = state.new_scratch_dir().unwrap();
+        let scratch = Some(scratch.as_fd());
+
+        // Create two equivalent files and a different one.
+        mknodat(scratch, cstr!(b"a"), S_IFREG | 0o644, 0).unwrap();
+        mknodat(scratch, cstr!(b"b"), S_IFREG | 0o644, 0).unwrap();
+        mknodat(scratch, cstr!(b"c"), S_IFREG | 0o755, 0).unwrap();
+
+        // Only the first of the equivalent files is new to the cache.
+        let (a, a_cached) = state.cache_output_dedup(scratch, cstr!(b"a")).unwrap();
+        let (b, b_cached) = state.cache_output_dedup(scratch, cstr!(b"b")).unwrap();
+        let (c, c_cached) = state.cache_output_dedup(scratch, cstr!(b"c")).unwrap();
+        assert_eq!((a_cached, b_cached, c_cached), (false, true, false));
+        assert_eq!(a, b);
+        assert_ne!(a, c);
+    }
+
+    #[test]
+    fn written()
+    {
+        // Create state directory.
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+
+        // Create scratch directory.
+        let state = State::open(&path).unwrap();
+        let scratch = state.new_scratch_dir().unwrap();
+        let scratch = Some(scratch.as_fd());
+
+        // The recorded hash of an unchanged file is trusted,
+        // even if it is wrong, which shows that the file is not read.
+        mknodat(scratch, cstr!(b"a"), S_IFREG | 0o644, 0).unwrap();
+        let bogus = Hash([1; 32]);
+        let written = WrittenFile{hash: bogus, executable: false, size: 0};
+        let (a, _) = state.cache_written_output(scratch, cstr!(b"a"), written).unwrap();
+        assert_eq!(a, bogus);
+
+        // Files that changed since they were written are hashed.
+        mknodat(scratch, cstr!(b"b"), S_IFREG | 0o755, 0).unwrap();
+        let (b, _) = state.cache_written_output(scratch, cstr!(b"b"), written).unwrap();
+        assert_ne!(b, bogus);
+    }
 }
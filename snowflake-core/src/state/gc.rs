@@ -0,0 +1,746 @@
+use {
+    super::{
+        ActionCacheEntry, LEGACY_ACTION_CACHE_DIR, OUTPUT_USES_FILE,
+        SCRATCHES_DIR, State,
+        hash_to_path,
+        record_log::{RecordLog, records},
+    },
+    os_ext::{
+        AT_REMOVEDIR, AT_SYMLINK_FOLLOW, AT_SYMLINK_NOFOLLOW,
+        LOCK_EX, LOCK_NB, LOCK_SH,
+        O_DIRECTORY, O_NOFOLLOW, O_RDONLY, O_RDWR, O_TMPFILE,
+        RENAME_NOREPLACE, S_IFDIR, S_IFMT,
+        cstr, fchmod, fdopendir, flock, fstatat, linkat, openat, readdir,
+        renameat2, unlinkat,
+        io::magic_link,
+    },
+    snowflake_util::hash::Hash,
+    std::{
+        collections::{HashMap, HashSet},
+        ffi::{CStr, CString},
+        fs::File,
+        io::{self, BufReader, ErrorKind::{NotFound, WouldBlock}},
+        iter,
+        os::{raw::c_int, unix::io::{AsFd, BorrowedFd, OwnedFd}},
+        time::{Duration, SystemTime, UNIX_EPOCH},
+    },
+};
+
+/// What [`State::collect_garbage`] removed.
+#[derive(Debug, Default)]
+pub struct GarbageReport
+{
+    /// The number of outputs removed from the output cache.
+    pub outputs: usize,
+
+    /// The number of action cache entries removed because
+    /// they referred to outputs that were removed.
+    pub actions: usize,
+
+    /// The disk space taken up by the removed outputs, in bytes.
+    pub bytes: u64,
+}
+
+/// Output in the output cache, as seen by the garbage collector.
+struct Candidate
+{
+    name: CString,
+
+    /// When the output was last used or cached, in seconds since the epoch.
+    used: u64,
+
+    /// How much disk space the output takes up, in bytes.
+    size: u64,
+}
+
+/* -------------------------------------------------------------------------- */
+/*                               Output cache                                 */
+/* -------------------------------------------------------------------------- */
+
+impl State
+{
+    /// Record that outputs were used by a build.
+    ///
+    /// The garbage collector evicts the outputs used least recently.
+    /// Uses are persisted as a [record log] in the state directory,
+    /// each record of which consists of a timestamp in seconds
+    /// followed by the hashes of the outputs used at that time.
+    /// Outputs used by the same build should be recorded at once,
+    /// so that recording them costs only a single write.
+    /// The garbage collector compacts the log to the latest use
+    /// of each output, so it does not grow without bound.
+    ///
+    /// [record log]: `RecordLog`
+    pub fn record_output_uses(&self, hashes: &[Hash]) -> io::Result<()>
+    {
+        let now = unix_seconds(SystemTime::now());
+        self.lock_output_uses(LOCK_SH)?.append(&uses_record(now, hashes))
+    }
+
+    /// Evict outputs from the output cache until it fits in a budget.
+    ///
+    /// Outputs are evicted in the order in which they were last used,
+    /// as [recorded][`Self::record_output_uses`], or cached if that was
+    /// more recent. Outputs used or cached less than `min_age` ago are
+    /// never evicted, even if that means the budget is exceeded.
+    /// Finding an action in the cache touches its outputs, as caching
+    /// them does, so builds that are running concurrently keep their
+    /// outputs for at least `min_age`, although their uses are not
+    /// recorded until the builds finish.
+    ///
+    /// Action cache entries that refer to an evicted output are removed
+    /// before the output is, so later lookups of those actions miss.
+    /// The action cache and the log of output uses are then compacted.
+    /// Other processes may find such entries in their index of the
+    /// action cache until they refresh it, but they miss when they
+    /// find that the outputs of such entries no longer exist.
+    pub fn collect_garbage(&self, budget: u64, min_age: Duration)
+        -> io::Result<GarbageReport>
+    {
+        let now = SystemTime::now();
+        let threshold = unix_seconds(now.checked_sub(min_age).unwrap_or(UNIX_EPOCH));
+
+        // Find out when each output was last used.
+        let mut candidates = self.garbage_candidates()?;
+        let total: u64 = candidates.iter().map(|c| c.size).sum();
+        candidates.sort_by_key(|c| c.used);
+
+        // Pick the least recently used outputs that are old enough.
+        // Their sizes are reported only once they are actually removed.
+        let mut evicted = HashMap::new();
+        let mut report = GarbageReport::default();
+        let mut remaining = total;
+        for candidate in candidates {
+            if remaining <= budget || candidate.used > threshold {
+                break;
+            }
+            remaining -= candidate.size;
+            evicted.insert(candidate.name, candidate.size);
+        }
+        if evicted.is_empty() {
+            self.compact_output_uses(&HashSet::new())?;
+            self.compact_action_cache()?;
+            return Ok(report);
+        }
+        *self.empty_build_log.lock().unwrap() = None;
+
+        // Remove the action cache entries that refer to the outputs.
+        let action_cache = self.action_cache()?;
+        for (hash, entry) in action_cache.entries()? {
+            let refers = iter::once(&entry.build_log).chain(&entry.outputs)
+                .any(|output| evicted.contains_key(&*hash_to_path(output)));
+            if refers {
+                action_cache.evict(hash)?;
+                report.actions += 1;
+            }
+        }
+        report.actions += self.evict_legacy_actions(&evicted)?;
+
+        // An output may have been cached again since we looked at it,
+        // by an action whose entry we did not see, so look again.
+        // Caching an output that is already cached updates its ctime,
+        // as does finding an action that refers to it.
+        // The output is moved out of the cache before it is removed,
+        // so that nobody sees a partially removed output.
+        let output_cache = self.output_cache_dir()?;
+        let scratches_dir = self.scratches_dir()?;
+        let mut removed = HashSet::new();
+        for (name, size) in evicted {
+            match output_ctime(output_cache, &name) {
+                Ok(ctime) if ctime > threshold => continue,
+                Ok(_) => (),
+                Err(err) if err.kind() == NotFound => continue,
+                Err(err) => return Err(err),
+            }
+            let trash = self.fresh_scratch();
+            match renameat2(Some(output_cache), &name, Some(scratches_dir), &trash, RENAME_NOREPLACE) {
+                Ok(()) => (),
+                Err(err) if err.kind() == NotFound => continue,
+                Err(err) => return Err(err),
+            }
+            remove_recursively(scratches_dir, &trash)?;
+            report.outputs += 1;
+            report.bytes += size;
+            removed.insert(name);
+        }
+
+        self.compact_output_uses(&removed)?;
+        self.compact_action_cache()?;
+        Ok(report)
+    }
+
+    /// Every output in the output cache, along with when it was last used.
+    fn garbage_candidates(&self) -> io::Result<Vec<Candidate>>
+    {
+        let buf = self.lock_output_uses(LOCK_SH)?.read()?;
+        let uses: HashMap<CString, u64> =
+            latest_uses(&buf).into_iter()
+            .map(|(hash, time)| ((*hash_to_path(&hash)).to_owned(), time))
+            .collect();
+
+        let output_cache = self.output_cache_dir()?;
+        let dir = openat(Some(output_cache), cstr!(b"."), O_DIRECTORY | O_RDONLY, 0)?;
+        let mut dir = fdopendir(dir)?;
+        let mut candidates = Vec::new();
+        while let Some(entry) = readdir(&mut dir)? {
+            let name = entry.d_name;
+            if matches!(name.as_bytes(), b"." | b"..") {
+                continue;
+            }
+            let ctime = match output_ctime(output_cache, &name) {
+                Ok(ctime) => ctime,
+                Err(err) if err.kind() == NotFound => continue,
+                Err(err) => return Err(err),
+            };
+            let used = uses.get(&name).map_or(ctime, |&used| used.max(ctime));
+            let size = disk_usage(output_cache, &name)?;
+            candidates.push(Candidate{name, used, size});
+        }
+
+        Ok(candidates)
+    }
+
+    /// Remove entries from the legacy action cache that refer to outputs.
+    ///
+    /// Otherwise they would be migrated to the action cache when looked up.
+    fn evict_legacy_actions(&self, evicted: &HashMap<CString, u64>)
+        -> io::Result<usize>
+    {
+        let dirfd = Some(self.state_dir.as_fd());
+        let dir = match openat(dirfd, LEGACY_ACTION_CACHE_DIR, O_DIRECTORY | O_RDONLY, 0) {
+            Ok(dir) => dir,
+            Err(err) if err.kind() == NotFound => return Ok(0),
+            Err(err) => return Err(err),
+        };
+        let mut dir = fdopendir(dir)?;
+
+        let mut stale = Vec::new();
+        while let Some(entry) = readdir(&mut dir)? {
+            let name = entry.d_name;
+            if matches!(name.as_bytes(), b"." | b"..") {
+                continue;
+            }
+            let file = match openat(Some(dir.as_fd()), &name, O_RDONLY, 0) {
+                Ok(file) => file,
+                Err(err) if err.kind() == NotFound => continue,
+                Err(err) => return Err(err),
+            };
+            let entry: ActionCacheEntry =
+                serde_json::from_reader(BufReader::new(File::from(file)))?;
+            let refers = iter::once(&entry.build_log).chain(&entry.outputs)
+                .any(|output| evicted.contains_key(&*hash_to_path(output)));
+            if refers {
+                stale.push(name);
+            }
+        }
+
+        for name in &stale {
+            match unlinkat(Some(dir.as_fd()), name, 0) {
+                Err(err) if err.kind() != NotFound => return Err(err),
+                _ => (),
+            }
+        }
+
+        Ok(stale.len())
+    }
+
+    /// Rewrite the log of output uses with only the latest use of each output.
+    ///
+    /// Uses of removed outputs are left out. The compacted log is written
+    /// to a scratch file, which then replaces the log. Others lock the log
+    /// before they append to it, and the log stays locked until it is
+    /// replaced, so no uses are lost; see [`Self::lock_output_uses`].
+    fn compact_output_uses(&self, removed: &HashSet<CString>)
+        -> io::Result<()>
+    {
+        let log = self.lock_output_uses(LOCK_EX)?;
+        let buf = log.read()?;
+
+        let mut uses: Vec<(u64, Hash)> =
+            latest_uses(&buf).into_iter()
+            .filter(|(hash, _)| !removed.contains(&*hash_to_path(hash)))
+            .map(|(hash, time)| (time, hash))
+            .collect();
+        uses.sort_unstable_by_key(|&(time, hash)| (time, hash.0));
+
+        // Uses at the same time share a record, as when they were recorded.
+        let mut records = Vec::new();
+        let mut hashes = Vec::new();
+        for (i, &(time, hash)) in uses.iter().enumerate() {
+            hashes.push(hash);
+            if uses.get(i + 1).map_or(true, |&(next, _)| next != time) {
+                records.push(uses_record(time, &hashes));
+                hashes.clear();
+            }
+        }
+
+        let scratches_dir = self.scratches_dir()?;
+        RecordLog::replace(
+            self.state_dir.as_fd(), OUTPUT_USES_FILE,
+            scratches_dir, &self.fresh_scratch(),
+            records.iter().map(Vec::as_slice),
+        )
+    }
+
+    /// Rewrite the action cache without the entries that were removed.
+    ///
+    /// Removing an entry appends a record to the action cache,
+    /// so without compaction it would only ever grow.
+    fn compact_action_cache(&self) -> io::Result<()>
+    {
+        let scratches_dir = self.scratches_dir()?;
+        self.action_cache()?.compact(scratches_dir, &self.fresh_scratch())
+    }
+
+    /// Open and lock the record log of output uses.
+    ///
+    /// The log is opened anew each time, as it may have been replaced
+    /// by [compaction][`Self::compact_output_uses`] since.
+    fn lock_output_uses(&self, operation: c_int) -> io::Result<RecordLog>
+    {
+        RecordLog::open_locked(self.state_dir.as_fd(), OUTPUT_USES_FILE, operation)
+    }
+}
+
+/// Encode a record of the log of output uses.
+fn uses_record(time: u64, hashes: &[Hash]) -> Vec<u8>
+{
+    let mut record = Vec::with_capacity(8 + 32 * hashes.len());
+    record.extend_from_slice(&time.to_le_bytes());
+    for hash in hashes {
+        record.extend_from_slice(&hash.0);
+    }
+    record
+}
+
+/// When each output in the log of output uses was last used.
+fn latest_uses(buf: &[u8]) -> HashMap<Hash, u64>
+{
+    let mut uses = HashMap::new();
+    for (record, _) in records(buf) {
+        let record = &buf[record];
+        let Some(time) = record.get(.. 8) else { continue };
+        let time = u64::from_le_bytes(time.try_into().unwrap());
+        for hash in record[8 ..].chunks_exact(32) {
+            let hash = Hash(hash.try_into().unwrap());
+            let used = uses.entry(hash).or_insert(time);
+            *used = time.max(*used);
+        }
+    }
+    uses
+}
+
+/* -------------------------------------------------------------------------- */
+/*                             Orphaned scratches                             */
+/* -------------------------------------------------------------------------- */
+
+/// Suffix of the lock files in the scratches directory.
+const LOCK_SUFFIX: &[u8] = b".lock";
+
+/// Create and lock the lock file for the scratches of an instance.
+///
+/// The lock is held for as long as the returned file descriptor is open,
+/// which tells [`State::reap_scratches`] that the instance is alive.
+/// The lock file is locked before it is given its name,
+/// so that it is never seen unlocked while the instance is alive.
+pub (super) fn lock_scratches(scratches_dir: BorrowedFd, unique_id: &str)
+    -> io::Result<OwnedFd>
+{
+    let lock = openat(Some(scratches_dir), cstr!(b"."), O_TMPFILE | O_RDWR, 0o644)?;
+    flock(lock.as_fd(), LOCK_EX)?;
+    let path = CString::new([unique_id.as_bytes(), LOCK_SUFFIX].concat()).unwrap();
+    linkat(
+        None, &magic_link(lock.as_fd()),
+        Some(scratches_dir), &path,
+        AT_SYMLINK_FOLLOW,
+    )?;
+    Ok(lock)
+}
+
+impl State
+{
+    /// Remove scratch files left behind by instances that are gone.
+    ///
+    /// Scratch files are named after the instance that created them.
+    /// Each instance holds a lock on a lock file named after it,
+    /// from before it creates its first scratch file until it exits,
+    /// so the scratch files of an instance whose lock file is not locked
+    /// can be removed safely, along with the lock file itself.
+    /// Scratch files of the current instance,
+    /// and of instances that are still running, are left alone.
+    ///
+    /// Reaping does not create a lock file for the current instance,
+    /// so an instance that only reaps leaves nothing behind.
+    ///
+    /// This may take a while, so consider doing it on a separate thread.
+    /// Returns the number of scratch files that were removed.
+    pub fn reap_scratches(&self) -> io::Result<usize>
+    {
+        let scratches_dir =
+            self.ensure_open_dir_once(&self.scratches_dir, SCRATCHES_DIR)?;
+        let dir = openat(Some(scratches_dir), cstr!(b"."), O_DIRECTORY | O_RDONLY, 0)?;
+        let mut dir = fdopendir(dir)?;
+        let mut names = Vec::new();
+        while let Some(entry) = readdir(&mut dir)? {
+            let name = entry.d_name;
+            if !matches!(name.as_bytes(), b"." | b"..") {
+                names.push(name);
+            }
+        }
+
+        // Scratch files are named "{unique_id}-{n}".
+        // Whether an owner is alive is checked once per owner.
+        // Lock files are checked too, as their owner may have
+        // exited without leaving behind any scratch files.
+        let mut alive = HashMap::new();
+        let mut dead_locks = Vec::new();
+        let mut reaped = 0;
+        for name in &names {
+            let bytes = name.as_bytes();
+            let lock_path = if bytes.ends_with(LOCK_SUFFIX) {
+                name.clone()
+            } else {
+                let owner = match bytes.iter().rposition(|&b| b == b'-') {
+                    Some(dash) => &bytes[.. dash],
+                    None => bytes,
+                };
+                CString::new([owner, LOCK_SUFFIX].concat()).unwrap()
+            };
+            let is_alive = match alive.get(&lock_path) {
+                Some(&is_alive) => is_alive,
+                None => {
+                    let (is_alive, lock) = owner_alive(scratches_dir, &lock_path)?;
+                    if let Some(lock) = lock {
+                        dead_locks.push((lock_path.clone(), lock));
+                    }
+                    alive.insert(lock_path, is_alive);
+                    is_alive
+                },
+            };
+            if !is_alive && !bytes.ends_with(LOCK_SUFFIX) {
+                remove_recursively(scratches_dir, name)?;
+                reaped += 1;
+            }
+        }
+
+        // Lock files of dead owners whose scratches were all removed.
+        // They are still locked by us, so no one else reaps them meanwhile.
+        for (lock_path, _lock) in dead_locks {
+            match unlinkat(Some(scratches_dir), &lock_path, 0) {
+                Err(err) if err.kind() != NotFound => return Err(err),
+                _ => (),
+            }
+        }
+
+        Ok(reaped)
+    }
+}
+
+/// Whether the owner of a lock file is alive.
+///
+/// If the owner is dead, the lock file is returned, locked by us.
+/// Owners without a lock file are dead; they predate lock files.
+fn owner_alive(scratches_dir: BorrowedFd, lock_path: &CStr)
+    -> io::Result<(bool, Option<OwnedFd>)>
+{
+    let lock = match openat(Some(scratches_dir), lock_path, O_RDONLY, 0) {
+        Ok(lock) => lock,
+        Err(err) if err.kind() == NotFound => return Ok((false, None)),
+        Err(err) => return Err(err),
+    };
+    match flock(lock.as_fd(), LOCK_EX | LOCK_NB) {
+        Ok(()) => Ok((false, Some(lock))),
+        Err(err) if err.kind() == WouldBlock => Ok((true, None)),
+        Err(err) => Err(err),
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                 Utilities                                  */
+/* -------------------------------------------------------------------------- */
+
+/// The time at which an output was cached, in seconds since the epoch.
+///
+/// Moving an output into the output cache changes its ctime.
+fn output_ctime(output_cache: BorrowedFd, name: &CStr) -> io::Result<u64>
+{
+    let statbuf = fstatat(Some(output_cache), name, AT_SYMLINK_NOFOLLOW)?;
+    Ok(statbuf.st_ctime.try_into().unwrap_or(0))
+}
+
+fn unix_seconds(time: SystemTime) -> u64
+{
+    time.duration_since(UNIX_EPOCH).map_or(0, |d| d.as_secs())
+}
+
+/// The disk space taken up by a file, or a directory and its contents.
+fn disk_usage(dirfd: BorrowedFd, path: &CStr) -> io::Result<u64>
+{
+    let statbuf = fstatat(Some(dirfd), path, AT_SYMLINK_NOFOLLOW)?;
+    let mut usage = statbuf.st_blocks as u64 * 512;
+    if statbuf.st_mode & S_IFMT == S_IFDIR {
+        let dir = openat(Some(dirfd), path, O_DIRECTORY | O_NOFOLLOW | O_RDONLY, 0)?;
+        let mut dir = fdopendir(dir)?;
+        while let Some(entry) = readdir(&mut dir)? {
+            let name = entry.d_name;
+            if !matches!(name.as_bytes(), b"." | b"..") {
+                usage += disk_usage(dir.as_fd(), &name)?;
+            }
+        }
+    }
+    Ok(usage)
+}
+
+/// Remove a file, or a directory and its contents.
+///
+/// Directories are made writable first, as commands may leave behind
+/// directories from which nothing could otherwise be removed.
+/// Files that no longer exist are not an error.
+fn remove_recursively(dirfd: BorrowedFd, path: &CStr) -> io::Result<()>
+{
+    let statbuf = match fstatat(Some(dirfd), path, AT_SYMLINK_NOFOLLOW) {
+        Ok(statbuf) => statbuf,
+        Err(err) if err.kind() == NotFound => return Ok(()),
+        Err(err) => return Err(err),
+    };
+
+    let flags = if statbuf.st_mode & S_IFMT == S_IFDIR {
+        let dir = openat(Some(dirfd), path, O_DIRECTORY | O_NOFOLLOW | O_RDONLY, 0)?;
+        fchmod(dir.as_fd(), 0o700)?;
+        let mut dir = fdopendir(dir)?;
+        let mut names = Vec::new();
+        while let Some(entry) = readdir(&mut dir)? {
+            let name = entry.d_name;
+            if !matches!(name.as_bytes(), b"." | b"..") {
+                names.push(name);
+            }
+        }
+        for name in names {
+            remove_recursively(dir.as_fd(), &name)?;
+        }
+        AT_REMOVEDIR
+    } else {
+        0
+    };
+
+    match unlinkat(Some(dirfd), path, flags) {
+        Err(err) if err.kind() != NotFound => Err(err),
+        _ => Ok(()),
+    }
+}
+
+#[cfg(test)]
+mod tests
+{
+    use {
+        super::*,
+        crate::state::ACTION_CACHE_FILE,
+        os_ext::{O_CREAT, O_WRONLY, cstring, mkdirat, mkdtemp},
+        std::{io::Write, thread},
+    };
+
+    /// Cache an output with the given contents.
+    fn cache(state: &State, content: &[u8]) -> Hash
+    {
+        let scratch = state.new_scratch_dir().unwrap();
+        let file = openat(Some(scratch.as_fd()), cstr!(b"output"), O_CREAT | O_WRONLY, 0o644).unwrap();
+        File::from(file).write_all(content).unwrap();
+        state.cache_output(Some(scratch.as_fd()), cstr!(b"output")).unwrap()
+    }
+
+    #[test]
+    fn collect_garbage()
+    {
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+
+        let build_log = cache(&state, b"build log\n");
+        let output = cache(&state, &[0; 8192]);
+        let entry = ActionCacheEntry{build_log, outputs: vec![output], warnings: false};
+        state.cache_action(Hash([1; 32]), &entry).unwrap();
+        state.record_output_uses(&[build_log, output]).unwrap();
+        let other = State::open(&path).unwrap();
+        assert!(other.cached_action(Hash([1; 32])).unwrap().is_some());
+
+        // Outputs that fit in the budget are kept.
+        let report = state.collect_garbage(u64::MAX, Duration::ZERO).unwrap();
+        assert_eq!(report.outputs, 0);
+
+        // Recently used outputs are kept.
+        let report = state.collect_garbage(0, Duration::from_secs(3600)).unwrap();
+        assert_eq!(report.outputs, 0);
+
+        // Otherwise outputs are evicted along with their actions.
+        let report = state.collect_garbage(0, Duration::ZERO).unwrap();
+        assert_eq!(report.outputs, 2);
+        assert_eq!(report.actions, 1);
+        assert!(report.bytes >= 8192);
+        assert!(state.cached_action(Hash([1; 32])).unwrap().is_none());
+        let (dirfd, output_path) = state.cached_output(output).unwrap();
+        let result = fstatat(Some(dirfd), &output_path, AT_SYMLINK_NOFOLLOW);
+        assert!(matches!(result, Err(err) if err.kind() == NotFound));
+
+        // Other instances do not find the action either,
+        // even though they have yet to learn that it was evicted.
+        assert!(other.cached_action(Hash([1; 32])).unwrap().is_none());
+
+        // Evicted actions are looked up normally once cached again.
+        let build_log = cache(&state, b"build log\n");
+        let output = cache(&state, &[0; 8192]);
+        let entry = ActionCacheEntry{build_log, outputs: vec![output], warnings: false};
+        state.cache_action(Hash([1; 32]), &entry).unwrap();
+        let reopened = State::open(&path).unwrap();
+        assert!(reopened.cached_action(Hash([1; 32])).unwrap().is_some());
+    }
+
+    #[test]
+    fn collect_garbage_after_hit()
+    {
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+
+        let build_log = cache(&state, b"build log\n");
+        let output = cache(&state, b"output\n");
+        let entry = ActionCacheEntry{build_log, outputs: vec![output], warnings: false};
+        state.cache_action(Hash([1; 32]), &entry).unwrap();
+
+        // The outputs were cached longer ago than the minimum age,
+        // but a build that is still running has just found them.
+        thread::sleep(Duration::from_millis(2100));
+        let build = State::open(&path).unwrap();
+        assert!(build.cached_action(Hash([1; 32])).unwrap().is_some());
+
+        // Another instance collects garbage before the build uses them.
+        let min_age = Duration::from_secs(1);
+        let report = state.collect_garbage(0, min_age).unwrap();
+        assert_eq!(report.outputs, 0);
+        assert_eq!(report.bytes, 0);
+        let (dirfd, output_path) = build.cached_output(output).unwrap();
+        fstatat(Some(dirfd), &output_path, AT_SYMLINK_NOFOLLOW).unwrap();
+
+        // Once the minimum age has passed, they are evicted after all.
+        thread::sleep(Duration::from_millis(2100));
+        let report = state.collect_garbage(0, min_age).unwrap();
+        assert_eq!(report.outputs, 2);
+        assert!(report.bytes > 0);
+    }
+
+    #[test]
+    fn compact_output_uses()
+    {
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+        let other = State::open(&path).unwrap();
+
+        let a = cache(&state, b"a\n");
+        let b = cache(&state, b"b\n");
+        for _ in 0 .. 3 {
+            state.record_output_uses(&[a, b]).unwrap();
+        }
+        let used = |state: &State| {
+            let buf = state.lock_output_uses(LOCK_SH).unwrap().read().unwrap();
+            records(&buf).map(|(r, _)| (r.len() - 8) / 32).sum::<usize>()
+        };
+        assert_eq!(used(&state), 6);
+
+        // Only the latest use of each output is kept.
+        state.collect_garbage(u64::MAX, Duration::ZERO).unwrap();
+        assert_eq!(used(&state), 2);
+
+        // Uses are recorded in the compacted log.
+        other.record_output_uses(&[a]).unwrap();
+        assert_eq!(used(&state), 3);
+
+        // Uses of removed outputs are dropped.
+        state.collect_garbage(0, Duration::ZERO).unwrap();
+        assert_eq!(used(&other), 0);
+    }
+
+    #[test]
+    fn compact_action_cache()
+    {
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+        let other = State::open(&path).unwrap();
+        other.action_cache().unwrap();
+
+        let build_log = cache(&state, b"build log\n");
+        let entry = ActionCacheEntry{build_log, outputs: vec![], warnings: false};
+        let missing = ActionCacheEntry{build_log: Hash([9; 32]), ..entry.clone()};
+        let records = || {
+            let log = RecordLog::open(state.state_dir.as_fd(), ACTION_CACHE_FILE).unwrap();
+            records(&log.read().unwrap()).count()
+        };
+
+        // A duplicate entry, and an entry that is evicted when looked up.
+        state.cache_action(Hash([1; 32]), &entry).unwrap();
+        other.cache_action(Hash([1; 32]), &entry).unwrap();
+        state.cache_action(Hash([2; 32]), &missing).unwrap();
+        assert!(state.cached_action(Hash([2; 32])).unwrap().is_none());
+        assert_eq!(records(), 4);
+
+        // Only the record of the remaining entry is kept.
+        state.collect_garbage(u64::MAX, Duration::ZERO).unwrap();
+        assert_eq!(records(), 1);
+
+        // Instances that mapped the old log find entries in the new log.
+        assert!(other.cached_action(Hash([1; 32])).unwrap().is_some());
+        other.cache_action(Hash([3; 32]), &entry).unwrap();
+        assert!(state.cached_action(Hash([3; 32])).unwrap().is_some());
+        assert_eq!(records(), 2);
+    }
+
+    #[test]
+    fn reap_scratches()
+    {
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let alive = State::open(&path).unwrap();
+        let alive_scratch = alive.new_scratch_dir().unwrap();
+
+        // Scratches of an instance that is gone, one of which
+        // has a directory left behind that is not writable.
+        let dead = State::open(&path).unwrap();
+        let dead_scratch = dead.new_scratch_dir().unwrap();
+        mkdirat(Some(dead_scratch.as_fd()), cstr!(b"d"), 0o755).unwrap();
+        let d = openat(Some(dead_scratch.as_fd()), cstr!(b"d"), O_DIRECTORY | O_RDONLY, 0).unwrap();
+        let file = openat(Some(d.as_fd()), cstr!(b"f"), O_CREAT | O_WRONLY, 0o644).unwrap();
+        drop(file);
+        fchmod(d.as_fd(), 0o555).unwrap();
+        drop((d, dead_scratch));
+        dead.new_scratch_dir().unwrap();
+        drop(dead);
+
+        // An instance that is gone without leaving scratches behind.
+        let lonely = State::open(&path).unwrap();
+        lonely.scratches_dir().unwrap();
+        drop(lonely);
+
+        // Scratches from before lock files were introduced.
+        let scratches_dir = alive.scratches_dir().unwrap();
+        mkdirat(Some(scratches_dir), cstr!(b"legacy-0"), 0o755).unwrap();
+
+        let reaper = State::open(&path).unwrap();
+        assert_eq!(reaper.reap_scratches().unwrap(), 3);
+
+        // Only the scratches and lock files of live instances remain.
+        let dir = openat(Some(scratches_dir), cstr!(b"."), O_DIRECTORY | O_RDONLY, 0).unwrap();
+        let mut dir = fdopendir(dir).unwrap();
+        let mut names = Vec::new();
+        while let Some(entry) = readdir(&mut dir).unwrap() {
+            if !matches!(entry.d_name.as_bytes(), b"." | b"..") {
+                names.push(entry.d_name);
+            }
+        }
+        names.sort();
+        // The reaper does not lock scratches it does not create.
+        let alive_id = alive.unique_id.to_string();
+        let mut expected = vec![
+            CString::new(format!("{alive_id}-0")).unwrap(),
+            CString::new(format!("{alive_id}.lock")).unwrap(),
+        ];
+        expected.sort();
+        assert_eq!(names, expected);
+
+        drop(alive_scratch);
+    }
+}
@@ -0,0 +1,97 @@
+use {
+    super::{State, record_log::{RecordLog, records}},
+    snowflake_util::hash::{Hash, hash_file_at, identify_file_at},
+    std::{
+        collections::HashMap,
+        ffi::CStr,
+        io,
+        os::unix::io::BorrowedFd,
+        sync::Mutex,
+        time::SystemTime,
+    },
+};
+
+/// Cache of hashes of input files, keyed by their identities.
+///
+/// This is similar in spirit to the index of Git.
+/// Identifying a file only requires `stat`ing it,
+/// which is much cheaper than reading and hashing it.
+/// See [`identify_file_at`] for how files are identified.
+///
+/// The cache is persisted as a [record log] in the state directory,
+/// each record of which consists of an identity and a hash.
+/// It is read into memory when it is first used.
+///
+/// [record log]: `RecordLog`
+pub (super) struct InputHashes
+{
+    log: RecordLog,
+    hashes: Mutex<HashMap<Hash, Hash>>,
+}
+
+impl InputHashes
+{
+    pub fn open(log: RecordLog) -> io::Result<Self>
+    {
+        let buf = log.read()?;
+        let hashes =
+            records(&buf)
+            .filter_map(|(record, _)| {
+                let record = &buf[record];
+                let fingerprint = Hash(record.get(.. 32)?.try_into().ok()?);
+                let hash = Hash(record.get(32 ..)?.try_into().ok()?);
+                Some((fingerprint, hash))
+            })
+            .collect();
+        Ok(Self{log, hashes: Mutex::new(hashes)})
+    }
+
+    fn get(&self, fingerprint: &Hash) -> Option<Hash>
+    {
+        self.hashes.lock().unwrap().get(fingerprint).copied()
+    }
+
+    fn insert(&self, fingerprint: Hash, hash: Hash) -> io::Result<()>
+    {
+        let mut record = [0; 64];
+        record[.. 32].copy_from_slice(&fingerprint.0);
+        record[32 ..].copy_from_slice(&hash.0);
+        self.log.append(&record)?;
+        self.hashes.lock().unwrap().insert(fingerprint, hash);
+        Ok(())
+    }
+}
+
+impl State
+{
+    /// Compute the hash of an input file.
+    ///
+    /// The result is the same as that of [`hash_file_at`],
+    /// but if the file was hashed before and has not changed since,
+    /// the hash is retrieved from the input hash cache instead.
+    /// Files that changed very recently are not inserted into the cache,
+    /// as their identity does not reliably indicate their contents.
+    pub fn hash_input(&self, dirfd: Option<BorrowedFd>, path: &CStr)
+        -> io::Result<Hash>
+    {
+        let cache = self.input_hashes()?;
+
+        let started = SystemTime::now();
+        let identity = identify_file_at(dirfd, path)?;
+
+        // Racy identities are never inserted into the cache,
+        // and any later change to the file changes its identity.
+        // So if the identity is found, the hash is still valid.
+        if let Some(hash) = cache.get(&identity.fingerprint) {
+            return Ok(hash);
+        }
+
+        let hash = hash_file_at(dirfd, path)?;
+
+        if !identity.is_racy(started) {
+            cache.insert(identity.fingerprint, hash)?;
+        }
+
+        Ok(hash)
+    }
+}
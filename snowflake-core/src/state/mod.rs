@@ -1,37 +1,75 @@
 //! Working with state directories.
 
-pub use self::cache_output::*;
+pub use self::{cache_output::*, gc::*, remote_cache::*};
 
 use {
+    self::{
+        action_cache::ActionCache,
+        action_durations::ActionDurations,
+        cache_output::touch_output,
+        gc::lock_scratches,
+        input_hashes::InputHashes,
+        record_log::RecordLog,
+        remote_cache::Remote,
+    },
     os_ext::{
         AT_SYMLINK_FOLLOW,
-        O_DIRECTORY, O_PATH, O_RDONLY, O_TMPFILE, O_WRONLY,
-        cstr, linkat, mkdirat, open, openat,
+        O_DIRECTORY, O_PATH, O_RDONLY, O_RDWR, O_TMPFILE,
+        RENAME_NOREPLACE,
+        cstr, fstat, linkat, mkdirat, open, openat, renameat2, unlinkat,
         io::magic_link,
     },
     serde::{Deserialize, Serialize},
-    snowflake_util::hash::Hash,
+    snowflake_util::hash::{Hash, HexHash, WrittenFile},
     std::{
         ffi::{CStr, CString},
         fs::File,
-        io::{self, BufReader, ErrorKind::{AlreadyExists, NotFound}, Write},
+        io::{
+            self, BufRead, BufReader, Read, Seek,
+            ErrorKind::{AlreadyExists, NotFound},
+        },
+        iter,
         lazy::SyncOnceCell,
         os::unix::io::{AsFd, BorrowedFd, OwnedFd},
-        sync::atomic::{AtomicU32, Ordering::SeqCst},
+        sync::{Mutex, atomic::{AtomicU32, Ordering::SeqCst}},
     },
     uuid::Uuid,
 };
 
+mod action_cache;
+mod action_durations;
 mod cache_output;
+mod gc;
+mod input_hashes;
+mod record_log;
+mod remote_cache;
 
 // Paths to the different components of the state directory.
 // TODO: Replace with cstr! macro once from_ptr is const.
 const SCRATCHES_DIR: &CStr =
     unsafe { CStr::from_bytes_with_nul_unchecked(b"scratches\0") };
-const ACTION_CACHE_DIR: &CStr =
+const ACTION_CACHE_FILE: &CStr =
+    unsafe { CStr::from_bytes_with_nul_unchecked(b"action-log\0") };
+const LEGACY_ACTION_CACHE_DIR: &CStr =
     unsafe { CStr::from_bytes_with_nul_unchecked(b"action-cache\0") };
 const OUTPUT_CACHE_DIR: &CStr =
     unsafe { CStr::from_bytes_with_nul_unchecked(b"output-cache\0") };
+const TEMPLATES_DIR: &CStr =
+    unsafe { CStr::from_bytes_with_nul_unchecked(b"templates\0") };
+const INPUT_HASHES_FILE: &CStr =
+    unsafe { CStr::from_bytes_with_nul_unchecked(b"input-hashes\0") };
+const ACTION_DURATIONS_FILE: &CStr =
+    unsafe { CStr::from_bytes_with_nul_unchecked(b"action-durations\0") };
+const OUTPUT_USES_FILE: &CStr =
+    unsafe { CStr::from_bytes_with_nul_unchecked(b"output-uses\0") };
+
+/// The zstd compression level for build logs.
+///
+/// Build logs are repetitive, so even fast levels compress them well.
+const BUILD_LOG_COMPRESSION_LEVEL: i32 = 3;
+
+/// The first bytes of every zstd frame.
+const ZSTD_MAGIC: [u8; 4] = [0x28, 0xB5, 0x2F, 0xFD];
 
 /// Handle to a state directory.
 pub struct State
@@ -41,8 +79,36 @@ pub struct State
 
     // Handles to the different components of the state directory.
     scratches_dir:    SyncOnceCell<OwnedFd>,
-    action_cache_dir: SyncOnceCell<OwnedFd>,
     output_cache_dir: SyncOnceCell<OwnedFd>,
+    templates_dir:    SyncOnceCell<OwnedFd>,
+
+    /// The action cache, mapped when it is first used.
+    action_cache: SyncOnceCell<ActionCache>,
+
+    /// The action cache of older versions, if there is one.
+    legacy_action_cache_dir: SyncOnceCell<Option<OwnedFd>>,
+
+    /// The input hash cache, loaded when it is first used.
+    input_hashes: SyncOnceCell<InputHashes>,
+
+    /// The recorded action durations, loaded when they are first used.
+    action_durations: SyncOnceCell<ActionDurations>,
+
+    /// The lock that keeps our scratch files from being reaped,
+    /// taken when the scratches directory is first used.
+    scratches_lock: SyncOnceCell<OwnedFd>,
+
+    /// The remote cache, if one is in use.
+    remote_cache: Option<Remote>,
+
+    /// Whether outputs are fetched from the remote cache only when needed.
+    lazy_outputs: bool,
+
+    /// The hash of the empty build log, once it was cached.
+    ///
+    /// This is forgotten when garbage is collected,
+    /// as the empty build log may have been evicted.
+    empty_build_log: Mutex<Option<Hash>>,
 
     /// Identifies this instance of Snowflake.
     ///
@@ -55,7 +121,7 @@ pub struct State
 }
 
 /// Cached information about an action.
-#[derive(Debug, Deserialize, Serialize)]
+#[derive(Clone, Debug, Deserialize, Serialize)]
 pub struct ActionCacheEntry
 {
     /// The hash of the build log.
@@ -93,10 +159,18 @@ impl State
         let this = Self{
             state_dir,
             scratches_dir:    SyncOnceCell::new(),
-            action_cache_dir: SyncOnceCell::new(),
             output_cache_dir: SyncOnceCell::new(),
+            templates_dir:    SyncOnceCell::new(),
+            action_cache:     SyncOnceCell::new(),
+            input_hashes:     SyncOnceCell::new(),
+            action_durations: SyncOnceCell::new(),
+            scratches_lock:   SyncOnceCell::new(),
             next_scratch:     AtomicU32::new(0),
             unique_id:        Uuid::new_v4(),
+            legacy_action_cache_dir: SyncOnceCell::new(),
+            remote_cache:     None,
+            lazy_outputs:     false,
+            empty_build_log:  Mutex::new(None),
         };
 
         Ok(this)
@@ -108,7 +182,12 @@ impl State
     /// A scratch file is a temporary file for use while building.
     fn scratches_dir(&self) -> io::Result<BorrowedFd>
     {
-        self.ensure_open_dir_once(&self.scratches_dir, SCRATCHES_DIR)
+        let scratches_dir =
+            self.ensure_open_dir_once(&self.scratches_dir, SCRATCHES_DIR)?;
+        self.scratches_lock.get_or_try_init(|| {
+            lock_scratches(scratches_dir, &self.unique_id.to_string())
+        })?;
+        Ok(scratches_dir)
     }
 
     /// Generate a unique name for a scratch file.
@@ -148,36 +227,23 @@ impl State
     }
 
     /// Handle to the action cache.
-    fn action_cache_dir(&self) -> io::Result<BorrowedFd>
+    fn action_cache(&self) -> io::Result<&ActionCache>
     {
-        self.ensure_open_dir_once(&self.action_cache_dir, ACTION_CACHE_DIR)
+        self.action_cache.get_or_try_init(|| {
+            ActionCache::open(self.state_dir.as_fd())
+        })
     }
 
     /// Insert an entry into the action cache.
     ///
     /// The entry is stored at the given action hash.
     /// If the entry already exists, nothing is changed.
+    /// If a remote cache is in use, the entry is also uploaded to it.
     pub fn cache_action(&self, hash: Hash, entry: &ActionCacheEntry)
         -> io::Result<()>
     {
-        let cache = self.action_cache_dir()?;
-
-        // Open a file to store the cache entry.
-        let flags = O_TMPFILE | O_WRONLY;
-        let file = openat(Some(cache), cstr!(b"."), flags, 0o644)?;
-
-        // Write the cache entry to a file.
-        let mut file = File::from(file);
-        serde_json::to_writer(&mut file, entry)?;
-        file.flush()?;
-
-        // Create the file in the action cache.
-        linkat(
-            None, &magic_link(file.as_fd()),
-            Some(cache), &CString::new(hash.to_string()).unwrap(),
-            AT_SYMLINK_FOLLOW,
-        ).or_else(ok_if_already_exists)?;
-
+        self.action_cache()?.insert(hash, entry)?;
+        self.upload_action(hash, entry);
         Ok(())
     }
 
@@ -185,25 +251,102 @@ impl State
     ///
     /// If there is no entry for the given action,
     /// this method returns [`None`].
+    /// Entries not in the local action cache are looked up
+    /// in the remote cache, if one is in use; see [`RemoteCache`].
     pub fn cached_action(&self, hash: Hash)
         -> io::Result<Option<ActionCacheEntry>>
     {
-        let cache = self.action_cache_dir()?;
-        let pathname = &CString::new(hash.to_string()).unwrap();
-        match openat(Some(cache), pathname, O_RDONLY, 0) {
+        // The garbage collector of another process may have evicted
+        // outputs of entries that we have yet to learn were evicted.
+        let cache = self.action_cache()?;
+        if let Some(entry) = cache.get(&hash)? {
+            if self.touch_outputs(&entry)? {
+                return Ok(Some(entry));
+            }
+            cache.evict(hash)?;
+        }
+
+        // Entries cached by older versions are migrated as they are found,
+        // unless their outputs are gone, in which case they are removed.
+        if let Some(entry) = self.legacy_cached_action(hash)? {
+            if self.touch_outputs(&entry)? {
+                cache.insert(hash, &entry)?;
+                return Ok(Some(entry));
+            }
+            self.remove_legacy_action(hash)?;
+        }
+
+        self.remote_cached_action(hash)
+    }
+
+    /// Touch the build log and outputs of an entry, if they are cached.
+    ///
+    /// Touching them keeps the garbage collector from evicting them
+    /// while the build that found the entry is still using them.
+    /// Returns false if any of them is not cached.
+    fn touch_outputs(&self, entry: &ActionCacheEntry) -> io::Result<bool>
+    {
+        let output_cache = self.output_cache_dir()?;
+        for output in iter::once(&entry.build_log).chain(&entry.outputs) {
+            match touch_output(output_cache, &hash_to_path(output)) {
+                Ok(()) => (),
+                Err(err) if err.kind() == NotFound => return Ok(false),
+                Err(err) => return Err(err),
+            }
+        }
+        Ok(true)
+    }
+
+    /// Read an entry from the legacy action cache.
+    ///
+    /// Older versions stored each entry as a JSON file
+    /// in the action cache directory, named after the action hash.
+    fn legacy_cached_action(&self, hash: Hash)
+        -> io::Result<Option<ActionCacheEntry>>
+    {
+        let Some(cache) = self.legacy_action_cache_dir()? else { return Ok(None) };
+
+        match openat(Some(cache), &hash_to_path(&hash), O_RDONLY, 0) {
             Ok(file) => {
                 let file = File::from(file);
                 let file = BufReader::new(file);
                 let entry = serde_json::from_reader(file)?;
-                Ok(Some(entry: ActionCacheEntry))
+                Ok(Some(entry))
             },
             Err(err) if err.kind() == NotFound => Ok(None),
             Err(err) => Err(err),
         }
     }
 
+    /// Remove an entry from the legacy action cache.
+    fn remove_legacy_action(&self, hash: Hash) -> io::Result<()>
+    {
+        let Some(cache) = self.legacy_action_cache_dir()? else { return Ok(()) };
+        match unlinkat(Some(cache), &hash_to_path(&hash), 0) {
+            Err(err) if err.kind() != NotFound => Err(err),
+            _ => Ok(()),
+        }
+    }
+
+    /// Handle to the legacy action cache, if there is one.
+    fn legacy_action_cache_dir(&self) -> io::Result<Option<BorrowedFd>>
+    {
+        let cache = self.legacy_action_cache_dir.get_or_try_init(|| {
+            let dirfd = Some(self.state_dir.as_fd());
+            match openat(dirfd, LEGACY_ACTION_CACHE_DIR, O_DIRECTORY | O_PATH, 0) {
+                Ok(dir) => Ok(Some(dir)),
+                Err(err) if err.kind() == NotFound => Ok(None),
+                Err(err) => Err(err),
+            }
+        })?;
+        Ok(cache.as_ref().map(|cache| cache.as_fd()))
+    }
+
     /// Handle to the output cache.
-    fn output_cache_dir(&self) -> io::Result<BorrowedFd>
+    ///
+    /// Outputs are cached by their hash, so they must never be modified.
+    /// Dependencies are passed to actions relative to this directory.
+    pub fn output_cache_dir(&self) -> io::Result<BorrowedFd>
     {
         self.ensure_open_dir_once(&self.output_cache_dir, OUTPUT_CACHE_DIR)
     }
@@ -217,24 +360,103 @@ impl State
     pub fn cache_output(&self, dirfd: Option<BorrowedFd>, pathname: &CStr)
         -> Result<Hash, CacheOutputError>
     {
-        self.cache_output_impl(dirfd, pathname)
+        self.cache_output_dedup(dirfd, pathname).map(|(hash, _)| hash)
+    }
+
+    /// Move a file to the output cache, reporting whether it was redundant.
+    ///
+    /// This is like [`cache_output`][`Self::cache_output`],
+    /// but also returns whether an equivalent file was already cached.
+    /// When an action is rebuilt and this returns true for all its outputs,
+    /// its dependents will typically find themselves in the action cache.
+    pub fn cache_output_dedup(&self, dirfd: Option<BorrowedFd>, pathname: &CStr)
+        -> Result<(Hash, bool), CacheOutputError>
+    {
+        self.cache_output_impl(dirfd, pathname, None)
+    }
+
+    /// Like [`cache_output_dedup`][`Self::cache_output_dedup`],
+    /// but for an output that was hashed while it was written.
+    ///
+    /// The output is not read, unless its size or mode show
+    /// that it changed since it was written.
+    pub fn cache_written_output(
+        &self,
+        dirfd: Option<BorrowedFd>,
+        pathname: &CStr,
+        written: WrittenFile,
+    ) -> Result<(Hash, bool), CacheOutputError>
+    {
+        self.cache_output_impl(dirfd, pathname, Some(written))
     }
 
     /// Insert a build log into the output cache.
     ///
     /// Build logs are opened with `O_TMPFILE`, so they don't have a path.
     /// They cannot be inserted using [`cache_output`][`Self::cache_output`].
-    /// This method first creates a scratch link, then moves it to the cache.
+    /// This method compresses the build log into a new scratch file,
+    /// then moves a scratch link to that file to the cache.
+    /// The returned hash is that of the compressed build log;
+    /// use [`open_build_log`][`Self::open_build_log`] to read it back.
     /// This method takes ownership of and closes the build log,
     /// because it must not be modified after adding it to the cache.
+    /// Empty build logs are handled by
+    /// [`cache_empty_build_log`][`Self::cache_empty_build_log`].
     pub fn cache_build_log(&self, build_log: OwnedFd)
         -> io::Result<Hash>
     {
-        let (scratches_dir, build_log_path) =
-            self.new_scratch_link(build_log.as_fd())?;
+        if fstat(build_log.as_fd())?.st_size == 0 {
+            return self.cache_empty_build_log();
+        }
+        self.compress_build_log(build_log)
+    }
+
+    /// Move the empty build log to the output cache.
+    ///
+    /// Many actions log nothing, and all empty build logs are the same,
+    /// so the empty build log is compressed and cached only once,
+    /// after which its hash is returned without any system calls.
+    pub fn cache_empty_build_log(&self) -> io::Result<Hash>
+    {
+        // Another process may have evicted the build log since,
+        // so check that it is still there, which also protects it.
+        let mut empty_build_log = self.empty_build_log.lock().unwrap();
+        if let Some(hash) = *empty_build_log {
+            match touch_output(self.output_cache_dir()?, &hash_to_path(&hash)) {
+                Ok(()) => return Ok(hash),
+                Err(err) if err.kind() == NotFound => (),
+                Err(err) => return Err(err),
+            }
+        }
+        let scratches_dir = self.scratches_dir()?;
+        let build_log = openat(Some(scratches_dir), cstr!(b"."),
+                               O_TMPFILE | O_RDWR, 0o644)?;
+        let hash = self.compress_build_log(build_log)?;
+        *empty_build_log = Some(hash);
+        Ok(hash)
+    }
+
+    /// Implementation of [`cache_build_log`][`Self::cache_build_log`].
+    fn compress_build_log(&self, build_log: OwnedFd) -> io::Result<Hash>
+    {
+        let mut build_log = File::from(build_log);
+        build_log.rewind()?;
+
+        let scratches_dir = self.scratches_dir()?;
+        let compressed = openat(Some(scratches_dir), cstr!(b"."),
+                                O_TMPFILE | O_RDWR, 0o644)?;
+        let mut encoder = zstd::Encoder::new(File::from(compressed),
+                                             BUILD_LOG_COMPRESSION_LEVEL)?;
+        io::copy(&mut build_log, &mut encoder)?;
+        let compressed = encoder.finish()?;
 
         drop(build_log);
 
+        let (scratches_dir, build_log_path) =
+            self.new_scratch_link(compressed.as_fd())?;
+
+        drop(compressed);
+
         match self.cache_output(Some(scratches_dir), &build_log_path) {
             Ok(hash) => Ok(hash),
             Err(CacheOutputError::Io(err)) => Err(err),
@@ -243,6 +465,28 @@ impl State
         }
     }
 
+    /// Open a build log in the output cache for reading.
+    ///
+    /// The build log is decompressed while it is read.
+    /// Build logs cached by older versions are not compressed;
+    /// these are recognized by their lack of a zstd header.
+    /// The build log is first [materialized] if need be.
+    ///
+    /// [materialized]: `Self::materialize_output`
+    pub fn open_build_log(&self, hash: Hash)
+        -> io::Result<Box<dyn Read + Send>>
+    {
+        self.materialize_output(hash)?;
+        let (dirfd, path) = self.cached_output(hash)?;
+        let file = openat(Some(dirfd), &path, O_RDONLY, 0)?;
+        let mut reader = BufReader::new(File::from(file));
+        if reader.fill_buf()?.starts_with(&ZSTD_MAGIC) {
+            Ok(Box::new(zstd::Decoder::with_buffer(reader)?))
+        } else {
+            Ok(Box::new(reader))
+        }
+    }
+
     /// Obtain the path to a cached output.
     ///
     /// Returns the file descriptor for the output cache
@@ -253,12 +497,69 @@ impl State
     /// Since the output cache is content-addressed,
     /// this would mean there is a dangling reference somewhere.
     /// The caller should interpret this as a bug and crash.
+    /// The exception is outputs that are not yet [materialized].
+    ///
+    /// [materialized]: `Self::materialize_output`
     pub fn cached_output(&self, hash: Hash)
-        -> io::Result<(BorrowedFd, CString)>
+        -> io::Result<(BorrowedFd, HexHash)>
     {
         let dirfd = self.output_cache_dir()?;
-        let path = CString::new(hash.to_string()).unwrap();
-        Ok((dirfd, path))
+        Ok((dirfd, hash_to_path(&hash)))
+    }
+
+    /// Handle to the templates directory.
+    fn templates_dir(&self) -> io::Result<BorrowedFd>
+    {
+        self.ensure_open_dir_once(&self.templates_dir, TEMPLATES_DIR)
+    }
+
+    /// Open a template directory, populating it if it does not exist.
+    ///
+    /// A template directory is populated once and then shared
+    /// between actions, which must not modify it.
+    /// Templates are identified by a key, which must determine
+    /// the contents that `populate` gives the directory.
+    /// A new template is populated in a scratch directory
+    /// and then moved into place, so it is never seen half-populated.
+    pub fn template_dir<E>(
+        &self,
+        key: Hash,
+        populate: impl FnOnce(BorrowedFd) -> Result<(), E>,
+    ) -> Result<OwnedFd, E>
+        where E: From<io::Error>
+    {
+        let templates_dir = self.templates_dir()?;
+        let path = hash_to_path(&key);
+
+        match openat(Some(templates_dir), &path, O_DIRECTORY | O_PATH, 0) {
+            Ok(template) => return Ok(template),
+            Err(err) if err.kind() == NotFound => { },
+            Err(err) => return Err(err.into()),
+        }
+
+        let scratches_dir = self.scratches_dir()?;
+        let scratch_path = self.fresh_scratch();
+        mkdirat(Some(scratches_dir), &scratch_path, 0o755)?;
+        let scratch = openat(Some(scratches_dir), &scratch_path, O_DIRECTORY | O_PATH, 0)?;
+        populate(scratch.as_fd())?;
+
+        // If another thread or process won the race, use theirs.
+        renameat2(
+            Some(scratches_dir), &scratch_path,
+            Some(templates_dir), &path,
+            RENAME_NOREPLACE,
+        ).or_else(ok_if_already_exists)?;
+
+        Ok(openat(Some(templates_dir), &path, O_DIRECTORY | O_PATH, 0)?)
+    }
+
+    /// Handle to the input hash cache.
+    fn input_hashes(&self) -> io::Result<&InputHashes>
+    {
+        self.input_hashes.get_or_try_init(|| {
+            let log = RecordLog::open(self.state_dir.as_fd(), INPUT_HASHES_FILE)?;
+            InputHashes::open(log)
+        })
     }
 
     /// Ensure that a directory exists and open it.
@@ -286,10 +587,9 @@ impl AsFd for State
     }
 }
 
-fn hash_to_path(hash: &Hash) -> CString
+fn hash_to_path(hash: &Hash) -> HexHash
 {
-    CString::new(hash.to_string())
-        .expect("Hash as Display should not write nul")
+    hash.to_hex()
 }
 
 fn ok_if_already_exists(err: io::Error) -> io::Result<()>
@@ -306,8 +606,9 @@ mod tests
 {
     use {
         super::*,
-        os_ext::{O_CREAT, O_WRONLY, cstr, cstring, mkdtemp, readlink},
-        std::{os::unix::io::AsFd},
+        os_ext::{O_CREAT, O_TRUNC, O_WRONLY, cstr, cstring, fstatat, mkdtemp, readlink},
+        snowflake_util::hash::hash_file_at,
+        std::{io::Write, os::unix::io::AsFd, time::Duration},
     };
 
     #[test]
@@ -337,6 +638,40 @@ mod tests
         ).unwrap();
     }
 
+    #[test]
+    fn build_log()
+    {
+        // Create state directory.
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+
+        // Write a repetitive build log, as actions do.
+        let content = b"compiling something\n".repeat(1000);
+        let build_log = openat(Some(state.as_fd()), cstr!(b"."), O_TMPFILE | O_RDWR, 0o644).unwrap();
+        let build_log_file = build_log.try_clone().unwrap();
+        File::from(build_log_file).write_all(&content).unwrap();
+
+        // The build log is cached compressed.
+        let hash = state.cache_build_log(build_log).unwrap();
+        let (dirfd, path) = state.cached_output(hash).unwrap();
+        let statbuf = fstatat(Some(dirfd), &path, 0).unwrap();
+        assert!((statbuf.st_size as usize) < content.len() / 10);
+
+        // Reading the build log decompresses it.
+        let mut actual = Vec::new();
+        state.open_build_log(hash).unwrap().read_to_end(&mut actual).unwrap();
+        assert_eq!(actual, content);
+
+        // Uncompressed build logs are read as is.
+        let scratch = state.new_scratch_dir().unwrap();
+        let file = openat(Some(scratch.as_fd()), cstr!(b"build.log"), O_CREAT | O_WRONLY, 0o644).unwrap();
+        File::from(file).write_all(b"legacy\n").unwrap();
+        let hash = state.cache_output(Some(scratch.as_fd()), cstr!(b"build.log")).unwrap();
+        let mut actual = Vec::new();
+        state.open_build_log(hash).unwrap().read_to_end(&mut actual).unwrap();
+        assert_eq!(actual, b"legacy\n");
+    }
+
     #[test]
     fn action_cache()
     {
@@ -345,10 +680,17 @@ mod tests
         let state = State::open(&path).unwrap();
 
         // Prepare action for inserting into action cache.
+        // Entries whose outputs are not cached are never found.
+        let scratch = state.new_scratch_dir().unwrap();
+        let cache = |path, content: &[u8]| {
+            let file = openat(Some(scratch.as_fd()), path, O_CREAT | O_WRONLY, 0o644).unwrap();
+            File::from(file).write_all(content).unwrap();
+            state.cache_output(Some(scratch.as_fd()), path).unwrap()
+        };
         let hash = Hash([0; 32]);
         let entry = ActionCacheEntry{
-            build_log: Hash([1; 32]),
-            outputs: vec![Hash([2; 32]), Hash([3; 32])],
+            build_log: cache(cstr!(b"build.log"), b""),
+            outputs: vec![cache(cstr!(b"a"), b"a\n"), cache(cstr!(b"b"), b"b\n")],
             warnings: true,
         };
 
@@ -361,5 +703,140 @@ mod tests
 
         // Retrieving a non-existent action should return None.
         assert!(state.cached_action(Hash([4; 32])).unwrap().is_none());
+
+        // Entries inserted by other instances are found too.
+        let other = State::open(&path).unwrap();
+        other.cache_action(Hash([4; 32]), &entry).unwrap();
+        let retrieved = state.cached_action(Hash([4; 32])).unwrap().unwrap();
+        assert_eq!(format!("{entry:?}"), format!("{retrieved:?}"));
+    }
+
+    #[test]
+    fn legacy_action_cache()
+    {
+        // Create state directory with a legacy action cache entry.
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+        let dirfd = Some(state.as_fd());
+        mkdirat(dirfd, LEGACY_ACTION_CACHE_DIR, 0o755).unwrap();
+        let legacy = openat(dirfd, LEGACY_ACTION_CACHE_DIR, O_DIRECTORY | O_PATH, 0).unwrap();
+        let scratch = state.new_scratch_dir().unwrap();
+        let file = openat(Some(scratch.as_fd()), cstr!(b"output"), O_CREAT | O_WRONLY, 0o644).unwrap();
+        File::from(file).write_all(b"output\n").unwrap();
+        let output = state.cache_output(Some(scratch.as_fd()), cstr!(b"output")).unwrap();
+        let legacy_entry = |hash: Hash, entry: &ActionCacheEntry| {
+            let file = openat(Some(legacy.as_fd()), &hash_to_path(&hash), O_CREAT | O_WRONLY, 0o644).unwrap();
+            serde_json::to_writer(File::from(file), entry).unwrap();
+        };
+        let hash = Hash([0; 32]);
+        let entry = ActionCacheEntry{
+            build_log: output,
+            outputs: vec![output],
+            warnings: false,
+        };
+        legacy_entry(hash, &entry);
+
+        // The entry is found and migrated to the action cache.
+        let retrieved = state.cached_action(hash).unwrap().unwrap();
+        assert_eq!(format!("{entry:?}"), format!("{retrieved:?}"));
+        let other = State::open(&path).unwrap();
+        assert!(other.action_cache().unwrap().get(&hash).unwrap().is_some());
+
+        // Entries whose outputs are gone are removed instead,
+        // without leaving any records in the action cache.
+        let missing = Hash([3; 32]);
+        let entry = ActionCacheEntry{
+            build_log: output,
+            outputs: vec![Hash([2; 32])],
+            warnings: false,
+        };
+        legacy_entry(missing, &entry);
+        let log_len = || fstatat(dirfd, ACTION_CACHE_FILE, 0).unwrap().st_size;
+        let before = log_len();
+        for _ in 0 .. 2 {
+            assert!(state.cached_action(missing).unwrap().is_none());
+        }
+        assert_eq!(log_len(), before);
+        let result = fstatat(Some(legacy.as_fd()), &hash_to_path(&missing), 0);
+        assert!(matches!(result, Err(err) if err.kind() == NotFound));
+    }
+
+    #[test]
+    fn template_dir()
+    {
+        // Create state directory.
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+
+        // Templates are populated only once.
+        let mut populated = 0;
+        for _ in 0 .. 2 {
+            let template = state.template_dir(Hash([0; 32]), |dir| {
+                populated += 1;
+                mkdirat(Some(dir), cstr!(b"bin"), 0o755)
+            }).unwrap();
+            fstatat(Some(template.as_fd()), cstr!(b"bin"), 0).unwrap();
+        }
+        assert_eq!(populated, 1);
+    }
+
+    #[test]
+    fn hash_input()
+    {
+        // Create state directory.
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let state = State::open(&path).unwrap();
+        let scratch = state.new_scratch_dir().unwrap();
+        let scratch = Some(scratch.as_fd());
+
+        // Hashing an input gives the same hash as hashing it directly.
+        let write = |content: &[u8]| {
+            let flags = O_CREAT | O_TRUNC | O_WRONLY;
+            let file = openat(scratch, cstr!(b"input"), flags, 0o644).unwrap();
+            File::from(file).write_all(content).unwrap();
+            let expected = hash_file_at(scratch, cstr!(b"input")).unwrap();
+            assert_eq!(state.hash_input(scratch, cstr!(b"input")).unwrap(), expected);
+            assert_eq!(state.hash_input(scratch, cstr!(b"input")).unwrap(), expected);
+            expected
+        };
+
+        // Changing the input changes the hash, also when done quickly.
+        let a = write(b"Hello, world!");
+        let b = write(b"Hello, World!");
+        assert_ne!(a, b);
+    }
+
+    #[test]
+    fn action_durations()
+    {
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let a = Hash([0; 32]);
+        let b = Hash([1; 32]);
+
+        // The most recently recorded duration is returned.
+        {
+            let state = State::open(&path).unwrap();
+            assert_eq!(state.action_duration(a).unwrap(), None);
+            state.record_action_duration(a, Duration::from_millis(1)).unwrap();
+            state.record_action_duration(a, Duration::from_millis(2)).unwrap();
+            state.record_action_duration(b, Duration::from_secs(3)).unwrap();
+            assert_eq!(state.action_duration(a).unwrap(), Some(Duration::from_millis(2)));
+        }
+
+        // Durations are persisted across instances.
+        let state = State::open(&path).unwrap();
+        assert_eq!(state.action_duration(a).unwrap(), Some(Duration::from_millis(2)));
+        assert_eq!(state.action_duration(b).unwrap(), Some(Duration::from_secs(3)));
+
+        // Superseded records are eventually compacted away.
+        for i in 0 .. 2000 {
+            state.record_action_duration(a, Duration::from_millis(i)).unwrap();
+        }
+        let size = || fstatat(Some(state.as_fd()), ACTION_DURATIONS_FILE, 0).unwrap().st_size;
+        let before = size();
+        let state = State::open(&path).unwrap();
+        assert_eq!(state.action_duration(a).unwrap(), Some(Duration::from_millis(1999)));
+        assert_eq!(state.action_duration(b).unwrap(), Some(Duration::from_secs(3)));
+        assert_eq!(size(), before / 2003 * 2);
     }
 }
@@ -0,0 +1,242 @@
+use {
+    os_ext::{O_APPEND, O_CREAT, O_RDWR, flock, fstat, openat, renameat2},
+    snowflake_util::hash::Blake3,
+    std::{
+        ffi::CStr,
+        fs::File,
+        io::{self, ErrorKind::Interrupted, Write},
+        ops::Range,
+        os::{raw::c_int, unix::{fs::FileExt, io::{AsFd, BorrowedFd}}},
+    },
+};
+
+/// Append-only file of records.
+///
+/// Records are appended with a single `write` each, using `O_APPEND`.
+/// This makes appending atomic with respect to concurrent appends,
+/// including those from other processes using the same state directory.
+///
+/// Each record is framed by a magic number, a length, and a checksum.
+/// If a write is torn, e.g. due to a crash, the damaged record is
+/// skipped when reading, and reading resumes at the next intact record.
+pub (super) struct RecordLog
+{
+    file: File,
+}
+
+impl AsFd for RecordLog
+{
+    fn as_fd(&self) -> BorrowedFd
+    {
+        self.file.as_fd()
+    }
+}
+
+/// Marks the start of a record.
+const MAGIC: [u8; 4] = *b"SfRc";
+
+/// Size of the framing around the payload of a record.
+const HEADER_LEN: usize = MAGIC.len() + 4;
+const CHECKSUM_LEN: usize = 8;
+
+impl RecordLog
+{
+    /// Open a record log, creating it if it does not exist.
+    pub fn open(dirfd: BorrowedFd, path: &CStr) -> io::Result<Self>
+    {
+        let flags = O_APPEND | O_CREAT | O_RDWR;
+        let file = openat(Some(dirfd), path, flags, 0o644)?;
+        Ok(Self{file: File::from(file)})
+    }
+
+    /// Open a record log and lock it with flock(2).
+    ///
+    /// Logs that are [replaced][`Self::replace`] must be opened this way.
+    /// If the log was replaced while we were waiting for the lock,
+    /// the log at `path` is a different file, so it is opened again.
+    /// The lock is released when the returned log is dropped.
+    pub fn open_locked(dirfd: BorrowedFd, path: &CStr, operation: c_int)
+        -> io::Result<Self>
+    {
+        loop {
+            let log = Self::open(dirfd, path)?;
+            flock(log.as_fd(), operation)?;
+            if fstat(log.as_fd())?.st_nlink != 0 {
+                return Ok(log);
+            }
+        }
+    }
+
+    /// Replace a record log with one that consists of the given records.
+    ///
+    /// The new log is written to `tmp_path`, which must be on
+    /// the same file system, and is then renamed to `path`.
+    /// The caller must hold an exclusive lock on the log at `path`,
+    /// obtained through [`open_locked`][`Self::open_locked`],
+    /// so that records appended concurrently are not lost.
+    pub fn replace<'a>(
+        dirfd:     BorrowedFd,
+        path:      &CStr,
+        tmp_dirfd: BorrowedFd,
+        tmp_path:  &CStr,
+        payloads:  impl IntoIterator<Item=&'a [u8]>,
+    ) -> io::Result<()>
+    {
+        let mut frames = Vec::new();
+        for payload in payloads {
+            push_frame(&mut frames, payload)?;
+        }
+        let tmp = Self::open(tmp_dirfd, tmp_path)?;
+        (&tmp.file).write_all(&frames)?;
+        renameat2(Some(tmp_dirfd), tmp_path, Some(dirfd), path, 0)
+    }
+
+    /// Append a record to the log.
+    pub fn append(&self, payload: &[u8]) -> io::Result<()>
+    {
+        let mut frame = Vec::with_capacity(HEADER_LEN + payload.len() + CHECKSUM_LEN);
+        push_frame(&mut frame, payload)?;
+
+        // Retrying a short write would break atomicity, so don't.
+        // Short writes only happen in exceptional situations anyway,
+        // such as when the disk is full; and the reader recovers from them.
+        let nwritten = (&self.file).write(&frame)?;
+        if nwritten != frame.len() {
+            return Err(io::Error::other("Short write to record log"));
+        }
+
+        Ok(())
+    }
+
+    /// Read the entire log into memory.
+    ///
+    /// Use [`records`] to iterate over the records in the returned buffer.
+    pub fn read(&self) -> io::Result<Vec<u8>>
+    {
+        let mut buf = Vec::new();
+        let mut chunk = vec![0; 64 * 1024];
+        loop {
+            let offset = buf.len() as u64;
+            match self.file.read_at(&mut chunk, offset) {
+                Ok(0) => break Ok(buf),
+                Ok(n) => buf.extend_from_slice(&chunk[.. n]),
+                Err(err) if err.kind() == Interrupted => continue,
+                Err(err) => break Err(err),
+            }
+        }
+    }
+}
+
+/// Append the framed record for a payload to a buffer.
+fn push_frame(buf: &mut Vec<u8>, payload: &[u8]) -> io::Result<()>
+{
+    let len: u32 = payload.len().try_into()
+        .map_err(|_| io::Error::other("Record is too large"))?;
+    let start = buf.len();
+    buf.extend_from_slice(&MAGIC);
+    buf.extend_from_slice(&len.to_le_bytes());
+    buf.extend_from_slice(payload);
+    let checksum = checksum(&buf[start + MAGIC.len() ..]);
+    buf.extend_from_slice(&checksum);
+    Ok(())
+}
+
+/// Iterate over the intact records in a log, in the order they were appended.
+///
+/// Yields the location of the payload of each record in `buf`, along with
+/// the offset just past the record; this is where reading should resume.
+///
+/// A record that claims to extend past the end of the buffer
+/// may still be in the process of being appended by another process.
+/// If no intact records follow it, iteration ends at that record.
+pub (super) fn records(buf: &[u8])
+    -> impl Iterator<Item=(Range<usize>, usize)> + '_
+{
+    let mut offset = 0;
+    std::iter::from_fn(move || {
+        while buf.len() - offset >= HEADER_LEN {
+            let rest = &buf[offset ..];
+            match parse_record(rest) {
+                Ok(len) => {
+                    let payload = offset + HEADER_LEN .. offset + HEADER_LEN + len;
+                    offset = payload.end + CHECKSUM_LEN;
+                    return Some((payload, offset));
+                },
+                Err(incomplete) => {
+                    // Damaged record; resynchronize at the next magic number.
+                    let next = rest[1 ..].windows(MAGIC.len())
+                        .position(|w| w == MAGIC);
+                    match next {
+                        Some(i) => offset += i + 1,
+                        None if incomplete => return None,
+                        None => offset = buf.len(),
+                    }
+                },
+            }
+        }
+        None
+    })
+}
+
+/// Parse the record at the start of the buffer, returning its length.
+///
+/// If it is not intact, returns whether that is because the buffer ends early.
+fn parse_record(buf: &[u8]) -> Result<usize, bool>
+{
+    if buf[.. MAGIC.len()] != MAGIC {
+        return Err(false);
+    }
+    let len = u32::from_le_bytes(buf[MAGIC.len() .. HEADER_LEN].try_into().unwrap());
+    let end = HEADER_LEN + len as usize;
+    if buf.len() < end + CHECKSUM_LEN {
+        return Err(true);
+    }
+    if checksum(&buf[MAGIC.len() .. end]) != buf[end .. end + CHECKSUM_LEN] {
+        return Err(false);
+    }
+    Ok(len as usize)
+}
+
+/// Compute the checksum of the length and payload of a record.
+fn checksum(buf: &[u8]) -> [u8; CHECKSUM_LEN]
+{
+    let hash = Blake3::new().update(buf).finalize();
+    hash.0[.. CHECKSUM_LEN].try_into().unwrap()
+}
+
+#[cfg(test)]
+mod tests
+{
+    use {
+        super::*,
+        os_ext::{O_DIRECTORY, O_PATH, cstr, cstring, mkdtemp, open},
+        std::os::unix::io::AsFd,
+    };
+
+    #[test]
+    fn torn_record()
+    {
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let dir = open(&path, O_DIRECTORY | O_PATH, 0).unwrap();
+        let log = RecordLog::open(dir.as_fd(), cstr!(b"log")).unwrap();
+
+        log.append(b"foo").unwrap();
+        log.append(b"bar").unwrap();
+        log.append(b"").unwrap();
+
+        // Simulate a write torn by a crash, followed by more appends.
+        let buf = log.read().unwrap();
+        (&log.file).write_all(&buf[.. 10]).unwrap();
+        log.append(b"baz").unwrap();
+
+        let buf = log.read().unwrap();
+        let actual: Vec<&[u8]> = records(&buf).map(|(r, _)| &buf[r]).collect();
+        let expected: Vec<&[u8]> = vec![b"foo", b"bar", b"", b"baz"];
+        assert_eq!(actual, expected);
+
+        // A record still being appended ends the iteration.
+        let (_, end) = records(&buf).last().unwrap();
+        assert_eq!(end, buf.len());
+        assert_eq!(records(&buf[.. end - 1]).count(), 3);
+    }
+}
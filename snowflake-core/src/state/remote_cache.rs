@@ -0,0 +1,569 @@
+use {
+    super::{
+        ActionCacheEntry, CacheOutputError, State,
+        action_cache::{VERSION, decode, encode},
+        hash_to_path, ok_if_already_exists,
+    },
+    os_ext::{
+        AT_SYMLINK_NOFOLLOW,
+        O_CREAT, O_DIRECTORY, O_EXCL, O_NOFOLLOW, O_PATH, O_RDONLY, O_WRONLY,
+        RENAME_NOREPLACE,
+        S_IFDIR, S_IFLNK, S_IFMT, S_IFREG,
+        fchmod, fdopendir, fstatat, mkdirat, open, openat, readdir,
+        readlinkat, renameat2, symlinkat,
+        cstr,
+        io::BorrowedFdExt,
+    },
+    snowflake_util::hash::Hash,
+    std::{
+        ffi::{CStr, CString},
+        fs::File,
+        io::{self, ErrorKind::{InvalidData, NotFound}, Read, Write},
+        iter,
+        os::unix::io::{AsFd, BorrowedFd, OwnedFd},
+        sync::{Arc, Mutex, atomic::{AtomicU32, Ordering::SeqCst}, mpsc},
+        thread::{self, JoinHandle},
+    },
+    uuid::Uuid,
+};
+
+/// Cache shared between state directories, such as those of a CI fleet.
+///
+/// Like the local caches, a remote cache consists of
+/// an action cache and a content-addressed output cache.
+/// When an action is not found in the local action cache,
+/// it is looked up in the remote cache, and on a hit the entry and
+/// its outputs are copied into the local caches, so that they are
+/// fetched at most once. Entries inserted into the local action cache
+/// are uploaded in the background, along with their outputs.
+///
+/// Outputs fetched from a remote cache are hashed before they are
+/// inserted into the local output cache, so a remote cache need not be
+/// trusted with the integrity of outputs, only with that of entries.
+pub trait RemoteCache: Send + Sync
+{
+    /// Look up an entry in the remote action cache.
+    fn get_action(&self, hash: Hash) -> io::Result<Option<ActionCacheEntry>>;
+
+    /// Insert an entry into the remote action cache.
+    ///
+    /// The outputs of the entry have already been inserted.
+    /// If the entry already exists, nothing should be changed.
+    fn put_action(&self, hash: Hash, entry: &ActionCacheEntry)
+        -> io::Result<()>;
+
+    /// Copy an output from the remote output cache to the given path.
+    ///
+    /// Nothing exists at the path yet.
+    /// If there is no such output, this method returns false.
+    fn get_output(&self, hash: Hash, dirfd: BorrowedFd, path: &CStr)
+        -> io::Result<bool>;
+
+    /// Copy an output to the remote output cache.
+    ///
+    /// If the output already exists, nothing should be changed.
+    fn put_output(&self, hash: Hash, dirfd: BorrowedFd, path: &CStr)
+        -> io::Result<()>;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                           Remote cache of a state                          */
+/* -------------------------------------------------------------------------- */
+
+/// Remote cache in use by a state directory.
+pub (super) struct Remote
+{
+    cache: Arc<dyn RemoteCache>,
+    uploader: Uploader,
+}
+
+impl State
+{
+    /// Use a remote cache in addition to the local caches.
+    ///
+    /// This starts a thread that uploads entries in the background.
+    /// See [`finish_uploads`][`Self::finish_uploads`] for waiting on it.
+    pub fn set_remote_cache(&mut self, cache: impl RemoteCache + 'static)
+        -> io::Result<()>
+    {
+        let cache: Arc<dyn RemoteCache> = Arc::new(cache);
+        let output_cache = self.output_cache_dir()?.try_to_owned()?;
+        let uploader = Uploader::spawn(cache.clone(), output_cache)?;
+        self.remote_cache = Some(Remote{cache, uploader});
+        Ok(())
+    }
+
+    /// Fetch outputs from the remote cache only when they are needed.
+    ///
+    /// By default, the outputs of an entry found in the remote cache
+    /// are fetched when the entry is found. With lazy outputs, they are
+    /// fetched by [`materialize_output`][`Self::materialize_output`]
+    /// instead, which the driver calls only for the inputs of actions
+    /// it performs and for artifacts. Entries found this way are not
+    /// inserted into the local action cache, as their outputs may
+    /// never be fetched; they are looked up remotely again next time.
+    pub fn set_lazy_outputs(&mut self, lazy_outputs: bool)
+    {
+        self.lazy_outputs = lazy_outputs;
+    }
+
+    /// Ensure that an output is in the local output cache.
+    ///
+    /// With [lazy outputs], entries returned by [`cached_action`]
+    /// may refer to outputs that were not yet fetched.
+    /// This method fetches such an output from the remote cache.
+    /// Outputs must be materialized before they are accessed
+    /// through the path returned by [`cached_output`].
+    ///
+    /// [lazy outputs]: `Self::set_lazy_outputs`
+    /// [`cached_action`]: `Self::cached_action`
+    /// [`cached_output`]: `Self::cached_output`
+    pub fn materialize_output(&self, hash: Hash) -> io::Result<()>
+    {
+        // Without a remote cache, entries never refer to missing outputs.
+        let Some(remote) = &self.remote_cache else { return Ok(()) };
+        if !self.fetch_output(&*remote.cache, hash)? {
+            let message = format!("Output {hash} is in neither the \
+                                   local nor the remote cache");
+            return Err(io::Error::new(NotFound, message));
+        }
+        Ok(())
+    }
+
+    /// Wait for all uploads to the remote cache to finish.
+    ///
+    /// Uploads are also waited for when the state is dropped,
+    /// but errors are then ignored. If any upload failed,
+    /// this method returns the first error that occurred.
+    /// The remote cache is no longer used afterwards.
+    pub fn finish_uploads(&mut self) -> io::Result<()>
+    {
+        match self.remote_cache.take() {
+            Some(mut remote) => remote.uploader.finish(),
+            None => Ok(()),
+        }
+    }
+
+    /// Upload an entry and its outputs to the remote cache, if any.
+    pub (super) fn upload_action(&self, hash: Hash, entry: &ActionCacheEntry)
+    {
+        if let Some(remote) = &self.remote_cache {
+            remote.uploader.enqueue(hash, entry.clone());
+        }
+    }
+
+    /// Look up an entry in the remote cache, if any.
+    ///
+    /// Unless outputs are [lazy], the outputs of the entry are copied
+    /// into the local output cache, and then the entry is inserted into
+    /// the local action cache. Inserting it before its outputs exist
+    /// would leave it referring to missing outputs if fetching fails.
+    ///
+    /// [lazy]: `Self::set_lazy_outputs`
+    pub (super) fn remote_cached_action(&self, hash: Hash)
+        -> io::Result<Option<ActionCacheEntry>>
+    {
+        let Some(remote) = &self.remote_cache else { return Ok(None) };
+        let Some(entry) = remote.cache.get_action(hash)? else { return Ok(None) };
+
+        if self.lazy_outputs {
+            return Ok(Some(entry));
+        }
+
+        for &output in iter::once(&entry.build_log).chain(&entry.outputs) {
+            if !self.fetch_output(&*remote.cache, output)? {
+                return Ok(None);
+            }
+        }
+
+        self.action_cache()?.insert(hash, &entry)?;
+        Ok(Some(entry))
+    }
+
+    /// Copy an output from the remote cache to the local output cache.
+    ///
+    /// Returns false if the remote cache does not have the output.
+    fn fetch_output(&self, cache: &dyn RemoteCache, hash: Hash)
+        -> io::Result<bool>
+    {
+        let output_cache = self.output_cache_dir()?;
+        match fstatat(Some(output_cache), &hash_to_path(&hash), AT_SYMLINK_NOFOLLOW) {
+            Ok(_) => return Ok(true),
+            Err(err) if err.kind() == NotFound => { },
+            Err(err) => return Err(err),
+        }
+
+        let scratches_dir = self.scratches_dir()?;
+        let scratch = self.fresh_scratch();
+        if !cache.get_output(hash, scratches_dir, &scratch)? {
+            return Ok(false);
+        }
+
+        let actual = match self.cache_output(Some(scratches_dir), &scratch) {
+            Ok(actual) => actual,
+            Err(CacheOutputError::Io(err)) => return Err(err),
+            Err(CacheOutputError::Output(err)) =>
+                return Err(io::Error::new(InvalidData, err)),
+        };
+        if actual != hash {
+            let message = format!("Remote cache has output {actual} at {hash}");
+            return Err(io::Error::new(InvalidData, message));
+        }
+
+        Ok(true)
+    }
+}
+
+/// Thread that uploads entries and their outputs to a remote cache.
+///
+/// Entries are uploaded in the order they are enqueued.
+/// The outputs of an entry are uploaded before the entry itself,
+/// so that entries in the remote cache never refer to missing outputs.
+struct Uploader
+{
+    // mpsc::Sender is not Sync, hence the mutex.
+    queue: Mutex<Option<mpsc::Sender<(Hash, ActionCacheEntry)>>>,
+    thread: Option<JoinHandle<io::Result<()>>>,
+}
+
+impl Uploader
+{
+    fn spawn(cache: Arc<dyn RemoteCache>, output_cache: OwnedFd)
+        -> io::Result<Self>
+    {
+        let (queue, uploads) = mpsc::channel::<(Hash, ActionCacheEntry)>();
+
+        let thread =
+            thread::Builder::new()
+            .name("remote cache uploader".into())
+            .spawn(move || {
+                // Keep uploading after an error; only report the first.
+                let mut result = Ok(());
+                for (hash, entry) in uploads {
+                    let upload = || {
+                        let outputs = iter::once(&entry.build_log).chain(&entry.outputs);
+                        for &output in outputs {
+                            let path = hash_to_path(&output);
+                            cache.put_output(output, output_cache.as_fd(), &path)?;
+                        }
+                        cache.put_action(hash, &entry)
+                    };
+                    result = result.and(upload());
+                }
+                result
+            })?;
+
+        Ok(Self{queue: Mutex::new(Some(queue)), thread: Some(thread)})
+    }
+
+    fn enqueue(&self, hash: Hash, entry: ActionCacheEntry)
+    {
+        // If the thread is gone, finish reports why.
+        if let Some(queue) = &*self.queue.lock().unwrap() {
+            let _ = queue.send((hash, entry));
+        }
+    }
+
+    /// Wait for the enqueued uploads to finish.
+    fn finish(&mut self) -> io::Result<()>
+    {
+        // Closing the queue makes the thread stop once it is empty.
+        drop(self.queue.get_mut().unwrap().take());
+        match self.thread.take() {
+            Some(thread) => thread.join()
+                .unwrap_or_else(|_| Err(io::Error::other("Uploader panicked"))),
+            None => Ok(()),
+        }
+    }
+}
+
+impl Drop for Uploader
+{
+    fn drop(&mut self)
+    {
+        let _ = self.finish();
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/*                           Directory remote cache                           */
+/* -------------------------------------------------------------------------- */
+
+/// Remote cache stored in a directory, such as on a network file system.
+///
+/// The directory contains an `actions` directory with a file for each entry,
+/// an `outputs` directory laid out like the local output cache,
+/// and a `tmp` directory in which files are prepared before
+/// they are renamed into place, so that they never appear half-written.
+pub struct DirectoryRemoteCache
+{
+    actions: OwnedFd,
+    outputs: OwnedFd,
+    tmp: OwnedFd,
+
+    /// Prevents concurrent users of the directory creating conflicting
+    /// temporary files; see [`State`] for the same approach.
+    unique_id: Uuid,
+    next_tmp: AtomicU32,
+}
+
+impl DirectoryRemoteCache
+{
+    /// Open a directory remote cache.
+    ///
+    /// The directory must already exist.
+    /// Its subdirectories are created if they do not exist.
+    pub fn open(path: &CStr) -> io::Result<Self>
+    {
+        let dir = open(path, O_DIRECTORY | O_PATH, 0)?;
+        let subdir = |path| {
+            mkdirat(Some(dir.as_fd()), path, 0o755)
+                .or_else(ok_if_already_exists)?;
+            openat(Some(dir.as_fd()), path, O_DIRECTORY | O_PATH, 0)
+        };
+        Ok(Self{
+            actions: subdir(cstr!(b"actions"))?,
+            outputs: subdir(cstr!(b"outputs"))?,
+            tmp:     subdir(cstr!(b"tmp"))?,
+            unique_id: Uuid::new_v4(),
+            next_tmp:  AtomicU32::new(0),
+        })
+    }
+
+    fn fresh_tmp(&self) -> CString
+    {
+        let local_id = self.next_tmp.fetch_add(1, SeqCst);
+        let name = format!("{}-{}", self.unique_id, local_id);
+        CString::new(name).unwrap()
+    }
+
+    /// Whether a file exists in the given directory.
+    fn exists(dirfd: BorrowedFd, path: &CStr) -> io::Result<bool>
+    {
+        match fstatat(Some(dirfd), path, AT_SYMLINK_NOFOLLOW) {
+            Ok(_) => Ok(true),
+            Err(err) if err.kind() == NotFound => Ok(false),
+            Err(err) => Err(err),
+        }
+    }
+
+    /// Move a file from the temporary directory into place.
+    ///
+    /// If another user of the directory won the race, theirs is kept,
+    /// and the temporary file is left behind.
+    fn publish(&self, tmp: &CStr, dirfd: BorrowedFd, path: &CStr)
+        -> io::Result<()>
+    {
+        renameat2(
+            Some(self.tmp.as_fd()), tmp,
+            Some(dirfd), path,
+            RENAME_NOREPLACE,
+        ).or_else(ok_if_already_exists)
+    }
+}
+
+impl RemoteCache for DirectoryRemoteCache
+{
+    fn get_action(&self, hash: Hash) -> io::Result<Option<ActionCacheEntry>>
+    {
+        let file = match openat(Some(self.actions.as_fd()), &hash_to_path(&hash), O_RDONLY, 0) {
+            Ok(file) => file,
+            Err(err) if err.kind() == NotFound => return Ok(None),
+            Err(err) => return Err(err),
+        };
+
+        let mut buf = Vec::new();
+        File::from(file).read_to_end(&mut buf)?;
+
+        // Entries written by other versions are treated as missing.
+        if buf.len() < 33 || buf[0] != VERSION || buf[1 .. 33] != hash.0 {
+            return Ok(None);
+        }
+        Ok(decode(&buf[33 ..]))
+    }
+
+    fn put_action(&self, hash: Hash, entry: &ActionCacheEntry)
+        -> io::Result<()>
+    {
+        let path = hash_to_path(&hash);
+        if Self::exists(self.actions.as_fd(), &path)? {
+            return Ok(());
+        }
+
+        let tmp = self.fresh_tmp();
+        let flags = O_CREAT | O_EXCL | O_WRONLY;
+        let file = openat(Some(self.tmp.as_fd()), &tmp, flags, 0o644)?;
+        File::from(file).write_all(&encode(hash, entry))?;
+        self.publish(&tmp, self.actions.as_fd(), &path)
+    }
+
+    fn get_output(&self, hash: Hash, dirfd: BorrowedFd, path: &CStr)
+        -> io::Result<bool>
+    {
+        let source = hash_to_path(&hash);
+        if !Self::exists(self.outputs.as_fd(), &source)? {
+            return Ok(false);
+        }
+        copy_tree(self.outputs.as_fd(), &source, dirfd, path)?;
+        Ok(true)
+    }
+
+    fn put_output(&self, hash: Hash, dirfd: BorrowedFd, path: &CStr)
+        -> io::Result<()>
+    {
+        let target = hash_to_path(&hash);
+        if Self::exists(self.outputs.as_fd(), &target)? {
+            return Ok(());
+        }
+
+        let tmp = self.fresh_tmp();
+        copy_tree(dirfd, path, self.tmp.as_fd(), &tmp)?;
+        self.publish(&tmp, self.outputs.as_fd(), &target)
+    }
+}
+
+/// Copy a file, recursively for directories.
+///
+/// Only the properties of files that [`hash_file_at`] considers
+/// are preserved: contents, file types, and permissions.
+///
+/// [`hash_file_at`]: `snowflake_util::hash::hash_file_at`
+fn copy_tree(
+    src_dirfd: BorrowedFd,
+    src_path:  &CStr,
+    dst_dirfd: BorrowedFd,
+    dst_path:  &CStr,
+) -> io::Result<()>
+{
+    let statbuf = fstatat(Some(src_dirfd), src_path, AT_SYMLINK_NOFOLLOW)?;
+
+    // Permissions are set explicitly, as they are subject to the umask.
+    let mode = statbuf.st_mode & 0o777;
+
+    match statbuf.st_mode & S_IFMT {
+        S_IFREG => {
+            let src = openat(Some(src_dirfd), src_path, O_NOFOLLOW | O_RDONLY, 0)?;
+            let flags = O_CREAT | O_EXCL | O_WRONLY;
+            let dst = openat(Some(dst_dirfd), dst_path, flags, mode)?;
+            fchmod(dst.as_fd(), mode)?;
+            io::copy(&mut File::from(src), &mut File::from(dst))?;
+        },
+        S_IFDIR => {
+            mkdirat(Some(dst_dirfd), dst_path, 0o700)?;
+            let flags = O_DIRECTORY | O_NOFOLLOW | O_RDONLY;
+            let dst = openat(Some(dst_dirfd), dst_path, flags, 0)?;
+            let mut src = fdopendir(openat(Some(src_dirfd), src_path, flags, 0)?)?;
+            while let Some(dirent) = readdir(&mut src)? {
+                let entry = dirent.d_name;
+                if entry.as_ref() == cstr!(b".") || entry.as_ref() == cstr!(b"..") {
+                    continue;
+                }
+                copy_tree(src.as_fd(), &entry, dst.as_fd(), &entry)?;
+            }
+            fchmod(dst.as_fd(), mode)?;
+        },
+        S_IFLNK => {
+            let target = readlinkat(Some(src_dirfd), src_path)?;
+            symlinkat(&target, Some(dst_dirfd), dst_path)?;
+        },
+        _ =>
+            return Err(io::Error::other("Cannot copy file of this type")),
+    }
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests
+{
+    use {
+        super::*,
+        os_ext::{cstring, mkdtemp},
+        snowflake_util::hash::hash_file_at,
+    };
+
+    /// Build an action on one machine, uploading it to the remote cache.
+    ///
+    /// Returns the action hash, the build log hash, and the output hash.
+    fn populate_remote_cache(remote: &CStr) -> (Hash, Hash, Hash)
+    {
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let mut state = State::open(&path).unwrap();
+        state.set_remote_cache(DirectoryRemoteCache::open(remote).unwrap()).unwrap();
+
+        let scratch = state.new_scratch_dir().unwrap();
+        let flags = O_CREAT | O_WRONLY;
+        mkdirat(Some(scratch.as_fd()), cstr!(b"output"), 0o755).unwrap();
+        let file = openat(Some(scratch.as_fd()), cstr!(b"output/a.txt"), flags, 0o644).unwrap();
+        File::from(file).write_all(b"Hello, world!\n").unwrap();
+        symlinkat(cstr!(b"a.txt"), Some(scratch.as_fd()), cstr!(b"output/b.lnk")).unwrap();
+        let file = openat(Some(scratch.as_fd()), cstr!(b"build.log"), flags, 0o644).unwrap();
+        File::from(file).write_all(b"Building...\n").unwrap();
+
+        let output = state.cache_output(Some(scratch.as_fd()), cstr!(b"output")).unwrap();
+        let build_log = state.cache_output(Some(scratch.as_fd()), cstr!(b"build.log")).unwrap();
+        let entry = ActionCacheEntry{build_log, outputs: vec![output], warnings: true};
+        let action = Hash([1; 32]);
+        state.cache_action(action, &entry).unwrap();
+        state.finish_uploads().unwrap();
+
+        (action, build_log, output)
+    }
+
+    #[test]
+    fn directory_remote_cache()
+    {
+        let remote = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let (action, build_log, output) = populate_remote_cache(&remote);
+
+        // Find it on another machine.
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let mut state = State::open(&path).unwrap();
+        state.set_remote_cache(DirectoryRemoteCache::open(&remote).unwrap()).unwrap();
+
+        assert!(state.cached_action(Hash([2; 32])).unwrap().is_none());
+        let actual = state.cached_action(action).unwrap().unwrap();
+        assert_eq!(actual.build_log, build_log);
+        assert_eq!(actual.outputs, [output]);
+        assert!(actual.warnings);
+
+        // The outputs are found in the local output cache.
+        for hash in [output, build_log] {
+            let (dirfd, path) = state.cached_output(hash).unwrap();
+            assert_eq!(hash_file_at(Some(dirfd), &path).unwrap(), hash);
+        }
+
+        // And so is the entry, once the remote cache is gone.
+        state.finish_uploads().unwrap();
+        assert!(state.cached_action(action).unwrap().is_some());
+    }
+
+    #[test]
+    fn lazy_outputs()
+    {
+        let remote = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let (action, build_log, output) = populate_remote_cache(&remote);
+
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let mut state = State::open(&path).unwrap();
+        state.set_remote_cache(DirectoryRemoteCache::open(&remote).unwrap()).unwrap();
+        state.set_lazy_outputs(true);
+
+        // Finding the entry does not fetch its outputs.
+        let actual = state.cached_action(action).unwrap().unwrap();
+        assert_eq!(actual.outputs, [output]);
+        let (dirfd, path) = state.cached_output(output).unwrap();
+        let err = fstatat(Some(dirfd), &path, AT_SYMLINK_NOFOLLOW).err();
+        assert_eq!(err.map(|err| err.kind()), Some(NotFound));
+
+        // Materializing an output does.
+        state.materialize_output(output).unwrap();
+        assert_eq!(hash_file_at(Some(dirfd), &path).unwrap(), output);
+        let (dirfd, path) = state.cached_output(build_log).unwrap();
+        assert!(fstatat(Some(dirfd), &path, AT_SYMLINK_NOFOLLOW).is_err());
+
+        // The entry was not inserted into the local action cache.
+        state.finish_uploads().unwrap();
+        assert!(state.cached_action(action).unwrap().is_none());
+    }
+}
@@ -0,0 +1,80 @@
+//! Benchmarks for [`hash_file_at`] on trees of different shapes.
+
+#![feature(concat_bytes)]
+#![feature(io_safety)]
+#![feature(test)]
+
+extern crate test;
+
+use {
+    os_ext::{
+        O_CREAT, O_DIRECTORY, O_PATH, O_WRONLY,
+        cstr, cstring, mkdirat, mkdtemp, open, openat,
+        cstr::CStrExt,
+    },
+    snowflake_util::hash::hash_file_at,
+    std::{
+        ffi::{CStr, CString},
+        fs::File,
+        io::Write,
+        os::unix::io::{AsFd, BorrowedFd, OwnedFd},
+    },
+    test::Bencher,
+};
+
+/// Create an empty directory to build a tree in.
+fn tree_root() -> OwnedFd
+{
+    let path = mkdtemp(cstring!(b"/tmp/snowflake-bench-XXXXXX")).unwrap();
+    open(&path, O_DIRECTORY | O_PATH, 0).unwrap()
+}
+
+fn write(dirfd: BorrowedFd, path: &CStr, content: &[u8])
+{
+    let file = openat(Some(dirfd), path, O_CREAT | O_WRONLY, 0o644).unwrap();
+    File::from(file).write_all(content).unwrap();
+}
+
+/// Bench hashing the tree at `t` in the tree root.
+fn bench_tree(b: &mut Bencher, root: BorrowedFd)
+{
+    b.iter(|| hash_file_at(Some(root), cstr!(b"t")).unwrap());
+}
+
+/// A single regular file of 16 MiB.
+#[bench]
+fn large_file(b: &mut Bencher)
+{
+    let root = tree_root();
+    let content = vec![0x5A; 16 << 20];
+    write(root.as_fd(), cstr!(b"t"), &content);
+    b.bytes = content.len() as u64;
+    bench_tree(b, root.as_fd());
+}
+
+/// A directory with a thousand small regular files.
+#[bench]
+fn wide_directory(b: &mut Bencher)
+{
+    let root = tree_root();
+    mkdirat(Some(root.as_fd()), cstr!(b"t"), 0o755).unwrap();
+    for i in 0 .. 1000 {
+        let path = CString::new(format!("t/{i}")).unwrap();
+        write(root.as_fd(), &path, format!("{i}\n").as_bytes());
+    }
+    bench_tree(b, root.as_fd());
+}
+
+/// A chain of 64 nested directories with a small file in each.
+#[bench]
+fn deep_directory(b: &mut Bencher)
+{
+    let root = tree_root();
+    let mut path = cstring!(b"t");
+    for i in 0 .. 64 {
+        mkdirat(Some(root.as_fd()), &path, 0o755).unwrap();
+        write(root.as_fd(), &path.join(cstr!(b"f")), format!("{i}\n").as_bytes());
+        path = path.join(cstr!(b"d"));
+    }
+    bench_tree(b, root.as_fd());
+}
@@ -0,0 +1,76 @@
+//! Sets of small integers.
+
+/// Set of integers below a fixed bound, stored one bit per integer.
+///
+/// This is meant for marking the vertices of a dense graph,
+/// where a hash set would cost an allocation and a hash per vertex.
+#[derive(Clone, Debug, Default, Eq, PartialEq)]
+pub struct BitSet
+{
+    words: Vec<u64>,
+}
+
+impl BitSet
+{
+    /// Create an empty set that can contain the integers below `bound`.
+    pub fn new(bound: usize) -> Self
+    {
+        Self{words: vec![0; (bound + 63) / 64]}
+    }
+
+    /// Whether the set contains an integer.
+    ///
+    /// Integers beyond the bound are never contained.
+    pub fn contains(&self, value: usize) -> bool
+    {
+        self.words.get(value / 64)
+            .map_or(false, |word| word & 1 << value % 64 != 0)
+    }
+
+    /// Add an integer to the set, returning whether it was not yet in it.
+    ///
+    /// Panics if the integer is beyond the bound.
+    pub fn insert(&mut self, value: usize) -> bool
+    {
+        let word = &mut self.words[value / 64];
+        let bit = 1 << value % 64;
+        let absent = *word & bit == 0;
+        *word |= bit;
+        absent
+    }
+
+    /// Remove an integer from the set, returning whether it was in it.
+    ///
+    /// Panics if the integer is beyond the bound.
+    pub fn remove(&mut self, value: usize) -> bool
+    {
+        let word = &mut self.words[value / 64];
+        let bit = 1 << value % 64;
+        let present = *word & bit != 0;
+        *word &= !bit;
+        present
+    }
+}
+
+#[cfg(test)]
+mod tests
+{
+    use super::*;
+
+    #[test]
+    fn insert_remove()
+    {
+        let mut set = BitSet::new(130);
+        assert!(!set.contains(0));
+        assert!(set.insert(0));
+        assert!(!set.insert(0));
+        assert!(set.insert(64));
+        assert!(set.insert(129));
+        assert!(set.contains(0) && set.contains(64) && set.contains(129));
+        assert!(!set.contains(1) && !set.contains(63) && !set.contains(128));
+        assert!(!set.contains(1000));
+        assert!(set.remove(64));
+        assert!(!set.remove(64));
+        assert!(!set.contains(64));
+    }
+}
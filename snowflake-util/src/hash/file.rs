@@ -4,13 +4,17 @@ use {
         AT_SYMLINK_NOFOLLOW,
         O_DIRECTORY, O_NOFOLLOW, O_RDONLY,
         S_IFDIR, S_IFLNK, S_IFMT, S_IFREG, S_IXUSR,
+        DIR,
         cstr, fdopendir, fstatat, openat, readdir, readlinkat, stat,
     },
     std::{
-        ffi::CStr,
+        ffi::{CStr, CString},
         fs::File,
-        io::{self, Write, copy},
+        io::{self, ErrorKind::{Interrupted, InvalidInput, UnexpectedEof}, Read, Write},
         os::unix::io::{AsFd, BorrowedFd},
+        panic::resume_unwind,
+        sync::atomic::{AtomicUsize, Ordering::SeqCst},
+        thread::{self, available_parallelism},
     },
 };
 
@@ -30,8 +34,7 @@ use {
 /// If the file is a regular file, the hash contains
 /// its contents and whether it is executable.
 /// If the file is a directory, the hash contains
-/// recursively the entries of the directory,
-/// including the names of the entries.
+/// the names and hashes of the entries of the directory.
 /// If the file is a symbolic link, the hash contains
 /// the target name of the symbolic link (it is not followed).
 ///
@@ -42,6 +45,14 @@ use {
 /// and outputs are made read-only before being added to the output cache.
 /// The execute permission bit is ignored for directories
 /// as non-executable directories cannot be hashed.
+///
+/// # Concurrency
+///
+/// Because the hash of a directory contains the hashes of its entries
+/// rather than their contents, large entries are hashed concurrently.
+/// The number of threads used for this is limited process-wide
+/// by the available parallelism, regardless of how many files are
+/// hashed at the same time.
 pub fn hash_file_at(dirfd: Option<BorrowedFd>, path: &CStr)
     -> io::Result<Hash>
 {
@@ -56,27 +67,42 @@ pub fn hash_file_at(dirfd: Option<BorrowedFd>, path: &CStr)
 pub fn hash_file_at_with(
     dirfd: Option<BorrowedFd>,
     path:  &CStr,
-    mut f: impl FnMut(&stat) -> io::Result<()>,
+    f:     impl Fn(&stat) -> io::Result<()> + Sync,
+) -> io::Result<Hash>
+{
+    let statbuf = fstatat(dirfd, path, AT_SYMLINK_NOFOLLOW)?;
+    hash_stat_at(dirfd, path, &statbuf, &f)
+}
+
+/// Extra checks passed to [`hash_file_at_with`].
+type Check<'a> = dyn Fn(&stat) -> io::Result<()> + Sync + 'a;
+
+/// Hash a file that was already statted.
+fn hash_stat_at(
+    dirfd:   Option<BorrowedFd>,
+    path:    &CStr,
+    statbuf: &stat,
+    f:       &Check,
 ) -> io::Result<Hash>
 {
     let mut blake3 = Blake3::new();
-    write_file_at(&mut blake3, dirfd, path.as_ref(), &mut f)?;
+    write_file_at(&mut blake3, dirfd, path, statbuf, f)?;
     Ok(blake3.finalize())
 }
 
 // NOTE: See the manual chapter on avoiding hash collisions.
 
 fn write_file_at(
-    writer: &mut impl Write,
-    dirfd:  Option<BorrowedFd>,
-    path:   &CStr,
-    f:      &mut dyn FnMut(&stat) -> io::Result<()>
+    writer:  &mut impl Write,
+    dirfd:   Option<BorrowedFd>,
+    path:    &CStr,
+    statbuf: &stat,
+    f:       &Check,
 ) -> io::Result<()>
 {
-    let statbuf = fstatat(dirfd, path, AT_SYMLINK_NOFOLLOW)?;
-    f(&statbuf)?;
+    f(statbuf)?;
     match statbuf.st_mode & S_IFMT {
-        S_IFREG => write_reg_at(writer, dirfd, path, &statbuf),
+        S_IFREG => write_reg_at(writer, dirfd, path, statbuf),
         S_IFDIR => write_dir_at(writer, dirfd, path, f),
         S_IFLNK => write_lnk_at(writer, dirfd, path),
         _       => todo!("Return error about unsupported file type"),
@@ -88,6 +114,12 @@ const FILE_TYPE_REG: u8 = 0;
 const FILE_TYPE_DIR: u8 = 1;
 const FILE_TYPE_LNK: u8 = 2;
 
+/// Size of the buffer used for reading regular files.
+///
+/// BLAKE3 hashes many chunks at once using SIMD instructions,
+/// so large files are best passed to the hasher in large buffers.
+const READ_BUFFER_SIZE: usize = 1024 * 1024;
+
 /// Write a regular file.
 fn write_reg_at(
     writer:  &mut impl Write,
@@ -95,23 +127,140 @@ fn write_reg_at(
     path:    &CStr,
     statbuf: &stat,
 ) -> io::Result<()>
+{
+    // Write file metadata.
+    let executable = statbuf.st_mode & S_IXUSR != 0;
+    write_reg_header(writer, executable, statbuf.st_size as u64)?;
+
+    // Write file contents.
+    // Exactly as many bytes as the file size are read, so that
+    // the contents are consistent with the size written above.
+    // This also saves the final read(2) call that would detect end of file,
+    // which is significant for trees of many small files.
+    // Empty files need not be opened at all.
+    let size = statbuf.st_size as usize;
+    if size != 0 {
+        let file = openat(dirfd, path, O_NOFOLLOW | O_RDONLY, 0)?;
+        let mut file = File::from(file);
+        let mut buf = vec![0; size.min(READ_BUFFER_SIZE)];
+        let mut remaining = size;
+        while remaining != 0 {
+            let chunk = remaining.min(buf.len());
+            match file.read(&mut buf[.. chunk]) {
+                Ok(0) => return Err(io::Error::new(UnexpectedEof,
+                                                   "File shrank while hashing")),
+                Ok(n) => { writer.write_all(&buf[.. n])?; remaining -= n; },
+                Err(err) if err.kind() == Interrupted => continue,
+                Err(err) => return Err(err),
+            }
+        }
+    }
+
+    Ok(())
+}
+
+/// Write the part of a regular file that precedes its contents.
+fn write_reg_header(writer: &mut impl Write, executable: bool, size: u64)
+    -> io::Result<()>
 {
     // Write file type.
     writer.write_all(&[FILE_TYPE_REG])?;
 
     // Write whether file is executable.
-    let executable = statbuf.st_mode & S_IXUSR != 0;
     writer.write_all(&[executable as u8])?;
 
     // Write file size.
-    writer.write_all(&(statbuf.st_size as u64).to_le_bytes())?;
+    writer.write_all(&size.to_le_bytes())
+}
 
-    // Write file contents.
-    let file = openat(dirfd, path, O_NOFOLLOW | O_RDONLY, 0)?;
-    let mut file = File::from(file);
-    copy(&mut file, writer)?;
+/// Writer that hashes a regular file as it writes it.
+///
+/// The resulting hash equals the one [`hash_file_at`] would compute,
+/// provided the file is not written to by anything else,
+/// so the file need not be read back in order to hash it.
+/// The size of a regular file precedes its contents in the hash,
+/// so the size must be known before writing starts.
+pub struct HashingWriter<W>
+{
+    inner: W,
+    blake3: Blake3,
+    executable: bool,
+    size: u64,
+    remaining: u64,
+}
 
-    Ok(())
+/// A regular file written by a [`HashingWriter`].
+#[derive(Clone, Copy, Debug)]
+pub struct WrittenFile
+{
+    /// The hash of the file.
+    pub hash: Hash,
+
+    /// Whether the file was hashed as executable.
+    pub executable: bool,
+
+    /// The size of the file.
+    pub size: u64,
+}
+
+impl<W> HashingWriter<W>
+{
+    /// Create a writer that writes a regular file of the given size.
+    ///
+    /// `executable` must match the mode the file is created with.
+    pub fn new(inner: W, executable: bool, size: u64) -> Self
+    {
+        let mut blake3 = Blake3::new();
+        write_reg_header(&mut blake3, executable, size)
+            .expect("Writing to a hasher should not fail");
+        Self{inner, blake3, executable, size, remaining: size}
+    }
+
+    /// Obtain the hash of the file, once all of it has been written.
+    pub fn finish(self) -> io::Result<(W, WrittenFile)>
+    {
+        if self.remaining != 0 {
+            return Err(io::Error::new(InvalidInput,
+                                      "File is smaller than declared"));
+        }
+        let Self{inner, blake3, executable, size, ..} = self;
+        Ok((inner, WrittenFile{hash: blake3.finalize(), executable, size}))
+    }
+}
+
+impl<W> Write for HashingWriter<W>
+    where W: Write
+{
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize>
+    {
+        if buf.len() as u64 > self.remaining {
+            return Err(io::Error::new(InvalidInput,
+                                      "File is larger than declared"));
+        }
+        let n = self.inner.write(buf)?;
+        self.blake3.update(&buf[.. n]);
+        self.remaining -= n as u64;
+        Ok(n)
+    }
+
+    fn flush(&mut self) -> io::Result<()>
+    {
+        self.inner.flush()
+    }
+}
+
+impl WrittenFile
+{
+    /// Whether the file as statted is still the file that was written.
+    ///
+    /// This only compares the properties that make up the hash,
+    /// apart from the contents, which would have to be read.
+    pub fn matches(&self, statbuf: &stat) -> bool
+    {
+        statbuf.st_mode & S_IFMT == S_IFREG &&
+            (statbuf.st_mode & S_IXUSR != 0) == self.executable &&
+            statbuf.st_size as u64 == self.size
+    }
 }
 
 /// Write a directory.
@@ -119,38 +268,26 @@ fn write_dir_at(
     writer: &mut impl Write,
     dirfd:  Option<BorrowedFd>,
     path:   &CStr,
-    f:      &mut dyn FnMut(&stat) -> io::Result<()>
+    f:      &Check,
 ) -> io::Result<()>
 {
     // Write directory metadata.
     writer.write_all(&[FILE_TYPE_DIR])?;
 
-    // Open directory for reading.
-    let dir = openat(dirfd, path, O_DIRECTORY | O_NOFOLLOW | O_RDONLY, 0)?;
-
     // Collect directory entries.
-    let mut stream = fdopendir(dir.try_clone()?)?;
-    let mut entries = Vec::new();
-    while let Some(dirent) = readdir(&mut stream)? {
-        let d_name = dirent.d_name;
-        if d_name.as_ref() != cstr!(b".") &&
-            d_name.as_ref() != cstr!(b"..") {
-            entries.push(d_name);
-        }
-    }
-    drop(stream);
+    let (dir, entries) = open_dir_sorted(dirfd, path)?;
 
-    // Make sure the order is always the same.
-    entries.sort();
+    // Hash the entries, possibly concurrently.
+    let hashes = hash_entries(dir.as_fd(), &entries, f)?;
 
-    // Recursively write the entries.
-    for entry in entries {
+    // Write the entries, in sorted order.
+    for (entry, hash) in entries.iter().zip(hashes) {
 
         // Write entry name.
         writer.write_all(entry.as_bytes_with_nul())?;
 
-        // Recursively write entry.
-        write_file_at(writer, Some(dir.as_fd()), &entry, f)?;
+        // Write entry hash.
+        writer.write_all(&hash.0)?;
 
     }
 
@@ -159,6 +296,115 @@ fn write_dir_at(
     writer.write_all(&[0])
 }
 
+/// Regular files smaller than this are not worth hashing on another thread.
+const CONCURRENT_SIZE: i64 = 256 * 1024;
+
+/// Hash each entry of a directory.
+///
+/// Directories and large regular files are hashed on helper threads,
+/// as long as helpers are available; other entries are hashed in place.
+/// The hashes are returned in the same order as the entries.
+fn hash_entries(dir: BorrowedFd, entries: &[CString], f: &Check)
+    -> io::Result<Vec<Hash>>
+{
+    thread::scope(|s| {
+        let mut hashes = Vec::with_capacity(entries.len());
+
+        for entry in entries {
+            let statbuf = fstatat(Some(dir), entry, AT_SYMLINK_NOFOLLOW)?;
+
+            let large = match statbuf.st_mode & S_IFMT {
+                S_IFDIR => true,
+                S_IFREG => statbuf.st_size >= CONCURRENT_SIZE,
+                _       => false,
+            };
+
+            match large.then(Helper::acquire).flatten() {
+                Some(helper) => hashes.push(Err(s.spawn(move || {
+                    let _helper = helper;
+                    hash_stat_at(Some(dir), entry, &statbuf, f)
+                }))),
+                None => hashes.push(Ok(
+                    hash_stat_at(Some(dir), entry, &statbuf, f)?
+                )),
+            }
+        }
+
+        hashes.into_iter()
+            .map(|hash| match hash {
+                Ok(hash) => Ok(hash),
+                Err(handle) => handle.join().unwrap_or_else(|p| resume_unwind(p)),
+            })
+            .collect()
+    })
+}
+
+/// Permission to run a helper thread for hashing.
+struct Helper;
+
+/// The number of helper threads currently running.
+static HELPERS: AtomicUsize = AtomicUsize::new(0);
+
+impl Helper
+{
+    /// Obtain permission, unless all helpers are busy.
+    fn acquire() -> Option<Self>
+    {
+        let max = Self::max();
+        HELPERS.fetch_update(SeqCst, SeqCst, |n| (n < max).then(|| n + 1))
+            .ok()
+            .map(|_| Self)
+    }
+
+    /// The maximum number of helper threads.
+    ///
+    /// The thread that hashes in place keeps one processor busy itself.
+    fn max() -> usize
+    {
+        static MAX: AtomicUsize = AtomicUsize::new(usize::MAX);
+        let max = MAX.load(SeqCst);
+        if max != usize::MAX {
+            return max;
+        }
+        let max = available_parallelism().map_or(0, |n| n.get() - 1);
+        MAX.store(max, SeqCst);
+        max
+    }
+}
+
+impl Drop for Helper
+{
+    fn drop(&mut self)
+    {
+        HELPERS.fetch_sub(1, SeqCst);
+    }
+}
+
+/// Open a directory and read the names of its entries, in sorted order.
+///
+/// The `.` and `..` entries are not included.
+/// The returned directory stream can be used as a directory file descriptor,
+/// so the directory does not have to be opened twice.
+pub (super) fn open_dir_sorted(dirfd: Option<BorrowedFd>, path: &CStr)
+    -> io::Result<(DIR, Vec<CString>)>
+{
+    let flags = O_DIRECTORY | O_NOFOLLOW | O_RDONLY;
+    let mut stream = fdopendir(openat(dirfd, path, flags, 0)?)?;
+    let mut entries = Vec::new();
+    while let Some(dirent) = readdir(&mut stream)? {
+        let d_name = dirent.d_name;
+        if d_name.as_ref() != cstr!(b".") &&
+            d_name.as_ref() != cstr!(b"..") {
+            entries.push(d_name);
+        }
+    }
+
+    // Make sure the order is always the same.
+    entries.sort();
+
+    Ok((stream, entries))
+}
+
 /// Write a symbolic link.
 fn write_lnk_at(
     writer: &mut impl Write,
@@ -181,45 +427,119 @@ fn write_lnk_at(
 #[cfg(test)]
 mod tests
 {
-    use super::*;
+    use {
+        super::*,
+        os_ext::{O_CREAT, O_WRONLY, cstring, mkdirat, mkdtemp, open},
+    };
+
+    fn blake3(buf: &[u8]) -> [u8; 32]
+    {
+        Blake3::new().update(buf).finalize().0
+    }
 
     #[test]
     fn example()
     {
-        let expected = &[
-            1,
-                b'b', b'r', b'o', b'k', b'e', b'n', b'.', b'l', b'n', b'k', 0,
-                    2, b'e', b'n', b'o', b'e', b'n', b't', b'.', b't', b'x', b't', 0,
-                b'd', b'i', b'r', b'e', b'c', b't', b'o', b'r', b'y', 0,
-                    1,
-                        b'b', b'a', b'r', b'.', b't', b'x', b't', 0,
-                            0, 1,
-                                4, 0, 0, 0, 0, 0, 0, 0,
-                                b'b', b'a', b'r', b'\n',
-                        b'f', b'o', b'o', b'.', b't', b'x', b't', 0,
-                            0, 0,
-                                4, 0, 0, 0, 0, 0, 0, 0,
-                                b'f', b'o', b'o', b'\n',
-                        0,
-                b'r', b'e', b'g', b'u', b'l', b'a', b'r', b'.', b't', b'x', b't', 0,
-                    0, 0,
-                        14, 0, 0, 0, 0, 0, 0, 0,
-                        b'H', b'e', b'l', b'l', b'o', b',', b' ',
-                        b'w', b'o', b'r', b'l', b'd', b'!', b'\n',
-                b's', b'y', b'm', b'l', b'i', b'n', b'k', b'.', b'l', b'n', b'k', 0,
-                    2, b'r', b'e', b'g', b'u', b'l', b'a', b'r', b'.', b't', b'x', b't', 0,
-                0,
-        ];
-
-        let expected_hash = Blake3::new().update(expected).finalize();
+        let bar = blake3(&[
+            0, 1,
+                4, 0, 0, 0, 0, 0, 0, 0,
+                b'b', b'a', b'r', b'\n',
+        ]);
+        let foo = blake3(&[
+            0, 0,
+                4, 0, 0, 0, 0, 0, 0, 0,
+                b'f', b'o', b'o', b'\n',
+        ]);
+        let directory = blake3(&[
+            &[1][..],
+                b"bar.txt\0", &bar,
+                b"foo.txt\0", &foo,
+                &[0],
+        ].concat());
+        let broken = blake3(b"\x02enoent.txt\0");
+        let regular = blake3(&[
+            0, 0,
+                14, 0, 0, 0, 0, 0, 0, 0,
+                b'H', b'e', b'l', b'l', b'o', b',', b' ',
+                b'w', b'o', b'r', b'l', b'd', b'!', b'\n',
+        ]);
+        let symlink = blake3(b"\x02regular.txt\0");
+
+        let expected = [
+            &[1][..],
+                b"broken.lnk\0", &broken,
+                b"directory\0", &directory,
+                b"regular.txt\0", &regular,
+                b"symlink.lnk\0", &symlink,
+                &[0],
+        ].concat();
+
+        let expected_hash = Blake3::new().update(&expected).finalize();
 
         let path = cstr!(b"testdata/hash_file_at");
+        let statbuf = fstatat(None, path, AT_SYMLINK_NOFOLLOW).unwrap();
 
         let mut buf = Vec::new();
-        write_file_at(&mut buf, None, path, &mut |_| Ok(())).unwrap();
+        write_file_at(&mut buf, None, path, &statbuf, &|_| Ok(())).unwrap();
         assert_eq!(buf, expected);
 
         let hash = hash_file_at(None, path).unwrap();
         assert_eq!(hash, expected_hash);
     }
+
+    #[test]
+    fn hashing_writer()
+    {
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let root = open(&path, O_DIRECTORY | O_RDONLY, 0).unwrap();
+        let content = b"Hello, world!\n";
+        let flags = O_CREAT | O_WRONLY;
+        let file = openat(Some(root.as_fd()), cstr!(b"f"), flags, 0o755).unwrap();
+        let mut writer = HashingWriter::new(File::from(file), true, 14);
+        writer.write_all(&content[.. 5]).unwrap();
+        writer.write_all(&content[5 ..]).unwrap();
+        let (_, written) = writer.finish().unwrap();
+
+        let expected = hash_file_at(Some(root.as_fd()), cstr!(b"f")).unwrap();
+        assert_eq!(written.hash, expected);
+        let statbuf = fstatat(Some(root.as_fd()), cstr!(b"f"), 0).unwrap();
+        assert!(written.matches(&statbuf));
+
+        // The declared size is enforced.
+        let mut writer = HashingWriter::new(Vec::new(), false, 1);
+        assert!(writer.write_all(b"ab").is_err());
+        assert!(HashingWriter::new(Vec::<u8>::new(), false, 1).finish().is_err());
+    }
+
+    #[test]
+    fn large_entries()
+    {
+        // Create directories with files large enough to use helpers.
+        let path = mkdtemp(cstring!(b"/tmp/snowflake-test-XXXXXX")).unwrap();
+        let root = open(&path, O_DIRECTORY | O_RDONLY, 0).unwrap();
+        let content = vec![b'x'; CONCURRENT_SIZE as usize + 1];
+        mkdirat(Some(root.as_fd()), cstr!(b"d"), 0o755).unwrap();
+        for name in [cstr!(b"a"), cstr!(b"b"), cstr!(b"d/c")] {
+            let flags = O_CREAT | O_WRONLY;
+            let file = openat(Some(root.as_fd()), name, flags, 0o644).unwrap();
+            File::from(file).write_all(&content).unwrap();
+        }
+
+        let file = blake3(&[
+            &[0, 0][..],
+                &(content.len() as u64).to_le_bytes(),
+                &content,
+        ].concat());
+        let d = blake3(&[&[1][..], b"c\0", &file, &[0]].concat());
+        let expected = blake3(&[
+            &[1][..],
+                b"a\0", &file,
+                b"b\0", &file,
+                b"d\0", &d,
+                &[0],
+        ].concat());
+
+        let hash = hash_file_at(None, &path).unwrap();
+        assert_eq!(hash.0, expected);
+    }
 }
@@ -0,0 +1,146 @@
+use {
+    super::{Blake3, Hash, file::open_dir_sorted},
+    os_ext::{
+        AT_SYMLINK_NOFOLLOW,
+        S_IFDIR, S_IFMT,
+        fstatat, stat,
+    },
+    std::{
+        ffi::CStr,
+        io,
+        os::unix::io::{AsFd, BorrowedFd},
+        time::{Duration, SystemTime, UNIX_EPOCH},
+    },
+};
+
+/// Identity of a file, as observed through its metadata.
+///
+/// See [`identify_file_at`] for more information.
+#[derive(Clone, Copy, Debug)]
+pub struct Identity
+{
+    /// Hash of the metadata of the file and any files it contains.
+    pub fingerprint: Hash,
+
+    /// The most recent modification or change time of any such file.
+    pub newest: SystemTime,
+}
+
+/// Identify a file at a given path without reading its contents.
+///
+/// The identity is computed from the device and inode numbers,
+/// mode, size, and modification and change times of the file,
+/// and recursively the names and identities of the entries of directories.
+/// Changing the file in any way would normally change its identity,
+/// so if the identity matches that of an earlier observation,
+/// [`hash_file_at`] would still return the hash it returned back then.
+///
+/// This breaks down for changes that happen in quick succession,
+/// as timestamps have limited granularity.
+/// If [`newest`] is recent, the identity must not be relied upon;
+/// see [`Identity::is_racy`].
+///
+/// [`hash_file_at`]: `super::hash_file_at`
+/// [`newest`]: `Identity::newest`
+pub fn identify_file_at(dirfd: Option<BorrowedFd>, path: &CStr)
+    -> io::Result<Identity>
+{
+    let mut blake3 = Blake3::new();
+    let mut newest = UNIX_EPOCH;
+
+    // The fingerprint is used to look up hashes computed by hash_file_at.
+    // If hash_file_at ever changes its encoding, so must this string.
+    blake3.put_str("snowflake-identity-2");
+
+    identify_at(&mut blake3, &mut newest, dirfd, path)?;
+
+    Ok(Identity{fingerprint: blake3.finalize(), newest})
+}
+
+impl Identity
+{
+    /// How recent a change must be for the identity to be unreliable.
+    ///
+    /// This is generous, as some file systems store timestamps
+    /// with a granularity of as much as two seconds.
+    pub const RACY_WINDOW: Duration = Duration::from_secs(3);
+
+    /// Whether a file changed too recently for its identity to be reliable.
+    ///
+    /// `since` must be a time from before the file was identified.
+    /// A file that changes again within the granularity of its timestamps
+    /// may retain its identity, even though its contents have changed.
+    pub fn is_racy(&self, since: SystemTime) -> bool
+    {
+        self.newest + Self::RACY_WINDOW >= since
+    }
+}
+
+// NOTE: See the manual chapter on avoiding hash collisions.
+
+fn identify_at(
+    blake3: &mut Blake3,
+    newest: &mut SystemTime,
+    dirfd:  Option<BorrowedFd>,
+    path:   &CStr,
+) -> io::Result<()>
+{
+    let statbuf = fstatat(dirfd, path, AT_SYMLINK_NOFOLLOW)?;
+    put_stat(blake3, newest, &statbuf);
+
+    if statbuf.st_mode & S_IFMT == S_IFDIR {
+        let (dir, entries) = open_dir_sorted(dirfd, path)?;
+        for entry in entries {
+            blake3.put_cstr(&entry);
+            identify_at(blake3, newest, Some(dir.as_fd()), &entry)?;
+        }
+        // Pathnames cannot be empty, so this is unambiguous.
+        blake3.put_u8(0);
+    }
+
+    Ok(())
+}
+
+fn put_stat(blake3: &mut Blake3, newest: &mut SystemTime, statbuf: &stat)
+{
+    let &stat{st_dev, st_ino, st_mode, st_size,
+              st_mtime, st_mtime_nsec, st_ctime, st_ctime_nsec, ..} = statbuf;
+
+    blake3.put_u64(st_dev as u64);
+    blake3.put_u64(st_ino as u64);
+    blake3.put_u64(st_mode as u64);
+    blake3.put_u64(st_size as u64);
+    blake3.put_u64(st_mtime as u64).put_u64(st_mtime_nsec as u64);
+    blake3.put_u64(st_ctime as u64).put_u64(st_ctime_nsec as u64);
+
+    // The change time is bumped on any change, but it is also
+    // under less control of the user, so consider both.
+    for (sec, nsec) in [(st_mtime, st_mtime_nsec), (st_ctime, st_ctime_nsec)] {
+        let time = UNIX_EPOCH + Duration::new(
+            sec.try_into().unwrap_or(0),
+            nsec.try_into().unwrap_or(0),
+        );
+        *newest = (*newest).max(time);
+    }
+}
+
+#[cfg(test)]
+mod tests
+{
+    use {super::*, os_ext::cstr};
+
+    #[test]
+    fn example()
+    {
+        let path = cstr!(b"testdata/hash_file_at");
+        let a = identify_file_at(None, path).unwrap();
+        let b = identify_file_at(None, path).unwrap();
+        assert_eq!(a.fingerprint, b.fingerprint);
+
+        let c = identify_file_at(None, cstr!(b"testdata/hash_file_at/directory")).unwrap();
+        assert_ne!(a.fingerprint, c.fingerprint);
+
+        // Files just identified were not changed in the future.
+        assert!(a.newest <= SystemTime::now());
+    }
+}
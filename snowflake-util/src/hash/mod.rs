@@ -1,11 +1,15 @@
 //! Identifying elements of a cache.
 
-pub use self::{blake3::*, file::*};
+pub use self::{blake3::*, file::*, identity::*};
 
-use {serde::{Deserialize, Serialize}, std::{fmt, str::from_utf8_unchecked}};
+use {
+    serde::{Deserialize, Serialize},
+    std::{ffi::CStr, fmt, ops::Deref, str::from_utf8_unchecked},
+};
 
 mod blake3;
 mod file;
+mod identity;
 mod put;
 
 /// Cryptographic hash used for identifying elements of a cache.
@@ -21,22 +25,33 @@ mod put;
 /// assert_eq!(hash.to_string(), "ede5c0b10f2ec4979c69b52f61e42ff5\
 ///                               b413519ce09be0f14d098dcfe5f6f98d");
 /// ```
-#[derive(Clone, Copy, Deserialize, Eq, PartialEq, Serialize)]
+#[derive(Clone, Copy, Deserialize, Eq, Hash, PartialEq, Serialize)]
 pub struct Hash(pub [u8; 32]);
 
-impl fmt::Display for Hash
+impl Hash
 {
-    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result
+    /// Format the hash as a lower-case hexadecimal C string.
+    ///
+    /// This is what [`Display`][`fmt::Display`] writes,
+    /// but formatted into a buffer on the stack,
+    /// so it can be used as a path without allocating.
+    pub fn to_hex(&self) -> HexHash
     {
         const ALPHABET: &[u8; 16] = b"0123456789abcdef";
-        let mut buf = [0; 64];
+        let mut buf = [0; 65];
         for (i, &b) in self.0.iter().enumerate() {
             buf[2 * i + 0] = ALPHABET[b as usize >> 4];
             buf[2 * i + 1] = ALPHABET[b as usize & 0b1111];
         }
-        // SAFETY: We filled the buffer with ASCII characters.
-        let str = unsafe { from_utf8_unchecked(&buf) };
-        write!(f, "{}", str)
+        HexHash(buf)
+    }
+}
+
+impl fmt::Display for Hash
+{
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result
+    {
+        write!(f, "{}", self.to_hex().as_str())
     }
 }
 
@@ -47,3 +62,53 @@ impl fmt::Debug for Hash
         write!(f, "\"{self}\"")
     }
 }
+
+/// Hash formatted as a lower-case hexadecimal C string.
+///
+/// See [`Hash::to_hex`].
+#[derive(Clone, Copy)]
+pub struct HexHash([u8; 65]);
+
+impl HexHash
+{
+    /// The hexadecimal digits, without the terminating nul.
+    pub fn as_str(&self) -> &str
+    {
+        // SAFETY: We filled the buffer with ASCII characters.
+        unsafe { from_utf8_unchecked(&self.0[.. 64]) }
+    }
+}
+
+impl Deref for HexHash
+{
+    type Target = CStr;
+
+    fn deref(&self) -> &CStr
+    {
+        // SAFETY: The buffer ends in its only nul.
+        unsafe { CStr::from_bytes_with_nul_unchecked(&self.0) }
+    }
+}
+
+impl fmt::Debug for HexHash
+{
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result
+    {
+        write!(f, "\"{}\"", self.as_str())
+    }
+}
+
+#[cfg(test)]
+mod tests
+{
+    use super::*;
+
+    #[test]
+    fn to_hex()
+    {
+        let hash = Blake3::new().update(b"Hello, world!").finalize();
+        let hex = hash.to_hex();
+        assert_eq!(hex.as_str(), hash.to_string());
+        assert_eq!(hex.to_bytes(), hash.to_string().as_bytes());
+    }
+}
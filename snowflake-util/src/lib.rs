@@ -28,4 +28,5 @@ macro_rules! see_manual
 }
 
 pub mod basename;
+pub mod bit_set;
 pub mod hash;
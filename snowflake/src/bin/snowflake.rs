@@ -1,23 +1,52 @@
 #![feature(concat_bytes)]
 #![feature(io_safety)]
 #![feature(let_chains)]
+#![feature(scoped_threads)]
 
 use {
-    os_ext::{O_DIRECTORY, O_PATH, cstr, cstring, mkdir, open},
+    os_ext::{
+        O_DIRECTORY, O_PATH, _SC_PAGESIZE, _SC_PHYS_PAGES,
+        cstr, cstring, mkdir, open, sysconf,
+    },
     regex::bytes::Regex,
     snowflake_actions::*,
-    snowflake_core::{action::*, drive::{self, drive}, label::*, state::State},
+    snowflake_core::{
+        action::*,
+        drive::{self, Incremental, Watcher},
+        label::*,
+        state::{DirectoryRemoteCache, State},
+    },
     snowflake_util::basename::*,
     std::{
-        ffi::CString,
-        io::ErrorKind::AlreadyExists,
-        os::unix::io::AsFd,
+        env,
+        ffi::{CString, OsString},
+        fs::{self, OpenOptions},
+        io::{self, BufRead, BufReader, BufWriter, ErrorKind::{AlreadyExists, NotFound}, Write},
+        num::NonZeroUsize,
+        os::unix::{ffi::OsStringExt, io::AsFd, net::{UnixListener, UnixStream}},
+        sync::{Mutex, atomic::{AtomicBool, Ordering::SeqCst}},
+        thread::{self, available_parallelism},
         time::Duration,
     },
 };
 
+/// Usage:
+///
+///  - `snowflake`: build once and exit.
+///  - `snowflake watch`: build, then rebuild whenever static files change.
+///  - `snowflake serve SOCKET`: keep the state and graph in memory and
+///    build on request, see [`serve`]; static files are watched meanwhile.
+///  - `snowflake request SOCKET`: ask a server to build and print the result.
 fn main()
 {
+    let args: Vec<OsString> = env::args_os().skip(1).collect();
+    let args: Vec<&str> = args.iter().map(|arg| arg.to_str().unwrap()).collect();
+
+    // The client does not need any of the setup below.
+    if let ["request", socket] = args[..] {
+        return request(socket).unwrap();
+    }
+
     let gnum4_path = CString::new(concat!("PATH=", env!("SNOWFLAKE_GNUM4"), "/bin")).unwrap();
     let minify = CString::new(concat!(env!("SNOWFLAKE_MINIFY"), "/bin/minify")).unwrap();
     let sassc = CString::new(concat!(env!("SNOWFLAKE_SASSC"), "/bin/sassc")).unwrap();
@@ -51,7 +80,10 @@ fn main()
                         ],
                         environment: vec![],
                         timeout: Duration::from_secs(1),
+                        resources: Resources::default(),
                         warnings: Some(Regex::new("^WARNING:").unwrap()),
+                        materialization: Materialization::Mount,
+                        worker: None,
                     }) as Box<dyn Action>,
                     vec![
                         Input::StaticFile(cstring!(b"snowflake-website/stylesheet.scss")),
@@ -79,7 +111,10 @@ fn main()
                             gnum4_path,
                         ],
                         timeout: Duration::from_secs(1),
+                        resources: Resources::default(),
                         warnings: None,
+                        materialization: Materialization::Mount,
+                        worker: None,
                     }) as Box<dyn Action>,
                     vec![
                         Input::StaticFile(cstring!(b"snowflake-website/index.html")),
@@ -106,7 +141,10 @@ fn main()
                         ],
                         environment: vec![],
                         timeout: Duration::from_secs(1),
+                        resources: Resources::default(),
                         warnings: None,
+                        materialization: Materialization::Mount,
+                        worker: None,
                     }) as Box<dyn Action>,
                     vec![
                         Input::Dependency(action_inject_css_output_html),
@@ -123,11 +161,198 @@ fn main()
         && err.kind() != AlreadyExists {
         panic!("{:?}", err);
     }
-    let state = State::open(cstr!(b".snowflake")).unwrap();
+    let mut state = State::open(cstr!(b".snowflake")).unwrap();
+
+    // Scratch files left behind by earlier runs are reaped meanwhile.
+    // Reaping is waited for before exiting, so that no scratch file
+    // is left half removed, and failing to reap does not end the build.
+    let reaper = thread::spawn(|| {
+        let reaped = State::open(cstr!(b".snowflake"))
+            .and_then(|state| state.reap_scratches());
+        if let Err(err) = reaped {
+            eprintln!("Failed to reap scratch files: {err}");
+        }
+    });
+
+    if let Some(remote_cache) = env::var_os("SNOWFLAKE_REMOTE_CACHE") {
+        let remote_cache = CString::new(remote_cache.into_vec()).unwrap();
+        let remote_cache = DirectoryRemoteCache::open(&remote_cache).unwrap();
+        state.set_remote_cache(remote_cache).unwrap();
+        state.set_lazy_outputs(env::var_os("SNOWFLAKE_LAZY_OUTPUTS").is_some());
+    }
     let source_root = open(cstr!(b"."), O_DIRECTORY | O_PATH, 0).unwrap();
-    let context = drive::Context{state: &state, source_root: source_root.as_fd()};
-    let result = drive(&context, &action_graph);
+    let jobs = available_parallelism().unwrap_or(NonZeroUsize::new(1).unwrap());
+    let memory = match (sysconf(_SC_PHYS_PAGES), sysconf(_SC_PAGESIZE)) {
+        (Ok(Some(pages)), Ok(Some(size))) => pages as u64 * size as u64,
+        _ => u64::MAX,
+    };
+    let budget = Resources{cpus: jobs.get().try_into().unwrap_or(u32::MAX), memory};
+    let cgroup = env::var_os("SNOWFLAKE_CGROUP").map(|cgroup| {
+        let cgroup = CString::new(cgroup.into_vec()).unwrap();
+        open(&cgroup, O_DIRECTORY | O_PATH, 0).unwrap()
+    });
+    let trace = env::var_os("SNOWFLAKE_TRACE").map(|_| Trace::new());
+    let context = drive::Context{
+        state: &state,
+        source_root: source_root.as_fd(),
+        jobs,
+        budget,
+        cgroup: cgroup.as_ref().map(|cgroup| cgroup.as_fd()),
+        fail_fast: env::var_os("SNOWFLAKE_FAIL_FAST").is_some(),
+        trace: trace.as_ref(),
+    };
+    let mut incremental = Incremental::new(&action_graph).unwrap();
+
+    match args[..] {
+        [] => {
+            println!("{}", action_graph);
+            println!("{:#?}", incremental.build(&context));
+            write_trace(&context, true).unwrap();
+        },
+
+        // Rebuild whenever static files change.
+        // Only the actions affected by the changes are visited.
+        ["watch"] => {
+            let mut watcher = Watcher::new(source_root.as_fd(), &action_graph).unwrap();
+            println!("{:#?}", incremental.build(&context));
+            write_trace(&context, true).unwrap();
+            loop {
+                let changed = watcher.wait().unwrap();
+                let dirty: usize = changed.iter().map(|path| incremental.invalidate(path)).sum();
+                if dirty != 0 {
+                    println!("{:#?}", incremental.build(&context));
+                    write_trace(&context, false).unwrap();
+                }
+            }
+        },
 
-    println!("{}", action_graph);
-    println!("{:#?}", result);
+        ["serve", socket] => {
+            let watcher = Watcher::new(source_root.as_fd(), &action_graph).unwrap();
+            serve(socket, &context, incremental, watcher).unwrap();
+        },
+
+        _ => panic!("Unknown command line arguments: {args:?}"),
+    }
+
+    // Outputs used in the last day are kept regardless of the budget,
+    // so that concurrent builds do not lose their outputs.
+    if let Some(budget) = env::var_os("SNOWFLAKE_CACHE_BUDGET") {
+        let budget = budget.to_str().unwrap().parse().unwrap();
+        let min_age = Duration::from_secs(24 * 60 * 60);
+        println!("{:#?}", state.collect_garbage(budget, min_age).unwrap());
+    }
+
+    state.finish_uploads().unwrap();
+    reaper.join().expect("Reaping scratch files should not panic");
+}
+
+/// Write the phases of the last build to the file named
+/// by `SNOWFLAKE_TRACE`, as a Chrome trace, if it is set.
+///
+/// The first build since startup replaces the file and later builds
+/// append to it, so that successive builds in watch and serve mode
+/// show up together without keeping their phases in memory.
+fn write_trace(context: &drive::Context, first: bool) -> io::Result<()>
+{
+    let (Some(path), Some(trace)) = (env::var_os("SNOWFLAKE_TRACE"), context.trace)
+        else { return Ok(()) };
+    let file = OpenOptions::new()
+        .write(true).create(true).truncate(first).append(!first)
+        .open(path)?;
+    let mut file = BufWriter::new(file);
+    trace.write_chrome_trace(&mut file, first)?;
+    file.flush()
+}
+
+/// Serve build requests on a Unix socket.
+///
+/// The protocol is line-based: a client connects and sends `build`,
+/// and the server responds with the outcomes of the build and closes
+/// the connection. Requests are handled one at a time.
+/// Changes to static files are applied between requests,
+/// so each build only performs the actions affected by changes.
+/// If watching for changes fails, every build from then on
+/// considers every static file changed, and says why.
+/// Errors while handling a request are reported and do not stop
+/// the server; only failing to accept connections does.
+fn serve(
+    socket: &str,
+    context: &drive::Context,
+    incremental: Incremental,
+    mut watcher: Watcher,
+) -> io::Result<()>
+{
+    // A socket left behind by an earlier server would make bind fail.
+    match fs::remove_file(socket) {
+        Err(err) if err.kind() != NotFound => return Err(err),
+        _ => (),
+    }
+    let listener = UnixListener::bind(socket)?;
+
+    let incremental = Mutex::new(incremental);
+    let watch_error = Mutex::new(None);
+    let stopped = AtomicBool::new(false);
+    let mut first_build = true;
+
+    thread::scope(|s| {
+        // The watcher checks now and then whether the server stopped.
+        s.spawn(|| {
+            while !stopped.load(SeqCst) {
+                let changed = match watcher.wait_timeout(Duration::from_secs(1)) {
+                    Ok(changed) => changed,
+                    Err(err) => {
+                        eprintln!("Not watching for changes anymore: {err}");
+                        *watch_error.lock().unwrap() = Some(err);
+                        return;
+                    },
+                };
+                let mut incremental = incremental.lock().unwrap();
+                for path in changed {
+                    incremental.invalidate(&path);
+                }
+            }
+        });
+
+        let mut handle = |mut stream: UnixStream| -> io::Result<()> {
+            let mut line = String::new();
+            BufReader::new(&stream).read_line(&mut line)?;
+            match line.trim_end() {
+                "build" => {
+                    let mut incremental = incremental.lock().unwrap();
+                    if let Some(err) = &*watch_error.lock().unwrap() {
+                        writeln!(stream, "Not watching for changes: {err}")?;
+                        incremental.invalidate(cstr!(b""));
+                    }
+                    // The client gets the outcomes even if tracing fails.
+                    let outcomes = incremental.build(context);
+                    let traced = write_trace(context, first_build);
+                    if traced.is_ok() {
+                        first_build = false;
+                    }
+                    writeln!(stream, "{:#?}", outcomes)?;
+                    traced?;
+                },
+                other => writeln!(stream, "Unknown request: {other:?}")?,
+            }
+            Ok(())
+        };
+
+        let result = listener.incoming().try_for_each(|stream| {
+            if let Err(err) = handle(stream?) {
+                eprintln!("Failed to handle request: {err}");
+            }
+            Ok(())
+        });
+        stopped.store(true, SeqCst);
+        result
+    })
+}
+
+/// Send a build request to a server started with `snowflake serve`.
+fn request(socket: &str) -> io::Result<()>
+{
+    let mut stream = UnixStream::connect(socket)?;
+    writeln!(stream, "build")?;
+    io::copy(&mut stream, &mut io::stdout())?;
+    Ok(())
 }